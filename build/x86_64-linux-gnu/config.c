@@ -0,0 +1,16 @@
+// This file is generated by ./config.sh --objdir build/x86_64-linux-gnu --make-config.mak
+const char *config_mak =
+  "\nCFG: strings FILE | sed -n 's/^CFG~//p' | openssl enc -d -base64 | gzip -d\n"
+  "CFG~H4sIADKp0moCA32VS3LjIBCG93OKqcoFEqfsyiyyaDUt1GMEGh52nA03mL1vP8j2\n"
+  "CFG~RCBQViq+v+kHtJqnn2h0zzKe2Q/ReZj4/e+Pp5ruK4zGqJb5g+9qP+HX23NF4bMz\n"
+  "CFG~HxUdESqmuEN7mbxJyn9OHffv12KZ7E6kjFzj338C2UuiX169CTjUaTq1BBjgRFGc\n"
+  "CFG~urnQ68pQU/CWdZaOJRDRCR9xAOvIuyUHtoK8iTKQc6xl7gxdBO0ZwWFW2RxBUBey\n"
+  "CFG~OkYjgqL00eyNzeq7nU638omAA1FxtAuNwKZQzhEvmJwnFY+5olC4ME3G+oJSi6Iy\n"
+  "CFG~eOy5iMnT6dAwfdSCMIrX16XsHO+ryu84epwqSdN5VustmHCLunRFVAlybsZrlaYF\n"
+  "CFG~QRKcrxJ1d+9re0eWQbXqNdp5PDeUCbQwFhqKHLyfVp2BYMXcbZS1wX0dNcjkpknj\n"
+  "CFG~SFaxrsR7c1Y4reCjprd/8Gzs0VWaI6xDnxgQU9s3BEFGhlRKJYn8bh7MGy170LIS\n"
+  "CFG~uqBuSVWCtNz3jXqFXNkvxxmnwZDmogkylbUnq0HVY6tl1BiR35jtljtuWTnkjaQc\n"
+  "CFG~vrF+2YgyTq/7DcmNYKXZEEW3QzNu7fTbZX09Fy0pjb5byzYj2tQ97ptc/YY2YT45\n"
+  "CFG~0zMRR9asPrOOniGQK4HFQwnSTHgpiVjvSS0LJelY6jCWbBS4K0mfpkedQQq42x82\n"
+  "CFG~ftZ0/GnUJ/Ef8Of4MqUHAAA=\n"
+  ;
@@ -382,6 +382,8 @@
 #define CS_MAXPROV				32
 #define CS_MAXPORTS				32		// max server ports
 #define CS_CLIENT_HASHBUCKETS	32
+#define CS_UDP_HASHBUCKETS		1024	// udp clients by ip and port
+#define CS_MAX_LISTENSHARDS		16		// sockets per listening port
 #define CS_SERVICENAME_SIZE		32
 
 #define CS_ECMSTORESIZE			16		// use MD5()
@@ -545,12 +547,15 @@
 #define DEFAULT_RETRYLIMIT						0
 #define DEFAULT_LB_MODE							0
 #define DEFAULT_LB_STAT_CLEANUP					336
+#define DEFAULT_LB_PERCENTILE					90
 #define DEFAULT_UPDATEINTERVAL					240
 #define DEFAULT_LB_AUTO_BETATUNNEL				1
 #define DEFAULT_LB_AUTO_BETATUNNEL_MODE			0
 #define DEFAULT_LB_AUTO_BETATUNNEL_PREFER_BETA	50
 
 #define DEFAULT_MAX_CACHE_TIME					15
+#define DEFAULT_CACHE_SHARDS					16
+#define MAX_CACHE_SHARDS						256
 #define DEFAULT_MAX_HITCACHE_TIME				15
 
 #define DEFAULT_LB_AUTO_TIMEOUT					0
@@ -595,6 +600,7 @@ enum {E2_GLOBAL = 0, E2_GROUP, E2_CAID, E2_IDENT, E2_CLASS, E2_CHID, E2_QUEUE, E
 #define CXM_FMT_LEN				209		// 160
 
 #define LB_MAX_STAT_TIME		10
+#define LB_HIST_BUCKETS			32		// response time buckets of half an octave from 2 ms, see module-stat.c
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 #define OSCAM_SIGNAL_WAKEUP		SIGCONT
@@ -688,10 +694,13 @@ typedef struct cs_mutexlock
 	pthread_cond_t	writecond, readcond;
 	const char		*name;
 	int8_t			flag;
-	int16_t			writelock, readlock;
+	int8_t			debug;				// counters under the mutex, see oscam-lock.c
+	int16_t			writelock, readlock;	// waiting threads (debug: holding and waiting)
+	volatile uint32_t	state;				// readers, writer and waiting bits
 } CS_MUTEX_LOCK;
 
 #include "oscam-llist.h"
+#include "tommyDS_hashlin/tommytypes.h"
 
 typedef struct s_caidvaluetab_data
 {
@@ -787,6 +796,8 @@ typedef struct s_port
 	int32_t			fd;
 	int32_t			s_port;
 	struct ncd_port	*ncd;							// newcamd specific settings
+	int32_t			shard_fd[CS_MAX_LISTENSHARDS - 1];	// further SO_REUSEPORT sockets, see listenshards
+	struct s_udp_batch *udp_batch[CS_MAX_LISTENSHARDS];	// receive buffers of udp listeners, see oscam-net.c
 } PORT;
 
 typedef struct s_ptab
@@ -896,6 +907,9 @@ struct s_client;
 struct ecm_request_t;
 struct emm_packet_t;
 struct s_ecm_answer;
+struct s_ecmtask_index;
+struct s_latency_tab;
+struct s_lb_stat;
 struct demux_s;
 
 #define DEFAULT_MODULE_BUFSIZE 1024
@@ -932,6 +946,9 @@ struct s_module
 #ifdef CS_CACHEEX
 	int32_t			(*c_cache_push)(struct s_client *, struct ecm_request_t *); // Cache push
 	int32_t			(*c_cache_push_chk)(struct s_client *, struct ecm_request_t *); // Cache push Node Check, 0=no push
+#ifdef CS_CACHEEX_AIO
+	int32_t			(*c_cache_push_batch)(struct s_client *, uint8_t *, int32_t, int32_t); // Cache push of batched entries (data, len, count)
+#endif
 #endif
 	int32_t			c_port;
 	PTAB			ptab;
@@ -1063,6 +1080,8 @@ typedef struct ecm_request_t
 	int8_t			checked;						// for doublecheck
 	uint8_t			cw_checked[16];					// for doublecheck
 	int8_t			readers_timeout_check;			// set to 1 after ctimeout occurs and readers not answered are checked
+	uint8_t			timers_pending;					// count of timeouts queued for this ecm in cw_process, atomic
+	int8_t			timers_unqueued;				// timeouts not queued for lack of memory, see oscam-ecm.c
 	struct s_reader	*origin_reader;
 
 #if defined MODULE_CCCAM
@@ -1090,7 +1109,6 @@ typedef struct ecm_request_t
 	uint8_t			cacheex_wait_time_expired;		// =1 if cacheex wait_time expires
 	uint16_t		cacheex_mode1_delay;			// cacheex mode 1 delay
 	uint8_t			cacheex_hitcache;				// =1 if wait_time due hitcache
-	void			*cw_cache;						// pointer to cw stored in cache
 #endif
 #ifdef CS_CACHEEX_AIO
 	int32_t			ecm_time;						// ecm-time in ms
@@ -1111,6 +1129,13 @@ typedef struct ecm_request_t
 #endif
 	struct ecm_request_t *parent;
 	struct ecm_request_t *next;
+	tommy_node		ecmcwcache_ht_node;				// node for ecmcwcache hash index (caid, ecmd5)
+	tommy_node		ecmcwcache_ll_node;				// node for ecmcwcache list (insertion order, oldest first)
+	struct ecm_request_t *inflight_owner;			// identical ecm in flight that answers this one too
+	struct ecm_request_t *inflight_waiters;			// ecms attached to this one while it is in flight
+	struct ecm_request_t *inflight_next;			// next waiter of inflight_owner
+	int64_t			lat_start;						// ecm_latency_now() when get_cw() got the request
+	int64_t			lat_cached;						// ecm_latency_now() after the cache check
 #ifdef HAVE_DVBAPI
 	uint8_t			adapter_index;
 #endif
@@ -1128,6 +1153,8 @@ struct s_ecm_answer
 	EXTENDED_CW		cw_ex;
 	char			msglog[MSGLOGSIZE];
 	struct timeb	time_request_sent;				// using for evaluate ecm_time
+	int64_t			lat_sent;						// ecm_latency_now() when queued for the reader
+	int64_t			lat_picked;						// ecm_latency_now() when the reader picked it up
 	int32_t			ecm_time;
 	uint16_t		tier;							// only filled by local videoguard reader atm
 #ifdef WITH_LB
@@ -1201,7 +1228,7 @@ struct s_client
 	int8_t			thread_active;
 	int8_t			kill;
 	int8_t			kill_started;
-	LLIST			*joblist;
+	struct s_job_queue	*jobqueue;					// lock-free job ring, see oscam-work.c
 	IN_ADDR_T		ip;
 	in_port_t		port;
 	time_t			login;							// connection
@@ -1278,6 +1305,7 @@ struct s_client
 	uint8_t			cacheex_needfilter;				// flag for cachex mode 3 used with camd35
 #ifdef CS_CACHEEX_AIO
 	uint8_t			cacheex_aio_checked;			// flag for cacheex aio detection done
+	struct s_push_batch *cacheex_batch;			// cache pushes waiting to be sent in one frame
 #endif
 #endif
 #ifdef CS_ANTICASC
@@ -1334,6 +1362,7 @@ struct s_client
 	struct s_reader	*reader;						// points to s_reader when cl->typ='r'
 
 	ECM_REQUEST *ecmtask;
+	struct s_ecmtask_index *ecmtask_index;			// lookup chains for ecmtask[], lives in the same allocation
 
 	pthread_t		thread;
 
@@ -1366,6 +1395,7 @@ struct s_client
 
 	void			*work_mbuf;						// Points to local data allocated in work_thread when the thread is running
 	void			*work_job_data;					// Points to current job_data when work_thread is running
+	struct s_client	*work_next;						// run queue of the worker pool
 
 #ifdef MODULE_PANDORA
 	int32_t			pand_autodelay;
@@ -1381,8 +1411,10 @@ struct s_client
 
 	struct s_client	*next;							// make client a linked list
 	struct s_client	*nexthashed;
+	struct s_client	*nextudp;						// udp clients hashed by ip and port
 
 	int8_t			start_hidecards;
+	time_t			hidecards_until;				// cards hidden by anticascading until, see client_check_status()
 };
 
 typedef struct s_ecm_whitelist_data
@@ -1771,10 +1803,11 @@ struct s_reader										// contains device info, reader info and card info
 	int32_t			lb_usagelevel_ecmcount;
 	struct timeb	lb_usagelevel_time;				// time for counting ecms, this creates usagelevel
 	struct timeb	lb_last;						// time for oldest reader
-	LLIST			*lb_stat;						// loadbalancer reader statistics
+	struct s_lb_stat *lb_stat;					// loadbalancer reader statistics, indexed by caid, prid, srvid and chid
 	CS_MUTEX_LOCK	lb_stat_lock;
 	int32_t			lb_stat_busy;					// do not add while saving
 #endif
+	struct s_latency_tab *ecm_latency;				// queue and answer time histograms per caid
 
 	AES_ENTRY		*aes_list;						// multi AES linked list
 	int8_t			ndsversion;						// 0 auto (default), 1 NDS1, 12 NDS1+, 2 NDS2
@@ -2091,6 +2124,9 @@ struct s_cacheex_matcher
 struct s_config
 {
 	int32_t			nice;
+	int32_t			workerthreads;
+	int32_t			listenshards;
+	int8_t			lockprofile;					// count lock waits and hold times, see cs_lock_profile()
 	uint32_t		netprio;
 	uint32_t		ctimeout;
 	uint32_t		ftimeout;
@@ -2279,6 +2315,7 @@ struct s_config
 	int32_t			lb_auto_betatunnel_mode;		// automatic selection of betatunnel direction
 #ifdef WITH_LB
 	int32_t			lb_save;						// schlocke: load/save statistics to file, save every x ecms
+	int32_t			lb_journal;						// seconds between journal writes of changed statistics, 0=off
 	int32_t			lb_nbest_readers;				// count of best readers
 	int32_t			lb_nfb_readers;					// count of fallback readers
 	int32_t			lb_min_ecmcount;				// minimal ecm count to evaluate lbvalues
@@ -2297,6 +2334,7 @@ struct s_config
 	int32_t			lb_auto_timeout;				// Automatic timeout by loadbalancer statistics
 	int32_t			lb_auto_timeout_p;				// percent added to avg time as timeout time
 	int32_t			lb_auto_timeout_t;				// minimal time added to avg time as timeout time
+	int32_t			lb_percentile;					// response time percentile used by lb_mode 4
 #endif
 	int32_t			resolve_gethostbyname;
 	int8_t			double_check;					// schlocke: Double checks each ecm+dcw from two (or more) readers
@@ -2378,6 +2416,8 @@ struct s_config
 #endif
 
 	int32_t			max_cache_time;					// seconds ecms are stored in ecmcwcache
+	uint32_t		cache_shards;					// number of cw cache shards, applied on restart
+	uint32_t		cache_max_memory;				// bytes the cw cache may hold, 0 = no limit
 	int32_t			max_hitcache_time;				// seconds hits are stored in cspec_hitcache (to detect dyn wait_time)
 
 	int8_t			reload_useraccounts;
@@ -2412,6 +2452,8 @@ struct s_config
 	CAIDVALUETAB	cacheex_nopushafter_tab;
 	uint8_t			waittime_block_start;
 	uint16_t		waittime_block_time;
+	uint8_t			cacheex_push_batch_time;		// ms to collect cache pushes per peer, 0 = off
+	uint8_t			cacheex_push_batch_max;			// max. cache pushes per frame
 #endif
 	CECSP			csp;							// CSP Settings
 	uint8_t			cacheex_enable_stats;			// enable stats
@@ -2450,6 +2492,7 @@ struct s_config
 	int8_t			global_whitelist_use_m;
 
 	char			*ecmfmt;
+	char			*ecmtrace;						// ecm trace file, written by oscam and read by the replay binary
 	char			*pidfile;
 
 	int32_t			max_pending;
@@ -2480,6 +2523,9 @@ struct s_clientmsg
 
 typedef struct reader_stat_t
 {
+	tommy_node		ht_node;						// node for the reader's stat hash index (caid, prid, srvid, chid)
+	tommy_node		ll_node;						// node for the reader's stat age list (ll_stamp, oldest first)
+	struct timeb	ll_stamp;						// when this stat was queued at the tail of the age list
 	int32_t			rc;
 	uint16_t		caid;
 	uint32_t		prid;
@@ -2490,11 +2536,14 @@ typedef struct reader_stat_t
 	struct timeb	last_received;
 
 	int32_t			ecm_count;
-	int32_t			time_avg;
-	int32_t			time_stat[LB_MAX_STAT_TIME];
-	int32_t			time_idx;
+	int32_t			time_avg;						// moving average of the ecm times, weighted like the last LB_MAX_STAT_TIME
+	int32_t			time_last;
+	uint16_t		time_hist[LB_HIST_BUCKETS + 1];	// decaying counts of the ecm times, failures in the last one
 
 	int32_t			fail_factor;
+
+	int8_t			journal_dirty;					// changed since the last journal write, see module-stat.c
+	struct reader_stat_t *journal_next;				// next stat of the reader's journal list
 } READER_STAT;
 
 typedef struct cs_stat_query
@@ -2540,6 +2589,7 @@ void set_thread_name(const char *thread_name);
 int32_t start_thread(char *nameroutine, void *startroutine, void *arg, pthread_t *pthread, int8_t detach, int8_t modify_stacksize);
 int32_t start_thread_nolog(char *nameroutine, void *startroutine, void *arg, pthread_t *pthread, int8_t detach, int8_t modify_stacksize);
 void kill_thread(struct s_client *cl);
+void watch_client_fd(struct s_client *cl);
 
 struct s_module *get_module(struct s_client *cl);
 void module_reader_set(struct s_reader *rdr);
@@ -0,0 +1,119 @@
+/*
+ * OSCam lock benchmark
+ * Runs readers (and optionally a writer) on one CS_MUTEX_LOCK with the lock
+ * implementation used by default and with the debug implementation, which
+ * counts readers and writers under the mutex, and reports lock operations
+ * per second.
+ * Build this file using `make lockbench`
+ */
+#include "globals.h"
+
+#ifdef BUILD_LOCKBENCH
+
+#include "oscam-lock.h"
+#include "oscam-time.h"
+
+#define LOCKBENCH_MSEC 300
+#define LOCKBENCH_WRITE_EVERY 100 // writer mix: every nth lock of the first thread is a write lock
+
+struct s_lockbench
+{
+	CS_MUTEX_LOCK lock;
+	volatile int8_t running;
+	int8_t writer;
+	uint32_t shared; // touched inside the lock
+};
+
+struct s_lockbench_thread
+{
+	pthread_t thread;
+	struct s_lockbench *bench;
+	int32_t id;
+	uint64_t ops;
+};
+
+static void *lockbench_thread(void *ptr)
+{
+	struct s_lockbench_thread *t = ptr;
+	struct s_lockbench *bench = t->bench;
+	uint32_t sum = 0;
+
+	while(bench->running)
+	{
+		if(bench->writer && !t->id && !(t->ops % LOCKBENCH_WRITE_EVERY))
+		{
+			cs_writelock(__func__, &bench->lock);
+			bench->shared++;
+			cs_writeunlock(__func__, &bench->lock);
+		}
+		else
+		{
+			cs_readlock(__func__, &bench->lock);
+			sum += bench->shared;
+			cs_readunlock(__func__, &bench->lock);
+		}
+		t->ops++;
+	}
+	return (void *)(uintptr_t)sum;
+}
+
+static double lockbench_run(int8_t debug, int32_t nthreads, int8_t writer)
+{
+	struct s_lockbench bench;
+	struct s_lockbench_thread threads[16];
+	struct timeb start, end;
+	uint64_t ops = 0;
+	int32_t i;
+
+	memset(&bench, 0, sizeof(bench));
+	cs_lock_debug = debug;
+	cs_lock_create(__func__, &bench.lock, "lockbench", 5000);
+	bench.running = 1;
+	bench.writer = writer;
+
+	cs_ftime(&start);
+	for(i = 0; i < nthreads; i++)
+	{
+		threads[i].bench = &bench;
+		threads[i].id = i;
+		threads[i].ops = 0;
+		pthread_create(&threads[i].thread, NULL, lockbench_thread, &threads[i]);
+	}
+	cs_sleepms(LOCKBENCH_MSEC);
+	bench.running = 0;
+	for(i = 0; i < nthreads; i++)
+	{
+		pthread_join(threads[i].thread, NULL);
+		ops += threads[i].ops;
+	}
+	cs_ftime(&end);
+
+	cs_lock_destroy(__func__, &bench.lock);
+	return ops * 1000.0 / (comp_timeb(&end, &start) ? comp_timeb(&end, &start) : 1);
+}
+
+void run_lock_benchmark(void)
+{
+	const int32_t nthreads[] = { 1, 4, 16 };
+	struct timespec ts;
+	double cas, mutex;
+	int8_t writer, debug = cs_lock_debug;
+	uint32_t i;
+
+	cs_gettime(&ts); // initialize the clock used by the lock timeouts
+	printf("OSCam lock benchmark, %d ms per run, Mops/s over all threads\n", LOCKBENCH_MSEC);
+	printf("%-8s %-8s %10s %10s %8s\n", "threads", "writer", "default", "debug", "speedup");
+	for(writer = 0; writer < 2; writer++)
+	{
+		for(i = 0; i < sizeof(nthreads) / sizeof(nthreads[0]); i++)
+		{
+			cas = lockbench_run(0, nthreads[i], writer);
+			mutex = lockbench_run(1, nthreads[i], writer);
+			printf("%-8d %-8s %10.2f %10.2f %7.1fx\n", nthreads[i], writer ? "1/100" : "none",
+					cas / 1000000, mutex / 1000000, mutex > 0 ? cas / mutex : 0);
+		}
+	}
+	cs_lock_debug = debug;
+}
+
+#endif
@@ -12,6 +12,7 @@
 #include "oscam-client.h"
 #include "oscam-conf.h"
 #include "oscam-ecm.h"
+#include "oscam-garbage.h"
 #include "oscam-hashtable.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
@@ -32,7 +33,6 @@ uint8_t cacheex_peer_id[8];
 extern CS_MUTEX_LOCK ecm_pushed_deleted_lock;
 extern struct ecm_request_t	*ecm_pushed_deleted;
 extern CS_MUTEX_LOCK ecmcache_lock;
-extern struct ecm_request_t *ecmcwcache;
 
 // HIT CACHE functions **************************************************************
 
@@ -60,11 +60,18 @@ static hash_table ht_hitcache;
 static list ll_hitcache;
 static bool cacheex_running;
 
+static void cacheex_init_push_index(void);
+static void cacheex_free_push_index(void);
+#ifdef CS_CACHEEX_AIO
+static void cacheex_push_batch_check(void);
+#endif
+
 void cacheex_init_hitcache(void)
 {
 	init_hash_table(&ht_hitcache, &ll_hitcache);
 	if (pthread_rwlock_init(&hitcache_lock,NULL) != 0)
 		cs_log("Error creating lock hitcache_lock!");
+	cacheex_init_push_index();
 	cacheex_running = true;
 }
 
@@ -74,6 +81,7 @@ void cacheex_free_hitcache(void)
 	cacheex_cleanup_hitcache(true);
 	deinitialize_hash_table(&ht_hitcache);
 	pthread_rwlock_destroy(&hitcache_lock);
+	cacheex_free_push_index();
 }
 
 static int cacheex_compare_hitkey(const void *arg, const void *obj)
@@ -303,7 +311,7 @@ static void *chkcache_process(void)
 	while(cacheex_running)
 	{
 		cs_readlock(__func__, &ecmcache_lock);
-		for(er = ecmcwcache; er; er = er->next)
+		for(er = ecmcwcache_newest(); er; er = ecmcwcache_older(er))
 		{
 			timeout = time(NULL) - ((cfg.ctimeout + 500) / 1000 + 1);
 			if(er->tps.time < timeout)
@@ -392,7 +400,12 @@ static void *chkcache_process(void)
 			}
 		}
 		cs_readunlock(__func__, &ecmcache_lock);
+#ifdef CS_CACHEEX_AIO
+		cacheex_push_batch_check();
+#endif
+		garbage_offline();
 		cs_sleepms(10);
+		garbage_online();
 	}
 
 	return NULL;
@@ -593,6 +606,223 @@ static uint8_t chk_cwcheck(ECM_REQUEST *er, uint8_t cw_check_for_push)
 }
 #endif
 
+// PUSH INDEX functions **************************************************************
+// Peers a cw may be pushed to (cacheex=2 clients, cacheex=3 readers and csp clients),
+// keyed by the caids their caid tab and cacheex_ecm_filter can accept. Peers without
+// a fixed caid list are in push_any. The index only preselects, the push still runs
+// all checks.
+
+#define PUSH_MAX_CAIDS 64
+
+struct s_push_peer
+{
+	struct s_client	*cl;
+	struct s_reader	*rdr;							// cacheex=3 reader, NULL for clients
+};
+
+struct s_push_sub
+{
+	uint16_t		caid;
+	int32_t			count;
+	int32_t			*idx;							// into push_peer
+	node			ht_node;
+	node			ll_node;
+};
+
+static pthread_rwlock_t push_index_lock;
+static hash_table ht_push_sub;
+static list ll_push_sub;
+static struct s_push_peer *push_peer;
+static int32_t push_peer_count;
+static int32_t *push_any;
+static int32_t push_any_count;
+static uint32_t push_index_gen = 1;
+static uint32_t push_index_built;
+
+/* Marks the push index as outdated, it is rebuilt on the next push. Called
+   when clients, readers, accounts or the ecm filters of peers change. */
+void cacheex_push_index_invalidate(void)
+{
+	push_index_gen++;
+}
+
+static int cacheex_compare_push_caid(const void *arg, const void *obj)
+{
+	return *(const uint16_t *)arg != ((const struct s_push_sub *)obj)->caid;
+}
+
+// chk_csp_ctab() for the caid alone
+static int32_t cacheex_push_filter_caid(CECSPVALUETAB *tab, uint16_t caid)
+{
+	int32_t i;
+
+	if(!tab->cevnum)
+		{ return 1; }
+	for(i = 0; i < tab->cevnum; i++)
+	{
+		CECSPVALUETAB_DATA *d = &tab->cevdata[i];
+		if(d->caid > 0 && (d->caid == caid || d->caid == caid >> 8 || (d->cmask >= 0 && (caid & d->cmask) == d->caid)))
+			{ return 1; }
+	}
+	return 0;
+}
+
+/* Collects the caids a peer can accept at most. Returns their number or -1 if
+   the tabs do not limit the peer to a short list of single caids. */
+static int32_t cacheex_push_peer_caids(CAIDTAB *ctab, CECSPVALUETAB *filter, uint16_t *caids)
+{
+	int32_t i, n = 0, m = 0;
+
+	if(ctab->ctnum)
+	{
+		for(i = 0; i < ctab->ctnum && ctab->ctdata[i].caid; i++)
+		{
+			if(ctab->ctdata[i].mask != 0xFFFF || n == PUSH_MAX_CAIDS)
+				{ return -1; }
+			caids[n++] = ctab->ctdata[i].caid;
+		}
+	}
+	else if(filter->cevnum)
+	{
+		for(i = 0; i < filter->cevnum; i++)
+		{
+			CECSPVALUETAB_DATA *d = &filter->cevdata[i];
+			if(d->caid <= 0)
+				{ continue; } // never matches
+			if(d->caid <= 0xFF || d->cmask >= 0 || n == PUSH_MAX_CAIDS)
+				{ return -1; }
+			caids[n++] = d->caid;
+		}
+		return n;
+	}
+	else
+		{ return -1; }
+
+	for(i = 0; i < n; i++)
+	{
+		if(cacheex_push_filter_caid(filter, caids[i]))
+			{ caids[m++] = caids[i]; }
+	}
+	return m;
+}
+
+static void cacheex_push_index_add(struct s_client *cl, struct s_reader *rdr, CAIDTAB *ctab, CECSPVALUETAB *filter)
+{
+	uint16_t caids[PUSH_MAX_CAIDS];
+	struct s_push_sub *sub;
+	int32_t i, n;
+
+	if(!cs_realloc(&push_peer, (push_peer_count + 1) * sizeof(struct s_push_peer)))
+	{
+		push_peer_count = 0;
+		return;
+	}
+	push_peer[push_peer_count].cl = cl;
+	push_peer[push_peer_count].rdr = rdr;
+
+	n = (ctab && filter) ? cacheex_push_peer_caids(ctab, filter, caids) : -1;
+	if(n < 0)
+	{
+		if(cs_realloc(&push_any, (push_any_count + 1) * sizeof(int32_t)))
+			{ push_any[push_any_count++] = push_peer_count; }
+		else
+			{ push_any_count = 0; }
+	}
+	for(i = 0; i < n; i++)
+	{
+		sub = find_hash_table(&ht_push_sub, &caids[i], sizeof(uint16_t), &cacheex_compare_push_caid);
+		if(!sub)
+		{
+			if(!cs_malloc(&sub, sizeof(struct s_push_sub)))
+				{ continue; }
+			sub->caid = caids[i];
+			add_hash_table(&ht_push_sub, &sub->ht_node, &ll_push_sub, &sub->ll_node, sub, &sub->caid, sizeof(uint16_t));
+		}
+		if(sub->count && sub->idx[sub->count - 1] == push_peer_count)
+			{ continue; } // caid listed twice
+		if(cs_realloc(&sub->idx, (sub->count + 1) * sizeof(int32_t)))
+			{ sub->idx[sub->count++] = push_peer_count; }
+		else
+			{ sub->count = 0; }
+	}
+	push_peer_count++;
+}
+
+// caller must hold push_index_lock for writing
+static void cacheex_push_index_clear(void)
+{
+	struct s_push_sub *sub;
+
+	while((sub = get_first_elem_list(&ll_push_sub)))
+	{
+		remove_elem_list(&ll_push_sub, &sub->ll_node);
+		remove_elem_hash_table(&ht_push_sub, &sub->ht_node);
+		NULLFREE(sub->idx);
+		NULLFREE(sub);
+	}
+	NULLFREE(push_peer);
+	NULLFREE(push_any);
+	push_peer_count = 0;
+	push_any_count = 0;
+}
+
+static void cacheex_push_index_build(void)
+{
+	struct s_client *cl;
+	struct s_reader *rdr;
+	uint32_t gen;
+
+	SAFE_RWLOCK_WRLOCK(&push_index_lock);
+	cs_readlock(__func__, &readerlist_lock);
+	cs_readlock(__func__, &clientlist_lock);
+
+	gen = push_index_gen;
+	if(push_index_built != gen)
+	{
+		cacheex_push_index_clear();
+
+		for(cl = first_client->next; cl; cl = cl->next)
+		{
+			if(!check_client(cl))
+				{ continue; }
+			if(get_module(cl)->num == R_CSP)
+				{ cacheex_push_index_add(cl, NULL, NULL, NULL); }
+			else if(cl->typ == 'c' && !cl->dup && cl->account && cl->account->cacheex.mode == 2 && get_module(cl)->c_cache_push)
+				{ cacheex_push_index_add(cl, NULL, &cl->ctab, &cl->account->cacheex.filter_caidtab); }
+		}
+
+		for(rdr = first_active_reader; rdr; rdr = rdr->next)
+		{
+			if(rdr->cacheex.mode == 3 && rdr->ph.c_cache_push && check_client(rdr->client))
+				{ cacheex_push_index_add(rdr->client, rdr, &rdr->ctab, &rdr->cacheex.filter_caidtab); }
+		}
+
+		cs_log_dbg(D_CACHEEX, "push index rebuilt: %d peers, %d caids, %d for any caid", push_peer_count, count_hash_table(&ht_push_sub), push_any_count);
+		push_index_built = gen;
+	}
+
+	cs_readunlock(__func__, &clientlist_lock);
+	cs_readunlock(__func__, &readerlist_lock);
+	SAFE_RWLOCK_UNLOCK(&push_index_lock);
+}
+
+static void cacheex_init_push_index(void)
+{
+	init_hash_table(&ht_push_sub, &ll_push_sub);
+	if (pthread_rwlock_init(&push_index_lock,NULL) != 0)
+		cs_log("Error creating lock push_index_lock!");
+}
+
+static void cacheex_free_push_index(void)
+{
+	SAFE_RWLOCK_WRLOCK(&push_index_lock);
+	cacheex_push_index_clear();
+	push_index_built = 0;
+	SAFE_RWLOCK_UNLOCK(&push_index_lock);
+	deinitialize_hash_table(&ht_push_sub);
+	pthread_rwlock_destroy(&push_index_lock);
+}
+
 /**
  * cacheex modes:
  *
@@ -617,105 +847,144 @@ static uint8_t chk_cwcheck(ECM_REQUEST *er, uint8_t cw_check_for_push)
  *   CW-flow: B->A
  *
  */
-void cacheex_cache_push(ECM_REQUEST *er)
-{
-	if(er->rc >= E_NOTFOUND) { return; }
 
-	//cacheex=2 mode: push (server->remote)
-	struct s_client *cl;
-	cs_readlock(__func__, &clientlist_lock);
-	for(cl = first_client->next; cl; cl = cl->next)
+// cacheex=2 mode: push (server->remote)
+static void cacheex_cache_push_client(struct s_client *cl, ECM_REQUEST *er)
+{
+	if(check_client(cl) && er->cacheex_src != cl)
 	{
-		if(check_client(cl) && er->cacheex_src != cl)
+		if(get_module(cl)->num == R_CSP) // always send to csp cl
 		{
-			if(get_module(cl)->num == R_CSP) // always send to csp cl
-			{
-				if(!er->cacheex_src || cfg.csp.allow_reforward) { cacheex_cache_push_to_client(cl, er); } // but not if the origin was cacheex (might loop)
-			}
-			else if(cl->typ == 'c' && !cl->dup && cl->account && cl->account->cacheex.mode == 2) // send cache over user
-			{
-				if(get_module(cl)->c_cache_push // cache-push able
-						&& (!er->grp || (cl->grp & er->grp)
+			if(!er->cacheex_src || cfg.csp.allow_reforward) { cacheex_cache_push_to_client(cl, er); } // but not if the origin was cacheex (might loop)
+		}
+		else if(cl->typ == 'c' && !cl->dup && cl->account && cl->account->cacheex.mode == 2) // send cache over user
+		{
+			if(get_module(cl)->c_cache_push // cache-push able
+					&& (!er->grp || (cl->grp & er->grp)
 #ifdef CS_CACHEEX_AIO
-							 || (er->localgenerated && ((cl->grp & cfg.cacheex_push_lg_groups) && strcmp(username(cl), username(er->cacheex_src))))
+						 || (er->localgenerated && ((cl->grp & cfg.cacheex_push_lg_groups) && strcmp(username(cl), username(er->cacheex_src))))
 #endif
-						) // Group-check
-						/**** OUTGOING FILTER CHECK ***/
-						&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_name || strcmp(username(cl), er->selected_reader->label)) // check reader mode-1 loopback by same name
-						&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_ip || (check_client(er->selected_reader->client) && !IP_EQUAL(cl->ip, er->selected_reader->client->ip))) // check reader mode-1 loopback by same ip
-						&& (!cl->account->cacheex.drop_csp || checkECMD5(er))                   // cacheex_drop_csp-check
-						&& chk_ctab(er->caid, &cl->ctab)                                        // Caid-check
-						&& (!checkECMD5(er) || chk_ident_filter(er->caid, er->prid, &cl->ftab)) // Ident-check (not for csp: prid=0 always!)
-						&& chk_srvid(cl, er)                                                    // Service-check
-						&& chk_csp_ctab(er, &cl->account->cacheex.filter_caidtab)               // cacheex_ecm_filter
+					) // Group-check
+					/**** OUTGOING FILTER CHECK ***/
+					&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_name || strcmp(username(cl), er->selected_reader->label)) // check reader mode-1 loopback by same name
+					&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_ip || (check_client(er->selected_reader->client) && !IP_EQUAL(cl->ip, er->selected_reader->client->ip))) // check reader mode-1 loopback by same ip
+					&& (!cl->account->cacheex.drop_csp || checkECMD5(er))                   // cacheex_drop_csp-check
+					&& chk_ctab(er->caid, &cl->ctab)                                        // Caid-check
+					&& (!checkECMD5(er) || chk_ident_filter(er->caid, er->prid, &cl->ftab)) // Ident-check (not for csp: prid=0 always!)
+					&& chk_srvid(cl, er)                                                    // Service-check
+					&& chk_csp_ctab(er, &cl->account->cacheex.filter_caidtab)               // cacheex_ecm_filter
 #ifdef CS_CACHEEX_AIO
-						&& (er->localgenerated 													//  lg-flag-check
-						|| chk_srvid_localgenerated_only_exception(er)	 						//		lg-only-service-exception
-						|| !(cl->account->cacheex.localgenerated_only						 	//		usr-lg-only
-							|| (
-							(cl->account->cacheex.feature_bitfield & 64)					 		// cx-aio >= 9.2.6 => check ftab
-								&&	(chk_lg_only(er, &cl->account->cacheex.lg_only_tab) 			// usr-lg-only-ftab (feature 64)
-									|| chk_lg_only(er, &cfg.cacheex_lg_only_tab)) 					// global-lg-only-ftab (feature 64)
-							)
+					&& (er->localgenerated 													//  lg-flag-check
+					|| chk_srvid_localgenerated_only_exception(er)	 						//		lg-only-service-exception
+					|| !(cl->account->cacheex.localgenerated_only						 	//		usr-lg-only
+						|| (
+						(cl->account->cacheex.feature_bitfield & 64)					 		// cx-aio >= 9.2.6 => check ftab
+							&&	(chk_lg_only(er, &cl->account->cacheex.lg_only_tab) 			// usr-lg-only-ftab (feature 64)
+								|| chk_lg_only(er, &cfg.cacheex_lg_only_tab)) 					// global-lg-only-ftab (feature 64)
 						)
 					)
-						&& (chk_cwcheck(er, cl->account->cacheex.cw_check_for_push))			// check cw_check-counter if enabled
-						&& chk_nopushafter(er->caid, &cl->account->cacheex.cacheex_nopushafter_tab, er->ecm_time) // no push after check
-#endif
 				)
-				{
-					cacheex_cache_push_to_client(cl, er);
-				}
+					&& (chk_cwcheck(er, cl->account->cacheex.cw_check_for_push))			// check cw_check-counter if enabled
+					&& chk_nopushafter(er->caid, &cl->account->cacheex.cacheex_nopushafter_tab, er->ecm_time) // no push after check
+#endif
+			)
+			{
+				cacheex_cache_push_to_client(cl, er);
 			}
 		}
 	}
-	cs_readunlock(__func__, &clientlist_lock);
+}
 
-	//cacheex=3 mode: reverse push (reader->server)
-	cs_readlock(__func__, &readerlist_lock);
-	cs_readlock(__func__, &clientlist_lock);
-	struct s_reader *rdr;
-	for(rdr = first_active_reader; rdr; rdr = rdr->next)
+// cacheex=3 mode: reverse push (reader->server)
+static void cacheex_cache_push_reader(struct s_reader *rdr, ECM_REQUEST *er)
+{
+	struct s_client *cl = rdr->client;
+
+	if(check_client(cl) && er->cacheex_src != cl && rdr->active && rdr->cacheex.mode == 3) // send cache over reader
 	{
-		cl = rdr->client;
-		if(check_client(cl) && er->cacheex_src != cl && rdr->cacheex.mode == 3) // send cache over reader
-		{
-			if(rdr->ph.c_cache_push // cache-push able
-					&& (!er->grp || (rdr->grp & er->grp)
+		if(rdr->ph.c_cache_push // cache-push able
+				&& (!er->grp || (rdr->grp & er->grp)
 #ifdef CS_CACHEEX_AIO
-						 || (er->localgenerated && ((rdr->grp & cfg.cacheex_push_lg_groups) && strcmp(username(cl), username(er->cacheex_src))))
+					 || (er->localgenerated && ((rdr->grp & cfg.cacheex_push_lg_groups) && strcmp(username(cl), username(er->cacheex_src))))
 #endif
-					) // Group-check
-					/**** OUTGOING FILTER CHECK ***/
-					&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_name || strcmp(username(cl), er->selected_reader->label)) // check reader mode-1 loopback by same name
-					&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_ip || (check_client(er->selected_reader->client) && !IP_EQUAL(cl->ip, er->selected_reader->client->ip))) // check reader mode-1 loopback by same ip
-					&& (!rdr->cacheex.drop_csp || checkECMD5(er))                            // cacheex_drop_csp-check
-					&& chk_ctab(er->caid, &rdr->ctab)                                        // Caid-check
-					&& (!checkECMD5(er) || chk_ident_filter(er->caid, er->prid, &rdr->ftab)) // Ident-check (not for csp: prid=0 always!)
-					&& chk_srvid(cl, er)                                                     // Service-check
-					&& chk_csp_ctab(er, &rdr->cacheex.filter_caidtab)                        // cacheex_ecm_filter
+				) // Group-check
+				/**** OUTGOING FILTER CHECK ***/
+				&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_name || strcmp(username(cl), er->selected_reader->label)) // check reader mode-1 loopback by same name
+				&& (!er->selected_reader || !cacheex_reader(er->selected_reader) || !cfg.block_same_ip || (check_client(er->selected_reader->client) && !IP_EQUAL(cl->ip, er->selected_reader->client->ip))) // check reader mode-1 loopback by same ip
+				&& (!rdr->cacheex.drop_csp || checkECMD5(er))                            // cacheex_drop_csp-check
+				&& chk_ctab(er->caid, &rdr->ctab)                                        // Caid-check
+				&& (!checkECMD5(er) || chk_ident_filter(er->caid, er->prid, &rdr->ftab)) // Ident-check (not for csp: prid=0 always!)
+				&& chk_srvid(cl, er)                                                     // Service-check
+				&& chk_csp_ctab(er, &rdr->cacheex.filter_caidtab)                        // cacheex_ecm_filter
 #ifdef CS_CACHEEX_AIO
-					&& (er->localgenerated 													//  lg-only-check
-						|| chk_srvid_localgenerated_only_exception(er)	 					//		service-exception
-						|| !(rdr->cacheex.localgenerated_only							 	//		rdr-lg-only
-							|| (
-							(rdr->cacheex.feature_bitfield & 64)					 		// cx-aio >= 9.2.6 => check ftab
-								&&	(chk_lg_only(er, &rdr->cacheex.lg_only_tab) 			// rdr-lg-only-ftab (feature 64)
-									|| chk_lg_only(er, &cfg.cacheex_lg_only_tab)) 			// global-lg-only-ftab (feature 64)
-							)
+				&& (er->localgenerated 													//  lg-only-check
+					|| chk_srvid_localgenerated_only_exception(er)	 					//		service-exception
+					|| !(rdr->cacheex.localgenerated_only							 	//		rdr-lg-only
+						|| (
+						(rdr->cacheex.feature_bitfield & 64)					 		// cx-aio >= 9.2.6 => check ftab
+							&&	(chk_lg_only(er, &rdr->cacheex.lg_only_tab) 			// rdr-lg-only-ftab (feature 64)
+								|| chk_lg_only(er, &cfg.cacheex_lg_only_tab)) 			// global-lg-only-ftab (feature 64)
 						)
 					)
-					&& (chk_cwcheck(er, rdr->cacheex.cw_check_for_push))                     // check cw_check-counter if enabled
-					&& chk_nopushafter(er->caid, &rdr->cacheex.cacheex_nopushafter_tab, er->ecm_time)
+				)
+				&& (chk_cwcheck(er, rdr->cacheex.cw_check_for_push))                     // check cw_check-counter if enabled
+				&& chk_nopushafter(er->caid, &rdr->cacheex.cacheex_nopushafter_tab, er->ecm_time)
 #endif
-			) // no push after check
-			{
-				cacheex_cache_push_to_client(cl, er);
-			}
+		) // no push after check
+		{
+			cacheex_cache_push_to_client(cl, er);
+		}
+	}
+}
+
+static void cacheex_cache_push_peer(struct s_push_peer *peer, ECM_REQUEST *er)
+{
+	if(peer->rdr)
+		{ cacheex_cache_push_reader(peer->rdr, er); }
+	else
+		{ cacheex_cache_push_client(peer->cl, er); }
+}
+
+void cacheex_cache_push(ECM_REQUEST *er)
+{
+	struct s_push_sub *sub;
+	int32_t i;
+
+	if(er->rc >= E_NOTFOUND) { return; }
+
+	// rebuild the index if peers changed, checked under the list locks so that no peer can go away meanwhile
+	while(1)
+	{
+		SAFE_RWLOCK_RDLOCK(&push_index_lock);
+		cs_readlock(__func__, &readerlist_lock);
+		cs_readlock(__func__, &clientlist_lock);
+		if(push_index_built == push_index_gen)
+			{ break; }
+		cs_readunlock(__func__, &clientlist_lock);
+		cs_readunlock(__func__, &readerlist_lock);
+		SAFE_RWLOCK_UNLOCK(&push_index_lock);
+		cacheex_push_index_build();
+	}
+
+	if(!er->caid) // caid 0 passes every caid check
+	{
+		for(i = 0; i < push_peer_count; i++)
+			{ cacheex_cache_push_peer(&push_peer[i], er); }
+	}
+	else
+	{
+		if((sub = find_hash_table(&ht_push_sub, &er->caid, sizeof(uint16_t), &cacheex_compare_push_caid)))
+		{
+			for(i = 0; i < sub->count; i++)
+				{ cacheex_cache_push_peer(&push_peer[sub->idx[i]], er); }
 		}
+		for(i = 0; i < push_any_count; i++)
+			{ cacheex_cache_push_peer(&push_peer[push_any[i]], er); }
 	}
+
 	cs_readunlock(__func__, &clientlist_lock);
 	cs_readunlock(__func__, &readerlist_lock);
+	SAFE_RWLOCK_UNLOCK(&push_index_lock);
 }
 
 /**** INCOMING FILTER CHECK ***/
@@ -1306,29 +1575,157 @@ void cacheex_push_out(struct s_client *cl, ECM_REQUEST *er)
 #endif
 }
 
-bool cacheex_check_queue_length(struct s_client *cl)
+#ifdef CS_CACHEEX_AIO
+// PUSH BATCH functions *************************************************************
+
+/*
+ * With cacheex_push_batch_time set in [cache] the pushes to a peer announcing
+ * CACHEEX_FEATURE_PUSH_BATCH are encoded by the module as usual, but collected
+ * per peer and sent in one frame once cacheex_push_batch_max entries are
+ * collected, the frame is full or cacheex_push_batch_time is over. The buffer
+ * is only used by the job thread of the peer, the time is checked every 10ms
+ * by chkcache_process() which queues ACTION_CACHE_PUSH_FLUSH. count, send_time
+ * and flush_queued are shared with chkcache_process() under push_batch_lock.
+ */
+
+#define PUSH_BATCH_SIZE 1024
+
+struct s_push_batch
 {
-	// Avoid full running queues:
-	if(ll_count(cl->joblist) <= 2000)
-		return 0;
+	uint8_t			buf[PUSH_BATCH_SIZE];
+	int32_t			len;
+	int32_t			count;
+	struct timeb	send_time;
+	int8_t			flush_queued;
+};
 
-	cs_log_dbg(D_TRACE, "WARNING: job queue %s %s has more than 2000 jobs! count=%d, dropped!",
-					cl->typ == 'c' ? "client" : "reader", username(cl), ll_count(cl->joblist));
+static pthread_mutex_t push_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int32_t push_batch_open; // batches waiting for their send time
 
-	// Thread down???
-	SAFE_MUTEX_LOCK(&cl->thread_lock);
-	if(cl && !cl->kill && cl->thread && cl->thread_active)
+int8_t cacheex_push_batch_enabled(struct s_client *cl)
+{
+	int32_t features = 0;
+
+	if(!cfg.cacheex_push_batch_time)
+		{ return 0; }
+	if(cl->typ == 'c' && cl->account)
+		{ features = cl->account->cacheex.feature_bitfield; }
+	else if(cl->reader)
+		{ features = cl->reader->cacheex.feature_bitfield; }
+	return (features & CACHEEX_FEATURE_PUSH_BATCH) ? 1 : 0;
+}
+
+static void cacheex_push_batch_close(struct s_push_batch *batch)
+{
+	batch->len = 0;
+	SAFE_MUTEX_LOCK(&push_batch_lock);
+	batch->count = 0;
+	push_batch_open--;
+	SAFE_MUTEX_UNLOCK(&push_batch_lock);
+}
+
+int32_t cacheex_push_batch_flush(struct s_client *cl)
+{
+	struct s_push_batch *batch = cl->cacheex_batch;
+	struct s_module *module = cl->reader ? &cl->reader->ph : get_module(cl);
+	int32_t res = -1;
+
+	if(!batch)
+		{ return 0; }
+	SAFE_MUTEX_LOCK(&push_batch_lock);
+	batch->flush_queued = 0;
+	SAFE_MUTEX_UNLOCK(&push_batch_lock);
+	if(!batch->count) // only changed by this thread
+		{ return 0; }
+
+	if(module->c_cache_push_batch)
+		{ res = module->c_cache_push_batch(cl, batch->buf, batch->len, batch->count); }
+	cs_log_dbg(D_CACHEEX, "cacheex: pushed %d CWs (%d bytes) in one frame to %s res %d", batch->count, batch->len, username(cl), res);
+	cacheex_push_batch_close(batch);
+	return res;
+}
+
+/* Adds an entry encoded by the module to the batch of the peer. maxlen is the
+   largest batch the module can send in one frame. */
+int32_t cacheex_push_batch_add(struct s_client *cl, uint8_t *entry, int32_t len, int32_t maxlen)
+{
+	struct s_push_batch *batch = cl->cacheex_batch;
+	int32_t res = 0;
+
+	maxlen = MIN(maxlen, PUSH_BATCH_SIZE);
+	if(len > maxlen)
+		{ return -1; }
+
+	if(!batch)
 	{
-		// Just test for invalid thread id:
-		if(pthread_detach(cl->thread) == ESRCH)
-		{
-			cl->thread_active = 0;
-			cs_log_dbg(D_TRACE, "WARNING: %s %s thread died!", cl->typ == 'c' ? "client" : "reader", username(cl));
-		}
+		if(!cs_malloc(&batch, sizeof(struct s_push_batch)))
+			{ return -1; }
+		cl->cacheex_batch = batch;
 	}
-	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
-	return 1;
+
+	if(batch->len + len > maxlen)
+		{ res = cacheex_push_batch_flush(cl); }
+
+	memcpy(batch->buf + batch->len, entry, len);
+	batch->len += len;
+	SAFE_MUTEX_LOCK(&push_batch_lock);
+	if(!batch->count)
+	{
+		cs_ftime(&batch->send_time);
+		add_ms_to_timeb(&batch->send_time, cfg.cacheex_push_batch_time);
+		push_batch_open++;
+	}
+	batch->count++;
+	SAFE_MUTEX_UNLOCK(&push_batch_lock);
+
+	if(batch->count >= cfg.cacheex_push_batch_max)
+		{ res = cacheex_push_batch_flush(cl); }
+	return res;
+}
+
+// queues the flush of the batches whose send time is over
+static void cacheex_push_batch_check(void)
+{
+	struct s_push_batch *batch;
+	struct s_client *cl;
+	struct timeb now;
+	int8_t due;
+
+	SAFE_MUTEX_LOCK(&push_batch_lock);
+	due = push_batch_open > 0;
+	SAFE_MUTEX_UNLOCK(&push_batch_lock);
+	if(!due)
+		{ return; }
+
+	cs_ftime(&now);
+	cs_readlock(__func__, &clientlist_lock);
+	for(cl = first_client->next; cl; cl = cl->next)
+	{
+		if(!(batch = cl->cacheex_batch))
+			{ continue; }
+
+		SAFE_MUTEX_LOCK(&push_batch_lock);
+		due = batch->count && !batch->flush_queued && comp_timeb(&now, &batch->send_time) >= 0;
+		if(due)
+			{ batch->flush_queued = 1; }
+		SAFE_MUTEX_UNLOCK(&push_batch_lock);
+
+		if(due)
+			{ add_job(cl, ACTION_CACHE_PUSH_FLUSH, NULL, 0); }
+	}
+	cs_readunlock(__func__, &clientlist_lock);
+}
+
+// called by free_client(), pushes not sent yet are dropped
+void cacheex_push_batch_free(struct s_client *cl)
+{
+	if(!cl->cacheex_batch)
+		{ return; }
+	if(cl->cacheex_batch->count)
+		{ cacheex_push_batch_close(cl->cacheex_batch); }
+	NULLFREE(cl->cacheex_batch);
 }
+#endif
 
 void cacheex_mode1_delay(ECM_REQUEST *er)
 {
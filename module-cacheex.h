@@ -37,8 +37,17 @@ void cacheex_set_cacheex_src(ECM_REQUEST *ecm, struct s_client *cl);
 void cacheex_init_cacheex_src(ECM_REQUEST *ecm, ECM_REQUEST *er);
 void cacheex_free_csp_lastnodes(ECM_REQUEST *er);
 void checkcache_process_thread_start(void);
+void cacheex_push_index_invalidate(void);
 void cacheex_push_out(struct s_client *cl, ECM_REQUEST *er);
-bool cacheex_check_queue_length(struct s_client *cl);
+#ifdef CS_CACHEEX_AIO
+int8_t cacheex_push_batch_enabled(struct s_client *cl);
+int32_t cacheex_push_batch_add(struct s_client *cl, uint8_t *entry, int32_t len, int32_t maxlen);
+int32_t cacheex_push_batch_flush(struct s_client *cl);
+void cacheex_push_batch_free(struct s_client *cl);
+#else
+static inline int32_t cacheex_push_batch_flush(struct s_client *UNUSED(cl)) { return 0; }
+static inline void cacheex_push_batch_free(struct s_client *UNUSED(cl)) { }
+#endif
 static inline int8_t cacheex_get_rdr_mode(struct s_reader *reader) { return reader ? reader->cacheex.mode : 0; }
 void cacheex_init_hitcache(void);
 void cacheex_free_hitcache(void);
@@ -50,7 +59,8 @@ void cacheex_timeout(ECM_REQUEST *er);
 char* cxaio_ftab_to_buf(FTAB *lg_only_ftab);
 FTAB caidtab2ftab(CAIDTAB *ctab);
 void caidtab2ftab_add(CAIDTAB *lgonly_ctab, FTAB *lgonly_tab);
-#define CACHEEX_FEATURES 127
+#define CACHEEX_FEATURES 255
+#define CACHEEX_FEATURE_PUSH_BATCH 128 // peer takes batched cache pushes
 #endif
 #else
 static inline void cacheex_init(void) { }
@@ -64,8 +74,10 @@ static inline void cacheex_free_csp_lastnodes(ECM_REQUEST *UNUSED(er)) { }
 static inline void cacheex_set_cacheex_src(ECM_REQUEST *UNUSED(ecm), struct s_client *UNUSED(cl)) { }
 static inline void cacheex_init_cacheex_src(ECM_REQUEST *UNUSED(ecm), ECM_REQUEST *UNUSED(er)) { }
 static inline void checkcache_process_thread_start(void) { }
+static inline void cacheex_push_index_invalidate(void) { }
 static inline void cacheex_push_out(struct s_client *UNUSED(cl), ECM_REQUEST *UNUSED(er)) { }
-static inline bool cacheex_check_queue_length(struct s_client *UNUSED(cl)) { return 0; }
+static inline int32_t cacheex_push_batch_flush(struct s_client *UNUSED(cl)) { return 0; }
+static inline void cacheex_push_batch_free(struct s_client *UNUSED(cl)) { }
 static inline int8_t cacheex_get_rdr_mode(struct s_reader *UNUSED(reader)) { return 0; }
 static inline void cacheex_init_hitcache(void) { }
 static inline void cacheex_free_hitcache(void) { }
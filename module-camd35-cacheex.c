@@ -20,6 +20,9 @@
 
 uint8_t camd35_node_id[8];
 
+// largest batch of cache-pushes, fits the 1024 bytes udp receive buffer
+#define CAMD35_PUSH_BATCH_SIZE MIN(MAX_ECM_SIZE, 960)
+
 #define CSP_HASH_SWAP(n) (((((uint32_t)(n) & 0xFF)) << 24) | \
                   ((((uint32_t)(n) & 0xFF00)) << 8) | \
                   ((((uint32_t)(n) & 0xFF0000)) >> 8) | \
@@ -207,6 +210,7 @@ void camd35_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf)
 					cecspvaluetab_add(filter, &d);
 				}
 			}
+			cacheex_push_index_invalidate();
 			break;
 		// no push after
 		case 8: ;
@@ -1063,6 +1067,7 @@ static void camd35_cacheex_push_filter(struct s_client *cl, uint8_t *buf, uint8_
 		i += 4;
 	}
 
+	cacheex_push_index_invalidate();
 	cs_log_dbg(D_CACHEEX, "cacheex: received push filter request from %s", username(cl));
 }
 
@@ -1123,7 +1128,7 @@ static int32_t camd35_cacheex_push_chk(struct s_client *cl, ECM_REQUEST *er)
 	}
 
 	//check if cw is already pushed
-	if(check_is_pushed(er->cw_cache, cl))
+	if(check_is_pushed(er, cl))
 		{ return 0; }
 
 	cs_log_dbg(D_CACHEEX, "cacheex: push ok %" PRIu64 "X to %" PRIu64 "X %s", cacheex_node_id(camd35_node_id), cacheex_node_id(remote_node), username(cl));
@@ -1226,12 +1231,50 @@ static int32_t camd35_cacheex_push_out(struct s_client *cl, struct ecm_request_t
 	{
 		*ofs = 0xFF;
 	}
+
+	// batch entry: size(2) rc(1) header bytes 8-19(12) data(size)
+	if(cacheex_push_batch_enabled(cl))
+	{
+		i2b_buf(2, size, buf + 5);
+		buf[7] = rc;
+		int32_t res = cacheex_push_batch_add(cl, buf + 5, 15 + size, CAMD35_PUSH_BATCH_SIZE);
+		NULLFREE(buf);
+		return res;
+	}
 #endif
 	int32_t res = camd35_send(cl, buf, size);
 	NULLFREE(buf);
 	return res;
 }
 
+#ifdef CS_CACHEEX_AIO
+static int32_t camd35_cacheex_push_batch(struct s_client *cl, uint8_t *data, int32_t len, int32_t count)
+{
+	if(cl->reader)
+	{
+		if(!camd35_tcp_connect(cl))
+		{
+			cs_log_dbg(D_CACHEEX, "cacheex: not connected %s -> no push", username(cl));
+			return (-1);
+		}
+	}
+
+	uint8_t *buf;
+	if(!cs_malloc(&buf, len + 20)) //camd35_send() adds +20
+		{ return -1; }
+
+	buf[0] = 0x3b; //Cache-push batch
+	buf[1] = len & 0xff;
+	buf[2] = len >> 8;
+	buf[3] = count;
+	memcpy(buf + 20, data, len);
+
+	int32_t res = camd35_send(cl, buf, len);
+	NULLFREE(buf);
+	return res;
+}
+#endif
+
 static void camd35_cacheex_push_in(struct s_client *cl, uint8_t *buf)
 {
 	int8_t rc = buf[3];
@@ -1473,31 +1516,58 @@ static void camd35_cacheex_push_in(struct s_client *cl, uint8_t *buf)
 	cacheex_add_to_cache(cl, er);
 }
 
-void camd35_cacheex_recv_ce1_cwc_info(struct s_client *cl, uint8_t *buf, int32_t idx)
+#ifdef CS_CACHEEX_AIO
+/**
+ * split a received batch into single cache-pushes
+ */
+// n is the number of bytes received, the size in the header is not trusted beyond it
+static void camd35_cacheex_push_batch_in(struct s_client *cl, uint8_t *buf, int32_t n)
 {
-	if(!(buf[0] == 0x01 && buf[18] < 0xFF && buf[18] > 0x00)) // cwc info ; normal camd3 ecms send 0xFF but we need no cycletime of 255 ;)
-		return;
-
-	ECM_REQUEST *er = NULL;
-	int32_t i;
+	uint8_t push[20 + CAMD35_PUSH_BATCH_SIZE];
+	uint16_t size = buf[1] | (buf[2] << 8);
+	uint8_t *ofs = buf + 20, *end = buf + MIN(20 + size, n);
+	int32_t count = buf[3], len;
 
-	for(i = 0; i < cfg.max_pending; i++)
+	while(count-- > 0 && ofs + 15 <= end)
 	{
-		if (cl->ecmtask[i].idx == idx)
+		len = b2i(2, ofs);
+		// ecmd5(16) csp_hash(4) cw(16) node count(1) nodes(n*8) lg-flag(1)
+		if(len < 38 || len > CAMD35_PUSH_BATCH_SIZE || ofs + 15 + len > end || 38 + ofs[15 + 36] * 8 > len)
 		{
-			er = &cl->ecmtask[i];
-			break;
+			cs_log_dbg(D_CACHEEX, "cacheex: %s received broken cache-push batch, rest ignored!", username(cl));
+			return;
 		}
+
+		memset(push, 0, 20);
+		push[0] = 0x3f;
+		push[1] = len & 0xff;
+		push[2] = len >> 8;
+		push[3] = ofs[2];
+		memcpy(push + 8, ofs + 3, 12);
+		memcpy(push + 20, ofs + 15, len);
+		camd35_cacheex_push_in(cl, push);
+		ofs += 15 + len;
 	}
+}
+#endif
 
-	if(!er)
+void camd35_cacheex_recv_ce1_cwc_info(struct s_client *cl, uint8_t *buf, int32_t idx)
+{
+	if(!(buf[0] == 0x01 && buf[18] < 0xFF && buf[18] > 0x00)) // cwc info ; normal camd3 ecms send 0xFF but we need no cycletime of 255 ;)
+		return;
+
+	ECM_REQUEST *er;
+	int32_t i;
+
+	if((i = casc_get_ecmtask(cl, idx)) < 0)
 	{ return; }
+	er = &cl->ecmtask[i];
 
 	int8_t rc = buf[3];
 	if(rc != E_FOUND)
 		{ return; }
 
-	if(buf[18])
+	if(buf[18] && er->parent)
 	{
 		if(buf[18] & (0x01 << 7))
 		{
@@ -1585,7 +1655,7 @@ void camd35_cacheex_push_send_own_id(struct s_client *cl, uint8_t *mbuf)
 	camd35_send(cl, rbuf, 12); //send adds +20
 }
 
-bool camd35_cacheex_server(struct s_client *client, uint8_t *mbuf)
+bool camd35_cacheex_server(struct s_client *client, uint8_t *mbuf, int32_t n)
 {
 	switch(mbuf[0])
 	{
@@ -1615,6 +1685,11 @@ bool camd35_cacheex_server(struct s_client *client, uint8_t *mbuf)
 	case 0x3f:  // Cache-push
 		camd35_cacheex_push_in(client, mbuf);
 		break;
+#ifdef CS_CACHEEX_AIO
+	case 0x3b:  // Cache-push batch
+		camd35_cacheex_push_batch_in(client, mbuf, n);
+		break;
+#endif
 #ifdef CS_CACHEEX_AIO
 	case 0x40:	// cacheex-features request
 		camd35_cacheex_feature_request_reply(client, mbuf);
@@ -1632,7 +1707,7 @@ bool camd35_cacheex_server(struct s_client *client, uint8_t *mbuf)
 	return 1; // Processed by cacheex
 }
 
-bool camd35_cacheex_recv_chk(struct s_client *client, uint8_t *buf)
+bool camd35_cacheex_recv_chk(struct s_client *client, uint8_t *buf, int32_t n)
 {
 	struct s_reader *rdr = client->reader;
 	switch(buf[0])
@@ -1659,6 +1734,11 @@ bool camd35_cacheex_recv_chk(struct s_client *client, uint8_t *buf)
 	case 0x3f:    //cache-push
 		camd35_cacheex_push_in(client, buf);
 		break;
+#ifdef CS_CACHEEX_AIO
+	case 0x3b:    //cache-push batch
+		camd35_cacheex_push_batch_in(client, buf, n);
+		break;
+#endif
 #ifdef CS_CACHEEX_AIO
 	case 0x40:	  // cacheex-features request
 		camd35_cacheex_feature_request_reply(client, buf);
@@ -1695,6 +1775,9 @@ void camd35_cacheex_module_init(struct s_module *ph)
 {
 	ph->c_cache_push = camd35_cacheex_push_out;
 	ph->c_cache_push_chk = camd35_cacheex_push_chk;
+#ifdef CS_CACHEEX_AIO
+	ph->c_cache_push_batch = camd35_cacheex_push_batch;
+#endif
 	ph->s_init = camd35_server_client_init;
 }
 
@@ -325,7 +325,7 @@ static int32_t camd35_recv(struct s_client *client, uint8_t *buf, int32_t l)
 				}
 				else if(
 #ifdef CS_CACHEEX_AIO
-					buf[0] == 0x40 || buf[0] == 0x41 || buf[0] == 0x42 ||
+					buf[0] == 0x3B || buf[0] == 0x40 || buf[0] == 0x41 || buf[0] == 0x42 ||
 #endif
 					buf[0] == 0x3D || buf[0] == 0x3E || buf[0] == 0x3F
 				) // cacheex-push
@@ -994,7 +994,7 @@ static void *camd35_server(struct s_client *client, uint8_t *mbuf, int32_t n)
 			break;
 #endif
 		default:
-			if(!camd35_cacheex_server(client, mbuf))
+			if(!camd35_cacheex_server(client, mbuf, n))
 			{
 				cs_log("unknown [cs357x/cs378x] command from %s! (%d) n=%d", username(client), mbuf[0], n);
 			}
@@ -1087,7 +1087,7 @@ static int32_t camd35_send_emm(EMM_PACKET *ep)
 	return rc;
 }
 
-static int32_t camd35_recv_chk(struct s_client *client, uint8_t *dcw, int32_t *rc, uint8_t *buf, int32_t rc2 __attribute__((unused)))
+static int32_t camd35_recv_chk(struct s_client *client, uint8_t *dcw, int32_t *rc, uint8_t *buf, int32_t rc2)
 {
 	uint16_t idx;
 	static const char *typtext[] = { "ok", "invalid", "sleeping" };
@@ -1165,7 +1165,7 @@ static int32_t camd35_recv_chk(struct s_client *client, uint8_t *dcw, int32_t *r
 				rdr->label, buf[21], buf[21], typtext[client->stopped]);
 	}
 
-	if(camd35_cacheex_recv_chk(client, buf))
+	if(camd35_cacheex_recv_chk(client, buf, rc2))
 	{
 		return -1;
 	}
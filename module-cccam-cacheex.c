@@ -19,6 +19,9 @@
 #include "oscam-config.h"
 #endif
 
+// largest batch of cache-pushes, fits CC_MAXMSGSIZE with header and count
+#define CC_PUSH_BATCH_SIZE (CC_MAXMSGSIZE - 24)
+
 #define CSP_HASH_SWAP(n) (((((uint32_t)(n) & 0xFF)) << 24) | \
 						((((uint32_t)(n) & 0xFF00)) << 8) | \
 						((((uint32_t)(n) & 0xFF0000)) >> 8) | \
@@ -209,6 +212,7 @@ void cc_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf)
 					cecspvaluetab_add(filter, &d);
 				}
 			}
+			cacheex_push_index_invalidate();
 			break;
 		// no push after
 		case 8: ;
@@ -1039,6 +1043,7 @@ void cc_cacheex_filter_in(struct s_client *cl, uint8_t *buf)
 		i += 4;
 	}
 
+	cacheex_push_index_invalidate();
 	cs_log_dbg(D_CACHEEX, "cacheex: received push filter request from %s", username(cl));
 }
 
@@ -1105,7 +1110,7 @@ static int32_t cc_cacheex_push_chk(struct s_client *cl, struct ecm_request_t *er
 	}
 
 	// check if cw is already pushed
-	if(check_is_pushed(er->cw_cache, cl))
+	if(check_is_pushed(er, cl))
 	{
 		return 0;
 	}
@@ -1235,6 +1240,19 @@ static int32_t cc_cacheex_push_out(struct s_client *cl, struct ecm_request_t *er
 	{
 		*ofs = 0xFF;
 	}
+
+	// batch entry: size(2) rc(1) caid(2) prid(4) srvid(2) header bytes 18-19(2) data(size)
+	if(cacheex_push_batch_enabled(cl))
+	{
+		i2b_buf(2, size, buf + 7);
+		buf[9] = rc;
+		i2b_buf(2, er->caid, buf + 10);
+		i2b_buf(4, er->prid, buf + 12);
+		i2b_buf(2, er->srvid, buf + 16);
+		int32_t res = cacheex_push_batch_add(cl, buf + 7, 13 + size, CC_PUSH_BATCH_SIZE);
+		NULLFREE(buf);
+		return res;
+	}
 #endif
 
 	int32_t res = cc_cmd_send(cl, buf, size + 20, MSG_CACHE_PUSH);
@@ -1255,6 +1273,80 @@ static int32_t cc_cacheex_push_out(struct s_client *cl, struct ecm_request_t *er
 	return res;
 }
 
+#ifdef CS_CACHEEX_AIO
+static int32_t cc_cacheex_push_batch(struct s_client *cl, uint8_t *data, int32_t len, int32_t count)
+{
+	if(cl->reader)
+	{
+		if(!cl->reader->tcp_connected)
+		{
+			cc_cli_connect(cl);
+		}
+	}
+
+	if(!cl->cc || !cl->udp_fd)
+	{
+		cs_log_dbg(D_CACHEEX, "cacheex: not connected %s -> no push", username(cl));
+		return (-1);
+	}
+
+	uint8_t *buf;
+	if(!cs_malloc(&buf, len + 1))
+	{
+		return -1;
+	}
+
+	buf[0] = count;
+	memcpy(buf + 1, data, len);
+
+	int32_t res = cc_cmd_send(cl, buf, len + 1, MSG_CACHE_PUSH_BATCH);
+	if(res > 0) // cache-ex is pushing out, so no receive but last_g should be updated otherwise disconnect!
+	{
+		if(cl->reader)
+		{
+			cl->reader->last_s = cl->reader->last_g = time((time_t *)0);
+		}
+		cl->last = time(NULL);
+	}
+
+	NULLFREE(buf);
+	return res;
+}
+
+/**
+ * split a received batch into single cache-pushes
+ */
+void cc_cacheex_push_batch_in(struct s_client *cl, uint8_t *buf, int32_t size)
+{
+	uint8_t push[20 + CC_PUSH_BATCH_SIZE];
+	uint8_t *ofs = buf + 1, *end = buf + size;
+	int32_t count = buf[0], len;
+
+	while(count-- > 0 && ofs + 13 <= end)
+	{
+		len = b2i(2, ofs);
+		// ecmd5(16) csp_hash(4) cw(16) node count(1) nodes(n*8) lg-flag(1)
+		if(len < 38 || len > CC_PUSH_BATCH_SIZE || ofs + 13 + len > end || 38 + ofs[13 + 36] * 8 > len)
+		{
+			cs_log_dbg(D_CACHEEX, "cacheex: %s received broken cache-push batch, rest ignored!", username(cl));
+			return;
+		}
+
+		memset(push, 0, 20);
+		memcpy(push, ofs + 3, 2); // caid
+		memcpy(push + 2, ofs + 5, 4); // prid
+		memcpy(push + 10, ofs + 9, 2); // srvid
+		push[12] = 16 + 4 + 16; // ecmd5 + csp_hash + cw
+		push[14] = ofs[2];
+		push[18] = ofs[11];
+		push[19] = ofs[12];
+		memcpy(push + 20, ofs + 13, len);
+		cc_cacheex_push_in(cl, push);
+		ofs += 13 + len;
+	}
+}
+#endif
+
 void cc_cacheex_push_in(struct s_client *cl, uint8_t *buf)
 {
 	struct cc_data *cc = cl->cc;
@@ -1533,6 +1625,9 @@ void cc_cacheex_module_init(struct s_module *ph)
 {
 	ph->c_cache_push = cc_cacheex_push_out;
 	ph->c_cache_push_chk = cc_cacheex_push_chk;
+#ifdef CS_CACHEEX_AIO
+	ph->c_cache_push_batch = cc_cacheex_push_batch;
+#endif
 }
 
 #endif
@@ -11,6 +11,7 @@ void cc_cacheex_feature_request(struct s_client *cl);
 void cc_cacheex_feature_request_reply(struct s_client *cl);
 void cc_cacheex_feature_request_save(struct s_client *cl, uint8_t *buf);
 void cc_cacheex_feature_trigger_in(struct s_client *cl, uint8_t *buf);
+void cc_cacheex_push_batch_in(struct s_client *cl, uint8_t *buf, int32_t size);
 #endif
 #else
 static inline void cc_cacheex_filter_out(struct s_client *UNUSED(cl)) { }
@@ -63,6 +63,7 @@ typedef enum
 	MSG_CACHE_FEATURE_EXCHANGE_REPLY = 0x84, // CacheEx feature-exchange-reply
 	MSG_CACHE_FEATURE_TRIGGER = 0x85, // CacheEx feature-trigger
 	MSG_CW_ECM_LGF = 0x86, // oscam lg-flagged CW
+	MSG_CACHE_PUSH_BATCH = 0x87, // CacheEx batched Cache-Push In/Out
 #endif
 	MSG_CW_NOK1 = 0xfe, // Node no more available
 	MSG_CW_NOK2 = 0xff, // No decoding
@@ -631,14 +631,11 @@ struct cc_extended_ecm_idx *get_extended_ecm_idx_by_idx(struct s_client *cl, uin
 
 void cc_reset_pending(struct s_client *cl, int32_t ecm_idx)
 {
-	int32_t i = 0;
+	int32_t i = casc_get_ecmtask(cl, ecm_idx);
 
-	for(i = 0; i < cfg.max_pending; i++)
+	if(i >= 0 && cl->ecmtask[i].rc == E_ALREADY_SENT)
 	{
-		if(cl->ecmtask[i].idx == ecm_idx && cl->ecmtask[i].rc == E_ALREADY_SENT)
-		{
-			cl->ecmtask[i].rc = E_UNHANDLED; // Mark unused
-		}
+		cl->ecmtask[i].rc = E_UNHANDLED; // Mark unused
 	}
 }
 
@@ -3233,17 +3230,13 @@ int32_t cc_parse_msg(struct s_client *cl, uint8_t *buf, int32_t l)
 						cs_log_dbg(D_TRACE, "NOK1: share temporarily not available %d %04X ecm %d %d!",
 									card->id, card->caid, eei->send_idx, eei->ecm_idx);
 
-						int j;
-						for(j = 0; j < cfg.max_pending; j++)
+						int j = casc_get_ecmtask(cl, ecm_idx);
+						if(j >= 0 && cl->ecmtask[j].rc == E_ALREADY_SENT)
 						{
-							if(cl->ecmtask[j].idx == ecm_idx && cl->ecmtask[j].rc == E_ALREADY_SENT)
-							{
-								ECM_REQUEST *er = &cl->ecmtask[j];
-								cl->pending--;
+							ECM_REQUEST *er = &cl->ecmtask[j];
+							cl->pending--;
 
-								write_ecm_answer(rdr, er, E_NOTFOUND, 0, NULL, NULL, 0, NULL);
-								break;
-							}
+							write_ecm_answer(rdr, er, E_NOTFOUND, 0, NULL, NULL, 0, NULL);
 						}
 					}
 					else if(cc->cmd05NOK) // else MSG_CW_NOK2: can't decode
@@ -3327,18 +3320,14 @@ int32_t cc_parse_msg(struct s_client *cl, uint8_t *buf, int32_t l)
 				}
 				else
 				{
-					int32_t i = 0;
-					for(i = 0; i < cfg.max_pending; i++)
+					int32_t i = casc_get_ecmtask(cl, ecm_idx);
+					if(i >= 0 && cl->ecmtask[i].rc == E_ALREADY_SENT)
 					{
-						if(cl->ecmtask[i].idx == ecm_idx && cl->ecmtask[i].rc == E_ALREADY_SENT)
-						{
-							cs_log_dbg(D_TRACE, "%s ext NOK %s", getprefix(), (buf[1] == MSG_CW_NOK1) ? "NOK1" : "NOK2");
-							ECM_REQUEST *er = &cl->ecmtask[i];
-							cl->pending--;
+						cs_log_dbg(D_TRACE, "%s ext NOK %s", getprefix(), (buf[1] == MSG_CW_NOK1) ? "NOK1" : "NOK2");
+						ECM_REQUEST *er = &cl->ecmtask[i];
+						cl->pending--;
 
-							write_ecm_answer(rdr, er, E_NOTFOUND, 0, NULL, NULL, 0, NULL);
-							break;
-						}
+						write_ecm_answer(rdr, er, E_NOTFOUND, 0, NULL, NULL, 0, NULL);
 					}
 				}
 			}
@@ -3399,6 +3388,15 @@ int32_t cc_parse_msg(struct s_client *cl, uint8_t *buf, int32_t l)
 			break;
 		}
 
+		case MSG_CACHE_PUSH_BATCH:
+		{
+			if((l - 4) >= 1)
+			{
+				cc_cacheex_push_batch_in(cl, data, l - 4);
+			}
+			break;
+		}
+
 		case MSG_CW_ECM_LGF:
 #endif
 		case MSG_CW_ECM:
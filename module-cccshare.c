@@ -9,6 +9,7 @@
 #include "module-cccshare.h"
 #include "oscam-chk.h"
 #include "oscam-client.h"
+#include "oscam-garbage.h"
 #include "oscam-lock.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
@@ -1615,7 +1616,9 @@ void share_updater(void)
 				share_updater_refresh = 0;
 				break;
 			}
+			garbage_offline();
 			cs_sleepms(sleep_step);
+			garbage_online();
 		}
 		if(!share_updater_thread_active)
 			{ break; }
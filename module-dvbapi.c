@@ -16,6 +16,7 @@
 #include "oscam-client.h"
 #include "oscam-config.h"
 #include "oscam-ecm.h"
+#include "oscam-garbage.h"
 #include "oscam-emm.h"
 #include "oscam-files.h"
 #include "oscam-net.h"
@@ -6990,7 +6991,9 @@ static void *dvbapi_main_local(void *cli)
 		rc = 0;
 		while(!(listenfd == -1 && cfg.dvbapi_pmtmode == 6))
 		{
+			garbage_offline();
 			rc = poll(pfd2, pfdcount, 500);
+			garbage_online();
 			if(rc < 0) // error occured while polling for fd's with fresh data
 			{
 				if(errno == EINTR || errno == EAGAIN) // try again in case of interrupt
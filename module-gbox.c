@@ -12,6 +12,7 @@
 #include "oscam-failban.h"
 #include "oscam-client.h"
 #include "oscam-ecm.h"
+#include "oscam-garbage.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
 #include "oscam-chk.h"
@@ -1453,14 +1454,10 @@ static int8_t gbox_received_dcw(struct s_client *cli, uint8_t *data, int32_t n)
 
 	cli->reader->last_g = time((time_t *)0); // for reconnect timeout
 
-	for(i = 0; i < cfg.max_pending; i++)
+	if((i = casc_get_ecmtask(cli, idx)) >= 0)
 	{
-		if(cli->ecmtask[i].idx == idx)
-		{
-			cli->pending--;
-			casc_check_dcw(cli->reader, i, rc, dcw);
-			return 0;
-		}
+		casc_check_dcw(cli->reader, i, rc, dcw);
+		return 0;
 	}
 	return -1;
 }
@@ -2688,7 +2685,9 @@ static void gbx_ticker(void)
 
 		gbox_send_idle_msg();
 
+		garbage_offline();
 		sleepms_on_cond(__func__, &gbx_tick_sleep_cond_mutex, &gbx_tick_sleep_cond, 1000);
+		garbage_online();
 	}
 	pthread_exit(NULL);
 }
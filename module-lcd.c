@@ -13,6 +13,7 @@
 #include "module-cccam.h"
 #include "oscam-client.h"
 #include "oscam-files.h"
+#include "oscam-garbage.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
 
@@ -243,7 +244,9 @@ static void refresh_lcd_file(void)
 			fclose(fpsave);
 		}
 
+		garbage_offline();
 		cs_sleepms(cfg.lcd_write_intervall * 1000);
+		garbage_online();
 		cnt++;
 
 		if(rename(temp_file, targetfile) < 0)
@@ -5,6 +5,7 @@
 #ifdef LEDSUPPORT
 
 #include "module-led.h"
+#include "oscam-garbage.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
 
@@ -164,7 +165,9 @@ static void *arm_led_thread_main(void *UNUSED(thread_data))
 		}
 		if(running)
 		{
+			garbage_offline();
 			sleep(60);
+			garbage_online();
 		}
 	}
 	ll_clear_data(arm_led_actions);
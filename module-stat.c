@@ -13,7 +13,10 @@
 #include "oscam-client.h"
 #include "oscam-ecm.h"
 #include "oscam-files.h"
+#include "oscam-garbage.h"
+#include "oscam-hashtable.h"
 #include "oscam-lock.h"
+#include "oscam-reader.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
 
@@ -24,19 +27,26 @@
 #define LB_FASTEST_READER_FIRST 1
 #define LB_OLDEST_READER_FIRST 2
 #define LB_LOWEST_USAGELEVEL 3
+#define LB_LOWEST_PERCENTILE 4
 
 #define DEFAULT_LOCK_TIMEOUT 1000000
 
 extern CS_MUTEX_LOCK ecmcache_lock;
-extern struct ecm_request_t *ecmcwcache;
+extern int32_t exit_oscam;
 
 static int32_t stat_load_save;
 
 static struct timeb last_housekeeping;
 
+static pthread_mutex_t lb_stat_file_lock;		// serializes writing the stat file and the journal
+static pthread_mutex_t lb_journal_sleep_mutex;
+static pthread_cond_t lb_journal_sleep_cond;
+
 void init_stat(void)
 {
 	stat_load_save = -100;
+	SAFE_MUTEX_INIT(&lb_stat_file_lock, NULL);
+	cs_pthread_cond_init(__func__, &lb_journal_sleep_mutex, &lb_journal_sleep_cond);
 
 	//checking config
 	if(cfg.lb_nbest_readers < 2)
@@ -53,6 +63,8 @@ void init_stat(void)
 		{ cfg.lb_retrylimit = DEFAULT_RETRYLIMIT; }
 	if(cfg.lb_stat_cleanup <= 0)
 		{ cfg.lb_stat_cleanup = DEFAULT_LB_STAT_CLEANUP; }
+	if(cfg.lb_percentile < 50 || cfg.lb_percentile > 99)
+		{ cfg.lb_percentile = DEFAULT_LB_PERCENTILE; }
 }
 
 #define LINESIZE 1024
@@ -86,116 +98,555 @@ static void get_stat_query(ECM_REQUEST *er, STAT_QUERY *q)
 	q->ecmlen = er->ecmlen;
 }
 
-void load_stat_from_file(void)
+/*
+ * Statistics of one reader: a hash index over caid, prid, srvid and chid (ecmlen is checked
+ * while walking the bucket) and an age list ordered by ll_stamp, oldest first. Both are
+ * protected by rdr->lb_stat_lock, which is only taken for writing to insert or remove.
+ * add_stat() updates the counters of an entry under the read lock, so answers for the same
+ * reader do not wait for each other or for stat_get_best_reader(): single stores are plain,
+ * read-modify-write goes through STAT_INC and STAT_CAS. It does not move the entry in the
+ * age list either, the housekeeping requeues entries received since they were queued and
+ * stops at the first entry queued within lb_stat_cleanup.
+ */
+#define STAT_INC(p)			__sync_add_and_fetch(p, 1)
+#define STAT_CAS(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+
+struct s_lb_stat
 {
-	stat_load_save = 0;
-	char buf[256];
-	char *line;
-	char *fname;
-	FILE *file;
+	hash_table ht;
+	list ll;
+	READER_STAT *journal;						// stats with journal_dirty set, pushed without lock
+};
+
+static int8_t lb_stat_create(struct s_reader *rdr)
+{
+	struct s_lb_stat *st;
+
+	if(rdr->lb_stat)
+		{ return 1; }
+	if(!cs_malloc(&st, sizeof(struct s_lb_stat)))
+		{ return 0; }
+	init_hash_table(&st->ht, &st->ll);
+	cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
+	rdr->lb_stat = st;
+	return 1;
+}
+
+static tommy_hash_t lb_stat_hash(uint16_t caid, uint32_t prid, uint16_t srvid, uint32_t chid)
+{
+	uint32_t key[3] = { (uint32_t)caid << 16 | srvid, prid, chid };
+	return tommy_hash_u32(0, key, sizeof(key));
+}
+
+// caller must hold lb_stat_lock for writing
+static void lb_stat_insert(struct s_lb_stat *st, READER_STAT *s)
+{
+	s->ll_stamp = s->last_received;
+	tommy_hashlin_insert(&st->ht, &s->ht_node, s, lb_stat_hash(s->caid, s->prid, s->srvid, s->chid));
+	tommy_list_insert_tail(&st->ll, &s->ll_node, s);
+}
+
+// caller must hold lb_stat_lock for writing
+static void lb_stat_remove(struct s_lb_stat *st, READER_STAT *s)
+{
+	READER_STAT **p;
+
+	// nobody pushes to the journal list without the read lock
+	if(s->journal_dirty)
+	{
+		for(p = &st->journal; *p; p = &(*p)->journal_next)
+		{
+			if(*p == s)
+			{
+				*p = s->journal_next;
+				break;
+			}
+		}
+	}
+	tommy_hashlin_remove_existing(&st->ht, &s->ht_node);
+	tommy_list_remove_existing(&st->ll, &s->ll_node);
+	NULLFREE(s);
+}
+
+// caller must hold lb_stat_lock for writing
+static void lb_stat_requeue(struct s_lb_stat *st, READER_STAT *s)
+{
+	cs_ftime(&s->ll_stamp);
+	tommy_list_remove_existing(&st->ll, &s->ll_node);
+	tommy_list_insert_tail(&st->ll, &s->ll_node, s);
+}
+
+// caller must hold lb_stat_lock
+static READER_STAT *lb_stat_find(struct s_lb_stat *st, uint16_t caid, uint32_t prid, uint16_t srvid, uint32_t chid, int16_t ecmlen)
+{
+	tommy_hash_t hash = lb_stat_hash(caid, prid, srvid, chid);
+	tommy_node *n;
+	READER_STAT *s;
 
-	if(!cfg.lb_savepath)
+	for(n = tommy_hashlin_bucket(&st->ht, hash); n; n = n->next)
 	{
-		get_tmp_dir_filename(buf, sizeof(buf), "stat");
-		fname = buf;
+		s = n->data;
+		if(n->index == hash && s->caid == caid && s->prid == prid && s->srvid == srvid && s->chid == chid && s->ecmlen == ecmlen)
+			{ return s; }
+	}
+	return NULL;
+}
+
+static int lb_stat_cmp_stamp(const void *a, const void *b)
+{
+	READER_STAT *s1 = (READER_STAT *)a, *s2 = (READER_STAT *)b;
+	int64_t res = comp_timeb(&s1->ll_stamp, &s2->ll_stamp);
+	return res < 0 ? -1 : res > 0;
+}
+
+/*
+ * Binary statistics file: a header, the reader label table and fixed size records, all in
+ * host byte order. The crc covers the label table and the records. The file is written from
+ * a snapshot to a temporary file that is renamed, and mapped read only for loading.
+ * Text files of older versions are still loaded, --lbstat-export and --lbstat-import
+ * convert between both formats.
+ * With lb_journal the records changed by add_stat() are appended to <file>.journal in blocks
+ * of the same layout, which are replayed after loading the file. Saving the file truncates
+ * the journal.
+ */
+#define LB_STAT_MAGIC "OSCAMLBS"
+#define LB_JOURNAL_MAGIC "OSCAMLBJ"
+#define LB_STAT_VERSION 1
+#define LB_STAT_LABEL_SIZE 64
+
+struct s_lb_stat_header
+{
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		header_size;
+	uint32_t		record_size;
+	uint32_t		label_count;
+	uint32_t		record_count;
+	uint32_t		crc;
+};
+
+struct s_lb_stat_record
+{
+	uint32_t		label;						// index into the label table
+	uint32_t		prid;
+	uint32_t		chid;
+	uint16_t		caid;
+	uint16_t		srvid;
+	int16_t			ecmlen;
+	int16_t			rc;
+	int32_t			time_avg;
+	int32_t			ecm_count;
+	int32_t			fail_factor;
+	int64_t			last_received;				// seconds
+};
+
+// a mapped stat file or the records collected for writing one
+struct s_lb_stat_file
+{
+	void			*map;
+	size_t			map_size;
+	char			(*labels)[LB_STAT_LABEL_SIZE];
+	uint32_t		label_count, label_alloc;
+	struct s_lb_stat_record *records;
+	uint32_t		record_count, record_alloc;
+};
+
+// under lb_stat_file_lock
+static uint32_t lb_stat_file_records;			// records in the stat file
+static uint32_t lb_journal_records;				// records in the journal
+
+static int8_t lb_journal_running;				// set by the first add_stat, cleared under lb_stat_file_lock
+
+static char *lb_stat_filename(char *buf, size_t len)
+{
+	if(cfg.lb_savepath)
+		{ return cfg.lb_savepath; }
+	get_tmp_dir_filename(buf, len, "stat");
+	return buf;
+}
+
+static char *lb_journal_filename(char *buf, size_t len)
+{
+	char base[256];
+	if(snprintf(buf, len, "%s.journal", lb_stat_filename(base, sizeof(base))) >= (int32_t)len)
+		{ cs_log("journal file name too long, truncated to %s", buf); }
+	return buf;
+}
+
+static struct s_reader *lb_stat_reader(const char *label)
+{
+	struct s_reader *rdr;
+	LL_ITER itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
+	{
+		if(strcmp(rdr->label, label) == 0)
+			{ break; }
 	}
+	return rdr;
+}
+
+static void lb_stat_from_record(READER_STAT *s, const struct s_lb_stat_record *r)
+{
+	s->rc = r->rc;
+	s->caid = r->caid;
+	s->prid = r->prid;
+	s->srvid = r->srvid;
+	s->chid = r->chid;
+	s->ecmlen = r->ecmlen;
+	s->time_avg = r->time_avg;
+	s->ecm_count = r->ecm_count;
+	s->last_received.time = r->last_received;
+	s->fail_factor = r->fail_factor;
+}
+
+static void lb_stat_to_record(struct s_lb_stat_record *r, uint32_t label, const READER_STAT *s)
+{
+	memset(r, 0, sizeof(*r));
+	r->label = label;
+	r->rc = s->rc;
+	r->caid = s->caid;
+	r->prid = s->prid;
+	r->srvid = s->srvid;
+	r->chid = s->chid;
+	r->ecmlen = s->ecmlen;
+	r->time_avg = s->time_avg;
+	r->ecm_count = s->ecm_count;
+	r->last_received = s->last_received.time;
+	r->fail_factor = s->fail_factor;
+}
+
+static int32_t lb_stat_add_label(struct s_lb_stat_file *f, const char *label)
+{
+	int32_t i;
+
+	for(i = f->label_count - 1; i >= 0; i--) // usually the last one
+	{
+		if(strcmp(f->labels[i], label) == 0)
+			{ return i; }
+	}
+	if(f->label_count == f->label_alloc)
+	{
+		char (*labels)[LB_STAT_LABEL_SIZE];
+		uint32_t alloc = f->label_alloc ? f->label_alloc * 2 : 16;
+		if(!(labels = realloc(f->labels, alloc * LB_STAT_LABEL_SIZE))) // keeps the labels on failure
+			{ return -1; }
+		f->labels = labels;
+		f->label_alloc = alloc;
+	}
+	memset(f->labels[f->label_count], 0, LB_STAT_LABEL_SIZE);
+	cs_strncpy(f->labels[f->label_count], label, LB_STAT_LABEL_SIZE);
+	return f->label_count++;
+}
+
+// makes room for count more records, keeps the records collected so far on failure
+static int8_t lb_stat_reserve(struct s_lb_stat_file *f, uint32_t count)
+{
+	struct s_lb_stat_record *records;
+	uint32_t alloc = f->record_alloc;
+
+	if(f->record_count + count <= alloc)
+		{ return 1; }
+	while(f->record_count + count > alloc)
+		{ alloc = alloc ? alloc * 2 : 1024; }
+	if(!(records = realloc(f->records, alloc * sizeof(struct s_lb_stat_record))))
+		{ return 0; }
+	f->records = records;
+	f->record_alloc = alloc;
+	return 1;
+}
+
+static void lb_stat_file_free(struct s_lb_stat_file *f)
+{
+	if(f->map)
+		{ munmap(f->map, f->map_size); }
 	else
-		{ fname = cfg.lb_savepath; }
+	{
+		NULLFREE(f->labels);
+		NULLFREE(f->records);
+	}
+	memset(f, 0, sizeof(*f));
+}
 
-	file = fopen(fname, "r");
-	if(!file)
+static uint32_t lb_stat_crc(struct s_lb_stat_file *f)
+{
+	uint32_t crc = crc32(0, (uint8_t *)f->labels, f->label_count * LB_STAT_LABEL_SIZE);
+	return crc32(crc, (uint8_t *)f->records, f->record_count * sizeof(struct s_lb_stat_record));
+}
+
+// writes f as one block
+static int8_t lb_stat_fwrite(FILE *file, const char *magic, struct s_lb_stat_file *f)
+{
+	struct s_lb_stat_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, magic, sizeof(h.magic));
+	h.version = LB_STAT_VERSION;
+	h.header_size = sizeof(h);
+	h.record_size = sizeof(struct s_lb_stat_record);
+	h.label_count = f->label_count;
+	h.record_count = f->record_count;
+	h.crc = lb_stat_crc(f);
+
+	return fwrite(&h, sizeof(h), 1, file) == 1
+		&& fwrite(f->labels, LB_STAT_LABEL_SIZE, f->label_count, file) == f->label_count
+		&& fwrite(f->records, sizeof(struct s_lb_stat_record), f->record_count, file) == f->record_count;
+}
+
+static int8_t lb_stat_write(const char *fname, struct s_lb_stat_file *f)
+{
+	char tmp[256];
+	FILE *file;
+	int8_t ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	if(!(file = fopen(tmp, "wb")))
+		{ return 0; }
+	ok = lb_stat_fwrite(file, LB_STAT_MAGIC, f);
+	if(fclose(file) || !ok || rename(tmp, fname))
 	{
-		cs_log_dbg(D_LB, "loadbalancer: could not open %s for reading (errno=%d %s)", fname, errno, strerror(errno));
-		return;
+		unlink(tmp);
+		return 0;
 	}
+	return 1;
+}
 
-	if(!cs_malloc(&line, LINESIZE))
+// Maps fname. Returns 1 if mapped, 0 if it is missing or too short, -1 on errors.
+static int8_t lb_stat_mmap(const char *fname, struct s_lb_stat_file *f, const char **error)
+{
+	struct stat st;
+	int fd;
+
+	*error = NULL;
+	memset(f, 0, sizeof(*f));
+	if((fd = open(fname, O_RDONLY)) < 0)
+		{ return 0; }
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(struct s_lb_stat_header))
 	{
-		fclose(file);
-		return;
+		close(fd);
+		return 0;
+	}
+	f->map_size = st.st_size;
+	f->map = mmap(NULL, f->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(f->map == MAP_FAILED)
+	{
+		f->map = NULL;
+		*error = strerror(errno);
+		return -1;
 	}
+	return 1;
+}
 
-	cs_log_dbg(D_LB, "loadbalancer: load statistics from %s", fname);
+/*
+ * Checks the block at h with avail bytes left and points f at its labels and records.
+ * Returns the size of the block, 0 if it is damaged (error is set then).
+ */
+static size_t lb_stat_block(struct s_lb_stat_header *h, size_t avail, struct s_lb_stat_file *f, const char **error)
+{
+	uint64_t size;
+	uint32_t i;
+
+	if(avail < sizeof(*h))
+		{ *error = "truncated"; return 0; }
+	if(h->version != LB_STAT_VERSION || h->header_size != sizeof(*h) || h->record_size != sizeof(struct s_lb_stat_record))
+		{ *error = "unsupported version"; return 0; }
+	size = (uint64_t)h->header_size + (uint64_t)h->label_count * LB_STAT_LABEL_SIZE + (uint64_t)h->record_count * h->record_size;
+	if(size > avail)
+		{ *error = "truncated"; return 0; }
+
+	f->labels = (void *)((uint8_t *)h + h->header_size);
+	f->label_count = h->label_count;
+	f->records = (void *)(f->labels + h->label_count);
+	f->record_count = h->record_count;
+	if(lb_stat_crc(f) != h->crc)
+		{ *error = "checksum mismatch"; return 0; }
+	for(i = 0; i < f->label_count; i++)
+	{
+		if(!memchr(f->labels[i], 0, LB_STAT_LABEL_SIZE))
+			{ *error = "invalid reader label"; return 0; }
+	}
+	for(i = 0; i < f->record_count; i++)
+	{
+		if(f->records[i].label >= f->label_count)
+			{ *error = "invalid record"; return 0; }
+	}
+	return size;
+}
 
-	struct timeb ts, te;
-	cs_ftime(&ts);
+/*
+ * Maps a binary stat file.
+ * Returns 1 if mapped, 0 if fname is missing or no binary stat file, -1 if it is damaged.
+ */
+static int8_t lb_stat_map(const char *fname, struct s_lb_stat_file *f, const char **error)
+{
+	int8_t ret = lb_stat_mmap(fname, f, error);
+	size_t size;
 
-	struct s_reader *rdr = NULL;
-	READER_STAT *s;
+	if(ret != 1)
+		{ return ret; }
+	if(memcmp(((struct s_lb_stat_header *)f->map)->magic, LB_STAT_MAGIC, 8))
+	{
+		lb_stat_file_free(f);
+		return 0;
+	}
+	size = lb_stat_block(f->map, f->map_size, f, error);
+	if(size && size != f->map_size)
+		{ *error = "wrong file size"; }
+	if(*error)
+	{
+		lb_stat_file_free(f);
+		return -1;
+	}
+	return 1;
+}
 
-	int32_t i = 1;
-	int32_t valid = 0;
-	int32_t count = 0;
-	int32_t type = 0;
+/*
+ * Parses one line of the text format into label and s, type is 0 before the first line.
+ * Returns 1 if valid.
+ */
+static int8_t lb_stat_parse_line(char *line, int32_t *type, char *label, size_t label_size, READER_STAT *s)
+{
 	char *ptr, *saveptr1 = NULL;
 	char *split[12];
+	char buf[256];
+	int32_t i;
 
-	while(fgets(line, LINESIZE, file))
+	memset(s, 0, sizeof(READER_STAT));
+
+	//get type by evaluating first line:
+	if(*type == 0)
 	{
-		if(!line[0] || line[0] == '#' || line[0] == ';')
-			{ continue; }
+		if(strstr(line, " rc ")) { *type = 2; }
+		else { *type = 1; }
+	}
 
-		if(!cs_malloc(&s, sizeof(READER_STAT)))
-			{ continue; }
+	if(*type == 1) // New format - faster parsing:
+	{
+		for(i = 0, ptr = strtok_r(line, ",", &saveptr1); ptr && i < 12 ; ptr = strtok_r(NULL, ",", &saveptr1), i++)
+			{ split[i] = ptr; }
+		if(i != 11)
+			{ return 0; }
+		cs_strncpy(label, split[0], label_size);
+		s->rc = atoi(split[1]);
+		s->caid = a2i(split[2], 4);
+		s->prid = a2i(split[3], 6);
+		s->srvid = a2i(split[4], 4);
+		s->chid = a2i(split[5], 4);
+		s->time_avg = atoi(split[6]);
+		s->ecm_count = atoi(split[7]);
+		s->last_received.time = atol(split[8]);
+		s->fail_factor = atoi(split[9]);
+		s->ecmlen = a2i(split[10], 2);
+	}
+	else // Old format - keep for compatibility:
+	{
+		i = sscanf(line, "%255s rc %04d caid %04hX prid %06X srvid %04hX time avg %d ms ecms %d last %ld fail %d len %02hX\n",
+				   buf, &s->rc, &s->caid, &s->prid, &s->srvid,
+				   &s->time_avg, &s->ecm_count, &s->last_received.time, &s->fail_factor, &s->ecmlen);
+		if(i <= 5)
+			{ return 0; }
+		cs_strncpy(label, buf, label_size);
+	}
+	return s->ecmlen > 0;
+}
+
+static void lb_stat_print_line(FILE *file, const char *label, READER_STAT *s)
+{
+	fprintf(file, "%s,%d,%04hX,%06X,%04hX,%04hX,%d,%d,%ld,%d,%02hX\n",
+			label, s->rc, s->caid, s->prid,
+			s->srvid, (uint16_t)s->chid, s->time_avg, s->ecm_count, s->last_received.time, s->fail_factor, s->ecmlen);
+}
+
+// inserts the records of f, replay=1 updates existing entries instead
+static int32_t load_stat_binary(struct s_lb_stat_file *f, int8_t replay)
+{
+	struct s_reader **rdrs, *locked = NULL;
+	READER_STAT *s;
+	uint32_t i;
+	int32_t count = 0;
 
-		//get type by evaluating first line:
-		if(type == 0)
+	if(!f->label_count || !cs_malloc(&rdrs, f->label_count * sizeof(struct s_reader *)))
+		{ return 0; }
+
+	for(i = 0; i < f->label_count; i++)
+	{
+		rdrs[i] = lb_stat_reader(f->labels[i]);
+		if(!rdrs[i] || !lb_stat_create(rdrs[i]))
 		{
-			if(strstr(line, " rc ")) { type = 2; }
-			else { type = 1; }
+			cs_log("loadbalancer: statistics could not be loaded for %s", f->labels[i]);
+			rdrs[i] = NULL;
 		}
+	}
 
-		if(type == 1) // New format - faster parsing:
+	// records are grouped by reader, keep its lock for the whole group
+	for(i = 0; i < f->record_count; i++)
+	{
+		struct s_reader *rdr = rdrs[f->records[i].label];
+		if(rdr != locked)
 		{
-			for(i = 0, ptr = strtok_r(line, ",", &saveptr1); ptr && i < 12 ; ptr = strtok_r(NULL, ",", &saveptr1), i++)
-				{ split[i] = ptr; }
-			valid = (i == 11);
-			if(valid)
-			{
-				cs_strncpy(buf, split[0], sizeof(buf));
-				s->rc = atoi(split[1]);
-				s->caid = a2i(split[2], 4);
-				s->prid = a2i(split[3], 6);
-				s->srvid = a2i(split[4], 4);
-				s->chid = a2i(split[5], 4);
-				s->time_avg = atoi(split[6]);
-				s->ecm_count = atoi(split[7]);
-				s->last_received.time = atol(split[8]);
-				s->fail_factor = atoi(split[9]);
-				s->ecmlen = a2i(split[10], 2);
-			}
+			if(locked) { cs_writeunlock(__func__, &locked->lb_stat_lock); }
+			if((locked = rdr)) { cs_writelock(__func__, &locked->lb_stat_lock); }
 		}
-		else // Old format - keep for compatibility:
+		if(!rdr || f->records[i].ecmlen <= 0)
+			{ continue; }
+		if(replay && (s = lb_stat_find(rdr->lb_stat, f->records[i].caid, f->records[i].prid, f->records[i].srvid, f->records[i].chid, f->records[i].ecmlen)))
+			{ lb_stat_from_record(s, &f->records[i]); } // age order is restored after loading
+		else if(cs_malloc(&s, sizeof(READER_STAT)))
 		{
-			i = sscanf(line, "%255s rc %04d caid %04hX prid %06X srvid %04hX time avg %d ms ecms %d last %ld fail %d len %02hX\n",
-					   buf, &s->rc, &s->caid, &s->prid, &s->srvid,
-					   &s->time_avg, &s->ecm_count, &s->last_received.time, &s->fail_factor, &s->ecmlen);
-			valid = i > 5;
+			lb_stat_from_record(s, &f->records[i]);
+			lb_stat_insert(rdr->lb_stat, s);
 		}
+		else
+			{ continue; }
+		count++;
+	}
+	if(locked) { cs_writeunlock(__func__, &locked->lb_stat_lock); }
+
+	NULLFREE(rdrs);
+	return count;
+}
 
-		if(valid && s->ecmlen > 0)
+static int32_t load_stat_text(const char *fname)
+{
+	char buf[256];
+	char *line;
+	FILE *file;
+	struct s_reader *rdr = NULL;
+	READER_STAT *s;
+	int32_t count = 0;
+	int32_t type = 0;
+
+	file = fopen(fname, "r");
+	if(!file)
+	{
+		cs_log_dbg(D_LB, "loadbalancer: could not open %s for reading (errno=%d %s)", fname, errno, strerror(errno));
+		return 0;
+	}
+
+	if(!cs_malloc(&line, LINESIZE))
+	{
+		fclose(file);
+		return 0;
+	}
+
+	while(fgets(line, LINESIZE, file))
+	{
+		if(!line[0] || line[0] == '#' || line[0] == ';')
+			{ continue; }
+
+		if(!cs_malloc(&s, sizeof(READER_STAT)))
+			{ continue; }
+
+		if(lb_stat_parse_line(line, &type, buf, sizeof(buf), s))
 		{
 			if(rdr == NULL || strcmp(buf, rdr->label) != 0)
-			{
-				LL_ITER itr = ll_iter_create(configured_readers);
-				while((rdr = ll_iter_next(&itr)))
-				{
-					if(strcmp(rdr->label, buf) == 0)
-					{
-						break;
-					}
-				}
-			}
+				{ rdr = lb_stat_reader(buf); }
 
-			if(rdr != NULL && strcmp(buf, rdr->label) == 0)
+			if(rdr != NULL && lb_stat_create(rdr))
 			{
-				if(!rdr->lb_stat)
-				{
-					rdr->lb_stat = ll_create("lb_stat");
-					cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
-				}
-
-				ll_append(rdr->lb_stat, s);
+				cs_writelock(__func__, &rdr->lb_stat_lock);
+				lb_stat_insert(rdr->lb_stat, s);
+				cs_writeunlock(__func__, &rdr->lb_stat_lock);
 				count++;
 			}
 			else
@@ -206,27 +657,213 @@ void load_stat_from_file(void)
 		}
 		else
 		{
-			cs_log_dbg(D_LB, "loadbalancer: statistics ERROR: %s rc=%d i=%d", buf, s->rc, i);
+			cs_log_dbg(D_LB, "loadbalancer: statistics ERROR: %s rc=%d", buf, s->rc);
 			NULLFREE(s);
 		}
 	}
 	fclose(file);
 	NULLFREE(line);
+	return count;
+}
+
+/*
+ * Applies the journal blocks written since the stat file was saved, a block cut off by a
+ * crash ends the replay. Returns the number of replayed records.
+ */
+static int32_t lb_journal_replay(const char *fname)
+{
+	struct s_lb_stat_file map, block;
+	struct s_lb_stat_header *h;
+	const char *error = NULL;
+	size_t off, size;
+	int32_t count = 0;
+
+	if(lb_stat_mmap(fname, &map, &error) != 1)
+	{
+		if(error)
+			{ cs_log("loadbalancer: journal %s not loaded: %s", fname, error); }
+		return 0;
+	}
+	for(off = 0; off < map.map_size; off += size)
+	{
+		h = (void *)((uint8_t *)map.map + off);
+		memset(&block, 0, sizeof(block));
+		if(map.map_size - off < sizeof(*h) || memcmp(h->magic, LB_JOURNAL_MAGIC, sizeof(h->magic)))
+			{ error = "no journal block"; }
+		if(error || !(size = lb_stat_block(h, map.map_size - off, &block, &error)))
+		{
+			cs_log("loadbalancer: journal %s damaged at offset %zu (%s), %d records replayed", fname, off, error, count);
+			break;
+		}
+		count += load_stat_binary(&block, 1);
+	}
+	lb_stat_file_free(&map);
+	return count;
+}
+
+void load_stat_from_file(void)
+{
+	stat_load_save = 0;
+	char buf[256];
+	char *fname = lb_stat_filename(buf, sizeof(buf));
+	struct s_lb_stat_file f;
+	const char *error = NULL;
+	struct s_reader *rdr;
+	int32_t count;
+
+	cs_log_dbg(D_LB, "loadbalancer: load statistics from %s", fname);
+
+	struct timeb ts, te;
+	cs_ftime(&ts);
+
+	SAFE_MUTEX_LOCK(&lb_stat_file_lock);
+	switch(lb_stat_map(fname, &f, &error))
+	{
+	case 1:
+		count = load_stat_binary(&f, 0);
+		lb_stat_file_free(&f);
+		break;
+	case 0:
+		count = load_stat_text(fname);
+		break;
+	default:
+		cs_log("loadbalancer: statistics in %s not loaded: %s", fname, error);
+		count = 0;
+		break;
+	}
+	lb_stat_file_records = count;
+	lb_journal_records = lb_journal_replay(lb_journal_filename(buf, sizeof(buf)));
+	if(lb_journal_records)
+		{ cs_log("loadbalancer: replayed %u records from %s", lb_journal_records, buf); }
+	count += lb_journal_records;
+	SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+
+	// the file is not in age order, sort the age lists once
+	LL_ITER itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
+	{
+		if(rdr->lb_stat)
+		{
+			tommy_node *n;
+			cs_writelock(__func__, &rdr->lb_stat_lock);
+			for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = n->next)
+				{ ((READER_STAT *)n->data)->ll_stamp = ((READER_STAT *)n->data)->last_received; } // replayed records
+			sort_list(&rdr->lb_stat->ll, lb_stat_cmp_stamp);
+			cs_writeunlock(__func__, &rdr->lb_stat_lock);
+		}
+	}
 
 	cs_ftime(&te);
 #ifdef WITH_DEBUG
 	int64_t load_time = comp_timeb(&te, &ts);
 
 	cs_log_dbg(D_LB, "loadbalancer: statistics loaded %d records in %"PRId64" ms", count, load_time);
+#else
+	(void)count;
 #endif
 }
 
+/*
+ * Converts the binary stat file src to the text format in dst.
+ * Returns the number of records or -1, error is set then.
+ */
+int32_t lb_stat_export(const char *src, const char *dst, const char **error)
+{
+	struct s_lb_stat_file f;
+	READER_STAT s;
+	FILE *file;
+	uint32_t i;
+
+	*error = NULL;
+	switch(lb_stat_map(src, &f, error))
+	{
+	case 1:
+		break;
+	case 0:
+		*error = "no binary stat file";
+		return -1;
+	default:
+		return -1;
+	}
+
+	if(!(file = fopen(dst, "w")))
+	{
+		*error = strerror(errno);
+		lb_stat_file_free(&f);
+		return -1;
+	}
+	for(i = 0; i < f.record_count; i++)
+	{
+		memset(&s, 0, sizeof(s));
+		lb_stat_from_record(&s, &f.records[i]);
+		lb_stat_print_line(file, f.labels[f.records[i].label], &s);
+	}
+	if(fclose(file))
+		{ *error = strerror(errno); }
+	lb_stat_file_free(&f);
+	return *error ? -1 : (int32_t)i;
+}
+
+/*
+ * Converts the text stat file src to the binary format in dst.
+ * Returns the number of records or -1, error is set then.
+ */
+int32_t lb_stat_import(const char *src, const char *dst, const char **error)
+{
+	struct s_lb_stat_file f;
+	char label[LB_STAT_LABEL_SIZE];
+	char *line;
+	READER_STAT s;
+	FILE *file;
+	int32_t idx, type = 0;
+
+	*error = NULL;
+	memset(&f, 0, sizeof(f));
+	if(!(file = fopen(src, "r")))
+	{
+		*error = strerror(errno);
+		return -1;
+	}
+	if(!cs_malloc(&line, LINESIZE))
+	{
+		fclose(file);
+		*error = "out of memory";
+		return -1;
+	}
+
+	while(!*error && fgets(line, LINESIZE, file))
+	{
+		if(!line[0] || line[0] == '#' || line[0] == ';' || !lb_stat_parse_line(line, &type, label, sizeof(label), &s))
+			{ continue; }
+		if((idx = lb_stat_add_label(&f, label)) < 0 || !lb_stat_reserve(&f, 1))
+			{ *error = "out of memory"; }
+		else
+			{ lb_stat_to_record(&f.records[f.record_count++], idx, &s); }
+	}
+	fclose(file);
+	NULLFREE(line);
+
+	if(!*error && !lb_stat_write(dst, &f))
+		{ *error = strerror(errno); }
+	idx = f.record_count;
+	lb_stat_file_free(&f);
+	return *error ? -1 : idx;
+}
+
 void lb_destroy_stats(struct s_reader *rdr)
 {
+	tommy_node *n, *next;
+
 	if(!rdr->lb_stat)
 		return;
+	for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = next)
+	{
+		next = n->next;
+		NULLFREE(n->data);
+	}
+	deinitialize_hash_table(&rdr->lb_stat->ht);
+	NULLFREE(rdr->lb_stat);
 	cs_lock_destroy(__func__, &rdr->lb_stat_lock);
-	ll_destroy_data(&rdr->lb_stat);
 }
 
 /**
@@ -234,21 +871,19 @@ void lb_destroy_stats(struct s_reader *rdr)
  **/
 static READER_STAT *get_stat_lock(struct s_reader *rdr, STAT_QUERY *q, int8_t lock)
 {
-	if(!rdr->lb_stat)
-	{
-		rdr->lb_stat = ll_create("lb_stat");
-		cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
-	}
+	tommy_hash_t hash = lb_stat_hash(q->caid, q->prid, q->srvid, q->chid);
+	tommy_node *n;
+	READER_STAT *s = NULL;
+
+	if(!lb_stat_create(rdr))
+		{ return NULL; }
 
 	if(lock) { cs_readlock(__func__, &rdr->lb_stat_lock); }
 
-	LL_ITER it = ll_iter_create(rdr->lb_stat);
-	READER_STAT *s;
-	int32_t i = 0;
-	while((s = ll_iter_next(&it)))
+	for(n = tommy_hashlin_bucket(&rdr->lb_stat->ht, hash); n; n = n->next)
 	{
-		i++;
-		if(s->caid == q->caid && s->prid == q->prid && s->srvid == q->srvid && s->chid == q->chid)
+		s = n->data;
+		if(n->index == hash && s->caid == q->caid && s->prid == q->prid && s->srvid == q->srvid && s->chid == q->chid)
 		{
 			if(s->ecmlen == q->ecmlen)
 				{ break; }
@@ -260,16 +895,10 @@ static READER_STAT *get_stat_lock(struct s_reader *rdr, STAT_QUERY *q, int8_t lo
 			if(!q->ecmlen) // Query without ecmlen from dvbapi
 				{ break; }
 		}
+		s = NULL;
 	}
 	if(lock) { cs_readunlock(__func__, &rdr->lb_stat_lock); }
 
-	// Move stat to list start for faster access:
-	if (i > 10 && s && !rdr->lb_stat_busy) {
-		if (lock) cs_writelock(__func__, &rdr->lb_stat_lock);
-		ll_iter_move_first(&it);
-		if (lock) cs_writeunlock(__func__, &rdr->lb_stat_lock);
-	}
-
 	return s;
 }
 
@@ -282,109 +911,210 @@ static READER_STAT *get_stat(struct s_reader *rdr, STAT_QUERY *q)
 }
 
 /**
- * Calculates average time
+ * Moves the average time towards ecm_time by 2 / (LB_MAX_STAT_TIME + 1), the weight of an
+ * average over the last LB_MAX_STAT_TIME times, rounded so it settles within 2 ms
  */
-static void calc_stat(READER_STAT *s)
+static void calc_stat(READER_STAT *s, int32_t ecm_time)
 {
-	int32_t i, c = 0, t = 0;
-	for(i = 0; i < LB_MAX_STAT_TIME; i++)
+	int32_t avg, diff;
+
+	if(ecm_time <= 0)
+		{ return; }
+	do
 	{
-		if(s->time_stat[i] > 0)
-		{
-			t += (int32_t)s->time_stat[i];
-			c++;
-		}
+		avg = s->time_avg;
+		diff = ecm_time - avg;
+		diff = (2 * diff + (diff < 0 ? -LB_MAX_STAT_TIME : LB_MAX_STAT_TIME) / 2) / (LB_MAX_STAT_TIME + 1);
 	}
-	if(!c)
-		{ s->time_avg = UNDEF_AVG_TIME; }
-	else
-		{ s->time_avg = t / c; }
+	while(!STAT_CAS(&s->time_avg, avg, avg == UNDEF_AVG_TIME ? ecm_time : avg + diff));
 }
 
-/**
- * Saves statistik to /tmp/.oscam/stat.n where n is reader-index
+/*
+ * Every reader keeps the stats changed since the last journal write in a list. add_stat()
+ * pushes a stat when it sets journal_dirty, the journal thread takes the whole list, so a
+ * write costs the changed stats only. Both run under the read lock of lb_stat_lock, a stat
+ * is only unlinked under the write lock when it is removed.
  */
-static void save_stat_to_file_thread(void)
+static void lb_journal_push(struct s_lb_stat *st, READER_STAT *s)
 {
-	stat_load_save = 0;
-	char buf[256];
+	READER_STAT *head;
+	do
+	{
+		head = st->journal;
+		s->journal_next = head;
+	}
+	while(!STAT_CAS(&st->journal, head, s));
+}
 
-	set_thread_name(__func__);
+// marks s for the next journal write, caller must hold lb_stat_lock
+static void lb_journal_mark(struct s_lb_stat *st, READER_STAT *s)
+{
+	if(!s->journal_dirty && STAT_CAS(&s->journal_dirty, 0, 1))
+		{ lb_journal_push(st, s); }
+}
+
+static READER_STAT *lb_journal_detach(struct s_lb_stat *st)
+{
+	READER_STAT *head;
+	do
+		{ head = st->journal; }
+	while(head && !STAT_CAS(&st->journal, head, NULL));
+	return head;
+}
+
+// the next of a taken stat is read before its flag is cleared, a new add_stat() pushes it again
+static READER_STAT *lb_journal_next(READER_STAT *s)
+{
+	READER_STAT *next = s->journal_next;
+	STAT_CAS(&s->journal_dirty, 1, 0);
+	return next;
+}
+
+/* Collects the stats changed since the last call, caller must hold lb_stat_file_lock. */
+static struct s_lb_stat_file lb_journal_take(void)
+{
+	struct s_lb_stat_file batch;
+	struct s_reader *rdr;
+	READER_STAT *s, *next;
 
-	char *fname;
-	if(!cfg.lb_savepath)
+	memset(&batch, 0, sizeof(batch));
+	LL_ITER itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
 	{
-		get_tmp_dir_filename(buf, sizeof(buf), "stat");
-		fname = buf;
+		int32_t label = -1;
+
+		if(!rdr->lb_stat || !rdr->lb_stat->journal)
+			{ continue; }
+
+		cs_readlock(__func__, &rdr->lb_stat_lock);
+		for(s = lb_journal_detach(rdr->lb_stat); s; s = next)
+		{
+			if(!lb_stat_reserve(&batch, 1) || (label < 0 && (label = lb_stat_add_label(&batch, rdr->label)) < 0))
+			{
+				for(; s; s = next) // still marked, keep them for the next write
+				{
+					next = s->journal_next;
+					lb_journal_push(rdr->lb_stat, s);
+				}
+				break;
+			}
+			next = lb_journal_next(s);
+			lb_stat_to_record(&batch.records[batch.record_count++], label, s);
+		}
+		cs_readunlock(__func__, &rdr->lb_stat_lock);
 	}
-	else
-		{ fname = cfg.lb_savepath; }
+	return batch;
+}
 
-	FILE *file = fopen(fname, "w");
+/* Marks the stats of records which could not be written again, so the next write retries them. */
+static void lb_journal_requeue(struct s_lb_stat_file *batch)
+{
+	struct s_lb_stat_record *r;
+	struct s_reader *rdr = NULL;
+	READER_STAT *s;
+	STAT_QUERY q;
+	uint32_t i;
+	int32_t label = -1;
 
-	if(!file)
+	for(i = 0; i < batch->record_count; i++)
 	{
-		cs_log("can't write to file %s", fname);
-		return;
+		r = &batch->records[i];
+		if(r->label != (uint32_t)label) // records of a reader are in a row
+		{
+			label = r->label;
+			rdr = get_reader_by_label(batch->labels[label]);
+		}
+		if(!rdr || !rdr->lb_stat)
+			{ continue; }
+		q.caid = r->caid;
+		q.prid = r->prid;
+		q.srvid = r->srvid;
+		q.chid = r->chid;
+		q.ecmlen = r->ecmlen;
+		cs_readlock(__func__, &rdr->lb_stat_lock);
+		if((s = get_stat_lock(rdr, &q, 0)))
+			{ lb_journal_mark(rdr->lb_stat, s); }
+		cs_readunlock(__func__, &rdr->lb_stat_lock);
 	}
+}
+
+/**
+ * Saves the statistics of all readers to the binary stat file (default /tmp/.oscam/stat)
+ * and truncates the journal. Each reader is only read locked while its entries are copied.
+ */
+static void lb_stat_save(void)
+{
+	stat_load_save = 0;
+	char buf[256];
+
+	char *fname = lb_stat_filename(buf, sizeof(buf));
 
 	struct timeb ts, te;
 	cs_ftime(&ts);
 
 	int32_t cleanup_timeout = (cfg.lb_stat_cleanup * 60 * 60 * 1000);
 
-	int32_t count = 0;
+	SAFE_MUTEX_LOCK(&lb_stat_file_lock);
+
+	struct s_lb_stat_file f;
+	memset(&f, 0, sizeof(f));
+
 	struct s_reader *rdr;
 	LL_ITER itr = ll_iter_create(configured_readers);
 	while((rdr = ll_iter_next(&itr)))
 	{
+		int32_t label = -1;
 
-		if(rdr->lb_stat)
-		{
-			rdr->lb_stat_busy = 1;
+		if(!rdr->lb_stat)
+			{ continue; }
 
-			cs_writelock(__func__, &rdr->lb_stat_lock);
-			LL_ITER it = ll_iter_create(rdr->lb_stat);
-			READER_STAT *s;
-			while((s = ll_iter_next(&it)))
+		cs_readlock(__func__, &rdr->lb_stat_lock);
+		// changes not yet journaled are part of the snapshot
+		READER_STAT *s = lb_journal_detach(rdr->lb_stat);
+		while(s)
+			{ s = lb_journal_next(s); }
+		if(lb_stat_reserve(&f, tommy_list_count(&rdr->lb_stat->ll)))
+		{
+			tommy_node *n;
+			for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = n->next)
 			{
+				s = n->data;
 				int64_t gone = comp_timeb(&ts, &s->last_received);
-				if(gone > cleanup_timeout || !s->ecmlen) // cleanup old stats
-				{
-					ll_iter_remove_data(&it);
-					continue;
-				}
-
-				//Old version, too slow to parse:
-				//fprintf(file, "%s rc %d caid %04hX prid %06X srvid %04hX time avg %d ms ecms %d last %ld fail %d len %02hX\n",
-				//  rdr->label, s->rc, s->caid, s->prid,
-				//  s->srvid, s->time_avg, s->ecm_count, s->last_received, s->fail_factor, s->ecmlen);
-
-				//New version:
-				fprintf(file, "%s,%d,%04hX,%06X,%04hX,%04hX,%d,%d,%ld,%d,%02hX\n",
-						rdr->label, s->rc, s->caid, s->prid,
-						s->srvid, (uint16_t)s->chid, s->time_avg, s->ecm_count, s->last_received.time, s->fail_factor, s->ecmlen);
-
-				count++;
-				//if(count % 500 == 0) { // Saving stats is using too much cpu and causes high file load. so we need a break
-				//	cs_readunlock(__func__, &rdr->lb_stat_lock);
-				//	cs_sleepms(100);
-				//	cs_readlock(__func__, &rdr->lb_stat_lock);
-				//}
+				if(gone > cleanup_timeout || !s->ecmlen) // old stats are removed by the housekeeping
+					{ continue; }
+				if(label < 0 && (label = lb_stat_add_label(&f, rdr->label)) < 0)
+					{ break; }
+				lb_stat_to_record(&f.records[f.record_count++], label, s);
 			}
-			cs_writeunlock(__func__, &rdr->lb_stat_lock);
-
-			rdr->lb_stat_busy = 0;
 		}
+		cs_readunlock(__func__, &rdr->lb_stat_lock);
 	}
 
-	fclose(file);
+	if(!lb_stat_write(fname, &f))
+	{
+		if(cfg.lb_journal > 0)
+			{ lb_journal_requeue(&f); }
+		SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+		cs_log("can't write to file %s", fname);
+		lb_stat_file_free(&f);
+		return;
+	}
+	lb_stat_file_records = f.record_count;
+	lb_journal_records = 0;
+	unlink(lb_journal_filename(buf, sizeof(buf)));
+	SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
 
 	cs_ftime(&te);
 	int64_t load_time = comp_timeb(&te, &ts);
 
+	cs_log("loadbalancer: statistic saved %d records to %s in %"PRId64" ms", f.record_count, fname, load_time);
+	lb_stat_file_free(&f);
+}
 
-	cs_log("loadbalancer: statistic saved %d records to %s in %"PRId64" ms", count, fname, load_time);
+static void save_stat_to_file_thread(void)
+{
+	set_thread_name(__func__);
+	lb_stat_save();
 }
 
 void save_stat_to_file(int32_t thread)
@@ -393,7 +1123,154 @@ void save_stat_to_file(int32_t thread)
 	if(thread)
 		{ start_thread("save lb stats", (void *)&save_stat_to_file_thread, NULL, NULL, 1, 1); }
 	else
-		{ save_stat_to_file_thread(); }
+		{ lb_stat_save(); }
+}
+
+/* Appends the changes collected since the last call to the journal. */
+static void lb_journal_flush(void)
+{
+	struct s_lb_stat_file batch;
+	char fname[256];
+	FILE *file;
+	long pos;
+	int8_t ok;
+
+	SAFE_MUTEX_LOCK(&lb_stat_file_lock);
+	batch = lb_journal_take();
+	if(!lb_journal_running || !batch.record_count)
+	{
+		SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+		lb_stat_file_free(&batch);
+		return;
+	}
+
+	lb_journal_filename(fname, sizeof(fname));
+	if(!(file = fopen(fname, "ab")))
+		{ ok = 0; }
+	else
+	{
+		fseek(file, 0, SEEK_END);
+		pos = ftell(file);
+		ok = lb_stat_fwrite(file, LB_JOURNAL_MAGIC, &batch);
+		if(!ok && pos >= 0 && ftruncate(fileno(file), pos)) // keep the journal replayable
+			{ cs_log_dbg(D_LB, "loadbalancer: can't truncate %s (errno=%d %s)", fname, errno, strerror(errno)); }
+		ok = !fclose(file) && ok;
+	}
+	if(ok)
+		{ lb_journal_records += batch.record_count; }
+	else
+		{ lb_journal_requeue(&batch); }
+	SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+
+	if(ok)
+		{ cs_log_dbg(D_LB, "loadbalancer: journaled %u records to %s", batch.record_count, fname); }
+	else
+		{ cs_log("can't write to file %s", fname); }
+	lb_stat_file_free(&batch);
+}
+
+/*
+ * Writes the journal every lb_journal seconds and saves the stat file once the journal
+ * holds more records than the stat file (and at least lb_save), so the writes follow the
+ * rate of changes instead of the number of statistics.
+ */
+static void lb_journal_thread(void)
+{
+	int8_t compact;
+
+	set_thread_name(__func__);
+	while(!exit_oscam && lb_journal_running && cfg.lb_journal > 0)
+	{
+		garbage_offline();
+		sleepms_on_cond(__func__, &lb_journal_sleep_mutex, &lb_journal_sleep_cond, cfg.lb_journal * 1000);
+		garbage_online();
+
+		lb_journal_flush();
+
+		SAFE_MUTEX_LOCK(&lb_stat_file_lock);
+		compact = lb_journal_running && lb_journal_records >= (uint32_t)cfg.lb_save && lb_journal_records > lb_stat_file_records;
+		SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+		if(compact)
+			{ lb_stat_save(); }
+	}
+	SAFE_MUTEX_LOCK(&lb_stat_file_lock);
+	lb_journal_running = 0;
+	SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+}
+
+/*
+ * Marks s for the journal, a stat changed again before it is written is only written once.
+ * Called under the read lock of rdr->lb_stat_lock, the journal thread collects the values.
+ */
+static void lb_journal_add(struct s_reader *rdr, READER_STAT *s)
+{
+	lb_journal_mark(rdr->lb_stat, s);
+
+	if(!lb_journal_running && STAT_CAS(&lb_journal_running, 0, 1))
+	{
+		if(start_thread("lb journal", (void *)&lb_journal_thread, NULL, NULL, 1, 1))
+			{ lb_journal_running = 0; }
+	}
+}
+
+/*
+ * Response time sketch for LB_LOWEST_PERCENTILE: bucket i of time_hist counts the ecm times
+ * from lb_hist_edge(i) up to lb_hist_edge(i + 1), failures are counted in the last one.
+ * The edges are half octaves from 2 ms, where they start to be distinct as whole ms, and
+ * bucket 0 also takes the faster answers.
+ * All counts are halved once one reaches LB_HIST_LIMIT, so older answers fade out.
+ * The sketch is not saved, until it has answers again time_avg is used.
+ */
+#define LB_HIST_LIMIT 256
+
+int32_t lb_hist_edge(int32_t i)
+{
+	return (i & 1) ? ((2 << (i / 2)) * 181 + 64) / 128 : 2 << (i / 2); // 2^(i/2 + 1) rounded
+}
+
+int32_t lb_hist_bucket(int32_t ecm_time)
+{
+	int32_t i;
+	for(i = 0; i < LB_HIST_BUCKETS - 1 && lb_hist_edge(i + 1) <= ecm_time; i++) { ; }
+	return i;
+}
+
+static void lb_hist_add(READER_STAT *s, int32_t i)
+{
+	uint16_t c;
+
+	if(STAT_INC(&s->time_hist[i]) != LB_HIST_LIMIT)
+		{ return; }
+	for(i = 0; i <= LB_HIST_BUCKETS; i++)
+	{
+		do
+			{ c = s->time_hist[i]; }
+		while(!STAT_CAS(&s->time_hist[i], c, c / 2));
+	}
+}
+
+/**
+ * Returns the response time below which pct percent of the answers were, interpolated within
+ * the bucket, and the share of answers among answers and failures in percent
+ **/
+int32_t lb_hist_percentile(READER_STAT *s, int32_t pct, int32_t *success)
+{
+	uint16_t hist[LB_HIST_BUCKETS + 1];
+	int32_t i, total = 0, rank, lo;
+
+	memcpy(hist, s->time_hist, sizeof(hist));
+	for(i = 0; i < LB_HIST_BUCKETS; i++)
+		{ total += hist[i]; }
+	if(success)
+		{ *success = total + hist[LB_HIST_BUCKETS] ? total * 100 / (total + hist[LB_HIST_BUCKETS]) : 100; }
+	if(!total)
+		{ return s->time_avg; }
+
+	rank = (total * pct + 99) / 100;
+	for(i = 0; rank > hist[i]; i++)
+		{ rank -= hist[i]; }
+	lo = lb_hist_edge(i);
+	return lo + (lb_hist_edge(i + 1) - lo) * rank / hist[i];
 }
 
 /**
@@ -401,45 +1278,59 @@ void save_stat_to_file(int32_t thread)
  **/
 static void inc_fail(READER_STAT *s)
 {
-	if(s->fail_factor <= 0)
-		{ s->fail_factor = 1; }
-	else
-		{ s->fail_factor++; } // inc by one at the time
+	int32_t f;
+	do
+		{ f = s->fail_factor; }
+	while(!STAT_CAS(&s->fail_factor, f, f <= 0 ? 1 : f + 1)); // inc by one at the time
 }
 
-static READER_STAT *get_add_stat(struct s_reader *rdr, STAT_QUERY *q)
+/**
+ * get or create the statistic for caid/prid/srvid/ecmlen and return it with lb_stat_lock
+ * read locked, received=1 sets last_received
+ **/
+static READER_STAT *get_add_stat(struct s_reader *rdr, STAT_QUERY *q, int8_t received)
 {
 	if (rdr->lb_stat_busy)
 		return NULL;
 
-	if(!rdr->lb_stat)
+	if(!lb_stat_create(rdr))
+		{ return NULL; }
+
+	cs_readlock(__func__, &rdr->lb_stat_lock);
+	READER_STAT *s = get_stat_lock(rdr, q, 0);
+	if(s)
 	{
-		rdr->lb_stat = ll_create("lb_stat");
-		cs_lock_create(__func__, &rdr->lb_stat_lock, rdr->label, DEFAULT_LOCK_TIMEOUT);
+		// only read locked: concurrent stores and reads may mix the words of the
+		// old and new timeb, but their seconds share the upper word, so a mixed
+		// value is one of them plus a wrong millitm, which the cleanup and reset
+		// timeouts of minutes and the sort by age do not notice
+		if(received)
+			{ cs_ftime(&s->last_received); }
+		return s;
 	}
+	cs_readunlock(__func__, &rdr->lb_stat_lock);
 
 	cs_writelock(__func__, &rdr->lb_stat_lock);
-
-	READER_STAT *s = get_stat_lock(rdr, q, 0);
-	if(!s)
-	{
-		if(cs_malloc(&s, sizeof(READER_STAT)))
-		{
-			s->caid = q->caid;
-			s->prid = q->prid;
-			s->srvid = q->srvid;
-			s->chid = q->chid;
-			s->ecmlen = q->ecmlen;
-			s->time_avg = UNDEF_AVG_TIME; // dummy placeholder
-			s->rc = E_FOUND; // set to found--> do not change!
-			cs_ftime(&s->last_received);
-			s->fail_factor = 0;
-			s->ecm_count = 0;
-			ll_prepend(rdr->lb_stat, s);
-		}
+	if(!get_stat_lock(rdr, q, 0) && cs_malloc(&s, sizeof(READER_STAT)))
+	{
+		s->caid = q->caid;
+		s->prid = q->prid;
+		s->srvid = q->srvid;
+		s->chid = q->chid;
+		s->ecmlen = q->ecmlen;
+		s->time_avg = UNDEF_AVG_TIME; // dummy placeholder
+		s->rc = E_FOUND; // set to found--> do not change!
+		cs_ftime(&s->last_received);
+		s->fail_factor = 0;
+		s->ecm_count = 0;
+		lb_stat_insert(rdr->lb_stat, s);
 	}
 	cs_writeunlock(__func__, &rdr->lb_stat_lock);
 
+	// look it up again, it may have been cleaned in between
+	cs_readlock(__func__, &rdr->lb_stat_lock);
+	if(!(s = get_stat_lock(rdr, q, 0)))
+		{ cs_readunlock(__func__, &rdr->lb_stat_lock); }
 	return s;
 }
 
@@ -457,7 +1348,9 @@ void readerinfofix_inc_fail(READER_STAT *s)
 
 READER_STAT *readerinfofix_get_add_stat(struct s_reader *rdr, STAT_QUERY *q)
 {
-	return get_add_stat(rdr, q);
+	READER_STAT *s = get_add_stat(rdr, q, 0);
+	if(s) { cs_readunlock(__func__, &rdr->lb_stat_lock); }
+	return s;
 }
 
 static int32_t get_reopen_seconds(READER_STAT *s)
@@ -590,27 +1483,26 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 	STAT_QUERY q;
 	get_stat_query(er, &q);
 	READER_STAT *s;
-	s = get_add_stat(rdr, &q);
+	s = get_add_stat(rdr, &q, 1); // sets last_received, read locked until the stat is updated
 	if (!s) return;
 
 	struct timeb now;
 	cs_ftime(&now);
 
-	cs_ftime(&s->last_received);
-
 	if(rc == E_FOUND) // found
 	{
 
 		s->rc = E_FOUND;
-		s->ecm_count++;
+		STAT_INC(&s->ecm_count);
 		s->fail_factor = 0;
 
 		// FASTEST READER:
-		s->time_idx++;
-		if(s->time_idx >= LB_MAX_STAT_TIME)
-			{ s->time_idx = 0; }
-		s->time_stat[s->time_idx] = ecm_time;
-		calc_stat(s);
+		if(ecm_time > 0)
+		{
+			s->time_last = ecm_time;
+			lb_hist_add(s, lb_hist_bucket(ecm_time));
+		}
+		calc_stat(s, ecm_time);
 
 		// OLDEST READER now set by get best reader!
 
@@ -635,6 +1527,7 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 	else if(rc == E_NOTFOUND || rc == E_TIMEOUT || rc == E_FAKE) // not found / timeout /fake
 	{
 		inc_fail(s);
+		lb_hist_add(s, LB_HIST_BUCKETS); // only here, unhandled timeouts also pass readerinfofix_inc_fail
 		s->rc = rc;
 	}
 	else if(rc == E_INVALID) // invalid
@@ -652,6 +1545,7 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 						rdr->label, rc, buf, ecm_time);
 		}
 #endif
+		cs_readunlock(__func__, &rdr->lb_stat_lock);
 		return;
 	}
 
@@ -667,7 +1561,11 @@ static void add_stat(struct s_reader *rdr, ECM_REQUEST *er, int32_t ecm_time, in
 	}
 #endif
 
-	if(cfg.lb_save)
+	if(cfg.lb_save && cfg.lb_journal > 0)
+		{ lb_journal_add(rdr, s); }
+	cs_readunlock(__func__, &rdr->lb_stat_lock);
+
+	if(cfg.lb_save && cfg.lb_journal <= 0)
 	{
 		stat_load_save++;
 		if(stat_load_save > cfg.lb_save)
@@ -685,12 +1583,14 @@ int32_t clean_stat_by_rc(struct s_reader *rdr, int8_t rc, int8_t inverse)
 		rdr->lb_stat_busy = 1;
 		cs_writelock(__func__, &rdr->lb_stat_lock);
 		READER_STAT *s;
-		LL_ITER itr = ll_iter_create(rdr->lb_stat);
-		while((s = ll_iter_next(&itr)))
+		tommy_node *n, *next;
+		for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = next)
 		{
+			next = n->next;
+			s = n->data;
 			if((!inverse && s->rc == rc) || (inverse && s->rc != rc))
 			{
-				ll_iter_remove_data(&itr);
+				lb_stat_remove(rdr->lb_stat, s);
 				count++;
 			}
 		}
@@ -722,20 +1622,11 @@ int32_t clean_stat_by_id(struct s_reader *rdr, uint16_t caid, uint32_t prid, uin
 
 		rdr->lb_stat_busy = 1;
 		cs_writelock(__func__, &rdr->lb_stat_lock);
-		READER_STAT *s;
-		LL_ITER itr = ll_iter_create(rdr->lb_stat);
-		while((s = ll_iter_next(&itr)))
+		READER_STAT *s = lb_stat_find(rdr->lb_stat, caid, prid, srvid, chid, ecmlen);
+		if(s) // the entry is unique
 		{
-			if(s->caid == caid &&
-					s->prid == prid &&
-					s->srvid == srvid &&
-					s->chid == chid &&
-					s->ecmlen == ecmlen)
-			{
-				ll_iter_remove_data(&itr);
-				count++;
-				break; // because the entry should unique we can left here
-			}
+			lb_stat_remove(rdr->lb_stat, s);
+			count++;
 		}
 		cs_writeunlock(__func__, &rdr->lb_stat_lock);
 		rdr->lb_stat_busy = 0;
@@ -923,15 +1814,11 @@ static void reset_ecmcount_reader(READER_STAT *s, struct s_reader *rdr)
 static void reset_avgtime_reader(READER_STAT *s, struct s_reader *rdr)
 {
 	cs_readlock(__func__, &rdr->lb_stat_lock);
-	if(rdr->lb_stat && rdr->client)
+	if(rdr->lb_stat && rdr->client && s)
 	{
-		if(!s) { return; }
-		int32_t i;
-		for(i = 0; i < LB_MAX_STAT_TIME; i++)
-		{
-			if(s->time_stat[i] > 0) { s->time_stat[i] = 0; }
-		}
+		s->time_last = 0;
 		s->time_avg = UNDEF_AVG_TIME;
+		memset(s->time_hist, 0, sizeof(s->time_hist));
 	}
 	cs_readunlock(__func__, &rdr->lb_stat_lock);
 }
@@ -1006,7 +1893,7 @@ static void try_open_blocked_readers(ECM_REQUEST *er, STAT_QUERY *q, int32_t *ma
  */
 void stat_get_best_reader(ECM_REQUEST *er)
 {
-	if(!cfg.lb_mode || cfg.lb_mode > 3)
+	if(!cfg.lb_mode || cfg.lb_mode > LB_LOWEST_PERCENTILE)
 		{ return; }
 
 	if(!er->reader_avail)
@@ -1441,6 +2328,17 @@ void stat_get_best_reader(ECM_REQUEST *er)
 							{ current = current - 1; } //so when all reaches retrylimit (all have lb_value=1000) or all have same current, it prioritizes the one with s->time_avg<=retrylimit! This avoid a loop!
 					}
 					break;
+
+				case LB_LOWEST_PERCENTILE:
+				{
+					// divided by the answered share: a reader answering 90% of the ecms is rated
+					// as if about 11% slower. Like mode 1 the time already orders the readers,
+					// retrylimit only takes part in the lb_max_ecmcount check above
+					int32_t success, time = lb_hist_percentile(s, cfg.lb_percentile, &success);
+					current = (int64_t)time * 100 / (success > 0 ? success : 1) * 100 / weight;
+					cs_log_dbg(D_LB, "loadbalancer: reader %s p%d %d ms, %d%% answered", rdr->label, cfg.lb_percentile, time, success);
+					break;
+				}
 			}
 
 			if(cfg.lb_mode != LB_OLDEST_READER_FIRST) // Adjust selection to reader load:
@@ -1755,10 +2653,19 @@ void stat_get_best_reader(ECM_REQUEST *er)
  **/
 void clear_reader_stat(struct s_reader *rdr)
 {
+	tommy_node *n, *next;
+
 	if(!rdr->lb_stat)
 		{ return; }
 
-	ll_clear_data(rdr->lb_stat);
+	cs_writelock(__func__, &rdr->lb_stat_lock);
+	rdr->lb_stat->journal = NULL; // all of them go
+	for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = next)
+	{
+		next = n->next;
+		lb_stat_remove(rdr->lb_stat, n->data);
+	}
+	cs_writeunlock(__func__, &rdr->lb_stat_lock);
 }
 
 void clear_all_stat(void)
@@ -1774,7 +2681,6 @@ void clear_all_stat(void)
 static void housekeeping_stat_thread(void)
 {
 	struct timeb now;
-	cs_ftime(&now);
 	int32_t cleanup_timeout = cfg.lb_stat_cleanup * 60 * 60 * 1000;
 	int32_t cleaned = 0;
 	struct s_reader *rdr;
@@ -1787,15 +2693,22 @@ static void housekeeping_stat_thread(void)
 		{
 			rdr->lb_stat_busy = 1;
 			cs_writelock(__func__, &rdr->lb_stat_lock);
-			LL_ITER it = ll_iter_create(rdr->lb_stat);
+			tommy_node *n;
 			READER_STAT *s;
 
-			while((s = ll_iter_next(&it)))
+			// oldest first, requeue entries received since they were queued and stop at the
+			// first one queued within cleanup_timeout
+			cs_ftime(&now);
+			while((n = tommy_list_head(&rdr->lb_stat->ll)))
 			{
-				int64_t gone = comp_timeb(&now, &s->last_received);
-				if(gone > cleanup_timeout)
+				s = n->data;
+				if(comp_timeb(&now, &s->ll_stamp) <= cleanup_timeout)
+					{ break; }
+				if(comp_timeb(&now, &s->last_received) <= cleanup_timeout)
+					{ lb_stat_requeue(rdr->lb_stat, s); }
+				else
 				{
-					ll_iter_remove_data(&it);
+					lb_stat_remove(rdr->lb_stat, s);
 					cleaned++;
 				}
 			}
@@ -1845,10 +2758,28 @@ static int compare_stat_r(READER_STAT **ps1, READER_STAT **ps2)
 
 READER_STAT **get_sorted_stat_copy(struct s_reader *rdr, int32_t reverse, int32_t *size)
 {
-	if(reverse)
-		{ return (READER_STAT **)ll_sort(rdr->lb_stat, compare_stat_r, size); }
-	else
-		{ return (READER_STAT **)ll_sort(rdr->lb_stat, compare_stat, size); }
+	READER_STAT **p;
+	tommy_node *n;
+	int32_t i = 0;
+
+	*size = 0;
+	if(!rdr->lb_stat)
+		{ return NULL; }
+
+	cs_readlock(__func__, &rdr->lb_stat_lock);
+	*size = tommy_list_count(&rdr->lb_stat->ll);
+	if(!*size || !cs_malloc(&p, *size * sizeof(p[0])))
+	{
+		*size = 0;
+		cs_readunlock(__func__, &rdr->lb_stat_lock);
+		return NULL;
+	}
+	for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = n->next)
+		{ p[i++] = n->data; }
+	cs_readunlock(__func__, &rdr->lb_stat_lock);
+
+	qsort(p, *size, sizeof(p[0]), (void *)(reverse ? compare_stat_r : compare_stat));
+	return p;
 }
 
 static int8_t stat_in_ecmlen(struct s_reader *rdr, READER_STAT *s)
@@ -1883,10 +2814,11 @@ void update_ecmlen_from_stat(struct s_reader *rdr)
 		{ return; }
 
 	cs_readlock(__func__, &rdr->lb_stat_lock);
-	LL_ITER it = ll_iter_create(rdr->lb_stat);
+	tommy_node *n;
 	READER_STAT *s;
-	while((s = ll_iter_next(&it)))
+	for(n = tommy_list_head(&rdr->lb_stat->ll); n; n = n->next)
 	{
+		s = n->data;
 		if(s->rc == E_FOUND)
 		{
 			if(!stat_in_ecmlen(rdr, s))
@@ -1941,8 +2873,10 @@ static uint32_t __lb_auto_timeout(ECM_REQUEST *er, uint32_t ctimeout)
 	{
 		if(s->ecm_count < cfg.lb_min_ecmcount) { return ctimeout; }
 
-		t = s->time_avg * (100 + cfg.lb_auto_timeout_p) / 100;
-		if((int32_t)(t - s->time_avg) < cfg.lb_auto_timeout_t) { t = s->time_avg + cfg.lb_auto_timeout_t; }
+		// the percentile shows the slow answers the average hides
+		int32_t time = cfg.lb_mode == LB_LOWEST_PERCENTILE ? lb_hist_percentile(s, cfg.lb_percentile, NULL) : s->time_avg;
+		t = time * (100 + cfg.lb_auto_timeout_p) / 100;
+		if((int32_t)(t - time) < cfg.lb_auto_timeout_t) { t = time + cfg.lb_auto_timeout_t; }
 	}
 
 	if(t > ctimeout) { t = ctimeout; }
@@ -1992,19 +2926,16 @@ static struct ecm_request_t *check_same_ecm(ECM_REQUEST *er)
 	struct s_ecm_answer *ea_ecm = NULL, *ea_er = NULL;
 	uint8_t rdrs = 0;
 
+	timeout = time(NULL) - ((cfg.ctimeout + 500) / 1000);
+
 	cs_readlock(__func__, &ecmcache_lock);
-	for(ecm = ecmcwcache; ecm; ecm = ecm->next)
+	for(ecm = ecmcwcache_find(er->caid, er->ecmd5); ecm; ecm = ecmcwcache_find_next(ecm))
 	{
-		timeout = time(NULL) - ((cfg.ctimeout + 500) / 1000);
-
 		if(ecm->tps.time <= timeout)
-			{ break; }
+			{ continue; }
 
 		if(ecm == er) { continue; }
 
-		if(er->caid != ecm->caid || memcmp(ecm->ecmd5, er->ecmd5, CS_ECMSTORESIZE))
-			{ continue; }
-
 		if(!er->readers || !ecm->readers || er->readers != ecm->readers)
 			{ continue; }
 
@@ -2101,6 +3032,12 @@ void stat_finish(void)
 {
 	if(cfg.lb_mode && cfg.lb_save)
 	{
+		// stop journaling, the saved file contains all changes
+		cfg.lb_journal = 0;
+		SAFE_MUTEX_LOCK(&lb_stat_file_lock);
+		lb_journal_running = 0;
+		SAFE_MUTEX_UNLOCK(&lb_stat_file_lock);
+		SAFE_COND_SIGNAL(&lb_journal_sleep_cond);
 		save_stat_to_file(0);
 		if(cfg.lb_savepath)
 			{ cs_log("stats saved to file %s", cfg.lb_savepath); }
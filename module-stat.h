@@ -14,6 +14,8 @@ void update_ecmlen_from_stat(struct s_reader *rdr);
 void init_stat(void);
 void stat_finish(void);
 void load_stat_from_file(void);
+int32_t lb_stat_export(const char *src, const char *dst, const char **error);
+int32_t lb_stat_import(const char *src, const char *dst, const char **error);
 void lb_destroy_stats(struct s_reader *rdr);
 void send_reader_stat(struct s_reader *rdr, ECM_REQUEST *er, struct s_ecm_answer *ea, int8_t rc);
 void stat_get_best_reader(ECM_REQUEST *er);
@@ -27,10 +29,15 @@ uint16_t lb_get_betatunnel_caid_to(ECM_REQUEST *er);
 void readerinfofix_get_stat_query(ECM_REQUEST *er, STAT_QUERY *q);
 void readerinfofix_inc_fail(READER_STAT *s);
 READER_STAT *readerinfofix_get_add_stat(struct s_reader *rdr, STAT_QUERY *q);
+int32_t lb_hist_edge(int32_t i);
+int32_t lb_hist_bucket(int32_t ecm_time);
+int32_t lb_hist_percentile(READER_STAT *s, int32_t pct, int32_t *success);
 #else
 static inline void init_stat(void) { }
 static inline void stat_finish(void) { }
 static inline void load_stat_from_file(void) { }
+static inline int32_t lb_stat_export(const char *UNUSED(src), const char *UNUSED(dst), const char **error) { *error = "loadbalancer not built in"; return -1; }
+static inline int32_t lb_stat_import(const char *UNUSED(src), const char *UNUSED(dst), const char **error) { *error = "loadbalancer not built in"; return -1; }
 static inline void lb_destroy_stats(struct s_reader *UNUSED(rdr)) { }
 static inline void send_reader_stat(struct s_reader *UNUSED(rdr), ECM_REQUEST *UNUSED(er), struct s_ecm_answer *UNUSED(ea), int8_t UNUSED(rc)) { }
 static inline void stat_get_best_reader(ECM_REQUEST *UNUSED(er)) { }
@@ -20,12 +20,16 @@
 #include "module-webif-tpl.h"
 #include "oscam-conf-mk.h"
 #include "oscam-config.h"
+#include "oscam-ecm.h"
 #include "oscam-files.h"
 #include "oscam-garbage.h"
 #include "oscam-cache.h"
+#include "oscam-chk.h"
 #include "oscam-client.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
+#include "oscam-latency.h"
+#include "oscam-pool.h"
 #include "oscam-reader.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
@@ -636,6 +640,9 @@ static char *send_oscam_config_global(struct templatevars *vars, struct uriparam
 	if(IP_ISSET(cfg.srvip))
 		{ tpl_addVar(vars, TPLADD, "SERVERIP", cs_inet_ntoa(cfg.srvip)); }
 	tpl_printf(vars, TPLADD, "NICE", "%d", cfg.nice);
+	tpl_printf(vars, TPLADD, "WORKERTHREADS", "%d", cfg.workerthreads);
+	tpl_printf(vars, TPLADD, "LISTENSHARDS", "%d", cfg.listenshards);
+	if(cfg.lockprofile) { tpl_addVar(vars, TPLADD, "LOCKPROFILECHECKED", "checked"); }
 	tpl_printf(vars, TPLADD, "BINDWAIT", "%d", cfg.bindwait);
 
 	tpl_printf(vars, TPLADD, "TMP", "NETPRIO%d", cfg.netprio);
@@ -803,6 +810,7 @@ static char *send_oscam_config_loadbalancer(struct templatevars *vars, struct ur
 	tpl_addVar(vars, TPLADD, tpl_getVar(vars, "TMP"), "selected");
 
 	tpl_printf(vars, TPLADD, "LBSAVE", "%d", cfg.lb_save);
+	tpl_printf(vars, TPLADD, "LBJOURNAL", "%d", cfg.lb_journal);
 	if(cfg.lb_savepath) { tpl_addVar(vars, TPLADD, "LBSAVEPATH", cfg.lb_savepath); }
 
 	tpl_printf(vars, TPLADD, "LBNBESTREADERS", "%d", cfg.lb_nbest_readers);
@@ -843,6 +851,7 @@ static char *send_oscam_config_loadbalancer(struct templatevars *vars, struct ur
 
 	tpl_printf(vars, TPLADD, "LBAUTOTIMEOUTP", "%d", cfg.lb_auto_timeout_p);
 	tpl_printf(vars, TPLADD, "LBAUTOTIMEOUTT", "%d", cfg.lb_auto_timeout_t);
+	tpl_printf(vars, TPLADD, "LBPERCENTILE", "%d", cfg.lb_percentile);
 
 	tpl_addVar(vars, TPLADDONCE, "CONFIG_CONTROL", tpl_getTpl(vars, "CONFIGLOADBALANCERCTRL"));
 
@@ -929,6 +938,8 @@ static char *send_oscam_config_cache(struct templatevars *vars, struct uriparams
 	tpl_printf(vars, TPLADD, "CACHEDELAY", "%u", cfg.delay);
 
 	tpl_printf(vars, TPLADD, "MAXCACHETIME", "%d", cfg.max_cache_time);
+	tpl_printf(vars, TPLADD, "CACHESHARDS", "%u", cfg.cache_shards);
+	tpl_printf(vars, TPLADD, "CACHEMAXMEMORY", "%u", cfg.cache_max_memory);
 
 #ifdef CS_CACHEEX
 	char *value = NULL;
@@ -967,6 +978,9 @@ static char *send_oscam_config_cache(struct templatevars *vars, struct uriparams
 	value = mk_t_caidvaluetab(&cfg.cacheex_nopushafter_tab);
 	tpl_addVar(vars, TPLADD, "CACHEEXNOPUSHAFTER", value);
 	free_mk_t(value);
+
+	tpl_printf(vars, TPLADD, "CACHEEXPUSHBATCHTIME", "%u", cfg.cacheex_push_batch_time);
+	tpl_printf(vars, TPLADD, "CACHEEXPUSHBATCHMAX", "%u", cfg.cacheex_push_batch_max);
 #endif
 
 	tpl_printf(vars, TPLADD, "MAX_HIT_TIME", "%d", cfg.max_hitcache_time);
@@ -2322,6 +2336,8 @@ static char *send_oscam_reader_config(struct templatevars *vars, struct uriparam
 		}
 		chk_reader("services", servicelabels, rdr);
 		chk_reader("lb_whitelist_services", servicelabelslb, rdr);
+		matching_reader_invalidate();
+		cacheex_push_index_invalidate();
 
 		if(is_network_reader(rdr) || rdr->typ == R_EMU)    //physical readers make trouble if re-started
 		{
@@ -3360,8 +3376,8 @@ static char *send_oscam_reader_stats(struct templatevars *vars, struct uriparams
 					tpl_printf(vars, TPLADD, "ECMLEN", "%04hX", s->ecmlen);
 					tpl_addVar(vars, TPLADD, "RC", stxt[s->rc]);
 					tpl_printf(vars, TPLADD, "TIME", PRINTF_LOCAL_D " ms", s->time_avg);
-					if(s->time_stat[s->time_idx])
-						{ tpl_printf(vars, TPLADD, "TIMELAST", PRINTF_LOCAL_D " ms", s->time_stat[s->time_idx]); }
+					if(s->time_last)
+						{ tpl_printf(vars, TPLADD, "TIMELAST", PRINTF_LOCAL_D " ms", s->time_last); }
 					else
 						{ tpl_addVar(vars, TPLADD, "TIMELAST", ""); }
 					tpl_printf(vars, TPLADD, "COUNT", PRINTF_LOCAL_D, s->ecm_count);
@@ -3384,7 +3400,7 @@ static char *send_oscam_reader_stats(struct templatevars *vars, struct uriparams
 					tpl_printf(vars, TPLADD, "ECMLEN", "%04hX", s->ecmlen);
 					tpl_addVar(vars, TPLADD, "ECMCHANNELNAME", xml_encode(vars, get_servicename(cur_client(), s->srvid, s->prid, s->caid, channame, sizeof(channame))));
 					tpl_printf(vars, TPLADD, "ECMTIME", PRINTF_LOCAL_D, s->time_avg);
-					tpl_printf(vars, TPLADD, "ECMTIMELAST", PRINTF_LOCAL_D, s->time_stat[s->time_idx]);
+					tpl_printf(vars, TPLADD, "ECMTIMELAST", PRINTF_LOCAL_D, s->time_last);
 					tpl_printf(vars, TPLADD, "ECMRC", "%d", s->rc);
 					tpl_addVar(vars, TPLADD, "ECMRCS", stxt[s->rc]);
 					if(s->last_received.time)
@@ -5424,6 +5440,61 @@ static char *send_oscam_logpoll(struct templatevars * vars, struct uriparams * p
 }
 #endif
 
+#ifdef CS_CACHEEX
+static void webif_add_cache_stats(struct templatevars * vars)
+{
+	uint32_t shards, waits, evictions;
+	uint64_t wait, memory;
+
+	cache_lock_stats(&shards, &waits, &wait);
+	tpl_printf(vars, TPLADD, "TOTAL_CACHESHARDS", "%u", shards);
+	tpl_printf(vars, TPLADD, "TOTAL_CACHELOCKWAITS", "%u", waits);
+	tpl_printf(vars, TPLADD, "TOTAL_CACHELOCKWAIT", "%.1f", wait / 1000.0);
+
+	cache_memory_stats(&memory, &evictions);
+	tpl_printf(vars, TPLADD, "TOTAL_CACHEMEMORY", "%.1f", memory / 1024.0);
+	tpl_printf(vars, TPLADD, "TOTAL_CACHEEVICTIONS", "%u", evictions);
+}
+#endif
+
+/* Adds the lock profile rows, ordered by wait time. The status page shows
+   milliseconds, the api microseconds. */
+static void webif_add_lockstats_rows(struct templatevars * vars, int8_t apicall, int32_t limit, char *rowsvar, int32_t *delimiter)
+{
+	struct s_lock_profile *profile;
+	int32_t i, count = cs_lock_profile(&profile);
+
+	if(limit && count > limit)
+		{ count = limit; }
+	for(i = 0; i < count; i++)
+	{
+		tpl_addVar(vars, TPLADD, "LOCKNAME", xml_encode(vars, profile[i].name));
+		tpl_printf(vars, TPLADD, "LOCKCOUNT", "%"PRIu64, profile[i].locks);
+		tpl_printf(vars, TPLADD, "LOCKCONTENDED", "%"PRIu64, profile[i].contended);
+		if(!apicall)
+		{
+			tpl_printf(vars, TPLADD, "LOCKWAIT", "%.1f", profile[i].wait_us / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKWAITMAX", "%.1f", profile[i].wait_max_us / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKHOLD", "%.1f", profile[i].hold_us / 1000.0);
+			tpl_printf(vars, TPLADD, "LOCKHOLDMAX", "%.1f", profile[i].hold_max_us / 1000.0);
+			tpl_addVar(vars, TPLAPPEND, rowsvar, tpl_getTpl(vars, "LOCKINFOROWBIT"));
+			continue;
+		}
+		tpl_printf(vars, TPLADD, "LOCKWAIT", "%"PRIu64, profile[i].wait_us);
+		tpl_printf(vars, TPLADD, "LOCKWAITMAX", "%u", profile[i].wait_max_us);
+		tpl_printf(vars, TPLADD, "LOCKHOLD", "%"PRIu64, profile[i].hold_us);
+		tpl_printf(vars, TPLADD, "LOCKHOLDMAX", "%u", profile[i].hold_max_us);
+		if(apicall == 2)
+		{
+			tpl_addVar(vars, TPLADD, "JSONDELIMITER", (*delimiter)++ ? "," : "");
+			tpl_addVar(vars, TPLAPPEND, rowsvar, tpl_getTpl(vars, "JSONLOCKSTATSBIT"));
+		}
+		else
+			{ tpl_addVar(vars, TPLAPPEND, rowsvar, tpl_getTpl(vars, "APILOCKSTATSBIT")); }
+	}
+	NULLFREE(profile);
+}
+
 static char *send_oscam_status(struct templatevars * vars, struct uriparams * params, int32_t apicall)
 {
 	int32_t i;
@@ -6343,6 +6414,13 @@ static char *send_oscam_status(struct templatevars * vars, struct uriparams * pa
 
 					if(apicall == 2)
 					{
+						struct s_job_stats jobs;
+						job_queue_stats(cl, &jobs);
+						tpl_printf(vars, TPLADD, "JOBSQUEUED", "%u", jobs.queued);
+						tpl_printf(vars, TPLADD, "JOBSENQUEUED", "%u", jobs.enqueued);
+						tpl_printf(vars, TPLADD, "JOBSDROPPED", "%u", jobs.dropped);
+						tpl_printf(vars, TPLADD, "JOBSMAXDEPTH", "%u", jobs.max_depth);
+						tpl_printf(vars, TPLADD, "JOBSSLOTS", "%u", jobs.slots);
 						tpl_addVar(vars, TPLADD, "JSONARRAYDELIMITER", delimiter?",":"");
 						tpl_addVar(vars, TPLAPPEND, "JSONSTATUSBITS", tpl_getTpl(vars, "JSONSTATUSBIT"));
 						delimiter++;
@@ -6427,6 +6505,7 @@ static char *send_oscam_status(struct templatevars * vars, struct uriparams * pa
 #ifdef CS_CACHEEX_AIO
 	tpl_printf(vars, TPLADD, "TOTAL_CACHESIZE_LG", "%d", cache_size_lg());
 #endif
+	webif_add_cache_stats(vars);
 	tpl_printf(vars, TPLADD, "REL_CACHEXHIT", "%.2f", (first_client ? first_client->cwcacheexhit : 0) * 100 / cachesum);
 	tpl_addVar(vars, TPLADD, "CACHEEXSTATS", tpl_getTpl(vars, "STATUSCACHEX"));
 #endif
@@ -6528,8 +6607,25 @@ static char *send_oscam_status(struct templatevars * vars, struct uriparams * pa
 	p_stat_cur.check_available = 65535;
 #endif
 	set_status_info(vars, p_stat_cur);
+	tpl_printf(vars, TPLADD, "POOL_ECM", "%u / %u (%u cached)", ecm_pool.hits, ecm_pool.misses, pool_cached(&ecm_pool));
+	tpl_printf(vars, TPLADD, "POOL_ECM_ANSWER", "%u / %u (%u cached)", ecm_answer_pool.hits, ecm_answer_pool.misses, pool_cached(&ecm_answer_pool));
+
+	struct s_garbage_stats gc;
+	garbage_stats(&gc);
+	tpl_addVar(vars, TPLADD, "GC_DEFERRED", "");
+	for(i = 0; i < gc.ntypes; i++)
+	{
+		tpl_printf(vars, TPLAPPEND, "GC_DEFERRED", "%s%s %d (%"PRId64" KB)", i ? ", " : "", gc.type[i].name,
+					gc.type[i].count, gc.type[i].bytes / 1024);
+	}
+	tpl_printf(vars, TPLADD, "GC_FREED", "%"PRIu64" / %"PRIu64" (epoch %u, %d/%d threads online)", gc.freed_quiescent,
+				gc.freed_deadline, gc.epoch, gc.online, gc.threads);
 
-	if(cfg.http_showmeminfo || cfg.http_showuserinfo || cfg.http_showreaderinfo || cfg.http_showloadinfo || cfg.http_showecminfo || (cfg.http_showcacheexinfo  && config_enabled(CS_CACHEEX)) || (cfg.http_showcacheexinfo  && config_enabled(CS_CACHEEX_AIO))){
+	if(cfg.lockprofile && !apicall)
+		{ webif_add_lockstats_rows(vars, 0, 10, "LOCKINFOROWS", NULL); }
+	tpl_addVar(vars, TPLADD, "DISPLAYLOCKINFO", cfg.lockprofile ? "visible" : "hidden");
+
+	if(cfg.http_showmeminfo || cfg.http_showuserinfo || cfg.http_showreaderinfo || cfg.http_showloadinfo || cfg.http_showecminfo || (cfg.http_showcacheexinfo  && config_enabled(CS_CACHEEX)) || (cfg.http_showcacheexinfo  && config_enabled(CS_CACHEEX_AIO)) || cfg.lockprofile){
 		tpl_addVar(vars, TPLADD, "DISPLAYINFO", "visible");
 	}
 	else{
@@ -7603,7 +7699,7 @@ static bool process_emm_file(struct templatevars * vars, struct s_reader * rdr,
 					if(send_EMM(rdr, caid, csystem, emmhex, len))
 					{
 						++wemms;
-						int32_t jcount = ll_count(rdr->client->joblist);
+						int32_t jcount = job_queue_length(rdr->client);
 						if (jcount > 200)
 						{
 							/* Give more time to process EMMs */
@@ -8154,6 +8250,7 @@ static char *send_oscam_cacheex(struct templatevars * vars, struct uriparams * p
 #ifdef CS_CACHEEX_AIO
 	tpl_printf(vars, TPLADD, "TOTAL_CACHESIZE_LG", "%d", cache_size_lg());
 #endif
+	webif_add_cache_stats(vars);
 
 	tpl_printf(vars, TPLADD, "REL_CACHEXHIT", "%.2f", (first_client ? first_client->cwcacheexhit : 0) * 100 / cachesum);
 
@@ -8172,6 +8269,98 @@ static char *send_oscam_cacheex(struct templatevars * vars, struct uriparams * p
 }
 #endif
 
+static void webif_add_ecmlatency_rows(struct templatevars * vars, int8_t apicall, struct s_reader *rdr, int32_t *delimiter)
+{
+	struct s_latency_tab *tab = ecm_latency_tab(rdr);
+	struct s_latency_entry *entry;
+	struct s_latency_hist *hist;
+	uint32_t count;
+	int32_t i, stage;
+
+	if(!tab)
+		{ return; }
+
+	for(i = 0; i < LAT_MAX_CAIDS; i++)
+	{
+		if(!(entry = tab->entry[i]))
+			{ continue; }
+		for(stage = 0; stage < LAT_STAGES; stage++)
+		{
+			hist = &entry->hist[stage];
+			if(!(count = ecm_latency_count(hist)))
+				{ continue; }
+			tpl_addVar(vars, TPLADD, "LATSTAGE", ecm_latency_stage_name(stage));
+			tpl_printf(vars, TPLADD, "LATCAID", "%04X", entry->caid);
+			tpl_addVar(vars, TPLADD, "LATREADER", rdr ? xml_encode(vars, rdr->label) : "");
+			tpl_printf(vars, TPLADD, "LATCOUNT", "%u", count);
+			tpl_printf(vars, TPLADD, "LATP50", "%u", ecm_latency_percentile(hist, 50));
+			tpl_printf(vars, TPLADD, "LATP90", "%u", ecm_latency_percentile(hist, 90));
+			tpl_printf(vars, TPLADD, "LATP99", "%u", ecm_latency_percentile(hist, 99));
+			tpl_printf(vars, TPLADD, "LATMAX", "%u", hist->max);
+			if(apicall == 2)
+			{
+				tpl_addVar(vars, TPLADD, "JSONDELIMITER", (*delimiter)++ ? "," : "");
+				tpl_addVar(vars, TPLAPPEND, "APIECMLATENCYROWS", tpl_getTpl(vars, "JSONECMLATENCYBIT"));
+			}
+			else
+			{
+				tpl_addVar(vars, TPLAPPEND, "APIECMLATENCYROWS", tpl_getTpl(vars, "APIECMLATENCYBIT"));
+			}
+		}
+	}
+}
+
+static char *send_oscam_ecmlatency(struct templatevars * vars, struct uriparams * params, int8_t apicall)
+{
+	struct s_reader *rdr;
+	int32_t delimiter = 0;
+	char *label = getParam(params, "label");
+
+	if(strcmp(getParam(params, "action"), "reset") == 0)
+	{
+		if(cfg.http_readonly)
+		{
+			tpl_addVar(vars, TPLADD, "APIERRORMESSAGE", "webif readonly mode");
+			return tpl_getTpl(vars, "APIERROR");
+		}
+		ecm_latency_reset();
+	}
+
+	// stages without a reader, skipped if only one reader is requested
+	if(!label[0])
+		{ webif_add_ecmlatency_rows(vars, apicall, NULL, &delimiter); }
+
+	cs_readlock(__func__, &readerlist_lock);
+	LL_ITER itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
+	{
+		if(!label[0] || streq(label, rdr->label))
+			{ webif_add_ecmlatency_rows(vars, apicall, rdr, &delimiter); }
+	}
+	cs_readunlock(__func__, &readerlist_lock);
+
+	return tpl_getTpl(vars, apicall == 2 ? "JSONECMLATENCY" : "APIECMLATENCY");
+}
+
+static char *send_oscam_lockstats(struct templatevars * vars, struct uriparams * params, int8_t apicall)
+{
+	int32_t delimiter = 0;
+
+	if(strcmp(getParam(params, "action"), "reset") == 0)
+	{
+		if(cfg.http_readonly)
+		{
+			tpl_addVar(vars, TPLADD, "APIERRORMESSAGE", "webif readonly mode");
+			return tpl_getTpl(vars, "APIERROR");
+		}
+		cs_lock_profile_reset();
+	}
+
+	tpl_printf(vars, TPLADD, "LOCKPROFILE", "%d", cfg.lockprofile);
+	webif_add_lockstats_rows(vars, apicall, 0, "APILOCKSTATSROWS", &delimiter);
+	return tpl_getTpl(vars, apicall == 2 ? "JSONLOCKSTATS" : "APILOCKSTATS");
+}
+
 static char *send_oscam_api(struct templatevars * vars, FILE * f, struct uriparams * params, int8_t *keepalive, int8_t apicall, char *extraheader)
 {
 	if(strcmp(getParam(params, "part"), "status") == 0)
@@ -8325,6 +8514,14 @@ static char *send_oscam_api(struct templatevars * vars, FILE * f, struct uripara
 		}
 		return tpl_getTpl(vars, "APISTATUS");
 	}
+	else if(strcmp(getParam(params, "part"), "ecmlatency") == 0)
+	{
+		return send_oscam_ecmlatency(vars, params, apicall);
+	}
+	else if(strcmp(getParam(params, "part"), "lockstats") == 0)
+	{
+		return send_oscam_lockstats(vars, params, apicall);
+	}
 	else if(strcmp(getParam(params, "part"), "readerstats") == 0)
 	{
 		if(strcmp(getParam(params, "label"), ""))
@@ -9584,7 +9781,10 @@ static void *http_server(void *UNUSED(d))
 
 	while(!exit_oscam)
 	{
-		if((s = accept(sock, (struct sockaddr *) &remote, &len)) < 0)
+		garbage_offline();
+		s = accept(sock, (struct sockaddr *) &remote, &len);
+		garbage_online();
+		if(s < 0)
 		{
 			if(exit_oscam)
 				{ break; }
@@ -46,10 +46,7 @@ typedef struct cw_t
 #ifdef CS_CACHEEX_AIO
 	uint8_t				localgenerated;      // flag for local generated CWs
 #endif
-	// for push out
-	pthread_rwlock_t    pushout_client_lock;
-	struct s_pushclient *pushout_client;     // list of clients that pushing cw
-	// end push out
+	struct s_pushclient *pushout_client;     // list of clients that pushing cw, grows by compare and swap under the shard read lock
 	node                ht_node;             // node for hash table
 	node                ll_node;             // node for linked list
 } CW;
@@ -61,8 +58,12 @@ typedef struct cache_t
 	struct timeb        upd_time;            // updated time. Update time at each cw got
 	struct timeb        first_recv_time;     // time of first cw received
 	uint32_t            csp_hash;
+	uint32_t            memory;              // bytes held incl. cws and the cw table
+	uint32_t            push_memory;         // bytes held by push client lists, updated atomically
+	uint8_t             referenced;          // used since the last eviction pass
 	node                ht_node;             // node for hash table
 	node                ll_node;             // node for linked list
+	node                lru_node;            // node for eviction list
 } ECMHASH;
 
 #ifdef CS_CACHEEX_AIO
@@ -85,23 +86,34 @@ typedef struct cw_cache_setting_t
 } CW_CACHE_SETTING;
 #endif
 
-static pthread_rwlock_t cache_lock;
+// the cache is split into shards selected by csp_hash, each with its own lock, table and expiry list
+struct s_cache_shard
+{
+	pthread_rwlock_t    lock;
+	hash_table          ht_cache;
+	list                ll_cache;            // ECMHASH in insertion order
+	list                ll_lru;              // ECMHASH in least recently used order
+	uint64_t            memory;              // bytes held by the entries
+	uint32_t            push_memory;         // bytes held by push client lists, updated atomically
+	uint32_t            evictions;           // entries dropped for the memory ceiling
 #ifdef CS_CACHEEX_AIO
-static pthread_rwlock_t cw_cache_lock;
+	uint32_t            lg_cache_size;       // lg-flagged cws
 #endif
-static hash_table ht_cache;
+	uint64_t            lock_wait;           // microseconds spent waiting for the lock
+	uint32_t            lock_waits;          // lock requests that had to wait
+};
+
+static struct s_cache_shard *cache_shard;
+static uint32_t cache_shard_count;
 #ifdef CS_CACHEEX_AIO
+static pthread_rwlock_t cw_cache_lock;
 static hash_table ht_cw_cache;
-#endif
-static list ll_cache;
-#ifdef CS_CACHEEX_AIO
 static list ll_cw_cache;
 #endif
 static int8_t cache_init_done = 0;
 
 #ifdef CS_CACHEEX_AIO
 static int8_t cw_cache_init_done = 0;
-static uint32_t lg_cache_size = 0;
 
 void init_cw_cache(void)
 {
@@ -120,15 +132,163 @@ void init_cw_cache(void)
 
 void init_cache(void)
 {
-	init_hash_table(&ht_cache, &ll_cache);
-	if (pthread_rwlock_init(&cache_lock,NULL) != 0)
-		{ cs_log("Error creating lock cache_lock!"); }
+	uint32_t i;
+
+	cache_shard_count = cfg.cache_shards ? cfg.cache_shards : DEFAULT_CACHE_SHARDS;
+	if(!cs_malloc(&cache_shard, cache_shard_count * sizeof(struct s_cache_shard)))
+		{ return; }
+
+	for(i = 0; i < cache_shard_count; i++)
+	{
+		init_hash_table(&cache_shard[i].ht_cache, &cache_shard[i].ll_cache);
+		tommy_list_init(&cache_shard[i].ll_lru);
+		if (pthread_rwlock_init(&cache_shard[i].lock,NULL) != 0)
+		{
+			cs_log("Error creating lock cache_lock!");
+			return;
+		}
+	}
+	cache_init_done = 1;
+}
+
+static inline struct s_cache_shard *get_cache_shard(uint32_t csp_hash)
+{
+	return &cache_shard[csp_hash % cache_shard_count];
+}
+
+// time spent blocked on a held lock is accounted to the shard
+static void cache_shard_lock(struct s_cache_shard *shard, bool write)
+{
+	struct timespec start, end;
+	int64_t wait;
+
+	if((write ? pthread_rwlock_trywrlock(&shard->lock) : pthread_rwlock_tryrdlock(&shard->lock)) == 0)
+		{ return; }
+
+	cs_gettime(&start);
+	if(write)
+		{ SAFE_RWLOCK_WRLOCK(&shard->lock); }
 	else
-		{ cache_init_done = 1; }
+		{ SAFE_RWLOCK_RDLOCK(&shard->lock); }
+	cs_gettime(&end);
+
+	wait = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	// readers update these concurrently, a lost update is fine for a statistic
+	shard->lock_wait += wait > 0 ? wait : 0;
+	shard->lock_waits++;
+}
+
+/* Lock wait statistic summed over all cache shards, wait in microseconds. */
+void cache_lock_stats(uint32_t *shards, uint32_t *waits, uint64_t *wait)
+{
+	uint32_t i;
+
+	*shards = cache_init_done ? cache_shard_count : 0;
+	*waits = 0;
+	*wait = 0;
+	for(i = 0; i < *shards; i++)
+	{
+		*waits += cache_shard[i].lock_waits;
+		*wait += cache_shard[i].lock_wait;
+	}
+}
+
+// entries plus the top level hash tables of the shards
+static uint64_t cache_shard_memory(struct s_cache_shard *shard)
+{
+	return shard->memory + shard->push_memory + shard->ht_cache.bucket_max * sizeof(shard->ht_cache.bucket[0][0]);
+}
+
+/* Memory held by the cache in bytes and the number of entries evicted for max_memory. */
+void cache_memory_stats(uint64_t *memory, uint32_t *evictions)
+{
+	uint32_t i;
+
+	*memory = 0;
+	*evictions = 0;
+	if(!cache_init_done)
+		{ return; }
+	for(i = 0; i < cache_shard_count; i++)
+	{
+		*memory += cache_shard_memory(&cache_shard[i]);
+		*evictions += cache_shard[i].evictions;
+	}
+}
+
+// caller must hold the shard lock for writing
+static void free_ecmhash(struct s_cache_shard *shard, ECMHASH *ecmhash)
+{
+	CW *cw;
+	struct s_pushclient *pc, *nxt;
+	node *j, *j_next;
+
+	j = get_first_node_list(&ecmhash->ll_cw);
+	while(j)
+	{
+		j_next = j->next;
+		cw = get_data_from_node(j);
+		if(cw)
+		{
+			pc = cw->pushout_client;
+			cw->pushout_client=NULL;
+			while(pc)
+			{
+				nxt = pc->next_push;
+				NULLFREE(pc);
+				pc = nxt;
+			}
+#ifdef CS_CACHEEX_AIO
+			if(cw->count >= 0x0F000000)
+			{
+				shard->lg_cache_size--;
+			}
+#endif
+			remove_elem_list(&ecmhash->ll_cw, &cw->ll_node);
+			remove_elem_hash_table(&ecmhash->ht_cw, &cw->ht_node);
+			NULLFREE(cw);
+		}
+		j = j_next;
+	}
+
+	shard->memory -= ecmhash->memory;
+	__sync_sub_and_fetch(&shard->push_memory, ecmhash->push_memory);
+	deinitialize_hash_table(&ecmhash->ht_cw);
+	remove_elem_list(&shard->ll_cache, &ecmhash->ll_node);
+	remove_elem_list(&shard->ll_lru, &ecmhash->lru_node);
+	remove_elem_hash_table(&shard->ht_cache, &ecmhash->ht_node);
+	NULLFREE(ecmhash);
+}
+
+/* Drops the least recently used entries until the shard fits into its part of
+   max_memory. Entries hit by check_cache() since the last pass get a second
+   chance, keep is never dropped. Caller must hold the shard lock for writing. */
+static void cache_evict(struct s_cache_shard *shard, ECMHASH *keep)
+{
+	uint64_t limit = cfg.cache_max_memory / cache_shard_count;
+	ECMHASH *ecmhash;
+	node *i;
+
+	while(cache_shard_memory(shard) > limit && (i = get_first_node_list(&shard->ll_lru)))
+	{
+		ecmhash = get_data_from_node(i);
+		if(ecmhash == keep || ecmhash->referenced)
+		{
+			if(ecmhash == keep && !i->next)
+				{ break; }
+			ecmhash->referenced = 0;
+			tommy_list_remove_existing(&shard->ll_lru, &ecmhash->lru_node);
+			tommy_list_insert_tail(&shard->ll_lru, &ecmhash->lru_node, ecmhash);
+			continue;
+		}
+		free_ecmhash(shard, ecmhash);
+		shard->evictions++;
+	}
 }
 
 void free_cache(void)
 {
+	uint32_t i;
+
 	cleanup_cache(true);
 #ifdef CS_CACHEEX_AIO
 	cw_cache_cleanup(true);
@@ -137,27 +297,41 @@ void free_cache(void)
 	deinitialize_hash_table(&ht_cw_cache);
 	pthread_rwlock_destroy(&cw_cache_lock);
 #endif
+	if(!cache_init_done)
+		{ return; }
 	cache_init_done = 0;
-	deinitialize_hash_table(&ht_cache);
-	pthread_rwlock_destroy(&cache_lock);
+	for(i = 0; i < cache_shard_count; i++)
+	{
+		deinitialize_hash_table(&cache_shard[i].ht_cache);
+		pthread_rwlock_destroy(&cache_shard[i].lock);
+	}
+	NULLFREE(cache_shard);
 }
 
 #ifdef CS_CACHEEX_AIO
 uint32_t cache_size_lg(void)
 {
+	uint32_t i, size = 0;
+
 	if(!cache_init_done)
 		{ return 0; }
 
-	return lg_cache_size;
+	for(i = 0; i < cache_shard_count; i++)
+		{ size += cache_shard[i].lg_cache_size; }
+	return size;
 }
 #endif
 
 uint32_t cache_size(void)
 {
+	uint32_t i, size = 0;
+
 	if(!cache_init_done)
 		{ return 0; }
 
-	return count_hash_table(&ht_cache);
+	for(i = 0; i < cache_shard_count; i++)
+		{ size += count_hash_table(&cache_shard[i].ht_cache); }
+	return size;
 }
 
 static uint8_t count_sort(CW *a, CW *b)
@@ -174,46 +348,6 @@ static uint8_t time_sort(CW_CACHE *a, CW_CACHE *b)
 }
 #endif
 
-uint8_t check_is_pushed(void *cwp, struct s_client *cl)
-{
-	struct s_pushclient *cl_tmp;
-	CW* cw = (CW*)cwp;
-	bool pushed=false;
-
-	SAFE_RWLOCK_RDLOCK(&cw->pushout_client_lock);
-	for (cl_tmp = cw->pushout_client; cl_tmp; cl_tmp = cl_tmp->next_push)
-	{
-		if(cl_tmp->cl==cl)
-		{
-			pushed=true;
-			break;
-		}
-	}
-
-	if(!pushed)
-	{
-		SAFE_RWLOCK_UNLOCK(&cw->pushout_client_lock);
-		SAFE_RWLOCK_WRLOCK(&cw->pushout_client_lock);
-
-		struct s_pushclient *new_push_client;
-		if(cs_malloc(&new_push_client, sizeof(struct s_pushclient)))
-		{
-			new_push_client->cl=cl;
-
-			new_push_client->next_push=cw->pushout_client;
-			cw->pushout_client=new_push_client;
-		}
-
-		SAFE_RWLOCK_UNLOCK(&cw->pushout_client_lock);
-		return 0;
-	}
-	else
-	{
-		SAFE_RWLOCK_UNLOCK(&cw->pushout_client_lock);
-		return 1;
-	}
-}
-
 uint8_t get_odd_even(ECM_REQUEST *er)
 {
 	return (er->ecm[0] != 0x80 && er->ecm[0] != 0x81 ? 0 : er->ecm[0]);
@@ -251,6 +385,61 @@ static int compare_cw(const void *arg, const void *obj)
 	return memcmp(arg, ((const CW*)obj)->cw, 16);
 }
 
+/* Returns 1 if the cw of er was already pushed to cl or is no longer cached,
+   otherwise cl is recorded as pushed and 0 is returned. */
+uint8_t check_is_pushed(ECM_REQUEST *er, struct s_client *cl)
+{
+	struct s_cache_shard *shard;
+	struct s_pushclient *cl_tmp, *head, *new_push = NULL;
+	ECMHASH *result;
+	CW *cw = NULL;
+	uint8_t pushed = 1;
+
+	if(!cache_init_done || !er->csp_hash)
+		{ return 1; }
+
+	shard = get_cache_shard(er->csp_hash);
+	cache_shard_lock(shard, false);
+
+	result = find_hash_table(&shard->ht_cache, &er->csp_hash, sizeof(uint32_t), &compare_csp_hash);
+	if(result)
+		{ cw = find_hash_table(&result->ht_cw, er->cw, sizeof(er->cw), &compare_cw); }
+
+	// under the read lock the push list only grows at its head, a failed swap
+	// means another thread added a client and the list is searched again
+	while(cw)
+	{
+		head = cw->pushout_client;
+		for(cl_tmp = head; cl_tmp; cl_tmp = cl_tmp->next_push)
+		{
+			if(cl_tmp->cl == cl)
+				{ break; }
+		}
+		if(cl_tmp)
+			{ break; }
+
+		if(!new_push && !cs_malloc(&new_push, sizeof(struct s_pushclient)))
+		{
+			pushed = 0;
+			break;
+		}
+		new_push->cl = cl;
+		new_push->next_push = head;
+		if(__sync_bool_compare_and_swap(&cw->pushout_client, head, new_push))
+		{
+			__sync_add_and_fetch(&result->push_memory, sizeof(struct s_pushclient));
+			__sync_add_and_fetch(&shard->push_memory, sizeof(struct s_pushclient));
+			new_push = NULL;
+			pushed = 0;
+			break;
+		}
+	}
+
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
+	NULLFREE(new_push);
+	return pushed;
+}
+
 #ifdef CS_CACHEEX_AIO
 static int compare_cw_cache(const void *arg, const void *obj)
 {
@@ -310,10 +499,11 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl)
 	ECMHASH *result;
 	CW *cw;
 	uint64_t grp = cl?cl->grp:0;
+	struct s_cache_shard *shard = get_cache_shard(er->csp_hash);
 
-	SAFE_RWLOCK_RDLOCK(&cache_lock);
+	cache_shard_lock(shard, false);
 
-	result = find_hash_table(&ht_cache, &er->csp_hash, sizeof(uint32_t),&compare_csp_hash);
+	result = find_hash_table(&shard->ht_cache, &er->csp_hash, sizeof(uint32_t),&compare_csp_hash);
 	cw = get_first_cw(result, er);
 	if (!cw)
 		goto out_err;
@@ -356,6 +546,9 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl)
 		if (!cwcycle_check_cache(cl, er, cw))
 			goto out_err;
 
+		if(!result->referenced) // shard is only read locked
+			{ __sync_lock_test_and_set(&result->referenced, 1); }
+
 		if (cs_malloc(&ecm, sizeof(ECM_REQUEST)))
 		{
 			ecm->rc = E_FOUND;
@@ -374,7 +567,7 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl)
 	}
 
 out_err:
-	SAFE_RWLOCK_UNLOCK(&cache_lock);
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
 	return ecm;
 }
 
@@ -385,11 +578,11 @@ uint16_t get_cacheex_nopushafter(ECM_REQUEST *er)
 }
 #endif
 
-static void cacheex_cache_add(ECM_REQUEST *er, ECMHASH *result, CW *cw, bool add_new_cw)
+// cw_first is a copy of the first cached cw taken under the shard lock, or NULL
+static void cacheex_cache_add(ECM_REQUEST *er, CW *cw_first, bool add_new_cw)
 {
-	(void)er; (void)result; (void)cw; (void)add_new_cw;
+	(void)er; (void)cw_first; (void)add_new_cw;
 #ifdef CS_CACHEEX
-	er->cw_cache = cw;
 	cacheex_cache_push(er);
 
 	// cacheex debug log lines and cw diff stuff
@@ -433,7 +626,6 @@ static void cacheex_cache_add(ECM_REQUEST *er, ECMHASH *result, CW *cw, bool add
 	}
 #endif
 
-	CW *cw_first = get_first_cw(result, er);
 	if(!cw_first)
 		return;
 
@@ -684,11 +876,13 @@ void add_cache(ECM_REQUEST *er)
 	ECMHASH *result = NULL;
 	CW *cw = NULL;
 	bool add_new_cw=false;
+	struct s_cache_shard *shard = get_cache_shard(er->csp_hash);
+	uint32_t bucket_max, memory;
 
-	SAFE_RWLOCK_WRLOCK(&cache_lock);
+	cache_shard_lock(shard, true);
 
 	// add csp_hash to cache
-	result = find_hash_table(&ht_cache, &er->csp_hash, sizeof(uint32_t), &compare_csp_hash);
+	result = find_hash_table(&shard->ht_cache, &er->csp_hash, sizeof(uint32_t), &compare_csp_hash);
 	if(!result)
 	{
 		if(cs_malloc(&result, sizeof(ECMHASH)))
@@ -696,11 +890,14 @@ void add_cache(ECM_REQUEST *er)
 			result->csp_hash = er->csp_hash;
 			init_hash_table(&result->ht_cw, &result->ll_cw);
 			cs_ftime(&result->first_recv_time);
-			add_hash_table(&ht_cache, &result->ht_node, &ll_cache, &result->ll_node, result, &result->csp_hash, sizeof(uint32_t));
+			add_hash_table(&shard->ht_cache, &result->ht_node, &shard->ll_cache, &result->ll_node, result, &result->csp_hash, sizeof(uint32_t));
+			tommy_list_insert_tail(&shard->ll_lru, &result->lru_node, result);
+			result->memory = sizeof(ECMHASH) + result->ht_cw.bucket_max * sizeof(result->ht_cw.bucket[0][0]);
+			shard->memory += result->memory;
 		}
 		else
 		{
-			SAFE_RWLOCK_UNLOCK(&cache_lock);
+			SAFE_RWLOCK_UNLOCK(&shard->lock);
 			cs_log("ERROR: NO added HASH to cache!!");
 			return;
 		}
@@ -708,6 +905,12 @@ void add_cache(ECM_REQUEST *er)
 
 	cs_ftime(&result->upd_time); // need to be updated at each cw! We use it for deleting this hash when no more cws arrive inside max_cache_time!
 
+	if(&result->lru_node != tommy_list_tail(&shard->ll_lru))
+	{
+		tommy_list_remove_existing(&shard->ll_lru, &result->lru_node);
+		tommy_list_insert_tail(&shard->ll_lru, &result->lru_node, result);
+	}
+
 	//add cw to this csp hash
 	cw = find_hash_table(&result->ht_cw, er->cw, sizeof(er->cw), &compare_cw);
 
@@ -715,7 +918,7 @@ void add_cache(ECM_REQUEST *er)
 	{
 		if(count_hash_table(&result->ht_cw) >= 10) // max 10 different cws stored
 		{
-			SAFE_RWLOCK_UNLOCK(&cache_lock);
+			SAFE_RWLOCK_UNLOCK(&shard->lock);
 			return;
 		}
 
@@ -740,16 +943,12 @@ void add_cache(ECM_REQUEST *er)
 				cw->cacheex_src=er->cacheex_src;
 				cw->pushout_client = NULL;
 
-				while(1)
-				{
-					if (pthread_rwlock_init(&cw->pushout_client_lock, NULL) == 0)
-						break;
-
-					cs_log("Error creating lock pushout_client_lock!");
-					cs_sleepms(1);
-				}
-
+				// the cw table grows with the cws, count its new buckets as well
+				bucket_max = result->ht_cw.bucket_max;
 				add_hash_table(&result->ht_cw, &cw->ht_node, &result->ll_cw, &cw->ll_node, cw, cw->cw, sizeof(er->cw));
+				memory = sizeof(CW) + (result->ht_cw.bucket_max - bucket_max) * sizeof(result->ht_cw.bucket[0][0]);
+				result->memory += memory;
+				shard->memory += memory;
 				add_new_cw=true;
 				break;
 			}
@@ -778,7 +977,7 @@ void add_cache(ECM_REQUEST *er)
 		if(cw->count < 0x0F000000)
 		{
 			cw->count |= 0x0F000000;
-			lg_cache_size++;
+			shard->lg_cache_size++;
 		}
 	}
 	else
@@ -799,6 +998,9 @@ void add_cache(ECM_REQUEST *er)
 	if(cw->count>1)
 		sort_list(&result->ll_cw, count_sort);
 
+	if(cfg.cache_max_memory)
+		{ cache_evict(shard, result); }
+
 #ifdef CS_CACHEEX_AIO
 	// dont push not flagged CWs - global
 	if(!er->localgenerated &&
@@ -808,7 +1010,7 @@ void add_cache(ECM_REQUEST *er)
 		)	)
 	{
 		cs_log_dbg(D_CACHEEX, "cacheex: push denied, cacheex_localgenerated_only->global");
-		SAFE_RWLOCK_UNLOCK(&cache_lock);
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
 		return;
 	}
 
@@ -816,7 +1018,7 @@ void add_cache(ECM_REQUEST *er)
 	if(er->rc < 3 && er->ecm_time && get_cacheex_nopushafter(er) != 0 &&(get_cacheex_nopushafter(er) < er->ecm_time ))
 	{
 		cs_log_dbg(D_CACHEEX, "cacheex: push denied, cacheex_nopushafter %04X:%u < %i, reader: %s", er->caid, get_cacheex_nopushafter(er), er->ecm_time, er->selected_reader->label);
-		SAFE_RWLOCK_UNLOCK(&cache_lock);
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
 		return;
 	}
 
@@ -824,14 +1026,21 @@ void add_cache(ECM_REQUEST *er)
 	if(cfg.cacheex_dropdiffs && (count_hash_table(&result->ht_cw) > 1) && !er->localgenerated)
 	{
 		cs_log_dbg(D_CACHEEX,"cacheex: diff CW - cacheex push denied src: %s", er->selected_reader->label);
-		SAFE_RWLOCK_UNLOCK(&cache_lock);
+		SAFE_RWLOCK_UNLOCK(&shard->lock);
 		return;
 	}
 #endif
 
-	SAFE_RWLOCK_UNLOCK(&cache_lock);
+	// another add_cache() may evict result once the lock is released
+	CW first, *cw_first = get_first_cw(result, er);
+	if(cw_first)
+	{
+		first = *cw_first;
+		cw_first = &first;
+	}
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
 
-	cacheex_cache_add(er, result, cw, add_new_cw);
+	cacheex_cache_add(er, cw_first, add_new_cw);
 }
 
 #ifdef CS_CACHEEX_AIO
@@ -891,22 +1100,17 @@ void cw_cache_cleanup(bool force)
 }
 #endif
 
-void cleanup_cache(bool force)
+static void cleanup_cache_shard(struct s_cache_shard *shard, bool force)
 {
 	ECMHASH *ecmhash;
-	CW *cw;
-	struct s_pushclient *pc, *nxt;
-	node *i,*i_next,*j,*j_next;
+	node *i,*i_next;
 
 	struct timeb now;
 	int64_t gone_first, gone_upd;
 
-	if(!cache_init_done)
-		{ return; }
-
-	SAFE_RWLOCK_WRLOCK(&cache_lock);
+	cache_shard_lock(shard, true);
 
-	i = get_first_node_list(&ll_cache);
+	i = get_first_node_list(&shard->ll_cache);
 	while(i)
 	{
 		i_next = i->next;
@@ -929,43 +1133,23 @@ void cleanup_cache(bool force)
 
 		if(force || gone_upd>(cfg.max_cache_time*1000))
 		{
-			j = get_first_node_list(&ecmhash->ll_cw);
-			while(j)
-			{
-				j_next = j->next;
-				cw = get_data_from_node(j);
-				if(cw)
-				{
-					pthread_rwlock_destroy(&cw->pushout_client_lock);
-					pc = cw->pushout_client;
-					cw->pushout_client=NULL;
-					while(pc)
-					{
-						nxt = pc->next_push;
-						NULLFREE(pc);
-						pc = nxt;
-					}
-#ifdef CS_CACHEEX_AIO
-					if(cw->count >= 0x0F000000)
-					{
-						lg_cache_size--;
-					}
-#endif
-					remove_elem_list(&ecmhash->ll_cw, &cw->ll_node);
-					remove_elem_hash_table(&ecmhash->ht_cw, &cw->ht_node);
-					NULLFREE(cw);
-				}
-				j = j_next;
-			}
-
-			deinitialize_hash_table(&ecmhash->ht_cw);
-			remove_elem_list(&ll_cache, &ecmhash->ll_node);
-			remove_elem_hash_table(&ht_cache, &ecmhash->ht_node);
-			NULLFREE(ecmhash);
+			free_ecmhash(shard, ecmhash);
 		}
 		i = i_next;
 	}
-	SAFE_RWLOCK_UNLOCK(&cache_lock);
+	SAFE_RWLOCK_UNLOCK(&shard->lock);
+}
+
+// one shard at a time, lookups in the other shards go on meanwhile
+void cleanup_cache(bool force)
+{
+	uint32_t i;
+
+	if(!cache_init_done)
+		{ return; }
+
+	for(i = 0; i < cache_shard_count; i++)
+		{ cleanup_cache_shard(&cache_shard[i], force); }
 }
 
 #ifdef CS_CACHEEX_AIO
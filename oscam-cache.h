@@ -11,11 +11,13 @@ struct ecm_request_t *check_cache(ECM_REQUEST *er, struct s_client *cl);
 void cleanup_cache(bool force);
 void remove_client_from_cache(struct s_client *cl);
 uint32_t cache_size(void);
+void cache_lock_stats(uint32_t *shards, uint32_t *waits, uint64_t *wait);
+void cache_memory_stats(uint64_t *memory, uint32_t *evictions);
 #ifdef CS_CACHEEX_AIO
 uint32_t cache_size_lg(void);
 #endif
 uint8_t get_odd_even(ECM_REQUEST *er);
-uint8_t check_is_pushed(void *cw, struct s_client *cl);
+uint8_t check_is_pushed(ECM_REQUEST *er, struct s_client *cl);
 #ifdef CS_CACHEEX_AIO
 void cw_cache_cleanup(bool force);
 int compare_csp_hash(const void *arg, const void *obj);
@@ -15,6 +15,8 @@
 #define OK    1
 #define ERROR 0
 
+extern uint32_t cfg_sidtab_generation;
+
 uint32_t get_fallbacktimeout(uint16_t caid)
 {
 	uint32_t ftimeout = caidvaluetab_get_value(&cfg.ftimeouttab, caid, 0);
@@ -858,19 +860,12 @@ uint8_t chk_if_ignore_checksum(ECM_REQUEST *er, FTAB *disablecrc_only_for)
 	return 0;
 }
 
-int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr)
+/* The part of matching_reader() that depends only on the configuration, the
+   group of the requesting client and the ecm tuple (caid, ocaid, prid, srvid,
+   chid), so the result can be cached by matching_reader_mask(). */
+static int32_t matching_reader_cfg(ECM_REQUEST *er, struct s_reader *rdr)
 {
-	// simple checks first:
-	if(!er || !rdr)
-		{ return (0); }
-
-	// reader active?
-	struct s_client *cl = rdr->client;
-	if(!cl || !rdr->enable)
-		{ return (0); }
-
-	// if physical reader a card needs to be inserted
-	if(!is_network_reader(rdr) && rdr->card_status != CARD_INSERTED)
+	if(!rdr->client)
 		{ return (0); }
 
 	// Checking connected & group valid:
@@ -917,13 +912,6 @@ int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr)
 			{ return 0; }
 	}
 
-	// Supports long ecms?
-	if(er->ecmlen > 255 && is_network_reader(rdr) && !rdr->ph.large_ecm_support)
-	{
-		cs_log_dbg(D_TRACE, "no large ecm support (l=%d) for reader %s", er->ecmlen, rdr->label);
-		return 0;
-	}
-
 	// Checking services:
 	if(!chk_srvid(rdr->client, er))
 	{
@@ -938,6 +926,41 @@ int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr)
 		return (0);
 	}
 
+	// Checking chid:
+	if(!chk_chid(er, &rdr->fchid, "reader", rdr->label))
+	{
+		cs_log_dbg(D_TRACE, "chid filter reader %s", rdr->label);
+		return (0);
+	}
+
+	return (1);
+}
+
+/* The part of matching_reader() that depends on the reader state and the ecm itself. */
+int32_t matching_reader_state(ECM_REQUEST *er, struct s_reader *rdr)
+{
+	// simple checks first:
+	if(!er || !rdr)
+		{ return (0); }
+
+	// reader active?
+	struct s_client *cl = rdr->client;
+	if(!cl || !rdr->enable)
+		{ return (0); }
+
+	// if physical reader a card needs to be inserted
+	if(!is_network_reader(rdr) && rdr->card_status != CARD_INSERTED)
+		{ return (0); }
+
+	struct s_client *cur_cl = er->client;
+
+	// Supports long ecms?
+	if(er->ecmlen > 255 && is_network_reader(rdr) && !rdr->ph.large_ecm_support)
+	{
+		cs_log_dbg(D_TRACE, "no large ecm support (l=%d) for reader %s", er->ecmlen, rdr->label);
+		return 0;
+	}
+
 	// Check ECM nanos:
 	if(!chk_class(er, &rdr->cltab, "reader", rdr->label))
 	{
@@ -978,13 +1001,6 @@ int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr)
 		}
 	}
 
-	// Checking chid:
-	if(!chk_chid(er, &rdr->fchid, "reader", rdr->label))
-	{
-		cs_log_dbg(D_TRACE, "chid filter reader %s", rdr->label);
-		return (0);
-	}
-
 	// Schlocke reader-defined function, reader-self-check
 	if(rdr->ph.c_available && !rdr->ph.c_available(rdr, AVAIL_CHECK_CONNECTED, er))
 	{
@@ -1158,6 +1174,124 @@ int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr)
 	return (1);
 }
 
+int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr)
+{
+	// simple checks first:
+	if(!er || !rdr || !rdr->client || !rdr->enable)
+		{ return (0); }
+
+	// if physical reader a card needs to be inserted
+	if(!is_network_reader(rdr) && rdr->card_status != CARD_INSERTED)
+		{ return (0); }
+
+	return matching_reader_cfg(er, rdr) && matching_reader_state(er, rdr);
+}
+
+/* Cache for matching_reader_cfg(): one bit per active reader (position in the
+   first_active_reader list) for each (client group, ecm tuple). The whole cache
+   is dropped by bumping the generation on any reader or account change, changed
+   services are caught by cfg_sidtab_generation. */
+#define MATCH_CACHE_SIZE 1024
+
+struct s_match_cache
+{
+	uint32_t gen;
+	uint32_t sidtab_gen;
+	uint16_t caid;
+	uint16_t ocaid;
+	uint32_t prid;
+	uint16_t srvid;
+	uint16_t chid;
+	uint8_t ecm_empty;
+	uint64_t grp;
+	uint64_t mask[MATCH_MASK_WORDS];
+};
+
+static struct s_match_cache *match_cache;
+static uint32_t match_cache_gen = 1;
+static pthread_mutex_t match_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void matching_reader_invalidate(void)
+{
+	SAFE_MUTEX_LOCK(&match_cache_lock);
+	match_cache_gen++;
+	if(!match_cache_gen)
+		{ match_cache_gen++; } // 0 marks unused entries
+	SAFE_MUTEX_UNLOCK(&match_cache_lock);
+}
+
+static int8_t match_cache_key_equal(struct s_match_cache *m, ECM_REQUEST *er, uint8_t ecm_empty)
+{
+	return m->caid == er->caid && m->ocaid == er->ocaid && m->prid == er->prid && m->srvid == er->srvid
+		&& m->chid == er->chid && m->ecm_empty == ecm_empty && m->grp == er->client->grp;
+}
+
+/* Fills mask with the result of the config dependent reader checks for every
+   active reader, bit n stands for the n-th reader in first_active_reader.
+   readerlist_lock has to be held by the caller. Returns 0 when the mask can not
+   be used (too many readers or out of memory), matching_reader() has to be
+   used then. The reader state checks are left to matching_reader_state(). */
+int32_t matching_reader_mask(ECM_REQUEST *er, uint64_t *mask)
+{
+	struct s_match_cache *m;
+	struct s_reader *rdr;
+	uint32_t hash, gen, sidtab_gen, n;
+	uint8_t ecm_empty = (er->ecm[0] == 0);
+
+	if(!er->client)
+		{ return 0; }
+
+	hash = er->caid * 31 + er->ocaid;
+	hash = hash * 31 + er->prid;
+	hash = hash * 31 + er->srvid;
+	hash = hash * 31 + er->chid;
+	hash = hash * 31 + (uint32_t)(er->client->grp ^ (er->client->grp >> 32));
+	hash ^= hash >> 13;
+	hash = (hash * 0x5bd1e995) ^ ecm_empty;
+	hash = (hash ^ (hash >> 15)) % MATCH_CACHE_SIZE;
+
+	SAFE_MUTEX_LOCK(&match_cache_lock);
+	if(!match_cache && !cs_malloc(&match_cache, MATCH_CACHE_SIZE * sizeof(struct s_match_cache)))
+	{
+		SAFE_MUTEX_UNLOCK(&match_cache_lock);
+		return 0;
+	}
+	m = &match_cache[hash];
+	gen = match_cache_gen;
+	sidtab_gen = cfg_sidtab_generation;
+	if(m->gen == gen && m->sidtab_gen == cfg_sidtab_generation && match_cache_key_equal(m, er, ecm_empty))
+	{
+		memcpy(mask, m->mask, sizeof(m->mask));
+		SAFE_MUTEX_UNLOCK(&match_cache_lock);
+		return 1;
+	}
+	SAFE_MUTEX_UNLOCK(&match_cache_lock);
+
+	memset(mask, 0, MATCH_MASK_WORDS * sizeof(uint64_t));
+	for(n = 0, rdr = first_active_reader; rdr; rdr = rdr->next, n++)
+	{
+		if(n == MATCH_MAX_READERS)
+			{ return 0; }
+		if(matching_reader_cfg(er, rdr))
+			{ mask[n / 64] |= (uint64_t)1 << (n % 64); }
+	}
+
+	// an invalidation while the mask was built leaves gen outdated, so the entry is never used
+	SAFE_MUTEX_LOCK(&match_cache_lock);
+	m->gen = gen;
+	m->sidtab_gen = sidtab_gen;
+	m->caid = er->caid;
+	m->ocaid = er->ocaid;
+	m->prid = er->prid;
+	m->srvid = er->srvid;
+	m->chid = er->chid;
+	m->ecm_empty = ecm_empty;
+	m->grp = er->client->grp;
+	memcpy(m->mask, mask, sizeof(m->mask));
+	SAFE_MUTEX_UNLOCK(&match_cache_lock);
+	return 1;
+}
+
 int32_t chk_caid(uint16_t caid, CAIDTAB *ctab)
 {
 	int32_t i;
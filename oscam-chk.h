@@ -5,9 +5,17 @@
 #define SRVID_ZERO 0 // srvid + 0000 (used for service-filter bypass)
 #define SRVID_MASK 1 // srvid + FFFF
 
+// reader eligibility cache (matching_reader_mask)
+#define MATCH_MAX_READERS 512
+#define MATCH_MASK_WORDS (MATCH_MAX_READERS / 64)
+#define MATCH_MASK_ISSET(mask, n) ((mask)[(n) / 64] & ((uint64_t)1 << ((n) % 64)))
+
 uint32_t get_fallbacktimeout(uint16_t caid);
 int32_t ecm_ratelimit_check(struct s_reader *reader, ECM_REQUEST *er, int32_t reader_mode);
 int32_t matching_reader(ECM_REQUEST *er, struct s_reader *rdr);
+int32_t matching_reader_state(ECM_REQUEST *er, struct s_reader *rdr);
+int32_t matching_reader_mask(ECM_REQUEST *er, uint64_t *mask);
+void matching_reader_invalidate(void);
 uint8_t chk_if_ignore_checksum(ECM_REQUEST *er, FTAB *disablecrc_only_for);
 
 uint8_t is_localreader(struct s_reader *rdr, ECM_REQUEST *er);
@@ -4,6 +4,7 @@
 
 #include "cscrypt/md5.h"
 #include "module-anticasc.h"
+#include "module-cacheex.h"
 #include "module-cccam.h"
 #include "module-webif.h"
 #include "oscam-array.h"
@@ -25,6 +26,7 @@ extern CS_MUTEX_LOCK fakeuser_lock;
 
 static char *processUsername;
 static struct s_client *first_client_hashed[CS_CLIENT_HASHBUCKETS]; // Alternative hashed client list
+static struct s_client *first_client_udp[CS_UDP_HASHBUCKETS]; // udp clients by ip and port
 
 /* Gets the unique thread number from the client. Used in monitor and newcamd. */
 int32_t get_threadnum(struct s_client *client)
@@ -75,6 +77,57 @@ int8_t is_valid_client(struct s_client *client)
 	return 0;
 }
 
+static int32_t udp_client_bucket(IN_ADDR_T ip, in_port_t port)
+{
+	const uint8_t *p = (const uint8_t *)&ip;
+	uint32_t i, hash = port;
+
+	for(i = 0; i < sizeof(IN_ADDR_T); i++)
+		{ hash = hash * 31 + p[i]; }
+	return hash % CS_UDP_HASHBUCKETS;
+}
+
+/* Returns the udp client created by accept_connection() for the remote
+   address, NULL if there is none or it is being killed. */
+struct s_client *find_udp_client(IN_ADDR_T ip, in_port_t port)
+{
+	struct s_client *cl;
+
+	cs_readlock(__func__, &clientlist_lock);
+	for(cl = first_client_udp[udp_client_bucket(ip, port)]; cl; cl = cl->nextudp)
+	{
+		if(!cl->kill && IP_EQUAL(cl->ip, ip) && cl->port == port)
+			{ break; }
+	}
+	cs_readunlock(__func__, &clientlist_lock);
+	return cl;
+}
+
+void add_udp_client(struct s_client *cl)
+{
+	int32_t bucket = udp_client_bucket(cl->ip, cl->port);
+
+	cs_writelock(__func__, &clientlist_lock);
+	cl->nextudp = first_client_udp[bucket];
+	first_client_udp[bucket] = cl;
+	cs_writeunlock(__func__, &clientlist_lock);
+}
+
+// call with clientlist_lock held
+static void remove_udp_client(struct s_client *cl)
+{
+	struct s_client **prev;
+
+	for(prev = &first_client_udp[udp_client_bucket(cl->ip, cl->port)]; *prev; prev = &(*prev)->nextudp)
+	{
+		if(*prev == cl)
+		{
+			*prev = cl->nextudp;
+			break;
+		}
+	}
+}
+
 const char *remote_txt(void)
 {
 	return cur_client()->typ == 'c' ? "client" : "remote server";
@@ -537,6 +590,7 @@ int32_t cs_auth_client(struct s_client *client, struct s_auth *account, const ch
 			break;
 		}
 	}
+	cacheex_push_index_invalidate(); // account and cacheex mode of the client may have changed
 	return rc;
 }
 
@@ -674,6 +728,8 @@ void cs_reinit_clients(struct s_auth *new_accounts)
 			cl->account = NULL;
 		}
 	}
+	matching_reader_invalidate(); // drop the cached reader matches on reload
+	cacheex_push_index_invalidate();
 }
 
 void client_check_status(struct s_client *cl)
@@ -687,6 +743,13 @@ void client_check_status(struct s_client *cl)
 	{
 		case 'm':
 		case 'c':
+#ifdef CS_ANTICASC
+			if(cl->hidecards_until && time(NULL) >= cl->hidecards_until)
+			{
+				cl->hidecards_until = 0;
+				add_job(cl, ACTION_CLIENT_UNHIDECARDS, NULL, 0);
+			}
+#endif
 			if((get_module(cl)->listenertype & LIS_CCCAM) && cl->last && (time(NULL) - cl->last) > (time_t)12)
 			{
 				add_job(cl, ACTION_CLIENT_IDLE, NULL, 0);
@@ -785,6 +848,7 @@ void free_client(struct s_client *cl)
 	{
 		prev->next = cl2->next;
 	}
+	cacheex_push_index_invalidate();
 
 	int32_t bucket = (uintptr_t)cl / 16 % CS_CLIENT_HASHBUCKETS;
 
@@ -810,6 +874,8 @@ void free_client(struct s_client *cl)
 		}
 	}
 
+	remove_udp_client(cl);
+
 	cs_writeunlock(__func__, &clientlist_lock);
 	cleanup_ecmtasks(cl);
 
@@ -865,12 +931,14 @@ void free_client(struct s_client *cl)
 
 	// Clean all remaining structures
 	free_joblist(cl);
+	cacheex_push_batch_free(cl);
 	NULLFREE(cl->work_mbuf);
 
 	if(cl->ecmtask)
 	{
 		add_garbage(cl->ecmtask);
 		cl->ecmtask = NULL;
+		cl->ecmtask_index = NULL;
 	}
 
 	ll_destroy_data(&cl->cascadeusers);
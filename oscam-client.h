@@ -14,6 +14,8 @@ const char *client_get_proto(struct s_client *cl);
 const char *username(struct s_client *client);
 void init_first_client(void);
 struct s_client *create_client(IN_ADDR_T ip);
+struct s_client *find_udp_client(IN_ADDR_T ip, in_port_t port);
+void add_udp_client(struct s_client *cl);
 int32_t cs_auth_client(struct s_client *client, struct s_auth *account, const char *e_txt);
 void cs_disconnect_client(struct s_client *client);
 void cs_reinit_clients(struct s_auth *new_accounts);
@@ -304,9 +304,14 @@ void global_fixups_fn(void *UNUSED(var))
 #endif
 	}
 	if(cfg.netprio <= 0 || cfg.netprio > 20) { cfg.netprio = 0; }
+	if(cfg.workerthreads < -1) { cfg.workerthreads = 0; }
+	if(cfg.workerthreads > 256) { cfg.workerthreads = 256; }
+	if(cfg.listenshards < -1) { cfg.listenshards = 0; }
+	if(cfg.listenshards > CS_MAX_LISTENSHARDS) { cfg.listenshards = CS_MAX_LISTENSHARDS; }
 	if(cfg.max_log_size != 0 && cfg.max_log_size <= 10) { cfg.max_log_size = 10; }
 #ifdef WITH_LB
 	if(cfg.lb_save > 0 && cfg.lb_save < 100) { cfg.lb_save = 100; }
+	if(cfg.lb_journal < 0) { cfg.lb_journal = 0; }
 	if(cfg.lb_nbest_readers < 2) { cfg.lb_nbest_readers = DEFAULT_NBEST; }
 #endif
 }
@@ -343,6 +348,9 @@ static const struct config_list global_opts[] =
 	DEF_OPT_INT32("sleep"                          , OFS(tosleep)                       , 0),
 	DEF_OPT_INT32("unlockparental"                 , OFS(ulparent)                      , 0),
 	DEF_OPT_INT32("nice"                           , OFS(nice)                          , 99),
+	DEF_OPT_INT32("workerthreads"                  , OFS(workerthreads)                 , 0),
+	DEF_OPT_INT32("listenshards"                   , OFS(listenshards)                  , 0),
+	DEF_OPT_INT8("lockprofile"                     , OFS(lockprofile)                   , 0),
 	DEF_OPT_INT32("maxlogsize"                     , OFS(max_log_size)                  , 10),
 	DEF_OPT_INT8("waitforcards"                    , OFS(waitforcards)                  , 1),
 	DEF_OPT_INT32("waitforcards_extra_delay"       , OFS(waitforcards_extra_delay)      , 500),
@@ -366,6 +374,7 @@ static const struct config_list global_opts[] =
 #ifdef WITH_LB
 	DEF_OPT_INT32("lb_mode"                        , OFS(lb_mode)                       , DEFAULT_LB_MODE),
 	DEF_OPT_INT32("lb_save"                        , OFS(lb_save)                       , 0),
+	DEF_OPT_INT32("lb_journal"                     , OFS(lb_journal)                    , 0),
 	DEF_OPT_INT32("lb_nbest_readers"               , OFS(lb_nbest_readers)              , DEFAULT_NBEST),
 	DEF_OPT_INT32("lb_nfb_readers"                 , OFS(lb_nfb_readers)                , DEFAULT_NFB),
 	DEF_OPT_INT32("lb_min_ecmcount"                , OFS(lb_min_ecmcount)               , DEFAULT_MIN_ECM_COUNT),
@@ -386,9 +395,11 @@ static const struct config_list global_opts[] =
 	DEF_OPT_INT32("lb_auto_timeout"                , OFS(lb_auto_timeout)               , DEFAULT_LB_AUTO_TIMEOUT),
 	DEF_OPT_INT32("lb_auto_timeout_p"              , OFS(lb_auto_timeout_p)             , DEFAULT_LB_AUTO_TIMEOUT_P),
 	DEF_OPT_INT32("lb_auto_timeout_t"              , OFS(lb_auto_timeout_t)             , DEFAULT_LB_AUTO_TIMEOUT_T),
+	DEF_OPT_INT32("lb_percentile"                  , OFS(lb_percentile)                 , DEFAULT_LB_PERCENTILE),
 #endif
 	DEF_OPT_FUNC("double_check_caid"               , OFS(double_check_caid)             , chk_ftab_fn),
 	DEF_OPT_STR("ecmfmt"                           , OFS(ecmfmt)                        , NULL),
+	DEF_OPT_STR("ecmtrace"                         , OFS(ecmtrace)                      , NULL),
 	DEF_OPT_INT32("resolvegethostbyname"           , OFS(resolve_gethostbyname)         , 0),
 	DEF_OPT_INT32("failbantime"                    , OFS(failbantime)                   , 0),
 	DEF_OPT_INT32("failbancount"                   , OFS(failbancount)                  , 0),
@@ -623,6 +634,8 @@ static const struct config_list camd33_opts[] = { DEF_LAST_OPT };
 void cache_fixups_fn(void *UNUSED(var))
 {
 	if(cfg.max_cache_time < ((int32_t)(cfg.ctimeout + 500) / 1000 + 3)) { cfg.max_cache_time = ((cfg.ctimeout + 500) / 1000 + 3); }
+	if(cfg.cache_shards < 1) { cfg.cache_shards = 1; }
+	if(cfg.cache_shards > MAX_CACHE_SHARDS) { cfg.cache_shards = MAX_CACHE_SHARDS; }
 #ifdef CW_CYCLE_CHECK
 	if(cfg.maxcyclelist > 4000) { cfg.maxcyclelist = 4000; }
 	if(cfg.keepcycletime > 240) { cfg.keepcycletime = 240; }
@@ -630,6 +643,8 @@ void cache_fixups_fn(void *UNUSED(var))
 	if(cfg.cwcycle_sensitive == 1) { cfg.cwcycle_sensitive = 2; }
 #endif
 #ifdef CS_CACHEEX_AIO
+	if(cfg.cacheex_push_batch_time > 100) { cfg.cacheex_push_batch_time = 100; }
+	if(cfg.cacheex_push_batch_max < 1) { cfg.cacheex_push_batch_max = 1; }
 	// lgo-ctab -> lgo-ftab port
 	caidtab2ftab_add(&cfg.cacheex_localgenerated_only_in_caidtab, &cfg.cacheex_lg_only_in_tab);
 	caidtab_clear(&cfg.cacheex_localgenerated_only_in_caidtab);
@@ -640,10 +655,10 @@ void cache_fixups_fn(void *UNUSED(var))
 
 static bool cache_should_save_fn(void *UNUSED(var))
 {
-	return cfg.delay > 0 || cfg.max_cache_time != 15
+	return cfg.delay > 0 || cfg.max_cache_time != 15 || cfg.cache_shards != DEFAULT_CACHE_SHARDS || cfg.cache_max_memory
 #ifdef CS_CACHEEX
 #ifdef CS_CACHEEX_AIO
-			|| cfg.cacheex_lg_only_tab.nfilts || cfg.cacheex_lg_only_in_tab.nfilts || cfg.cacheex_lg_only_remote_settings || cfg.cacheex_lg_only_in_aio_only || cfg.cacheex_push_lg_groups || cfg.cacheex_filter_caidtab_aio.cevnum || cfg.cacheex_filter_caidtab.cevnum || cfg.cacheex_localgenerated_only_caidtab.ctnum || cfg.cacheex_localgenerated_only_in_caidtab.ctnum || cfg.cacheex_localgenerated_only_in || cfg.cacheex_localgenerated_only || cfg.cacheex_dropdiffs || cfg.cw_cache_settings.cwchecknum || cfg.cw_cache_size > 0 || cfg.cw_cache_memory > 0 || cfg.cacheex_wait_timetab.cevnum || cfg.cacheex_enable_stats > 0 || cfg.csp_port || cfg.csp.filter_caidtab.cevnum || cfg.csp.allow_request == 0 || cfg.csp.allow_reforward > 0
+			|| cfg.cacheex_lg_only_tab.nfilts || cfg.cacheex_lg_only_in_tab.nfilts || cfg.cacheex_lg_only_remote_settings || cfg.cacheex_lg_only_in_aio_only || cfg.cacheex_push_lg_groups || cfg.cacheex_filter_caidtab_aio.cevnum || cfg.cacheex_filter_caidtab.cevnum || cfg.cacheex_push_batch_time || cfg.cacheex_push_batch_max != 16 || cfg.cacheex_localgenerated_only_caidtab.ctnum || cfg.cacheex_localgenerated_only_in_caidtab.ctnum || cfg.cacheex_localgenerated_only_in || cfg.cacheex_localgenerated_only || cfg.cacheex_dropdiffs || cfg.cw_cache_settings.cwchecknum || cfg.cw_cache_size > 0 || cfg.cw_cache_memory > 0 || cfg.cacheex_wait_timetab.cevnum || cfg.cacheex_enable_stats > 0 || cfg.csp_port || cfg.csp.filter_caidtab.cevnum || cfg.csp.allow_request == 0 || cfg.csp.allow_reforward > 0
 #else
 			|| cfg.cacheex_wait_timetab.cevnum || cfg.cacheex_enable_stats > 0 || cfg.csp_port || cfg.csp.filter_caidtab.cevnum || cfg.csp.allow_request == 0 || cfg.csp.allow_reforward > 0
 #endif
@@ -660,6 +675,8 @@ static const struct config_list cache_opts[] =
 	DEF_OPT_FIXUP_FUNC(cache_fixups_fn),
 	DEF_OPT_UINT32("delay"                , OFS(delay)                  , CS_DELAY),
 	DEF_OPT_INT32("max_time"              , OFS(max_cache_time)         , DEFAULT_MAX_CACHE_TIME),
+	DEF_OPT_UINT32("shards"               , OFS(cache_shards)           , DEFAULT_CACHE_SHARDS),
+	DEF_OPT_UINT32("max_memory"           , OFS(cache_max_memory)       , 0),
 #ifdef CS_CACHEEX
 #ifdef CS_CACHEEX_AIO
 	DEF_OPT_UINT32("cw_cache_size"        , OFS(cw_cache_size)          , 0),
@@ -699,6 +716,8 @@ static const struct config_list cache_opts[] =
 	DEF_OPT_FUNC("cacheex_nopushafter"    , OFS(cacheex_nopushafter_tab), caidvaluetab_fn),
 	DEF_OPT_UINT8("waittime_block_start"  , OFS(waittime_block_start)   , 0),
 	DEF_OPT_INT32("waittime_block_time"   , OFS(waittime_block_time)    , 0),
+	DEF_OPT_UINT8("cacheex_push_batch_time", OFS(cacheex_push_batch_time), 0),
+	DEF_OPT_UINT8("cacheex_push_batch_max", OFS(cacheex_push_batch_max) , 16),
 #endif
 #endif
 #ifdef CW_CYCLE_CHECK
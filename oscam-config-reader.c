@@ -9,6 +9,7 @@
 #include "oscam-conf-mk.h"
 #include "oscam-config.h"
 #include "oscam-garbage.h"
+#include "oscam-latency.h"
 #include "oscam-lock.h"
 #include "oscam-reader.h"
 #include "oscam-string.h"
@@ -1497,6 +1498,7 @@ void free_reader(struct s_reader *rdr)
 #endif
 #endif
 	lb_destroy_stats(rdr);
+	ecm_latency_free(rdr);
 
 	cs_clear_entitlement(rdr);
 	ll_destroy(&rdr->ll_entitlements);
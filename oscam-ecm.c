@@ -18,18 +18,18 @@
 #include "oscam-garbage.h"
 #include "oscam-failban.h"
 #include "oscam-net.h"
+#include "oscam-pool.h"
 #include "oscam-time.h"
+#include "oscam-latency.h"
+#include "oscam-trace.h"
 #include "oscam-lock.h"
 #include "oscam-string.h"
 #include "oscam-work.h"
 #include "reader-common.h"
 #include "module-cccam-data.h"
-#ifdef CS_CACHEEX_AIO
 #include "oscam-hashtable.h"
-#endif
 
 extern CS_MUTEX_LOCK ecmcache_lock;
-extern struct ecm_request_t *ecmcwcache;
 extern uint16_t len4caid[256];
 extern uint32_t ecmcwcache_size;
 extern int32_t exit_oscam;
@@ -42,6 +42,467 @@ static pthread_cond_t cw_process_sleep_cond;
 static int cw_process_wakeups;
 int64_t ecmc_next, cache_next, msec_wait = 3000;
 
+// ecmcwcache: all ecms requested by clients, indexed by (caid, ecmd5)
+// and kept in insertion order for expiry. Protected by ecmcache_lock.
+static hash_table ht_ecmcwcache;
+static list ll_ecmcwcache;
+
+// ecm timers: every deadline of an ecm (cacheex wait time, cacheex mode 1 delay,
+// fallback timeout and client timeout) is registered once in get_cw() and kept
+// in a binary min-heap, so cw_process() only touches ecms with expired deadlines.
+// When the heap cannot grow the ecm is marked timers_unqueued and cw_process()
+// checks it by scanning ecmcwcache instead.
+static pthread_mutex_t ecm_timer_lock;			// protects the following
+static struct ecm_timer_heap ecm_timers;
+static uint32_t ecm_timers_unqueued;			// ecms in ecmcwcache with timers_unqueued set
+
+#define ECM_TIMERS_CLIENT	1					// timers_unqueued: only the client timeout
+#define ECM_TIMERS_ALL		2
+
+struct s_pool ecm_pool;
+struct s_pool ecm_answer_pool;
+
+void init_ecmcwcache(void)
+{
+	init_hash_table(&ht_ecmcwcache, &ll_ecmcwcache);
+	// every client thread allocates ecms, so keep the per thread caches small
+	pool_init(&ecm_pool, "ecm", sizeof(ECM_REQUEST), 256, 2);
+	pool_init(&ecm_answer_pool, "ecm answer", sizeof(struct s_ecm_answer), 1024, 4);
+	SAFE_MUTEX_INIT(&ecm_timer_lock, NULL);
+}
+
+static tommy_hash_t ecmcwcache_hash(uint16_t caid, const uint8_t *ecmd5)
+{
+	return tommy_hash_u32(caid, ecmd5, CS_ECMSTORESIZE);
+}
+
+// caller must hold ecmcache_lock for writing
+static void ecmcwcache_remove(ECM_REQUEST *er)
+{
+	ECM_REQUEST **p, *waiter;
+
+	if(er->inflight_owner) // waiter expired before its owner was answered
+	{
+		for(p = &er->inflight_owner->inflight_waiters; *p; p = &(*p)->inflight_next)
+		{
+			if(*p == er)
+			{
+				*p = er->inflight_next;
+				break;
+			}
+		}
+		er->inflight_owner = NULL;
+	}
+	for(waiter = er->inflight_waiters; waiter; waiter = waiter->inflight_next)
+		{ waiter->inflight_owner = NULL; }
+	er->inflight_waiters = NULL;
+
+	tommy_hashlin_remove_existing(&ht_ecmcwcache, &er->ecmcwcache_ht_node);
+	tommy_list_remove_existing(&ll_ecmcwcache, &er->ecmcwcache_ll_node);
+	ecmcwcache_size--;
+}
+
+static ECM_REQUEST *ecmcwcache_match_from(tommy_node *i, tommy_hash_t hash, uint16_t caid, const uint8_t *ecmd5)
+{
+	ECM_REQUEST *ecm;
+	for(; i; i = i->next)
+	{
+		ecm = i->data;
+		if(i->index == hash && ecm->caid == caid && !memcmp(ecm->ecmd5, ecmd5, CS_ECMSTORESIZE))
+			{ return ecm; }
+	}
+	return NULL;
+}
+
+/* The following iterators must be called with ecmcache_lock held. */
+
+// first cached ecm with the given caid and ecm hash
+ECM_REQUEST *ecmcwcache_find(uint16_t caid, const uint8_t *ecmd5)
+{
+	tommy_hash_t hash = ecmcwcache_hash(caid, ecmd5);
+	return ecmcwcache_match_from(tommy_hashlin_bucket(&ht_ecmcwcache, hash), hash, caid, ecmd5);
+}
+
+// next cached ecm with the same caid and ecm hash as ecm
+ECM_REQUEST *ecmcwcache_find_next(ECM_REQUEST *ecm)
+{
+	return ecmcwcache_match_from(ecm->ecmcwcache_ht_node.next, ecm->ecmcwcache_ht_node.index, ecm->caid, ecm->ecmd5);
+}
+
+ECM_REQUEST *ecmcwcache_oldest(void)
+{
+	return get_first_elem_list(&ll_ecmcwcache);
+}
+
+ECM_REQUEST *ecmcwcache_newer(ECM_REQUEST *ecm)
+{
+	return get_data_from_node(ecm->ecmcwcache_ll_node.next);
+}
+
+ECM_REQUEST *ecmcwcache_newest(void)
+{
+	return get_data_from_node(tommy_list_tail(&ll_ecmcwcache));
+}
+
+ECM_REQUEST *ecmcwcache_older(ECM_REQUEST *ecm)
+{
+	if(&ecm->ecmcwcache_ll_node == tommy_list_head(&ll_ecmcwcache))
+		{ return NULL; }
+	return ecm->ecmcwcache_ll_node.prev->data;
+}
+
+/*
+ * Single-flight for identical ecms: an ecm still waiting for its readers owns the requests,
+ * a later ecm with the same caid and ecmd5 whose readers are all asked by the owner too
+ * just attaches as waiter and is answered together with the owner in send_dcw().
+ * Caller must hold ecmcache_lock for writing.
+ */
+static ECM_REQUEST *ecm_inflight_owner(ECM_REQUEST *er)
+{
+	ECM_REQUEST *ecm;
+	struct s_ecm_answer *ea;
+	time_t timeout = time(NULL) - ((cfg.ctimeout + 500) / 1000 + 1);
+
+	for(ecm = ecmcwcache_find(er->caid, er->ecmd5); ecm; ecm = ecmcwcache_find_next(ecm))
+	{
+		if(ecm->rc < E_99 || ecm->inflight_owner || ecm->readers_timeout_check
+			|| ecm->tps.time <= timeout || !check_client(ecm->client))
+			{ continue; }
+
+		for(ea = er->matching_rdr; ea; ea = ea->next)
+		{
+			if(!get_ecm_answer(ea->reader, ecm))
+				{ break; }
+		}
+		if(!ea)
+			{ return ecm; }
+	}
+	return NULL;
+}
+
+/* Inserts er into ecmcwcache. Returns the in flight ecm er was attached to, if any. */
+static ECM_REQUEST *ecmcwcache_add(ECM_REQUEST *er)
+{
+	ECM_REQUEST *owner;
+
+	cs_writelock(__func__, &ecmcache_lock);
+	owner = ecm_inflight_owner(er);
+	if(owner)
+	{
+		er->inflight_owner = owner;
+		er->inflight_next = owner->inflight_waiters;
+		owner->inflight_waiters = er;
+	}
+	tommy_hashlin_insert(&ht_ecmcwcache, &er->ecmcwcache_ht_node, er, ecmcwcache_hash(er->caid, er->ecmd5));
+	tommy_list_insert_tail(&ll_ecmcwcache, &er->ecmcwcache_ll_node, er);
+	ecmcwcache_size++;
+	cs_writeunlock(__func__, &ecmcache_lock);
+	return owner;
+}
+
+/*
+ * Answers all ecms attached to er with the result of er. Every waiter gets its own copy of
+ * the result, it is written and sent by the waiter's client thread (write_ecm_answer_fromcache),
+ * so it cannot race with the waiter's own timeout.
+ */
+static void ecm_inflight_release(ECM_REQUEST *er)
+{
+	ECM_REQUEST *waiter, *next, *ecm;
+	struct s_write_from_cache *wfc;
+
+	if(!er->inflight_waiters || er->rc >= E_99)
+		{ return; }
+
+	cs_writelock(__func__, &ecmcache_lock);
+	waiter = er->inflight_waiters;
+	er->inflight_waiters = NULL;
+	for(next = waiter; next; next = next->inflight_next)
+		{ next->inflight_owner = NULL; }
+	cs_writeunlock(__func__, &ecmcache_lock);
+
+	for(; waiter; waiter = next)
+	{
+		next = waiter->inflight_next;
+		waiter->inflight_next = NULL;
+		if(!check_client(waiter->client))
+			{ continue; }
+
+		ecm = NULL;
+		if(!cs_malloc(&ecm, sizeof(ECM_REQUEST)))
+			{ continue; } // waiter runs into its timeout
+		ecm->rc = (er->rc < E_NOTFOUND) ? E_CACHE2 : er->rc;
+		ecm->rcEx = er->rcEx;
+		memcpy(ecm->cw, er->cw, sizeof(ecm->cw));
+		ecm->cw_ex = er->cw_ex;
+		cs_strncpy(ecm->msglog, er->msglog, sizeof(ecm->msglog));
+		ecm->selected_reader = er->selected_reader;
+		ecm->cw_count = er->cw_count;
+
+		wfc = NULL;
+		if(!cs_malloc(&wfc, sizeof(struct s_write_from_cache)))
+		{
+			NULLFREE(ecm);
+			continue;
+		}
+		wfc->er_new = waiter;
+		wfc->er_cache = ecm;
+
+		cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [ecm_inflight_release] answered together with client %s",
+					(check_client(waiter->client) ? waiter->client->account->usr : "-"), waiter->caid, waiter->prid, waiter->srvid,
+					(check_client(er->client) ? er->client->account->usr : "-"));
+		if(!add_job(waiter->client, ACTION_ECM_ANSWER_CACHE, wfc, sizeof(struct s_write_from_cache))) // write_ecm_answer_fromcache
+			{ NULLFREE(ecm); }
+	}
+}
+
+static void ecm_timer_swap(struct ecm_timer_heap *h, uint32_t a, uint32_t b)
+{
+	struct ecm_timer t = h->timers[a];
+	h->timers[a] = h->timers[b];
+	h->timers[b] = t;
+}
+
+/* Makes room for n more timers. Returns 0 if the heap could not grow. */
+int32_t ecm_timer_reserve(struct ecm_timer_heap *h, uint32_t n)
+{
+	uint32_t new_size = h->size ? h->size : 256;
+
+	if(h->count + n <= h->size)
+		{ return 1; }
+	while(new_size < h->count + n)
+		{ new_size *= 2; }
+	if(!cs_realloc(&h->timers, new_size * sizeof(struct ecm_timer)))
+		{ return 0; }
+	h->size = new_size;
+	return 1;
+}
+
+// caller must have reserved room for t
+void ecm_timer_push(struct ecm_timer_heap *h, const struct ecm_timer *t)
+{
+	uint32_t i = h->count++, parent;
+
+	h->timers[i] = *t;
+	while(i > 0)
+	{
+		parent = (i - 1) / 2;
+		if(comp_timeb(&h->timers[parent].expire, &h->timers[i].expire) <= 0)
+			{ break; }
+		ecm_timer_swap(h, i, parent);
+		i = parent;
+	}
+}
+
+// caller must check h->count
+void ecm_timer_pop(struct ecm_timer_heap *h, struct ecm_timer *t)
+{
+	uint32_t i = 0, l, r, min;
+
+	*t = h->timers[0];
+	h->timers[0] = h->timers[--h->count];
+
+	while(1)
+	{
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if(l < h->count && comp_timeb(&h->timers[l].expire, &h->timers[min].expire) < 0)
+			{ min = l; }
+		if(r < h->count && comp_timeb(&h->timers[r].expire, &h->timers[min].expire) < 0)
+			{ min = r; }
+		if(min == i)
+			{ break; }
+		ecm_timer_swap(h, i, min);
+		i = min;
+	}
+}
+
+static uint32_t ecm_timer_msec(ECM_REQUEST *er, enum actions action)
+{
+	switch(action)
+	{
+#ifdef CS_CACHEEX
+		case ACTION_CACHEEX_TIMEOUT:
+			return lb_auto_timeout(er, er->cacheex_wait_time);
+		case ACTION_CACHEEX1_DELAY:
+			return lb_auto_timeout(er, er->cacheex_mode1_delay);
+#endif
+		case ACTION_FALLBACK_TIMEOUT:
+			return lb_auto_timeout(er, get_fallbacktimeout(er->caid));
+		default:
+			return lb_auto_timeout(er, cfg.ctimeout);
+	}
+}
+
+// caller must hold ecm_timer_lock and have reserved room
+static void ecm_timer_add(ECM_REQUEST *er, enum actions action)
+{
+	struct ecm_timer t;
+
+	t.expire = er->tps;
+	add_ms_to_timeb(&t.expire, ecm_timer_msec(er, action));
+	t.er = er;
+	t.action = action;
+	__sync_add_and_fetch(&er->timers_pending, 1);
+	ecm_timer_push(&ecm_timers, &t);
+}
+
+/* Queues the deadlines of er, only its client timeout with ECM_TIMERS_CLIENT. */
+static void ecm_timers_register(ECM_REQUEST *er, int8_t which)
+{
+	SAFE_MUTEX_LOCK(&ecm_timer_lock);
+	if(!ecm_timer_reserve(&ecm_timers, 4))
+	{
+		cs_log("ecm timers: out of memory, checking ecm of %s by scanning", username(er->client));
+		er->timers_unqueued = which;
+		ecm_timers_unqueued++;
+		SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+		return;
+	}
+	if(which == ECM_TIMERS_ALL)
+	{
+#ifdef CS_CACHEEX
+		if(er->cacheex_wait_time)
+		{
+			ecm_timer_add(er, ACTION_CACHEEX_TIMEOUT);
+			if(er->cacheex_mode1_delay && er->cacheex_reader_count > 0)
+				{ ecm_timer_add(er, ACTION_CACHEEX1_DELAY); }
+		}
+#endif
+		ecm_timer_add(er, ACTION_FALLBACK_TIMEOUT);
+	}
+	ecm_timer_add(er, ACTION_CLIENT_TIMEOUT);
+	SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+}
+
+static int8_t ecm_timers_done(ECM_REQUEST *er)
+{
+	return !__sync_fetch_and_add(&er->timers_pending, 0);
+}
+
+static void ecm_timer_fire(struct ecm_timer *t)
+{
+	ECM_REQUEST *er = t->er;
+
+	if((er->from_cacheex || er->from_csp) // ignore ecms from cacheex/csp
+		|| er->readers_timeout_check      // ignore already checked
+		|| !check_client(er->client))     // ignore ecm of killed clients
+	{
+		return;
+	}
+
+	switch(t->action)
+	{
+#ifdef CS_CACHEEX
+		case ACTION_CACHEEX_TIMEOUT:
+			if(er->rc >= E_UNHANDLED && !er->cacheex_wait_time_expired)
+				{ add_job(er->client, ACTION_CACHEEX_TIMEOUT, (void *)er, 0); }
+			break;
+
+		case ACTION_CACHEEX1_DELAY:
+			if(er->rc >= E_UNHANDLED && !er->cacheex_wait_time_expired && !er->stage)
+				{ add_job(er->client, ACTION_CACHEEX1_DELAY, (void *)er, 0); }
+			break;
+#endif
+		case ACTION_FALLBACK_TIMEOUT:
+			if(er->rc >= E_UNHANDLED && er->stage < 4)
+				{ add_job(er->client, ACTION_FALLBACK_TIMEOUT, (void *)er, 0); }
+			break;
+
+		case ACTION_CLIENT_TIMEOUT:
+			add_job(er->client, ACTION_CLIENT_TIMEOUT, (void *)er, 0);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Fires all ecm timers expired at t_now.
+ * Returns msec until the next timer expires or 0 if no timer is pending.
+ */
+static int64_t ecm_timers_run(struct timeb *t_now)
+{
+	struct ecm_timer t;
+	int64_t next = 0;
+
+	while(1)
+	{
+		SAFE_MUTEX_LOCK(&ecm_timer_lock);
+		if(!ecm_timers.count)
+		{
+			SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+			break;
+		}
+		next = comp_timeb(&ecm_timers.timers[0].expire, t_now);
+		if(next > 0)
+		{
+			SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+			break;
+		}
+		ecm_timer_pop(&ecm_timers, &t);
+		SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+
+		ecm_timer_fire(&t);
+		__sync_sub_and_fetch(&t.er->timers_pending, 1);
+	}
+	return next;
+}
+
+/*
+ * Checks the ecms whose timers could not be queued the way cw_process() did before
+ * the heap: every expired deadline fires again until the ecm state moved on.
+ * Returns msec until the next deadline or 0.
+ */
+static int64_t ecm_timers_scan(struct timeb *t_now)
+{
+	static const enum actions actions[] =
+	{
+#ifdef CS_CACHEEX
+		ACTION_CACHEEX_TIMEOUT, ACTION_CACHEEX1_DELAY,
+#endif
+		ACTION_FALLBACK_TIMEOUT, ACTION_CLIENT_TIMEOUT
+	};
+	struct ecm_timer t;
+	ECM_REQUEST *er;
+	int64_t left, next = 0;
+	uint32_t i, unqueued;
+
+	SAFE_MUTEX_LOCK(&ecm_timer_lock);
+	unqueued = ecm_timers_unqueued;
+	SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+	if(!unqueued)
+		{ return 0; }
+
+	cs_readlock(__func__, &ecmcache_lock);
+	for(er = ecmcwcache_oldest(); er; er = ecmcwcache_newer(er))
+	{
+		if(!er->timers_unqueued)
+			{ continue; }
+		for(i = 0; i < sizeof(actions) / sizeof(actions[0]); i++)
+		{
+			if(er->timers_unqueued == ECM_TIMERS_CLIENT && actions[i] != ACTION_CLIENT_TIMEOUT)
+				{ continue; }
+#ifdef CS_CACHEEX
+			if((actions[i] == ACTION_CACHEEX_TIMEOUT && !er->cacheex_wait_time)
+				|| (actions[i] == ACTION_CACHEEX1_DELAY && (!er->cacheex_mode1_delay || er->cacheex_reader_count <= 0)))
+				{ continue; }
+#endif
+			t.expire = er->tps;
+			left = add_ms_to_timeb_diff(&t.expire, ecm_timer_msec(er, actions[i]));
+			t.er = er;
+			t.action = actions[i];
+			if(comp_timeb(t_now, &t.expire) >= 0)
+				{ ecm_timer_fire(&t); }
+			else if(!next || left < next)
+				{ next = left; }
+		}
+	}
+	cs_readunlock(__func__, &ecmcache_lock);
+	return next;
+}
+
 #ifdef CS_CACHEEX_AIO
 // ecm-cache
 typedef struct ecm_cache
@@ -235,16 +696,10 @@ void update_n_request(void)
 static void *cw_process(void)
 {
 	set_thread_name(__func__);
-	int64_t time_to_check_fbtimeout, time_to_check_ctimeout, next_check, n_request_next;
-	struct timeb t_now, tbc, ecmc_time, cache_time, n_request_time;
-	ECM_REQUEST *er = NULL;
+	int64_t next_check, scan_next, n_request_next;
+	struct timeb t_now, ecmc_time, cache_time, n_request_time;
 	time_t ecm_maxcachetime;
 
-#ifdef CS_CACHEEX
-	int64_t time_to_check_cacheex_wait_time;
-	int64_t time_to_check_cacheex_mode1_delay;
-#endif
-
 	cs_pthread_cond_init(__func__, &cw_process_sleep_cond_mutex, &cw_process_sleep_cond);
 
 #ifdef CS_ANTICASC
@@ -265,13 +720,14 @@ static void *cw_process(void)
 	{
 		if(cw_process_wakeups == 0) // No waiting wakeups, proceed to sleep
 		{
+			garbage_offline();
 			sleepms_on_cond(__func__, &cw_process_sleep_cond_mutex, &cw_process_sleep_cond, msec_wait);
+			garbage_online();
 		}
 		cw_process_wakeups = 0; // We've been woken up, reset the counter
 		if(exit_oscam)
 			{ break; }
 
-		next_check = 0;
 #ifdef CS_ANTICASC
 		ac_next = 0;
 #endif
@@ -280,87 +736,10 @@ static void *cw_process(void)
 		msec_wait = 0;
 
 		cs_ftime(&t_now);
-		cs_readlock(__func__, &ecmcache_lock);
-		for(er = ecmcwcache; er; er = er->next)
-		{
-
-			if((er->from_cacheex || er->from_csp) // ignore ecms from cacheex/csp
-				|| er->readers_timeout_check      // ignore already checked
-				|| !check_client(er->client))     // ignore ecm of killed clients
-			{
-				continue;
-			}
-
-			if(er->rc >= E_UNHANDLED)
-			{
-#ifdef CS_CACHEEX
-				// cacheex_wait_time
-				if(er->cacheex_wait_time && !er->cacheex_wait_time_expired)
-				{
-					tbc = er->tps;
-					time_to_check_cacheex_mode1_delay = 0;
-					time_to_check_cacheex_wait_time = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, er->cacheex_wait_time));
-
-					if(comp_timeb(&t_now, &tbc) >= 0)
-					{
-						add_job(er->client, ACTION_CACHEEX_TIMEOUT, (void *)er, 0);
-						time_to_check_cacheex_wait_time = 0;
-
-					}
-					else if(er->cacheex_mode1_delay && !er->stage && er->cacheex_reader_count>0)
-					{
-						// check for cacheex_mode1_delay
-						tbc = er->tps;
-						time_to_check_cacheex_mode1_delay = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, er->cacheex_mode1_delay));
-
-						if(comp_timeb(&t_now, &tbc) >= 0)
-						{
-							add_job(er->client, ACTION_CACHEEX1_DELAY, (void *)er, 0);
-							time_to_check_cacheex_mode1_delay = 0;
-						}
-					}
-
-					if(!next_check || (time_to_check_cacheex_wait_time > 0 && time_to_check_cacheex_wait_time < next_check))
-						{ next_check = time_to_check_cacheex_wait_time; }
-
-					if(!next_check || (time_to_check_cacheex_mode1_delay > 0 && time_to_check_cacheex_mode1_delay < next_check))
-						{ next_check = time_to_check_cacheex_mode1_delay; }
-				}
-#endif
-				if(er->stage < 4)
-				{
-					// fbtimeout
-					tbc = er->tps;
-					time_to_check_fbtimeout = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, get_fallbacktimeout(er->caid)));
-
-					if(comp_timeb(&t_now, &tbc) >= 0)
-					{
-						add_job(er->client, ACTION_FALLBACK_TIMEOUT, (void *)er, 0);
-						time_to_check_fbtimeout = 0;
-					}
-
-					if(!next_check || (time_to_check_fbtimeout > 0 && time_to_check_fbtimeout < next_check))
-						{ next_check = time_to_check_fbtimeout; }
-				}
-			}
-
-			// clienttimeout
-			if(!er->readers_timeout_check) // ecm stays in cache at least ctimeout+2seconds!
-			{
-				tbc = er->tps;
-				time_to_check_ctimeout = add_ms_to_timeb_diff(&tbc, lb_auto_timeout(er, cfg.ctimeout));
-
-				if(comp_timeb(&t_now, &tbc) >= 0)
-				{
-					add_job(er->client, ACTION_CLIENT_TIMEOUT, (void *)er, 0);
-					time_to_check_ctimeout = 0;
-				}
-
-				if(!next_check || (time_to_check_ctimeout > 0 && time_to_check_ctimeout < next_check))
-					{ next_check = time_to_check_ctimeout; }
-			}
-		}
-		cs_readunlock(__func__, &ecmcache_lock);
+		next_check = ecm_timers_run(&t_now);
+		scan_next = ecm_timers_scan(&t_now);
+		if(scan_next > 0 && (!next_check || scan_next < next_check))
+			{ next_check = scan_next; }
 #ifdef CS_ANTICASC
 		if(cfg.ac_enabled && (ac_next = comp_timeb(&ac_time, &t_now)) <= 10)
 		{
@@ -371,30 +750,34 @@ static void *cw_process(void)
 #endif
 		if((ecmc_next = comp_timeb(&ecmc_time, &t_now)) <= 10)
 		{
-			uint32_t count = 0;
-			struct ecm_request_t *ecm, *ecmt = NULL, *prv;
+			struct ecm_request_t *ecm, *ecmt = NULL;
+
+			ecm_maxcachetime = t_now.time - ((cfg.ctimeout + 500) / 1000 + 3); // to be sure no more access er!
 
 			cs_readlock(__func__, &ecmcache_lock);
-			for(ecm = ecmcwcache, prv = NULL; ecm; prv = ecm, ecm = ecm->next, count++)
+			ecm = ecmcwcache_oldest();
+			if(ecm && ecm->tps.time < ecm_maxcachetime && ecm_timers_done(ecm))
 			{
-				ecm_maxcachetime = t_now.time - ((cfg.ctimeout + 500) / 1000 + 3); // to be sure no more access er!
-
-				if(ecm->tps.time < ecm_maxcachetime)
+				cs_readunlock(__func__, &ecmcache_lock);
+				cs_writelock(__func__, &ecmcache_lock);
+				// list is in insertion order, so expired ecms are at its head;
+				// an ecm with timers still queued is kept until they have fired
+				while((ecm = ecmcwcache_oldest()) && ecm->tps.time < ecm_maxcachetime && ecm_timers_done(ecm))
 				{
-					cs_readunlock(__func__, &ecmcache_lock);
-					cs_writelock(__func__, &ecmcache_lock);
+					if(ecm->timers_unqueued)
+					{
+						SAFE_MUTEX_LOCK(&ecm_timer_lock);
+						ecm_timers_unqueued--;
+						SAFE_MUTEX_UNLOCK(&ecm_timer_lock);
+					}
+					ecmcwcache_remove(ecm);
+					ecm->next = ecmt;
 					ecmt = ecm;
-					if(prv)
-						{ prv->next = NULL; }
-					else
-						{ ecmcwcache = NULL; }
-					cs_writeunlock(__func__, &ecmcache_lock);
-					break;
 				}
+				cs_writeunlock(__func__, &ecmcache_lock);
 			}
-			if(!ecmt)
+			else
 				{ cs_readunlock(__func__, &ecmcache_lock); }
-			ecmcwcache_size = count;
 
 			while(ecmt)
 			{
@@ -404,6 +787,7 @@ static void *cw_process(void)
 			}
 
 #ifdef CS_CACHEEX
+			struct ecm_request_t *prv;
 			ecmt=NULL;
 			cs_readlock(__func__, &ecm_pushed_deleted_lock);
 			for(ecm = ecm_pushed_deleted, prv = NULL; ecm; prv = ecm, ecm = ecm->next)
@@ -579,9 +963,10 @@ static void remove_ecm_from_reader(ECM_REQUEST *ecm)
 	struct s_ecm_answer *ea = ecm->matching_rdr;
 	while(ea)
 	{
-		if((ea->status & REQUEST_SENT) && !(ea->status & REQUEST_ANSWERED))
+		// answered readers too: a timed out slot stays pending and a late answer
+		// would follow its parent into the pool once this ecm is recycled
+		if(ea->status & REQUEST_SENT)
 		{
-			// we found a outstanding reader, clean it:
 			struct s_reader *rdr = ea->reader;
 			if(rdr)
 			{
@@ -595,6 +980,7 @@ static void remove_ecm_from_reader(ECM_REQUEST *ecm)
 						{
 							if(ecmtask[i].parent == ecm)
 							{
+								ecmtask[i].parent = NULL;
 								ecmtask[i].client = NULL;
 								cacheex_set_csp_lastnode(&ecmtask[i]);
 							}
@@ -622,12 +1008,12 @@ void free_ecm(ECM_REQUEST *ecm)
 	{
 		nxt = ea->next;
 		cs_lock_destroy(__func__, &ea->ecmanswer_lock);
-		add_garbage(ea);
+		add_garbage_pool(ea, &ecm_answer_pool);
 		ea = nxt;
 	}
 	if(ecm->src_data)
 		{ add_garbage(ecm->src_data); }
-	add_garbage(ecm);
+	add_garbage_pool(ecm, &ecm_pool);
 }
 
 
@@ -637,7 +1023,7 @@ void free_push_in_ecm(ECM_REQUEST *ecm)
 	gbox_free_cards_pending(ecm);
 	if(ecm->src_data)
 		{ NULLFREE(ecm->src_data); }
-	NULLFREE(ecm);
+	pool_free(&ecm_pool, ecm);
 }
 
 ECM_REQUEST *get_ecmtask(void)
@@ -646,7 +1032,7 @@ ECM_REQUEST *get_ecmtask(void)
 	struct s_client *cl = cur_client();
 	if(!cl)
 		{ return NULL; }
-	if(!cs_malloc(&er, sizeof(ECM_REQUEST)))
+	if(!(er = pool_alloc(&ecm_pool)))
 		{ return NULL; }
 	cs_ftime(&er->tps);
 	er->rc = E_UNHANDLED;
@@ -664,7 +1050,7 @@ void cleanup_ecmtasks(struct s_client *cl)
 
 	// remove this clients ecm from queue. because of cache, just null the client:
 	cs_readlock(__func__, &ecmcache_lock);
-	for(ecm = ecmcwcache; ecm && cl; ecm = ecm->next)
+	for(ecm = ecmcwcache_oldest(); ecm; ecm = ecmcwcache_newer(ecm))
 	{
 		if(ecm->client == cl)
 		{
@@ -791,7 +1177,10 @@ void distribute_ea(struct s_ecm_answer *ea)
 int32_t send_dcw(struct s_client *client, ECM_REQUEST *er)
 {
 	if(!check_client(client) || client->typ != 'c')
-		{ return 0; }
+	{
+		ecm_inflight_release(er);
+		return 0;
+	}
 
 	cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [send_dcw] rc %d from reader %s", (check_client(er->client) ? er->client->account->usr : "-"), er->caid, er->prid, er->srvid, er->rc, er->selected_reader ? er->selected_reader->label : "-");
 
@@ -1254,6 +1643,8 @@ int32_t send_dcw(struct s_client *client, ECM_REQUEST *er)
 		}
 	}
 
+	ecm_inflight_release(er);
+
 	ac_chk(client, er, 1);
 	int32_t is_fake = 0;
 	if(er->rc == E_FAKE)
@@ -1262,7 +1653,10 @@ int32_t send_dcw(struct s_client *client, ECM_REQUEST *er)
 		er->rc = E_FOUND;
 	}
 
+	int64_t lat_send = ecm_latency_now();
 	get_module(client)->send_dcw(client, er);
+	ecm_latency_add(NULL, er->caid, LAT_SEND, lat_send);
+	ecm_latency_add(NULL, er->caid, LAT_TOTAL, er->lat_start);
 
 	add_cascade_data(client, er);
 
@@ -1346,6 +1740,13 @@ void request_cw_from_readers(ECM_REQUEST *er, uint8_t stop_stage)
 		if(er->stage == 2 && !er->preferlocalcards)
 			{ er->stage++; }
 
+		// cacheex readers had their chance, the time up to now is the cacheex wait
+		if(er->stage >= 2 && er->lat_cached)
+		{
+			ecm_latency_add(NULL, er->caid, LAT_WAIT, er->lat_cached);
+			er->lat_cached = 0;
+		}
+
 		for(ea = er->matching_rdr; ea; ea = ea->next)
 		{
 			switch(er->stage)
@@ -1397,6 +1798,7 @@ void request_cw_from_readers(ECM_REQUEST *er, uint8_t stop_stage)
 #endif
 			ea->status |= REQUEST_SENT;
 			cs_ftime(&ea->time_request_sent);
+			ea->lat_sent = ecm_latency_now();
 
 			er->reader_requested++;
 
@@ -1804,6 +2206,9 @@ int32_t write_ecm_answer(struct s_reader *reader, ECM_REQUEST *er, int8_t rc, ui
 		return 0;
 	}
 
+	if(ea->lat_picked && rc <= E_NOTFOUND) // answers only, no timeouts
+		{ ecm_latency_add(reader, er->caid, LAT_READER, ea->lat_picked); }
+
 	// Special checks for rc
 	// Skip check for BISS1 - cw could be zero but still catch cw=0 by anticascading
 	// Skip check for BISS2 - we use the extended cw, so the "simple" cw is always zero
@@ -2252,6 +2657,23 @@ void write_ecm_answer_fromcache(struct s_write_from_cache *wfc)
 		er->localgenerated = 1;
 #endif
 
+	// result of the in flight ecm er was attached to, see ecm_inflight_release()
+	if(ecm->rc == E_CACHE2 || ecm->rc >= E_NOTFOUND)
+	{
+		if(er->rc < E_99) // already answered, e.g. from cache or by its timeout
+			{ return; }
+
+		er->rc = ecm->rc;
+		er->rcEx = ecm->rcEx;
+		memcpy(er->cw, ecm->cw, sizeof(er->cw));
+		er->cw_ex = ecm->cw_ex;
+		cs_strncpy(er->msglog, ecm->msglog, sizeof(er->msglog));
+		er->selected_reader = ecm->selected_reader;
+		er->cw_count = ecm->cw_count;
+		send_dcw(er->client, er);
+		return;
+	}
+
 	int8_t rc_orig = er->rc;
 
 	er->grp |= ecm->grp; // update group
@@ -2400,6 +2822,8 @@ static bool ecm_cache_check(ECM_REQUEST *er)
 
 void get_cw(struct s_client *client, ECM_REQUEST *er)
 {
+	er->lat_start = ecm_latency_now();
+	ecm_trace_write(client, er);
 #ifdef CS_CACHEEX_AIO
 	cacheex_update_hash(er);
 	if(!ecm_cache_check(er))
@@ -2770,7 +3194,10 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 
 	//******** CHECK IF FOUND ECM IN CACHE
 	struct ecm_request_t *ecm = NULL;
+	er->lat_cached = ecm_latency_now();
 	ecm = check_cache(er, client);
+	ecm_latency_add(NULL, er->caid, LAT_CACHE, er->lat_cached);
+	er->lat_cached = ecm_latency_now();
 	if(ecm) // found in cache
 	{
 		cs_log_dbg(D_LB,"{client %s, caid %04X, prid %06X, srvid %04X} [get_cw] cw found immediately in cache! ", (check_client(er->client)?er->client->account->usr:"-"),er->caid, er->prid, er->srvid);
@@ -2808,14 +3235,23 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 
 	struct s_ecm_answer *ea, *prv = NULL;
 	struct s_reader *rdr;
+	uint64_t match_mask[MATCH_MASK_WORDS];
+	int8_t use_mask;
 
 	cs_readlock(__func__, &readerlist_lock);
 	cs_readlock(__func__, &clientlist_lock);
 
-	for(rdr = first_active_reader; rdr; rdr = rdr->next)
+	use_mask = matching_reader_mask(er, match_mask);
+
+	for(i = 0, rdr = first_active_reader; rdr; rdr = rdr->next, i++)
 	{
 		uint8_t is_fallback = chk_is_fixed_fallback(rdr, er);
-		int8_t match = matching_reader(er, rdr);
+		int8_t match;
+
+		if(use_mask)
+			{ match = MATCH_MASK_ISSET(match_mask, i) && matching_reader_state(er, rdr); }
+		else
+			{ match = matching_reader(er, rdr); }
 
 		if(!match) // if this reader does not match, check betatunnel for it
 			match = lb_check_auto_betatunnel(er, rdr);
@@ -2829,7 +3265,7 @@ void get_cw(struct s_client *client, ECM_REQUEST *er)
 				{ continue; }
 #endif
 
-			if(!cs_malloc(&ea, sizeof(struct s_ecm_answer)))
+			if(!(ea = pool_alloc(&ecm_answer_pool)))
 				{ goto OUT; }
 
 #ifdef WITH_EXTENDED_CW
@@ -2934,11 +3370,16 @@ OUT:
 	}
 
 	//insert it in ecmcwcache!
-	cs_writelock(__func__, &ecmcache_lock);
-	er->next = ecmcwcache;
-	ecmcwcache = er;
-	ecmcwcache_size++;
-	cs_writeunlock(__func__, &ecmcache_lock);
+	if(ecmcwcache_add(er))
+	{
+		// identical ecm in flight: no reader requests, just the client timeout as safety net
+		cs_log_dbg(D_LB, "{client %s, caid %04X, prid %06X, srvid %04X} [get_cw] same ecm in flight, waiting for its answer",
+					(check_client(er->client) ? er->client->account->usr : "-"), er->caid, er->prid, er->srvid);
+		er->rcEx = 0;
+		ecm_timers_register(er, ECM_TIMERS_CLIENT);
+		cw_process_thread_wakeup();
+		return;
+	}
 
 	er->rcEx = 0;
 #ifdef CS_CACHEEX
@@ -2972,6 +3413,7 @@ OUT:
 	}
 #endif
 
+	ecm_timers_register(er, ECM_TIMERS_ALL);
 	cw_process_thread_wakeup();
 }
 
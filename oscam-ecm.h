@@ -1,6 +1,35 @@
 #ifndef OSCAM_ECM_H_
 #define OSCAM_ECM_H_
 
+extern struct s_pool ecm_pool;
+extern struct s_pool ecm_answer_pool;
+
+void init_ecmcwcache(void);
+ECM_REQUEST *ecmcwcache_find(uint16_t caid, const uint8_t *ecmd5);
+ECM_REQUEST *ecmcwcache_find_next(ECM_REQUEST *ecm);
+ECM_REQUEST *ecmcwcache_oldest(void);
+ECM_REQUEST *ecmcwcache_newer(ECM_REQUEST *ecm);
+ECM_REQUEST *ecmcwcache_newest(void);
+ECM_REQUEST *ecmcwcache_older(ECM_REQUEST *ecm);
+
+// deadlines of ecms, kept in a binary min-heap by cw_process()
+struct ecm_timer
+{
+	struct timeb	expire;
+	ECM_REQUEST		*er;
+	int32_t			action;			// enum actions
+};
+
+struct ecm_timer_heap
+{
+	struct ecm_timer	*timers;
+	uint32_t			count, size;
+};
+
+int32_t ecm_timer_reserve(struct ecm_timer_heap *h, uint32_t n);
+void ecm_timer_push(struct ecm_timer_heap *h, const struct ecm_timer *t);
+void ecm_timer_pop(struct ecm_timer_heap *h, struct ecm_timer *t);
+
 void cw_process_thread_start(void);
 void cw_process_thread_wakeup(void);
 
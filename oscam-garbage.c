@@ -3,98 +3,482 @@
 #include "globals.h"
 #include "oscam-garbage.h"
 #include "oscam-lock.h"
+#include "oscam-pool.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
+#include "oscam-work.h"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/* Deferred frees.
+
+   Pooled objects (ECM requests and answers) are reclaimed by quiescent
+   states: every thread started with start_thread() is registered and says
+   between two units of work that it holds no reference any more (a job
+   boundary, the top of its main loop) or that it is blocked (offline).
+   The collector advances a global epoch, a batch of garbage handed over in
+   epoch E is freed once every online thread has announced a later epoch and
+   no job queued in epoch E or earlier is still waiting, because a job may
+   carry a pointer to an ECM or answer.
 
-#define HASH_BUCKETS 250
+   Everything else (clients, readers, accounts, list nodes) is still kept
+   for 2 * ctimeout + 6 seconds. Code holds such pointers across jobs, eg.
+   er->client, so a quiescent state says nothing about them. The same
+   deadline also frees pooled objects if a thread never gets quiescent. */
+
+#define GARBAGE_BATCH 64
+#define GARBAGE_TYPES (int32_t)(sizeof(garbage_stat.type) / sizeof(garbage_stat.type[0])) // heap blocks and pools
 
 struct cs_garbage
 {
-	time_t time;
 	void *data;
+	struct s_pool *pool; // data goes back to this pool instead of free() if set
 #ifdef WITH_DEBUG
 	char *file;
 	uint32_t line;
 #endif
-	struct cs_garbage *next;
 };
 
-static int32_t counter = 0;
-static pthread_mutex_t add_lock;
-static struct cs_garbage *garbage_first[HASH_BUCKETS];
-static CS_MUTEX_LOCK garbage_lock[HASH_BUCKETS];
+struct cs_garbage_batch
+{
+	uint32_t epoch; // epoch the batch was handed to the collector in
+	time_t time;
+	int32_t count;
+	struct cs_garbage item[GARBAGE_BATCH];
+	struct cs_garbage_batch *next;
+};
+
+struct s_garbage_list
+{
+	struct cs_garbage_batch *first;
+	struct cs_garbage_batch *last;
+	struct cs_garbage_batch *shared; // filled by threads which are not registered
+};
+
+struct s_garbage_thread
+{
+	pthread_mutex_t lock; // makes the announcement visible to the collector
+	uint32_t epoch; // epoch seen in the last quiescent state
+	int8_t online;
+	struct cs_garbage_batch *batch; // pooled objects not yet handed over
+	struct s_garbage_thread *next;
+};
+
+static pthread_mutex_t garbage_lock = PTHREAD_MUTEX_INITIALIZER; // lists, threads and stats
+static struct s_garbage_list garbage_pooled, garbage_heap;
+static struct s_garbage_thread *garbage_threads;
+static struct s_garbage_stats garbage_stat;
+static struct s_pool *garbage_pool[sizeof(garbage_stat.type) / sizeof(garbage_stat.type[0])]; // [0] is unused, heap blocks
+static uint32_t global_epoch = 1;
+static pthread_key_t garbage_key;
+static pthread_once_t garbage_key_once = PTHREAD_ONCE_INIT;
 static pthread_t garbage_thread;
 static int32_t garbage_collector_active;
 static int32_t garbage_debug;
 
+static void garbage_free(void *data, struct s_pool *pool)
+{
+	if(pool)
+		{ pool_free(pool, data); }
+	else
+		{ free(data); }
+}
+
+// call with garbage_lock held
+static int32_t garbage_type(struct s_pool *pool)
+{
+	int32_t i;
+
+	if(!pool)
+		{ return 0; }
+	for(i = 1; i < GARBAGE_TYPES; i++)
+	{
+		if(!garbage_pool[i])
+		{
+			garbage_pool[i] = pool;
+			garbage_stat.type[i].name = pool->name;
+			garbage_stat.ntypes = i + 1;
+		}
+		if(garbage_pool[i] == pool)
+			{ return i; }
+	}
+	return 0;
+}
+
+static size_t garbage_size(void *data, struct s_pool *pool)
+{
+	if(pool)
+		{ return pool->size; }
+#ifdef __GLIBC__
+	return malloc_usable_size(data);
+#else
+	(void)data;
+	return 0;
+#endif
+}
+
+// call with garbage_lock held
+static void garbage_account(struct cs_garbage_batch *batch, int32_t sign)
+{
+	int32_t i, type;
+
+	for(i = 0; i < batch->count; i++)
+	{
+		type = garbage_type(batch->item[i].pool);
+		garbage_stat.type[type].count += sign;
+		garbage_stat.type[type].bytes += sign * (int64_t)garbage_size(batch->item[i].data, batch->item[i].pool);
+	}
+}
+
+// call with garbage_lock held
+static void garbage_hand_over(struct s_garbage_list *list, struct cs_garbage_batch *batch)
+{
+	batch->epoch = global_epoch;
+	batch->time = time(NULL);
+	batch->next = NULL;
+	if(list->last)
+		{ list->last->next = batch; }
+	else
+		{ list->first = batch; }
+	list->last = batch;
+	garbage_account(batch, 1);
+}
+
+static void garbage_batch_free(struct cs_garbage_batch *batch)
+{
+	struct cs_garbage_batch *next;
+	int32_t i;
+
+	for(; batch; batch = next)
+	{
+		next = batch->next;
+		for(i = 0; i < batch->count; i++)
+			{ garbage_free(batch->item[i].data, batch->item[i].pool); }
+		free(batch);
+	}
+}
+
 #ifdef WITH_DEBUG
-void add_garbage_debug(void *data, char *file, uint32_t line)
+// call with garbage_lock held
+static struct cs_garbage *garbage_find(struct cs_garbage_batch *batch, void *data)
+{
+	int32_t i;
+
+	for(; batch; batch = batch->next)
+	{
+		for(i = 0; i < batch->count; i++)
+		{
+			if(batch->item[i].data == data)
+				{ return &batch->item[i]; }
+		}
+	}
+	return NULL;
+}
+
+// call with garbage_lock held
+static int8_t garbage_added_twice(void *data, char *file, uint32_t line)
+{
+	struct s_garbage_list *lists[] = { &garbage_pooled, &garbage_heap };
+	struct s_garbage_thread *t;
+	struct cs_garbage *found = NULL;
+	uint32_t i;
+
+	for(i = 0; !found && i < sizeof(lists) / sizeof(lists[0]); i++)
+	{
+		if(!(found = garbage_find(lists[i]->first, data)))
+			{ found = garbage_find(lists[i]->shared, data); }
+	}
+	for(t = garbage_threads; !found && t; t = t->next)
+		{ found = garbage_find(t->batch, data); }
+	if(!found)
+		{ return 0; }
+
+	cs_log("Found a try to add garbage twice. Not adding the element to garbage list...");
+	cs_log("Current garbage addition: %s, line %d.", file, line);
+	cs_log("Original garbage addition: %s, line %d.", found->file, found->line);
+	return 1;
+}
+#endif
+
+static void garbage_thread_unregister(void *ptr)
+{
+	struct s_garbage_thread *t = ptr, **prev;
+
+	SAFE_MUTEX_LOCK(&garbage_lock);
+	for(prev = &garbage_threads; *prev; prev = &(*prev)->next)
+	{
+		if(*prev == t)
+		{
+			*prev = t->next;
+			break;
+		}
+	}
+	if(t->batch)
+		{ garbage_hand_over(&garbage_pooled, t->batch); }
+	SAFE_MUTEX_UNLOCK(&garbage_lock);
+
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+static void garbage_key_init(void)
+{
+	if(pthread_key_create(&garbage_key, garbage_thread_unregister))
+	{
+		fprintf(stderr, "Could not create garbage key, exiting...");
+		exit(1);
+	}
+}
+
+/* Called by start_thread() for every new thread. The thread is online until
+   it exits, see garbage_offline(). */
+void garbage_thread_register(void)
+{
+	struct s_garbage_thread *t;
+
+	pthread_once(&garbage_key_once, garbage_key_init);
+	if(!(t = calloc(1, sizeof(struct s_garbage_thread))))
+		{ return; }
+	SAFE_MUTEX_INIT(&t->lock, NULL);
+	t->online = 1;
+
+	SAFE_MUTEX_LOCK(&garbage_lock);
+	t->epoch = global_epoch;
+	t->next = garbage_threads;
+	garbage_threads = t;
+	SAFE_MUTEX_UNLOCK(&garbage_lock);
+
+	SAFE_SETSPECIFIC(garbage_key, t);
+}
+
+static struct s_garbage_thread *garbage_thread_self(void)
+{
+	pthread_once(&garbage_key_once, garbage_key_init);
+	return pthread_getspecific(garbage_key);
+}
+
+static void garbage_flush(struct s_garbage_thread *t)
+{
+	if(!t->batch)
+		{ return; }
+	SAFE_MUTEX_LOCK(&garbage_lock);
+	garbage_hand_over(&garbage_pooled, t->batch);
+	SAFE_MUTEX_UNLOCK(&garbage_lock);
+	t->batch = NULL;
+}
+
+/* Epoch a job queued now is stamped with: the last one the calling thread
+   announced, because the job may carry any pointer the thread holds. Threads
+   which are not registered could hold anything. */
+uint32_t garbage_epoch(void)
+{
+	struct s_garbage_thread *t = garbage_thread_self();
+	uint32_t epoch;
+
+	if(!t)
+		{ return 0; }
+	SAFE_MUTEX_LOCK(&t->lock);
+	epoch = t->epoch;
+	SAFE_MUTEX_UNLOCK(&t->lock);
+	return epoch;
+}
+
+/* The calling thread took over pointers which are safe since epoch, eg. by
+   taking a queued job. */
+void garbage_hold(uint32_t epoch)
+{
+	struct s_garbage_thread *t = garbage_thread_self();
+
+	if(!t)
+		{ return; }
+	SAFE_MUTEX_LOCK(&t->lock);
+	if(epoch < t->epoch)
+		{ t->epoch = epoch; }
+	SAFE_MUTEX_UNLOCK(&t->lock);
+}
+
+/* The calling thread holds no pointer to garbage retired before this call. */
+void garbage_quiescent(void)
+{
+	struct s_garbage_thread *t = garbage_thread_self();
+
+	if(!t)
+		{ return; }
+	garbage_flush(t);
+	SAFE_MUTEX_LOCK(&t->lock);
+	t->epoch = global_epoch;
+	t->online = 1;
+	SAFE_MUTEX_UNLOCK(&t->lock);
+}
+
+/* The calling thread blocks and touches no shared data until garbage_online(). */
+void garbage_offline(void)
+{
+	struct s_garbage_thread *t = garbage_thread_self();
+
+	if(!t)
+		{ return; }
+	garbage_flush(t);
+	SAFE_MUTEX_LOCK(&t->lock);
+	t->online = 0;
+	SAFE_MUTEX_UNLOCK(&t->lock);
+}
+
+void garbage_online(void)
+{
+	struct s_garbage_thread *t = garbage_thread_self();
+
+	if(!t)
+		{ return; }
+	SAFE_MUTEX_LOCK(&t->lock);
+	t->epoch = global_epoch;
+	t->online = 1;
+	SAFE_MUTEX_UNLOCK(&t->lock);
+}
+
+#ifdef WITH_DEBUG
+void add_garbage_debug(void *data, struct s_pool *pool, char *file, uint32_t line)
 {
 #else
 void add_garbage(void *data)
+{
+	add_garbage_pool(data, NULL);
+}
+
+void add_garbage_pool(void *data, struct s_pool *pool)
 {
 #endif
+	struct s_garbage_thread *t = NULL;
+	struct cs_garbage_batch **batch;
+	struct s_garbage_list *list = pool ? &garbage_pooled : &garbage_heap;
+	struct cs_garbage *item;
+
 	if(!data)
 		{ return; }
 
 	if(!garbage_collector_active || garbage_debug == 1)
 	{
-		NULLFREE(data);
+		garbage_free(data, pool);
 		return;
 	}
 
-	SAFE_MUTEX_LOCK(&add_lock);
-
-	int32_t bucket = counter++;
-
-	if(counter >= HASH_BUCKETS)
+	// pooled objects of registered threads are collected without a lock
+	if(pool && (t = garbage_thread_self()))
+		{ batch = &t->batch; }
+	else
 	{
-		counter = 0;
+		SAFE_MUTEX_LOCK(&garbage_lock);
+		batch = &list->shared;
 	}
 
-	SAFE_MUTEX_UNLOCK(&add_lock);
+#ifdef WITH_DEBUG
+	if(garbage_debug == 2)
+	{
+		if(t)
+			{ SAFE_MUTEX_LOCK(&garbage_lock); }
+		int8_t twice = garbage_added_twice(data, file, line);
+		if(t)
+			{ SAFE_MUTEX_UNLOCK(&garbage_lock); }
+		if(twice)
+		{
+			if(!t)
+				{ SAFE_MUTEX_UNLOCK(&garbage_lock); }
+			return;
+		}
+	}
+#endif
 
-	struct cs_garbage *garbage = (struct cs_garbage*)malloc(sizeof(struct cs_garbage));
-	if(garbage == NULL)
+	if(!*batch && !(*batch = calloc(1, sizeof(struct cs_garbage_batch))))
 	{
+		if(!t)
+			{ SAFE_MUTEX_UNLOCK(&garbage_lock); }
 		cs_log("*** MEMORY FULL -> FREEING DIRECT MAY LEAD TO INSTABILITY!!! ***");
-		NULLFREE(data);
+		garbage_free(data, pool);
 		return;
 	}
-	garbage->time = time(NULL);
-	garbage->data = data;
-	garbage->next = NULL;
+
+	item = &(*batch)->item[(*batch)->count++];
+	item->data = data;
+	item->pool = pool;
 #ifdef WITH_DEBUG
-	garbage->file = file;
-	garbage->line = line;
+	item->file = file;
+	item->line = line;
 #endif
 
-	cs_writelock(__func__, &garbage_lock[bucket]);
+	if((*batch)->count < GARBAGE_BATCH)
+	{
+		if(!t)
+			{ SAFE_MUTEX_UNLOCK(&garbage_lock); }
+		return;
+	}
+
+	if(t)
+		{ SAFE_MUTEX_LOCK(&garbage_lock); }
+	garbage_hand_over(list, *batch);
+	*batch = NULL;
+	SAFE_MUTEX_UNLOCK(&garbage_lock);
+}
 
-#ifdef WITH_DEBUG
-	if(garbage_debug == 2)
+// call with garbage_lock held, detaches the batches at the head of list which may be freed
+static struct cs_garbage_batch *garbage_take(struct s_garbage_list *list, uint32_t safe_epoch, time_t deltime, uint32_t *freed_quiescent, uint32_t *freed_deadline)
+{
+	struct cs_garbage_batch *first = list->first, *batch;
+
+	for(batch = first; batch; batch = batch->next)
 	{
-		struct cs_garbage *garbagecheck = garbage_first[bucket];
-		while(garbagecheck)
-		{
-			if(garbagecheck->data == data)
-			{
-				cs_log("Found a try to add garbage twice. Not adding the element to garbage list...");
-				cs_log("Current garbage addition: %s, line %d.", file, line);
-				cs_log("Original garbage addition: %s, line %d.", garbagecheck->file, garbagecheck->line);
-				cs_writeunlock(__func__, &garbage_lock[bucket]);
-				NULLFREE(garbage);
-				return;
-			}
-			garbagecheck = garbagecheck->next;
-		}
+		if(list == &garbage_pooled && batch->epoch < safe_epoch)
+			{ *freed_quiescent += batch->count; }
+		else if(batch->time < deltime)
+			{ *freed_deadline += batch->count; }
+		else
+			{ break; } // the list is in hand over order, all following batches are newer
+		garbage_account(batch, -1);
+		list->first = batch->next;
 	}
-#endif
+	if(!list->first)
+		{ list->last = NULL; }
+	if(list->first == first)
+		{ return NULL; }
+
+	for(batch = first; batch->next != list->first; batch = batch->next) { ; }
+	batch->next = NULL;
+	return first;
+}
 
-	garbage->next = garbage_first[bucket];
-	garbage_first[bucket] = garbage;
+/* Lowest epoch which a thread or a queued job may still hold garbage of. The
+   queues are checked first: a job taken in between has been passed on to
+   its thread by garbage_hold() before it left the queue. */
+static uint32_t garbage_safe_epoch(void)
+{
+	struct s_garbage_thread *t;
+	struct s_client *cl;
+	uint32_t safe = global_epoch, epoch;
 
-	cs_writeunlock(__func__, &garbage_lock[bucket]);
+	cs_readlock(__func__, &clientlist_lock);
+	for(cl = first_client; cl; cl = cl->next)
+	{
+		if(job_queue_epoch(cl, &epoch) && epoch < safe)
+			{ safe = epoch; }
+	}
+	cs_readunlock(__func__, &clientlist_lock);
+
+	SAFE_MUTEX_LOCK(&garbage_lock);
+	garbage_stat.threads = garbage_stat.online = 0;
+	for(t = garbage_threads; t; t = t->next)
+	{
+		SAFE_MUTEX_LOCK(&t->lock);
+		if(t->online)
+		{
+			if(t->epoch < safe)
+				{ safe = t->epoch; }
+			garbage_stat.online++;
+		}
+		SAFE_MUTEX_UNLOCK(&t->lock);
+		garbage_stat.threads++;
+	}
+	SAFE_MUTEX_UNLOCK(&garbage_lock);
+	return safe;
 }
 
 static pthread_cond_t sleep_cond;
@@ -102,8 +486,8 @@ static pthread_mutex_t sleep_cond_mutex;
 
 static void garbage_collector(void)
 {
-	int32_t i,j;
-	struct cs_garbage *garbage, *next, *prev, *first;
+	struct cs_garbage_batch *pooled, *heap;
+	uint32_t safe_epoch, freed_quiescent, freed_deadline;
 	set_thread_name(__func__);
 	int32_t timeout_time = 2 * cfg.ctimeout / 1000 + 6;
 
@@ -111,63 +495,52 @@ static void garbage_collector(void)
 	{
 		time_t deltime = time(NULL) - timeout_time;
 
-		for(i = 0; i < HASH_BUCKETS; ++i)
-		{
-			j = 0;
-			cs_writelock(__func__, &garbage_lock[i]);
-			first = garbage_first[i];
-
-			for(garbage = first, prev = NULL; garbage; prev = garbage, garbage = garbage->next, j++)
-			{
-				if(j == 2)
- 				{
-					j++;
-					cs_writeunlock(__func__, &garbage_lock[i]);
-				}
-
-				if(garbage->time < deltime) // all following elements are too new
-				{
-					if(prev)
-					{
-						prev->next = NULL;
-					}
-					else
-					{
-						garbage_first[i] = NULL;
-					}
-					break;
-				}
-			}
-
-			cs_writeunlock(__func__, &garbage_lock[i]);
-
-			// list has been taken out before so we don't need a lock here anymore!
-			while(garbage)
-			{
-				next = garbage->next;
-				free(garbage->data);
-				free(garbage);
-				garbage = next;
-			}
-		}
-		sleepms_on_cond(__func__, &sleep_cond_mutex, &sleep_cond, 500);
+		SAFE_MUTEX_LOCK(&garbage_lock);
+		if(garbage_pooled.shared)
+			{ garbage_hand_over(&garbage_pooled, garbage_pooled.shared); }
+		if(garbage_heap.shared)
+			{ garbage_hand_over(&garbage_heap, garbage_heap.shared); }
+		garbage_pooled.shared = garbage_heap.shared = NULL;
+		global_epoch++;
+		SAFE_MUTEX_UNLOCK(&garbage_lock);
+
+		garbage_quiescent();
+		safe_epoch = garbage_safe_epoch();
+
+		freed_quiescent = freed_deadline = 0;
+		SAFE_MUTEX_LOCK(&garbage_lock);
+		pooled = garbage_take(&garbage_pooled, safe_epoch, deltime, &freed_quiescent, &freed_deadline);
+		heap = garbage_take(&garbage_heap, safe_epoch, deltime, &freed_quiescent, &freed_deadline);
+		garbage_stat.epoch = global_epoch;
+		garbage_stat.freed_quiescent += freed_quiescent;
+		garbage_stat.freed_deadline += freed_deadline;
+		SAFE_MUTEX_UNLOCK(&garbage_lock);
+
+		// the batches have been taken out before so we don't need a lock here anymore!
+		garbage_batch_free(pooled);
+		garbage_batch_free(heap);
+
+		garbage_offline();
+		sleepms_on_cond(__func__, &sleep_cond_mutex, &sleep_cond, 200);
+		garbage_online();
 	}
 	pthread_exit(NULL);
 }
 
+void garbage_stats(struct s_garbage_stats *stats)
+{
+	SAFE_MUTEX_LOCK(&garbage_lock);
+	*stats = garbage_stat;
+	SAFE_MUTEX_UNLOCK(&garbage_lock);
+	stats->type[0].name = "heap";
+	if(!stats->ntypes)
+		{ stats->ntypes = 1; }
+}
+
 void start_garbage_collector(int32_t debug)
 {
 	garbage_debug = debug;
-	int32_t i;
-
-	SAFE_MUTEX_INIT(&add_lock, NULL);
 
-	for(i = 0; i < HASH_BUCKETS; ++i)
-	{
-		cs_lock_create(__func__, &garbage_lock[i], "garbage_lock", 9000);
-
-		garbage_first[i] = NULL;
-	}
 	cs_pthread_cond_init(__func__, &sleep_cond_mutex, &sleep_cond);
 
 	garbage_collector_active = 1;
@@ -183,7 +556,9 @@ void stop_garbage_collector(void)
 {
 	if(garbage_collector_active)
 	{
-		int32_t i;
+		struct s_garbage_list *lists[] = { &garbage_pooled, &garbage_heap };
+		struct s_garbage_thread *t;
+		uint32_t i;
 
 		garbage_collector_active = 0;
 		SAFE_COND_SIGNAL(&sleep_cond);
@@ -191,27 +566,21 @@ void stop_garbage_collector(void)
 		SAFE_COND_SIGNAL(&sleep_cond);
 		SAFE_THREAD_JOIN(garbage_thread, NULL);
 
-		for(i = 0; i < HASH_BUCKETS; ++i)
-			{ cs_writelock(__func__, &garbage_lock[i]); }
-
-		for(i = 0; i < HASH_BUCKETS; ++i)
+		SAFE_MUTEX_LOCK(&garbage_lock);
+		for(i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
 		{
-			while(garbage_first[i])
-			{
-				struct cs_garbage *next = garbage_first[i]->next;
-				NULLFREE(garbage_first[i]->data);
-				NULLFREE(garbage_first[i]);
-				garbage_first[i] = next;
-			}
+			garbage_batch_free(lists[i]->first);
+			garbage_batch_free(lists[i]->shared);
+			lists[i]->first = lists[i]->last = lists[i]->shared = NULL;
 		}
-
-		for(i = 0; i < HASH_BUCKETS; ++i)
+		for(t = garbage_threads; t; t = t->next)
 		{
-			cs_writeunlock(__func__, &garbage_lock[i]);
-			cs_lock_destroy(__func__, &garbage_lock[i]);
+			garbage_batch_free(t->batch);
+			t->batch = NULL;
 		}
+		memset(garbage_stat.type, 0, sizeof(garbage_stat.type));
+		SAFE_MUTEX_UNLOCK(&garbage_lock);
 
-		pthread_mutex_destroy(&add_lock);
 		pthread_cond_destroy(&sleep_cond);
 		pthread_mutex_destroy(&sleep_cond_mutex);
 	}
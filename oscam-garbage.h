@@ -1,12 +1,40 @@
 #ifndef OSCAM_GARBAGE_H_
 #define OSCAM_GARBAGE_H_
 
+struct s_pool;
+
 #ifdef WITH_DEBUG
-extern void add_garbage_debug(void *data, char *file, uint32_t line);
-#define add_garbage(x) add_garbage_debug(x, __FILE__, __LINE__)
+extern void add_garbage_debug(void *data, struct s_pool *pool, char *file, uint32_t line);
+#define add_garbage(x) add_garbage_debug(x, NULL, __FILE__, __LINE__)
+#define add_garbage_pool(x, p) add_garbage_debug(x, p, __FILE__, __LINE__)
 #else
 extern void add_garbage(void *data);
+extern void add_garbage_pool(void *data, struct s_pool *pool);
 #endif
+
+struct s_garbage_stats
+{
+	uint32_t epoch;
+	int32_t threads;			// registered threads
+	int32_t online;				// of those not blocked in garbage_offline()
+	uint64_t freed_quiescent;	// pooled objects freed after a grace period
+	uint64_t freed_deadline;	// objects freed after 2 * clienttimeout + 6 seconds
+	int32_t ntypes;
+	struct
+	{
+		const char *name;		// "heap" or the pool name
+		int32_t count;			// objects waiting to be freed
+		int64_t bytes;
+	} type[4];
+};
+
+extern void garbage_thread_register(void);
+extern void garbage_quiescent(void);
+extern void garbage_offline(void);
+extern void garbage_online(void);
+extern uint32_t garbage_epoch(void);
+extern void garbage_hold(uint32_t epoch);
+extern void garbage_stats(struct s_garbage_stats *stats);
 extern void start_garbage_collector(int32_t);
 extern void stop_garbage_collector(void);
 
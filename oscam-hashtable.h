@@ -1,4 +1,5 @@
 #include "tommyDS_hashlin/tommytypes.h"
+#include "tommyDS_hashlin/tommyhash.h"
 #include "tommyDS_hashlin/tommyhashlin.h"
 #include "tommyDS_hashlin/tommylist.h"
 
@@ -0,0 +1,204 @@
+#define MODULE_LOG_PREFIX "latency"
+
+#include "globals.h"
+#include "oscam-latency.h"
+#include "oscam-lock.h"
+#include "oscam-string.h"
+
+static struct s_latency_tab latency_global;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *latency_stage_txt[LAT_STAGES] = { "cache", "wait", "queue", "reader", "send", "total" };
+
+int64_t ecm_latency_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint32_t latency_bucket(uint32_t value)
+{
+	uint32_t msb = 0;
+
+	if(value < LAT_LINEAR)
+		{ return value; }
+	while(value >> (msb + 1))
+		{ msb++; }
+	return LAT_LINEAR + (msb - LAT_SUB_BITS - 1) * (1 << LAT_SUB_BITS) + ((value >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+// highest value falling into the bucket
+static uint32_t latency_bucket_value(uint32_t bucket)
+{
+	uint32_t shift, sub;
+
+	if(bucket < LAT_LINEAR)
+		{ return bucket; }
+	shift = (bucket - LAT_LINEAR) >> LAT_SUB_BITS;
+	sub = (bucket - LAT_LINEAR) & ((1 << LAT_SUB_BITS) - 1);
+	return MIN((((uint64_t)(1 << LAT_SUB_BITS) + sub + 1) << (shift + 1)) - 1, UINT32_MAX);
+}
+
+static struct s_latency_entry *latency_get_entry(struct s_latency_tab *tab, uint16_t caid)
+{
+	struct s_latency_entry *entry;
+	uint32_t i, n;
+
+	for(n = 0, i = caid % LAT_MAX_CAIDS; n < LAT_MAX_CAIDS; n++, i = (i + 1) % LAT_MAX_CAIDS)
+	{
+		entry = tab->entry[i];
+		if(!entry)
+			{ break; }
+		if(entry->caid == caid)
+			{ return entry; }
+	}
+	if(n == LAT_MAX_CAIDS)
+		{ return NULL; }
+
+	// new caid, the slots are only ever filled so the lookup above needs no lock
+	SAFE_MUTEX_LOCK(&latency_lock);
+	for(; n < LAT_MAX_CAIDS; n++, i = (i + 1) % LAT_MAX_CAIDS)
+	{
+		entry = tab->entry[i];
+		if(entry && entry->caid == caid)
+			{ break; }
+		if(!entry)
+		{
+			if(cs_malloc(&entry, sizeof(struct s_latency_entry)))
+			{
+				entry->caid = caid;
+				tab->entry[i] = entry;
+			}
+			break;
+		}
+	}
+	SAFE_MUTEX_UNLOCK(&latency_lock);
+	return n < LAT_MAX_CAIDS ? entry : NULL;
+}
+
+/* Returns the histogram table of a reader or the global one for rdr == NULL,
+   NULL if the reader has no samples yet. */
+struct s_latency_tab *ecm_latency_tab(struct s_reader *rdr)
+{
+	return rdr ? rdr->ecm_latency : &latency_global;
+}
+
+// adds the time passed since start (ecm_latency_now() timestamp) to the histogram of the stage
+void ecm_latency_add(struct s_reader *rdr, uint16_t caid, int8_t stage, int64_t start)
+{
+	struct s_latency_tab *tab = &latency_global;
+	struct s_latency_entry *entry;
+	struct s_latency_hist *hist;
+	int64_t value;
+	uint32_t max;
+
+	if(!start || stage < 0 || stage >= LAT_STAGES)
+		{ return; }
+
+	if(rdr)
+	{
+		if(!rdr->ecm_latency)
+		{
+			SAFE_MUTEX_LOCK(&latency_lock);
+			if(!rdr->ecm_latency && !cs_malloc(&rdr->ecm_latency, sizeof(struct s_latency_tab)))
+				{ rdr->ecm_latency = NULL; }
+			SAFE_MUTEX_UNLOCK(&latency_lock);
+			if(!rdr->ecm_latency)
+				{ return; }
+		}
+		tab = rdr->ecm_latency;
+	}
+
+	if(!(entry = latency_get_entry(tab, caid)))
+		{ return; }
+
+	value = ecm_latency_now() - start;
+	if(value < 0)
+		{ value = 0; }
+	if(value > UINT32_MAX)
+		{ value = UINT32_MAX; }
+
+	// callers run in many client and reader threads
+	hist = &entry->hist[stage];
+	__sync_add_and_fetch(&hist->count[latency_bucket(value)], 1);
+	do
+	{
+		max = hist->max;
+	}
+	while((uint32_t)value > max && !__sync_bool_compare_and_swap(&hist->max, max, (uint32_t)value));
+}
+
+uint32_t ecm_latency_count(struct s_latency_hist *hist)
+{
+	uint32_t i, count = 0;
+	for(i = 0; i < LAT_BUCKETS; i++)
+		{ count += hist->count[i]; }
+	return count;
+}
+
+// pct in percent, returns microseconds
+uint32_t ecm_latency_percentile(struct s_latency_hist *hist, uint32_t pct)
+{
+	uint32_t count[LAT_BUCKETS];
+	uint32_t i, total = 0;
+	uint64_t sum = 0, limit;
+
+	memcpy(count, hist->count, sizeof(count)); // snapshot, the counters keep moving
+	for(i = 0; i < LAT_BUCKETS; i++)
+		{ total += count[i]; }
+	if(!total)
+		{ return 0; }
+
+	limit = ((uint64_t)total * pct + 99) / 100;
+	for(i = 0; i < LAT_BUCKETS; i++)
+	{
+		sum += count[i];
+		if(sum >= limit)
+			{ return MIN(latency_bucket_value(i), hist->max); }
+	}
+	return hist->max;
+}
+
+const char *ecm_latency_stage_name(int8_t stage)
+{
+	return (stage >= 0 && stage < LAT_STAGES) ? latency_stage_txt[stage] : "";
+}
+
+static void latency_reset_tab(struct s_latency_tab *tab)
+{
+	uint32_t i;
+
+	if(!tab)
+		{ return; }
+	for(i = 0; i < LAT_MAX_CAIDS; i++)
+	{
+		if(tab->entry[i])
+			{ memset(tab->entry[i]->hist, 0, sizeof(tab->entry[i]->hist)); }
+	}
+}
+
+void ecm_latency_reset(void)
+{
+	struct s_reader *rdr;
+	LL_ITER itr;
+
+	latency_reset_tab(&latency_global);
+
+	cs_readlock(__func__, &readerlist_lock);
+	itr = ll_iter_create(configured_readers);
+	while((rdr = ll_iter_next(&itr)))
+		{ latency_reset_tab(rdr->ecm_latency); }
+	cs_readunlock(__func__, &readerlist_lock);
+}
+
+void ecm_latency_free(struct s_reader *rdr)
+{
+	uint32_t i;
+
+	if(!rdr->ecm_latency)
+		{ return; }
+	for(i = 0; i < LAT_MAX_CAIDS; i++)
+		{ NULLFREE(rdr->ecm_latency->entry[i]); }
+	NULLFREE(rdr->ecm_latency);
+}
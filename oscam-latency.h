@@ -0,0 +1,52 @@
+#ifndef OSCAM_LATENCY_H_
+#define OSCAM_LATENCY_H_
+
+/* Per stage ecm latency histograms. Values are microseconds, stored in log
+   linear buckets (8 sub buckets per power of two, max. 12.5% error). The
+   counters and the maximum are updated with atomics instead of locks, readers
+   take a snapshot that may miss concurrent updates. Stages without a reader
+   are kept per caid, queue and reader answer times per caid and reader. */
+
+enum ecm_latency_stage
+{
+	LAT_CACHE = 0,      // check_cache() in get_cw()
+	LAT_WAIT,           // cache checked -> first request to a non cacheex reader (cacheex wait_time)
+	LAT_QUEUE,          // request queued for the reader -> picked up by reader_get_ecm()
+	LAT_READER,         // picked up by reader_get_ecm() -> write_ecm_answer()
+	LAT_SEND,           // module send_dcw() encoding and write
+	LAT_TOTAL,          // get_cw() -> answer sent to the client
+	LAT_STAGES
+};
+
+#define LAT_SUB_BITS	3
+#define LAT_LINEAR		(2 << LAT_SUB_BITS)
+#define LAT_BUCKETS		(LAT_LINEAR + (32 - LAT_SUB_BITS - 1) * (1 << LAT_SUB_BITS))
+#define LAT_MAX_CAIDS	32
+
+struct s_latency_hist
+{
+	uint32_t count[LAT_BUCKETS];
+	uint32_t max;
+};
+
+struct s_latency_entry
+{
+	uint16_t caid;
+	struct s_latency_hist hist[LAT_STAGES];
+};
+
+struct s_latency_tab
+{
+	struct s_latency_entry *entry[LAT_MAX_CAIDS];
+};
+
+int64_t ecm_latency_now(void);
+void ecm_latency_add(struct s_reader *rdr, uint16_t caid, int8_t stage, int64_t start);
+struct s_latency_tab *ecm_latency_tab(struct s_reader *rdr);
+uint32_t ecm_latency_count(struct s_latency_hist *hist);
+uint32_t ecm_latency_percentile(struct s_latency_hist *hist, uint32_t pct);
+const char *ecm_latency_stage_name(int8_t stage);
+void ecm_latency_reset(void);
+void ecm_latency_free(struct s_reader *rdr);
+
+#endif
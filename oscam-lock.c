@@ -2,18 +2,64 @@
 
 #include "globals.h"
 #include "oscam-lock.h"
+#include "oscam-string.h"
 #include "oscam-time.h"
 
 extern char *LOG_LIST;
 
+/* Locks keep their readers and a writer in one word which is changed with
+   compare and swap, so uncontended read and write locks never touch the
+   mutex. Only a thread which has to wait takes l->lock, counts itself in
+   l->writelock or l->readlock and sets the matching WAITING bit. Unlocking
+   threads take the mutex only to wake up waiters. Waiting writers block new
+   readers. A wait which exceeds the lock timeout assumes the holder to be
+   stuck or finished and enforces the lock, as before.
+
+   In debug mode (WITH_MUTEXDEBUG, or cs_lock_debug set before the lock is
+   created) the old implementation is used: readers and writers are counted
+   under the mutex. */
+#define LOCK_READERS		0x1FFFFFFF
+#define LOCK_WRITER			0x20000000
+#define LOCK_WRITER_WAITING	0x40000000
+#define LOCK_READER_WAITING	0x80000000
+
+#if defined(__GNUC__)
+#define LOCK_CAS(l, o, n)	__sync_bool_compare_and_swap(&(l)->state, o, n)
+#define LOCK_OR(l, b)		__sync_fetch_and_or(&(l)->state, b)
+#define LOCK_AND(l, b)		__sync_fetch_and_and(&(l)->state, b)
+#ifdef WITH_MUTEXDEBUG
+int8_t cs_lock_debug = 1;
+#else
+int8_t cs_lock_debug = 0;
+#endif
+#else
+#define LOCK_CAS(l, o, n)	0
+#define LOCK_OR(l, b)		0
+#define LOCK_AND(l, b)		0
+int8_t cs_lock_debug = 1; // no atomic operations
+#endif
+
+#define LOCK_MUTEX(l, n, nolog) \
+	if(nolog) SAFE_MUTEX_LOCK_NOLOG_R(&(l)->lock, n) \
+	else SAFE_MUTEX_LOCK_R(&(l)->lock, n)
+#define UNLOCK_MUTEX(l, n, nolog) \
+	if(nolog) SAFE_MUTEX_UNLOCK_NOLOG_R(&(l)->lock, n) \
+	else SAFE_MUTEX_UNLOCK_R(&(l)->lock, n)
+
+static void lock_init(CS_MUTEX_LOCK *l, const char *name, uint32_t timeout_ms)
+{
+	memset(l, 0, sizeof(CS_MUTEX_LOCK));
+	l->timeout = timeout_ms / 1000;
+	l->name = name;
+	l->debug = cs_lock_debug;
+}
+
 /**
  * creates a lock
  **/
 void cs_lock_create(const char *n, CS_MUTEX_LOCK *l, const char *name, uint32_t timeout_ms)
 {
-	memset(l, 0, sizeof(CS_MUTEX_LOCK));
-	l->timeout = timeout_ms / 1000;
-	l->name = name;
+	lock_init(l, name, timeout_ms);
 	SAFE_MUTEX_INIT_R(&l->lock, NULL, n);
 	__cs_pthread_cond_init(n, &l->writecond);
 	__cs_pthread_cond_init(n, &l->readcond);
@@ -27,9 +73,7 @@ void cs_lock_create(const char *n, CS_MUTEX_LOCK *l, const char *name, uint32_t
  **/
 void cs_lock_create_nolog(const char *n, CS_MUTEX_LOCK *l, const char *name, uint32_t timeout_ms)
 {
-	memset(l, 0, sizeof(CS_MUTEX_LOCK));
-	l->timeout = timeout_ms / 1000;
-	l->name = name;
+	lock_init(l, name, timeout_ms);
 	SAFE_MUTEX_INIT_NOLOG_R(&l->lock, NULL, n);
 	__cs_pthread_cond_init(n, &l->writecond);
 	__cs_pthread_cond_init(n, &l->readcond);
@@ -38,6 +82,13 @@ void cs_lock_create_nolog(const char *n, CS_MUTEX_LOCK *l, const char *name, uin
 #endif
 }
 
+static int8_t lock_busy(CS_MUTEX_LOCK *l)
+{
+	if(l->debug)
+		{ return l->writelock || l->readlock; }
+	return l->state != 0;
+}
+
 void cs_lock_destroy(const char *pn, CS_MUTEX_LOCK *l)
 {
 	if(!l || !l->name || l->flag) { return; }
@@ -51,11 +102,17 @@ void cs_lock_destroy(const char *pn, CS_MUTEX_LOCK *l)
 
 	// Do not destroy when having pending locks!
 	int32_t n = (l->timeout / 10) + 2;
-	while((--n > 0) && (l->writelock || l->readlock)) { cs_sleepms(10); }
+	while((--n > 0) && lock_busy(l)) { cs_sleepms(10); }
 
-	cs_rwlock_int(pn, l, WRITELOCK);
-	l->flag++; // No new unlocks!
-	cs_rwunlock_int(pn, l, WRITELOCK);
+	// No new unlocks!
+	if(l->debug)
+	{
+		cs_rwlock_int(pn, l, WRITELOCK);
+		l->flag++;
+		cs_rwunlock_int(pn, l, WRITELOCK);
+	}
+	else
+		{ l->flag++; }
 
 #ifdef WITH_DEBUG
 	if(!n && old_name != LOG_LIST)
@@ -70,61 +127,286 @@ void cs_lock_destroy(const char *pn, CS_MUTEX_LOCK *l)
 #endif
 }
 
-void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+/* Lock profiling ([global] lockprofile). Every thread counts the locks it
+   takes per lock name in its own table, so the counters need no lock.
+   cs_lock_profile() merges the tables of all threads. The hold time is
+   measured by the thread which took the lock, a lock released by another
+   thread has no hold time. A slot is published by setting its key after its
+   name was written, cs_lock_profile() only reads the names of set keys. */
+#define LOCKPROF_SLOTS 64
+#define LOCKPROF_HELD 16
+
+struct s_lock_profile_thread
 {
-	struct timespec ts;
-	int8_t ret = 0;
+	uint32_t generation; // the table is cleared when cs_lock_profile_reset() changed it
+	struct s_lock_profile slot[LOCKPROF_SLOTS];
+	const char *key[LOCKPROF_SLOTS]; // l->name pointers of the slots
+	struct
+	{
+		CS_MUTEX_LOCK *l;
+		int64_t start;
+		struct s_lock_profile *entry;
+	} held[LOCKPROF_HELD];
+	int32_t nheld;
+	struct s_lock_profile_thread *next;
+};
+
+static pthread_mutex_t lock_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct s_lock_profile_thread *lock_profile_threads;
+static struct s_lock_profile_thread lock_profile_exited; // counters of threads which have ended
+static uint32_t lock_profile_generation;
+static pthread_key_t lock_profile_key;
+static pthread_once_t lock_profile_once = PTHREAD_ONCE_INIT;
+
+static int64_t lock_profile_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-	if(!l || !l->name || l->flag)
+static void lock_profile_add(struct s_lock_profile *to, struct s_lock_profile *from)
+{
+	to->locks += from->locks;
+	to->contended += from->contended;
+	to->wait_us += from->wait_us;
+	to->hold_us += from->hold_us;
+	if(from->wait_max_us > to->wait_max_us)
+		{ to->wait_max_us = from->wait_max_us; }
+	if(from->hold_max_us > to->hold_max_us)
+		{ to->hold_max_us = from->hold_max_us; }
+}
+
+// call with lock_profile_lock held, the owner of from may still count
+static void lock_profile_merge(struct s_lock_profile_thread *to, struct s_lock_profile_thread *from)
+{
+	int32_t i, j;
+
+	if(from->generation != lock_profile_generation)
 		{ return; }
+	for(i = 0; i < LOCKPROF_SLOTS; i++)
+	{
+		if(!from->key[i])
+			{ continue; }
+		__sync_synchronize(); // pairs with lock_profile_publish()
+		if(!from->slot[i].locks)
+			{ continue; }
+		for(j = 0; j < LOCKPROF_SLOTS && to->slot[j].locks; j++)
+		{
+			if(streq(to->slot[j].name, from->slot[i].name))
+				{ break; }
+		}
+		if(j == LOCKPROF_SLOTS)
+			{ j--; }
+		if(!to->slot[j].locks)
+		{
+			cs_strncpy(to->slot[j].name, from->slot[i].name, sizeof(to->slot[j].name));
+			to->key[j] = to->slot[j].name;
+		}
+		lock_profile_add(&to->slot[j], &from->slot[i]);
+	}
+}
 
-	SAFE_MUTEX_LOCK_R(&l->lock, n);
+static void lock_profile_exit(void *ptr)
+{
+	struct s_lock_profile_thread *t = ptr, **prev;
 
-	add_ms_to_timespec(&ts, l->timeout * 1000);
-	ts.tv_nsec = 0; // 100% resemble previous code, I consider it wrong
-	if(type == WRITELOCK)
+	SAFE_MUTEX_LOCK_NOLOG(&lock_profile_lock);
+	for(prev = &lock_profile_threads; *prev; prev = &(*prev)->next)
 	{
-		l->writelock++;
-		// if read- or writelock is busy, wait for unlock
-		if(l->writelock > 1 || l->readlock > 0)
-			{ ret = pthread_cond_timedwait(&l->writecond, &l->lock, &ts); }
+		if(*prev == t)
+		{
+			*prev = t->next;
+			break;
+		}
 	}
-	else
+	lock_profile_merge(&lock_profile_exited, t);
+	SAFE_MUTEX_UNLOCK_NOLOG(&lock_profile_lock);
+	free(t);
+}
+
+static void lock_profile_key_init(void)
+{
+	pthread_key_create(&lock_profile_key, lock_profile_exit);
+}
+
+static struct s_lock_profile_thread *lock_profile_thread(void)
+{
+	struct s_lock_profile_thread *t;
+
+	pthread_once(&lock_profile_once, lock_profile_key_init);
+	if(!(t = pthread_getspecific(lock_profile_key)))
 	{
-		l->readlock++;
-		// if writelock is busy, wait for unlock
-		if(l->writelock > 0)
-			{ ret = pthread_cond_timedwait(&l->readcond, &l->lock, &ts); }
+		if(!(t = calloc(1, sizeof(struct s_lock_profile_thread))))
+			{ return NULL; }
+		SAFE_MUTEX_LOCK_NOLOG(&lock_profile_lock);
+		t->generation = lock_profile_generation;
+		t->next = lock_profile_threads;
+		lock_profile_threads = t;
+		SAFE_MUTEX_UNLOCK_NOLOG(&lock_profile_lock);
+		pthread_setspecific(lock_profile_key, t);
 	}
+	else if(t->generation != lock_profile_generation)
+	{
+		// merges skip the table until its new generation is set
+		memset(t->slot, 0, sizeof(t->slot));
+		memset(t->key, 0, sizeof(t->key));
+		t->nheld = 0;
+		__sync_synchronize();
+		t->generation = lock_profile_generation;
+	}
+	return t;
+}
 
-	if(ret > 0)
+// writes the name of a new slot before its key makes it visible to cs_lock_profile()
+static struct s_lock_profile *lock_profile_publish(struct s_lock_profile_thread *t, uint32_t i, const char *name)
+{
+	cs_strncpy(t->slot[i].name, name, sizeof(t->slot[i].name));
+	__sync_synchronize();
+	t->key[i] = name;
+	return &t->slot[i];
+}
+
+// slot of the lock name, the last slot collects the names which do not fit
+static struct s_lock_profile *lock_profile_entry(struct s_lock_profile_thread *t, const char *name)
+{
+	uint32_t i, start = ((uintptr_t)name >> 3) % (LOCKPROF_SLOTS - 1);
+
+	i = start;
+	do
 	{
-		// lock wasn't returned within time, assume locking thread to
-		// be stuck or finished, so enforce lock.
-		l->writelock = (type == WRITELOCK) ? 1 : 0;
-		l->readlock = (type == WRITELOCK) ? 0 : 1;
-#ifdef WITH_DEBUG
-		if(l->name != LOG_LIST)
-			{ cs_log("WARNING lock %s (%s) timed out.", l->name, (type == WRITELOCK) ? "WRITELOCK" : "READLOCK"); }
-#endif
+		if(!t->key[i])
+			{ return lock_profile_publish(t, i, name); }
+		if(t->key[i] == name && !strncmp(t->slot[i].name, name, sizeof(t->slot[i].name) - 1))
+			{ return &t->slot[i]; }
+		i = (i + 1) % (LOCKPROF_SLOTS - 1);
 	}
+	while(i != start);
 
-	SAFE_MUTEX_UNLOCK_R(&l->lock, n);
-#ifdef WITH_MUTEXDEBUG
-	//cs_log_dbg(D_TRACE, "lock %s locked", l->name);
-#endif
-	return;
+	i = LOCKPROF_SLOTS - 1;
+	if(!t->key[i])
+		{ return lock_profile_publish(t, i, "(other)"); }
+	return &t->slot[i];
 }
 
-void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+static void lock_profile_locked(CS_MUTEX_LOCK *l, int8_t busy, int64_t start)
 {
-	struct timespec ts;
-	int8_t ret = 0;
+	struct s_lock_profile_thread *t = lock_profile_thread();
+	struct s_lock_profile *entry;
+	int64_t now = start;
+	uint32_t wait;
 
-	if(!l || !l->name || l->flag)
+	if(!t || !l->name)
 		{ return; }
+	entry = lock_profile_entry(t, l->name);
+	entry->locks++;
+	if(busy)
+	{
+		now = lock_profile_now();
+		wait = now - start;
+		entry->contended++;
+		entry->wait_us += wait;
+		if(wait > entry->wait_max_us)
+			{ entry->wait_max_us = wait; }
+	}
+	if(t->nheld < LOCKPROF_HELD)
+	{
+		t->held[t->nheld].l = l;
+		t->held[t->nheld].start = now;
+		t->held[t->nheld].entry = entry;
+		t->nheld++;
+	}
+}
+
+static void lock_profile_unlocked(CS_MUTEX_LOCK *l)
+{
+	struct s_lock_profile_thread *t;
+	uint32_t hold;
+	int32_t i;
+
+	pthread_once(&lock_profile_once, lock_profile_key_init);
+	if(!(t = pthread_getspecific(lock_profile_key)) || t->generation != lock_profile_generation)
+		{ return; }
+	for(i = t->nheld - 1; i >= 0; i--)
+	{
+		if(t->held[i].l != l)
+			{ continue; }
+		hold = lock_profile_now() - t->held[i].start;
+		t->held[i].entry->hold_us += hold;
+		if(hold > t->held[i].entry->hold_max_us)
+			{ t->held[i].entry->hold_max_us = hold; }
+		t->nheld--;
+		memmove(&t->held[i], &t->held[i + 1], (t->nheld - i) * sizeof(t->held[0]));
+		break;
+	}
+}
 
-	SAFE_MUTEX_LOCK_NOLOG_R(&l->lock, n);
+static int lock_profile_cmp(const void *a, const void *b)
+{
+	const struct s_lock_profile *pa = a, *pb = b;
+
+	if(pa->wait_us != pb->wait_us)
+		{ return pa->wait_us < pb->wait_us ? 1 : -1; }
+	return pa->locks < pb->locks ? 1 : (pa->locks > pb->locks ? -1 : 0);
+}
+
+/* Merges the counters of all threads into *profile (malloc'd, ordered by
+   wait time), returns the number of lock names. */
+int32_t cs_lock_profile(struct s_lock_profile **profile)
+{
+	struct s_lock_profile_thread *sum, *t;
+	int32_t count;
+
+	*profile = NULL;
+	if(!cs_malloc(&sum, sizeof(struct s_lock_profile_thread)))
+		{ return 0; }
+	sum->generation = lock_profile_generation;
+	SAFE_MUTEX_LOCK(&lock_profile_lock);
+	lock_profile_merge(sum, &lock_profile_exited);
+	for(t = lock_profile_threads; t; t = t->next)
+		{ lock_profile_merge(sum, t); }
+	SAFE_MUTEX_UNLOCK(&lock_profile_lock);
+
+	for(count = 0; count < LOCKPROF_SLOTS && sum->slot[count].locks; count++) { ; }
+	if(count && cs_malloc(profile, count * sizeof(struct s_lock_profile)))
+	{
+		memcpy(*profile, sum->slot, count * sizeof(struct s_lock_profile));
+		qsort(*profile, count, sizeof(struct s_lock_profile), lock_profile_cmp);
+	}
+	else
+		{ count = 0; }
+	NULLFREE(sum);
+	return count;
+}
+
+// every thread clears its table on its next lock
+void cs_lock_profile_reset(void)
+{
+	SAFE_MUTEX_LOCK(&lock_profile_lock);
+	lock_profile_generation++;
+	memset(&lock_profile_exited, 0, sizeof(lock_profile_exited));
+	lock_profile_exited.generation = lock_profile_generation;
+	SAFE_MUTEX_UNLOCK(&lock_profile_lock);
+}
+
+static void lock_timed_out(CS_MUTEX_LOCK *l, int8_t type)
+{
+#ifdef WITH_DEBUG
+	if(l->name != LOG_LIST)
+		{ cs_log("WARNING lock %s (%s) timed out.", l->name, (type == WRITELOCK) ? "WRITELOCK" : "READLOCK"); }
+#else
+	(void)l;
+	(void)type;
+#endif
+}
+
+// returns 1 if the lock was busy
+static int8_t lock_debug_rwlock(const char *n, CS_MUTEX_LOCK *l, int8_t type, int8_t nolog)
+{
+	struct timespec ts;
+	int8_t ret = 0, busy = 0;
+
+	LOCK_MUTEX(l, n, nolog)
 
 	add_ms_to_timespec(&ts, l->timeout * 1000);
 	ts.tv_nsec = 0; // 100% resemble previous code, I consider it wrong
@@ -132,14 +414,14 @@ void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 	{
 		l->writelock++;
 		// if read- or writelock is busy, wait for unlock
-		if(l->writelock > 1 || l->readlock > 0)
+		if((busy = (l->writelock > 1 || l->readlock > 0)))
 			{ ret = pthread_cond_timedwait(&l->writecond, &l->lock, &ts); }
 	}
 	else
 	{
 		l->readlock++;
 		// if writelock is busy, wait for unlock
-		if(l->writelock > 0)
+		if((busy = (l->writelock > 0)))
 			{ ret = pthread_cond_timedwait(&l->readcond, &l->lock, &ts); }
 	}
 
@@ -149,25 +431,16 @@ void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 		// be stuck or finished, so enforce lock.
 		l->writelock = (type == WRITELOCK) ? 1 : 0;
 		l->readlock = (type == WRITELOCK) ? 0 : 1;
-#ifdef WITH_DEBUG
-		if(l->name != LOG_LIST)
-			{ cs_log("WARNING lock %s (%s) timed out.", l->name, (type == WRITELOCK) ? "WRITELOCK" : "READLOCK"); }
-#endif
+		lock_timed_out(l, type);
 	}
 
-	SAFE_MUTEX_UNLOCK_NOLOG_R(&l->lock, n);
-#ifdef WITH_MUTEXDEBUG
-	//cs_log_dbg(D_TRACE, "lock %s locked", l->name);
-#endif
-	return;
+	UNLOCK_MUTEX(l, n, nolog)
+	return busy;
 }
 
-void cs_rwunlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+static void lock_debug_rwunlock(const char *n, CS_MUTEX_LOCK *l, int8_t type, int8_t nolog)
 {
-
-	if(!l || l->flag) { return; }
-
-	SAFE_MUTEX_LOCK_R(&l->lock, n);
+	LOCK_MUTEX(l, n, nolog)
 
 	if(type == WRITELOCK)
 		{ l->writelock--; }
@@ -184,42 +457,149 @@ void cs_rwunlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 	else if(l->readlock && type != READLOCK)
 		{ SAFE_COND_BROADCAST_R(&l->readcond, n); }
 
-	SAFE_MUTEX_UNLOCK_R(&l->lock, n);
+	UNLOCK_MUTEX(l, n, nolog)
+}
 
-#ifdef WITH_MUTEXDEBUG
-#ifdef WITH_DEBUG
-	if(l->name != LOG_LIST)
+// new readers are held back by a writer and by waiting writers
+static int8_t lock_try_read(CS_MUTEX_LOCK *l)
+{
+	uint32_t s;
+
+	while(!((s = l->state) & (LOCK_WRITER | LOCK_WRITER_WAITING)))
 	{
-		const char *typetxt[] = { "", "write", "read" };
-		cs_log_dbg(D_TRACE, "%slock %s: released", typetxt[type], l->name);
+		if(LOCK_CAS(l, s, s + 1))
+			{ return 1; }
 	}
-#endif
-#endif
+	return 0;
 }
 
-void cs_rwunlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+static int8_t lock_try_write(CS_MUTEX_LOCK *l, uint32_t busy)
 {
+	uint32_t s;
 
-	if(!l || l->flag) { return; }
+	while(!((s = l->state) & busy))
+	{
+		if(LOCK_CAS(l, s, s | LOCK_WRITER))
+			{ return 1; }
+	}
+	return 0;
+}
 
-	SAFE_MUTEX_LOCK_NOLOG_R(&l->lock, n);
+// lock wasn't returned within time, assume the holders to be stuck or finished
+static void lock_enforce(CS_MUTEX_LOCK *l, int8_t type)
+{
+	uint32_t s, waiting;
 
-	if(type == WRITELOCK)
-		{ l->writelock--; }
-	else
-		{ l->readlock--; }
+	do
+	{
+		s = l->state;
+		waiting = s & (LOCK_WRITER_WAITING | LOCK_READER_WAITING);
+	}
+	while(!LOCK_CAS(l, s, waiting | (type == WRITELOCK ? LOCK_WRITER : 1)));
+}
 
-	if(l->writelock < 0) { l->writelock = 0; }
-	if(l->readlock < 0) { l->readlock = 0; }
+static void lock_wait(const char *n, CS_MUTEX_LOCK *l, int8_t type, int8_t nolog)
+{
+	struct timespec ts;
+	int16_t *waiters = (type == WRITELOCK) ? &l->writelock : &l->readlock;
+	pthread_cond_t *cond = (type == WRITELOCK) ? &l->writecond : &l->readcond;
+	uint32_t waiting = (type == WRITELOCK) ? LOCK_WRITER_WAITING : LOCK_READER_WAITING;
+	int32_t ret = 0;
+	int8_t enforced = 0;
+
+	LOCK_MUTEX(l, n, nolog)
+
+	add_ms_to_timespec(&ts, l->timeout * 1000);
+	(*waiters)++;
+	LOCK_OR(l, waiting); // unlocking threads wake us up from now on
 
+	while(!(type == WRITELOCK ? lock_try_write(l, LOCK_READERS | LOCK_WRITER) : lock_try_read(l)))
+	{
+		if(ret > 0)
+		{
+			lock_enforce(l, type);
+			enforced = 1;
+			break;
+		}
+		ret = pthread_cond_timedwait(cond, &l->lock, &ts);
+	}
+
+	if(!--(*waiters))
+		{ LOCK_AND(l, ~waiting); }
+
+	UNLOCK_MUTEX(l, n, nolog)
+
+	if(enforced)
+		{ lock_timed_out(l, type); }
+}
+
+static void lock_wake(const char *n, CS_MUTEX_LOCK *l, uint32_t s, int8_t nolog)
+{
+	LOCK_MUTEX(l, n, nolog)
 	// waiting writelocks always have priority. If one is waiting, signal it
-	if(l->writelock)
+	if(s & LOCK_WRITER_WAITING)
 		{ SAFE_COND_SIGNAL_R(&l->writecond, n); }
-	// Otherwise signal a waiting readlock (if any)
-	else if(l->readlock && type != READLOCK)
+	// Otherwise signal the waiting readlocks
+	else
 		{ SAFE_COND_BROADCAST_R(&l->readcond, n); }
+	UNLOCK_MUTEX(l, n, nolog)
+}
+
+static void lock_rwlock(const char *n, CS_MUTEX_LOCK *l, int8_t type, int8_t nolog)
+{
+	int64_t start = 0;
+	int8_t busy = 0;
 
-	SAFE_MUTEX_UNLOCK_NOLOG_R(&l->lock, n);
+	if(!l || !l->name || l->flag)
+		{ return; }
+
+	if(cfg.lockprofile)
+		{ start = lock_profile_now(); }
+
+	if(l->debug)
+		{ busy = lock_debug_rwlock(n, l, type, nolog); }
+	else if(!(type == WRITELOCK ? lock_try_write(l, LOCK_READERS | LOCK_WRITER | LOCK_WRITER_WAITING) : lock_try_read(l)))
+	{
+		lock_wait(n, l, type, nolog);
+		busy = 1;
+	}
+
+	if(start)
+		{ lock_profile_locked(l, busy, start); }
+#ifdef WITH_MUTEXDEBUG
+	//cs_log_dbg(D_TRACE, "lock %s locked", l->name);
+#endif
+}
+
+static void lock_rwunlock(const char *n, CS_MUTEX_LOCK *l, int8_t type, int8_t nolog)
+{
+	uint32_t s, next;
+
+	if(!l || l->flag) { return; }
+
+	if(cfg.lockprofile)
+		{ lock_profile_unlocked(l); }
+
+	if(l->debug)
+		{ lock_debug_rwunlock(n, l, type, nolog); }
+	else
+	{
+		do
+		{
+			s = l->state;
+			if(type == WRITELOCK)
+				{ next = s & ~LOCK_WRITER; }
+			else
+				{ next = (s & LOCK_READERS) ? s - 1 : s; } // unbalanced unlocks are ignored
+		}
+		while(next != s && !LOCK_CAS(l, s, next));
+
+		// wake up waiters once the lock is free for them
+		if(type == WRITELOCK && (next & (LOCK_WRITER_WAITING | LOCK_READER_WAITING)))
+			{ lock_wake(n, l, next, nolog); }
+		else if(type == READLOCK && !(next & LOCK_READERS) && (next & LOCK_WRITER_WAITING))
+			{ lock_wake(n, l, next, nolog); }
+	}
 
 #ifdef WITH_MUTEXDEBUG
 #ifdef WITH_DEBUG
@@ -232,6 +612,26 @@ void cs_rwunlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 #endif
 }
 
+void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+{
+	lock_rwlock(n, l, type, 0);
+}
+
+void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+{
+	lock_rwlock(n, l, type, 1);
+}
+
+void cs_rwunlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+{
+	lock_rwunlock(n, l, type, 0);
+}
+
+void cs_rwunlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type)
+{
+	lock_rwunlock(n, l, type, 1);
+}
+
 int8_t cs_try_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 {
 	if(!l || !l->name || l->flag)
@@ -239,24 +639,37 @@ int8_t cs_try_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type)
 
 	int8_t status = 0;
 
-	SAFE_MUTEX_LOCK_R(&l->lock, n);
-
-	if(type == WRITELOCK)
+	if(!l->debug)
 	{
-		if(l->writelock || l->readlock)
-			{ status = 1; }
+		if(type == WRITELOCK)
+			{ status = !lock_try_write(l, LOCK_READERS | LOCK_WRITER | LOCK_WRITER_WAITING); }
 		else
-			{ l->writelock++; }
+			{ status = !lock_try_read(l); }
 	}
 	else
 	{
-		if(l->writelock)
-			{ status = 1; }
+		SAFE_MUTEX_LOCK_R(&l->lock, n);
+
+		if(type == WRITELOCK)
+		{
+			if(l->writelock || l->readlock)
+				{ status = 1; }
+			else
+				{ l->writelock++; }
+		}
 		else
-			{ l->readlock++; }
+		{
+			if(l->writelock)
+				{ status = 1; }
+			else
+				{ l->readlock++; }
+		}
+
+		SAFE_MUTEX_UNLOCK_R(&l->lock, n);
 	}
 
-	SAFE_MUTEX_UNLOCK_R(&l->lock, n);
+	if(!status && cfg.lockprofile)
+		{ lock_profile_locked(l, 0, lock_profile_now()); }
 
 #ifdef WITH_MUTEXDEBUG
 #ifdef WITH_DEBUG
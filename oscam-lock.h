@@ -5,12 +5,28 @@
 #define WRITELOCK 1
 #define READLOCK 2
 
+extern int8_t cs_lock_debug; // new locks count readers and writers under their mutex
+
 void cs_lock_create(const char *n, CS_MUTEX_LOCK *l, const char *name, uint32_t timeout_ms);
 void cs_lock_destroy(const char *n, CS_MUTEX_LOCK *l);
 void cs_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type);
 void cs_rwunlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type);
 int8_t cs_try_rwlock_int(const char *n, CS_MUTEX_LOCK *l, int8_t type);
 
+struct s_lock_profile
+{
+	char		name[32];
+	uint64_t	locks;
+	uint64_t	contended;		// locks which had to wait
+	uint64_t	wait_us;
+	uint64_t	hold_us;
+	uint32_t	wait_max_us;
+	uint32_t	hold_max_us;
+};
+
+int32_t cs_lock_profile(struct s_lock_profile **profile);
+void cs_lock_profile_reset(void);
+
 void cs_lock_create_nolog(const char *n, CS_MUTEX_LOCK *l, const char *name, uint32_t timeout_ms);
 void cs_rwlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type);
 void cs_rwunlock_int_nolog(const char *n, CS_MUTEX_LOCK *l, int8_t type);
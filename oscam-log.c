@@ -747,7 +747,11 @@ void log_list_thread(void)
 			NULLFREE(log);
 		}
 		if(!log_list_queued) // The list is empty, sleep until new data comes in and we are woken up
+		{
+			garbage_offline();
 			sleepms_on_cond(__func__, &log_thread_sleep_cond_mutex, &log_thread_sleep_cond, 60 * 1000);
+			garbage_online();
+		}
 	}
 	while(log_running);
 	ll_destroy(&log_list);
@@ -560,78 +560,221 @@ int32_t process_input(uint8_t *buf, int32_t buflen, int32_t timeout)
 	return rc;
 }
 
-static struct s_client *find_client_by_ip(IN_ADDR_T ip, in_port_t port)
+/* Receive buffers of the udp listeners are recycled. The job of a datagram
+   gives its buffer back with udp_buf_free(), which pushes it on a shared list
+   without lock. A listener takes the whole list at once into its own spare
+   list, so no two threads pop the same buffer. The pool grows to the number
+   of datagrams queued at the same time, which the job rings limit. */
+#define UDP_BUF_SIZE 1024
+
+struct s_udp_buf
 {
+	struct s_udp_buf	*next;
+	uint8_t				data[UDP_BUF_SIZE];
+};
+
+static struct s_udp_buf *udp_buf_pool;
+
+void udp_buf_free(uint8_t *buf)
+{
+	struct s_udp_buf *b, *head;
+
+	if(!buf)
+		{ return; }
+	b = (struct s_udp_buf *)(buf - offsetof(struct s_udp_buf, data));
+	do
+	{
+		head = udp_buf_pool;
+		b->next = head;
+	}
+	while(!__sync_bool_compare_and_swap(&udp_buf_pool, head, b));
+}
+
+// takes a buffer from *spare, refilled from the shared pool, or allocates one
+static uint8_t *udp_buf_alloc(struct s_udp_buf **spare)
+{
+	struct s_udp_buf *b;
+
+	if(!*spare)
+	{
+		do
+			{ *spare = udp_buf_pool; }
+		while(*spare && !__sync_bool_compare_and_swap(&udp_buf_pool, *spare, NULL));
+	}
+	if((b = *spare))
+		{ *spare = b->next; }
+	else if(!cs_malloc(&b, sizeof(struct s_udp_buf)))
+		{ return NULL; }
+	return b->data;
+}
+
+static void udp_buf_free_list(struct s_udp_buf *b)
+{
+	struct s_udp_buf *next;
+
+	for(; b; b = next)
+	{
+		next = b->next;
+		NULLFREE(b);
+	}
+}
+
+/* Hands a datagram received on the udp listener socket fd to its client, the
+   client is created for the first datagram from an address. buf is
+   UDP_BUF_SIZE bytes from udp_buf_alloc() with the datagram at buf + 3, the
+   job gives it back. */
+
+static void udp_packet_in(struct s_module *module, int8_t module_idx, int8_t port_idx, int32_t fd, uint8_t *buf, int32_t n, struct SOCKADDR *cad)
+{
+	struct s_port *port = &module->ptab.ports[port_idx];
 	struct s_client *cl;
-	for(cl = first_client; cl; cl = cl->next)
+	uint16_t rl = n;
+
+	if(cs_check_violation(SIN_GET_ADDR((*cad)), port->s_port))
 	{
-		if(!cl->kill && IP_EQUAL(cl->ip, ip) && cl->port == port && (cl->typ == 'c' || cl->typ == 'm'))
+		udp_buf_free(buf);
+		return;
+	}
+
+	buf[0] = 'U';
+	memcpy(buf + 1, &rl, 2);
+
+	cl = find_udp_client(SIN_GET_ADDR((*cad)), ntohs(SIN_GET_PORT((*cad))));
+
+	cs_log_dbg(D_TRACE, "got %d bytes on port %d from ip %s:%d client %s",
+					n, port->s_port,
+					cs_inet_ntoa(SIN_GET_ADDR((*cad))), SIN_GET_PORT((*cad)),
+					username(cl));
+
+	if(!cl)
+	{
+		cl = create_client(SIN_GET_ADDR((*cad)));
+		if(!cl)
 		{
-			return cl;
+			udp_buf_free(buf);
+			return;
 		}
+
+		cl->module_idx = module_idx;
+		cl->port_idx = port_idx;
+		cl->udp_fd = fd;
+		cl->udp_sa = *cad;
+		cl->udp_sa_len = sizeof(cl->udp_sa);
+
+		cl->port = ntohs(SIN_GET_PORT((*cad)));
+		cl->typ = 'c';
+		add_udp_client(cl);
+
+		add_job(cl, ACTION_CLIENT_INIT, NULL, 0);
 	}
-	return NULL;
+	add_job(cl, ACTION_CLIENT_UDP, buf, n + 3);
 }
 
-int32_t accept_connection(struct s_module *module, int8_t module_idx, int8_t port_idx)
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+/* recvmmsg() takes up to UDP_BATCH_SIZE datagrams per call. The buffers stay
+   with the port until a datagram is received into them, then they go to the
+   client job and are replaced from the pool before the next call. */
+#define UDP_BATCH_SIZE 32
+
+struct s_udp_batch
+{
+	struct s_udp_buf *spare;
+	uint8_t			*buf[UDP_BATCH_SIZE];
+	struct mmsghdr	msg[UDP_BATCH_SIZE];
+	struct iovec	iov[UDP_BATCH_SIZE];
+	struct SOCKADDR	cad[UDP_BATCH_SIZE];
+};
+
+static int32_t accept_udp_batch(struct s_module *module, int8_t module_idx, int8_t port_idx, int8_t shard, int32_t fd)
 {
-	struct SOCKADDR cad;
-	int32_t scad = sizeof(cad), n;
-	struct s_client *cl;
 	struct s_port *port = &module->ptab.ports[port_idx];
+	struct s_udp_batch *batch = port->udp_batch[shard];
+	int32_t i, n;
 
-	memset(&cad, 0, sizeof(struct SOCKADDR));
-
-	if(module->type == MOD_CONN_UDP)
+	if(!batch)
 	{
-		uint8_t *buf;
-		if(!cs_malloc(&buf, 1024))
+		if(!cs_malloc(&batch, sizeof(struct s_udp_batch)))
 			{ return -1; }
+		port->udp_batch[shard] = batch;
+	}
 
-		if((n = recvfrom(port->fd, buf + 3, 1024 - 3, 0, (struct sockaddr *)&cad, (socklen_t *)&scad)) > 0)
+	for(i = 0; i < UDP_BATCH_SIZE; i++)
+	{
+		if(!batch->buf[i] && !(batch->buf[i] = udp_buf_alloc(&batch->spare)))
+			{ break; }
+		batch->iov[i].iov_base = batch->buf[i] + 3;
+		batch->iov[i].iov_len = UDP_BUF_SIZE - 3;
+		memset(&batch->msg[i], 0, sizeof(struct mmsghdr));
+		batch->msg[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msg[i].msg_hdr.msg_iovlen = 1;
+		batch->msg[i].msg_hdr.msg_name = &batch->cad[i];
+		batch->msg[i].msg_hdr.msg_namelen = sizeof(struct SOCKADDR);
+	}
+	if(!i)
+		{ return -1; }
+
+	n = recvmmsg(fd, batch->msg, i, MSG_DONTWAIT, NULL);
+	for(i = 0; i < n; i++)
+	{
+		if(batch->msg[i].msg_len > 0)
 		{
-			uint16_t rl;
-			cl = find_client_by_ip(SIN_GET_ADDR(cad), ntohs(SIN_GET_PORT(cad)));
-			rl = n;
-			buf[0] = 'U';
-			memcpy(buf + 1, &rl, 2);
+			udp_packet_in(module, module_idx, port_idx, fd, batch->buf[i], batch->msg[i].msg_len, &batch->cad[i]);
+			batch->buf[i] = NULL;
+		}
+	}
+	return 0;
+}
 
-			if(cs_check_violation(SIN_GET_ADDR(cad), port->s_port))
-			{
-				NULLFREE(buf);
-				return 0;
-			}
+static void free_udp_batch(struct s_udp_batch *batch)
+{
+	int32_t i;
+
+	if(!batch)
+		{ return; }
+	for(i = 0; i < UDP_BATCH_SIZE; i++)
+		{ udp_buf_free(batch->buf[i]); }
+	udp_buf_free_list(batch->spare);
+	NULLFREE(batch);
+}
+#endif
 
-			cs_log_dbg(D_TRACE, "got %d bytes on port %d from ip %s:%d client %s",
-							n, port->s_port,
-							cs_inet_ntoa(SIN_GET_ADDR(cad)), SIN_GET_PORT(cad),
-							username(cl));
+// shard 0 is port->fd served by process_clients(), the others run in listener_shard_thread()
+int32_t listener_fd(struct s_port *port, int8_t shard)
+{
+	return shard ? port->shard_fd[shard - 1] : port->fd;
+}
 
-			if(!cl)
-			{
-				cl = create_client(SIN_GET_ADDR(cad));
-				if(!cl) { return 0; }
+int32_t accept_connection(struct s_module *module, int8_t module_idx, int8_t port_idx, int8_t shard)
+{
+	struct SOCKADDR cad;
+	int32_t scad = sizeof(cad);
+	struct s_client *cl;
+	struct s_port *port = &module->ptab.ports[port_idx];
+	int32_t fd = listener_fd(port, shard);
 
-				cl->module_idx = module_idx;
-				cl->port_idx = port_idx;
-				cl->udp_fd = port->fd;
-				cl->udp_sa = cad;
-				cl->udp_sa_len = sizeof(cl->udp_sa);
+	memset(&cad, 0, sizeof(struct SOCKADDR));
 
-				cl->port = ntohs(SIN_GET_PORT(cad));
-				cl->typ = 'c';
+	if(module->type == MOD_CONN_UDP)
+	{
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		return accept_udp_batch(module, module_idx, port_idx, shard, fd);
+#else
+		static struct s_udp_buf *spare; // only the main loop reads udp listeners here
+		uint8_t *buf;
+		int32_t n;
+		if(!(buf = udp_buf_alloc(&spare)))
+			{ return -1; }
 
-				add_job(cl, ACTION_CLIENT_INIT, NULL, 0);
-			}
-			add_job(cl, ACTION_CLIENT_UDP, buf, n + 3);
-		}
+		if((n = recvfrom(fd, buf + 3, UDP_BUF_SIZE - 3, 0, (struct sockaddr *)&cad, (socklen_t *)&scad)) > 0)
+			{ udp_packet_in(module, module_idx, port_idx, fd, buf, n, &cad); }
 		else
-			{ NULLFREE(buf); }
+			{ udp_buf_free(buf); }
+#endif
 	}
 	else // TCP
 	{
 		int32_t pfd3;
-		if((pfd3 = accept(port->fd, (struct sockaddr *)&cad, (socklen_t *)&scad)) > 0)
+		if((pfd3 = accept(fd, (struct sockaddr *)&cad, (socklen_t *)&scad)) > 0)
 		{
 
 			if(cs_check_violation(SIN_GET_ADDR(cad), port->s_port))
@@ -675,66 +818,41 @@ void set_so_reuseport(int fd) {
 #endif
 }
 
-int32_t start_listener(struct s_module *module, struct s_port *port)
+/* Number of sockets opened per listening port, see listenshards in
+   oscam.conf. The kernel only spreads connections over SO_REUSEPORT sockets
+   on Linux, elsewhere there is always one socket. */
+int32_t listen_shard_count(void)
 {
-	int32_t ov = 1, timeout, is_udp, i;
-	char ptxt[2][45];
-	struct SOCKADDR sad; // structure to hold server's address
-	socklen_t sad_len;
-
-	ptxt[0][0] = ptxt[1][0] = '\0';
-	if(!port->s_port)
-	{
-		cs_log_dbg(D_TRACE, "%s: disabled", module->desc);
-		return 0;
-	}
-	is_udp = (module->type == MOD_CONN_UDP);
-
-	memset(&sad, 0 , sizeof(sad));
-#ifdef IPV6SUPPORT
-	SIN_GET_FAMILY(sad) = AF_INET6;
-	SIN_GET_ADDR(sad) = in6addr_any;
-	sad_len = sizeof(struct sockaddr_in6);
+#if defined(__linux__) && defined(SO_REUSEPORT)
+	int32_t shards = cfg.listenshards;
+
+	if(shards < 0)
+		{ shards = sysconf(_SC_NPROCESSORS_ONLN); }
+	if(shards > CS_MAX_LISTENSHARDS)
+		{ shards = CS_MAX_LISTENSHARDS; }
+	return shards > 1 ? shards : 1;
 #else
-	sad.sin_family = AF_INET;
-	sad_len = sizeof(struct sockaddr);
-
-	if(!module->s_ip)
-		{ module->s_ip = cfg.srvip; }
-
-	if(module->s_ip)
-	{
-		sad.sin_addr.s_addr = module->s_ip;
-		snprintf(ptxt[0], sizeof(ptxt[0]), ", ip=%s", inet_ntoa(sad.sin_addr));
-	}
-	else
-	{
-		sad.sin_addr.s_addr = INADDR_ANY;
-	}
+	return 1;
 #endif
+}
 
-	timeout = cfg.bindwait;
-	port->fd = 0;
-
-	if(port->s_port > 0) // test for illegal value
-	{
-		SIN_GET_PORT(sad) = htons((uint16_t)port->s_port);
-	}
-	else
-	{
-		cs_log("%s: Bad port %d", module->desc, port->s_port);
-		return 0;
-	}
-
+/* Opens and binds one listening socket, returns 0 on failure.
+   SO_REUSEPORT lets the listener shards bind the same port again. */
+static int32_t open_listen_socket(struct s_module *module, struct SOCKADDR *sad, socklen_t sad_len, char *prio_txt, size_t prio_txt_len)
+{
+	int32_t ov = 1, timeout, fd;
+	int32_t is_udp = (module->type == MOD_CONN_UDP);
 	int s_type = (is_udp ? SOCK_DGRAM : SOCK_STREAM);
 	int s_proto = (is_udp ? IPPROTO_UDP : IPPROTO_TCP);
 
-	if((port->fd = socket(DEFAULT_AF, s_type, s_proto)) < 0)
+	timeout = cfg.bindwait;
+
+	if((fd = socket(DEFAULT_AF, s_type, s_proto)) < 0)
 	{
 		cs_log("%s: Cannot create socket (errno=%d: %s)", module->desc, errno, strerror(errno));
 #ifdef IPV6SUPPORT
 		cs_log("%s: Trying fallback to IPv4", module->desc);
-		if((port->fd = socket(AF_INET, s_type, s_proto)) < 0)
+		if((fd = socket(AF_INET, s_type, s_proto)) < 0)
 		{
 			cs_log("%s: Cannot create socket (errno=%d: %s)", module->desc, errno, strerror(errno));
 			return 0;
@@ -751,37 +869,36 @@ int32_t start_listener(struct s_module *module, struct s_port *port)
 #endif
 	// set the server socket option to listen on IPv4 and IPv6 simultaneously
 	int val = 0;
-	if(setsockopt(port->fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&val, sizeof(val)) < 0)
+	if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&val, sizeof(val)) < 0)
 	{
 		cs_log("%s: setsockopt(IPV6_V6ONLY) failed (errno=%d: %s)", module->desc, errno, strerror(errno));
 	}
 #endif
 
 	ov = 1;
-	if(setsockopt(port->fd, SOL_SOCKET, SO_REUSEADDR, (void *)&ov, sizeof(ov)) < 0)
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&ov, sizeof(ov)) < 0)
 	{
 		cs_log("%s: setsockopt failed (errno=%d: %s)", module->desc, errno, strerror(errno));
-		close(port->fd);
-		port->fd = 0;
+		close(fd);
 		return 0;
 	}
 
-	set_so_reuseport(port->fd);
+	set_so_reuseport(fd);
 
-	int prio_ret = set_socket_priority(port->fd, cfg.netprio);
+	int prio_ret = set_socket_priority(fd, cfg.netprio);
 	if (prio_ret > -1) {
-		snprintf(ptxt[1], sizeof(ptxt[1]), ", prio=%d [%s%s%s ]", cfg.netprio, prio_ret&0x04 ? " SO_PRIORITY" : "", prio_ret&0x01 ? " IP_TOS" : "", prio_ret&0x02 ? " IPV6_TCLASS" : "");
+		snprintf(prio_txt, prio_txt_len, ", prio=%d [%s%s%s ]", cfg.netprio, prio_ret&0x04 ? " SO_PRIORITY" : "", prio_ret&0x01 ? " IP_TOS" : "", prio_ret&0x02 ? " IPV6_TCLASS" : "");
 	}
 
 	if(!is_udp)
 	{
 		int32_t keep_alive = 1;
-		setsockopt(port->fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keep_alive, sizeof(keep_alive));
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keep_alive, sizeof(keep_alive));
 	}
 
 	while(timeout-- && !exit_oscam)
 	{
-		if(bind(port->fd, (struct sockaddr *)&sad, sad_len) < 0)
+		if(bind(fd, (struct sockaddr *)sad, sad_len) < 0)
 		{
 			if(timeout)
 			{
@@ -792,8 +909,7 @@ int32_t start_listener(struct s_module *module, struct s_port *port)
 			else
 			{
 				cs_log("%s: Bind request failed (%s), giving up", module->desc, strerror(errno));
-				close(port->fd);
-				port->fd = 0;
+				close(fd);
 				return 0;
 			}
 		}
@@ -805,17 +921,80 @@ int32_t start_listener(struct s_module *module, struct s_port *port)
 
 	if(!is_udp)
 	{
-		if(listen(port->fd, CS_QLEN) < 0)
+		if(listen(fd, CS_QLEN) < 0)
 		{
 			cs_log("%s: Cannot start listen mode (errno=%d: %s)", module->desc, errno, strerror(errno));
-			close(port->fd);
-			port->fd = 0;
+			close(fd);
 			return 0;
 		}
 	}
 
+	return fd;
+}
+
+int32_t start_listener(struct s_module *module, struct s_port *port)
+{
+	int32_t i, shards;
+	char ptxt[2][45];
+	struct SOCKADDR sad; // structure to hold server's address
+	socklen_t sad_len;
+
+	ptxt[0][0] = ptxt[1][0] = '\0';
+	if(!port->s_port)
+	{
+		cs_log_dbg(D_TRACE, "%s: disabled", module->desc);
+		return 0;
+	}
+
+	memset(&sad, 0 , sizeof(sad));
+#ifdef IPV6SUPPORT
+	SIN_GET_FAMILY(sad) = AF_INET6;
+	SIN_GET_ADDR(sad) = in6addr_any;
+	sad_len = sizeof(struct sockaddr_in6);
+#else
+	sad.sin_family = AF_INET;
+	sad_len = sizeof(struct sockaddr);
+
+	if(!module->s_ip)
+		{ module->s_ip = cfg.srvip; }
+
+	if(module->s_ip)
+	{
+		sad.sin_addr.s_addr = module->s_ip;
+		snprintf(ptxt[0], sizeof(ptxt[0]), ", ip=%s", inet_ntoa(sad.sin_addr));
+	}
+	else
+	{
+		sad.sin_addr.s_addr = INADDR_ANY;
+	}
+#endif
+
+	port->fd = 0;
+
+	if(port->s_port > 0) // test for illegal value
+	{
+		SIN_GET_PORT(sad) = htons((uint16_t)port->s_port);
+	}
+	else
+	{
+		cs_log("%s: Bad port %d", module->desc, port->s_port);
+		return 0;
+	}
+
+	if(!(port->fd = open_listen_socket(module, &sad, sad_len, ptxt[1], sizeof(ptxt[1]))))
+		{ return 0; }
+
 	cs_log("%s: initialized (fd=%d, port=%d%s%s)", module->desc, port->fd, port->s_port, ptxt[0], ptxt[1]);
 
+	shards = listen_shard_count();
+	for(i = 1; i < shards; i++)
+	{
+		if(!(port->shard_fd[i - 1] = open_listen_socket(module, &sad, sad_len, ptxt[1], sizeof(ptxt[1]))))
+			{ break; }
+	}
+	if(i > 1)
+		{ cs_log("%s: port %d is served by %d listener shards", module->desc, port->s_port, i); }
+
 	for(i = 0; port->ncd && i < port->ncd->ncd_ftab.nfilts; i++)
 	{
 		int32_t j, pos = 0;
@@ -834,6 +1013,35 @@ int32_t start_listener(struct s_module *module, struct s_port *port)
 	return port->fd;
 }
 
+void stop_listener(struct s_port *port)
+{
+	struct s_udp_buf *pool;
+	int32_t i;
+
+	for(i = 0; i < CS_MAX_LISTENSHARDS; i++)
+	{
+		int32_t fd = listener_fd(port, i);
+		if(fd)
+		{
+			shutdown(fd, SHUT_RDWR);
+			close(fd);
+		}
+		if(i)
+			{ port->shard_fd[i - 1] = 0; }
+		else
+			{ port->fd = 0; }
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		free_udp_batch(port->udp_batch[i]);
+		port->udp_batch[i] = NULL;
+#endif
+	}
+	// buffers of jobs still queued come back later and are not freed
+	do
+		{ pool = udp_buf_pool; }
+	while(pool && !__sync_bool_compare_and_swap(&udp_buf_pool, pool, NULL));
+	udp_buf_free_list(pool);
+}
+
 #ifdef __CYGWIN__
 /**
  * Workaround missing MSG_WAITALL implementation under Cygwin.
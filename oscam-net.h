@@ -40,8 +40,12 @@ void set_so_reuseport(int fd);
 int8_t check_fd_for_data(int32_t fd);
 int32_t recv_from_udpipe(uint8_t *);
 int32_t process_input(uint8_t *buf, int32_t buflen, int32_t timeout);
-int32_t accept_connection(struct s_module *module, int8_t module_idx, int8_t port_idx);
+int32_t listen_shard_count(void);
+int32_t listener_fd(struct s_port *port, int8_t shard);
+int32_t accept_connection(struct s_module *module, int8_t module_idx, int8_t port_idx, int8_t shard);
 int32_t start_listener(struct s_module *module, struct s_port *port);
+void stop_listener(struct s_port *port);
+void udp_buf_free(uint8_t *buf);
 
 #ifdef __CYGWIN__
 ssize_t cygwin_recv(int sock, void *buf, int count, int tflags);
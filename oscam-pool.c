@@ -0,0 +1,160 @@
+#define MODULE_LOG_PREFIX "pool"
+
+#include "globals.h"
+#include "oscam-pool.h"
+#include "oscam-string.h"
+
+struct s_pool_cache
+{
+	struct s_pool *pool;
+	uint32_t count;
+	void *obj[];                // pool->cache_size
+};
+
+// hands objects back to the shared free list, whatever doesn't fit goes back to malloc
+static void pool_push(struct s_pool *pool, void **obj, uint32_t count)
+{
+	uint32_t i;
+
+	SAFE_MUTEX_LOCK(&pool->lock);
+	for(i = 0; i < count; i++)
+	{
+		if(pool->free_count < pool->max_free)
+		{
+			*(void **)obj[i] = pool->free_list;
+			pool->free_list = obj[i];
+			pool->free_count++;
+		}
+		else
+		{
+			free(obj[i]);
+			pool->releases++;
+		}
+	}
+	SAFE_MUTEX_UNLOCK(&pool->lock);
+}
+
+static void *pool_pop(struct s_pool *pool)
+{
+	void *obj = pool->free_list;
+	if(obj)
+	{
+		pool->free_list = *(void **)obj;
+		pool->free_count--;
+	}
+	return obj;
+}
+
+// called on thread exit: the cached objects are still good for other threads
+static void pool_cache_destroy(void *arg)
+{
+	struct s_pool_cache *cache = arg;
+	pool_push(cache->pool, cache->obj, cache->count);
+	free(cache);
+}
+
+static struct s_pool_cache *pool_get_cache(struct s_pool *pool)
+{
+	struct s_pool_cache *cache;
+
+	if(!pool->key_ok || !pool->cache_size)
+		{ return NULL; }
+
+	cache = pthread_getspecific(pool->key);
+	if(!cache)
+	{
+		if(!cs_malloc(&cache, sizeof(struct s_pool_cache) + pool->cache_size * sizeof(void *)))
+			{ return NULL; }
+		cache->pool = pool;
+		if(pthread_setspecific(pool->key, cache))
+		{
+			NULLFREE(cache);
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+void pool_init(struct s_pool *pool, const char *name, size_t size, uint32_t max_free, uint32_t cache_size)
+{
+	memset(pool, 0, sizeof(struct s_pool));
+	pool->name = name;
+	pool->size = size < sizeof(void *) ? sizeof(void *) : size;
+	pool->max_free = max_free;
+	pool->cache_size = cache_size;
+	SAFE_MUTEX_INIT(&pool->lock, NULL);
+	if(pthread_key_create(&pool->key, pool_cache_destroy))
+		{ cs_log("Could not create thread cache for pool %s, using shared free list only", name); }
+	else
+		{ pool->key_ok = 1; }
+}
+
+/* Returns a zeroed object, served from the calling thread's cache or the shared
+   free list when possible and from malloc otherwise. NULL if out of memory. */
+void *pool_alloc(struct s_pool *pool)
+{
+	struct s_pool_cache *cache = pool_get_cache(pool);
+	void *obj = NULL;
+
+	if(cache)
+	{
+		if(!cache->count && pool->free_count)
+		{
+			SAFE_MUTEX_LOCK(&pool->lock);
+			while(cache->count < (pool->cache_size + 1) / 2 && pool->free_list)
+				{ cache->obj[cache->count++] = pool_pop(pool); }
+			SAFE_MUTEX_UNLOCK(&pool->lock);
+		}
+		if(cache->count)
+			{ obj = cache->obj[--cache->count]; }
+	}
+	else
+	{
+		SAFE_MUTEX_LOCK(&pool->lock);
+		obj = pool_pop(pool);
+		SAFE_MUTEX_UNLOCK(&pool->lock);
+	}
+
+	if(obj)
+	{
+		__sync_add_and_fetch(&pool->hits, 1);
+		memset(obj, 0, pool->size);
+		return obj;
+	}
+
+	__sync_add_and_fetch(&pool->misses, 1);
+	if(!cs_malloc(&obj, pool->size))
+		{ return NULL; }
+	return obj;
+}
+
+void pool_free(struct s_pool *pool, void *obj)
+{
+	struct s_pool_cache *cache;
+
+	if(!obj)
+		{ return; }
+
+	cache = pool_get_cache(pool);
+	if(!cache)
+	{
+		pool_push(pool, &obj, 1);
+		return;
+	}
+
+	if(cache->count == pool->cache_size)
+	{
+		// move the older half to the shared list so other threads can pick it up
+		uint32_t half = (pool->cache_size + 1) / 2;
+		pool_push(pool, cache->obj, half);
+		memmove(cache->obj, &cache->obj[half], (cache->count - half) * sizeof(void *));
+		cache->count -= half;
+	}
+	cache->obj[cache->count++] = obj;
+}
+
+// number of objects waiting in the shared free list (thread caches not included)
+uint32_t pool_cached(struct s_pool *pool)
+{
+	return pool->free_count;
+}
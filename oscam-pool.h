@@ -0,0 +1,32 @@
+#ifndef OSCAM_POOL_H_
+#define OSCAM_POOL_H_
+
+/* Free-list pool for fixed size objects. Every thread keeps a small cache of
+   released objects so the hot path needs no lock, the shared free list behind
+   it is refilled/drained in batches. The cache holds up to cache_size objects
+   per thread that uses the pool, keep it small for pools used by client threads.
+   Pooled objects are ordinary heap blocks, so an object may also be released
+   with free() if it never returns to the pool. */
+
+struct s_pool
+{
+	const char *name;
+	size_t size;
+	uint32_t max_free;          // upper bound for objects kept in the shared free list
+	uint32_t cache_size;        // objects kept per thread, 0 = shared free list only
+	pthread_key_t key;          // per thread cache
+	int8_t key_ok;
+	pthread_mutex_t lock;       // protects free_list and free_count
+	void *free_list;
+	uint32_t free_count;
+	uint32_t hits;              // allocations served from the pool, atomic
+	uint32_t misses;            // allocations that had to use malloc, atomic
+	uint32_t releases;          // objects handed back to malloc because the pool was full, under lock
+};
+
+void pool_init(struct s_pool *pool, const char *name, size_t size, uint32_t max_free, uint32_t cache_size);
+void *pool_alloc(struct s_pool *pool);
+void pool_free(struct s_pool *pool, void *obj);
+uint32_t pool_cached(struct s_pool *pool);
+
+#endif
@@ -1,6 +1,7 @@
 #define MODULE_LOG_PREFIX "reader"
 
 #include "globals.h"
+#include "module-cacheex.h"
 #include "module-cccam.h"
 #include "module-led.h"
 #include "module-stat.h"
@@ -10,6 +11,8 @@
 #include "oscam-client.h"
 #include "oscam-ecm.h"
 #include "oscam-garbage.h"
+#include "oscam-hashtable.h"
+#include "oscam-latency.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
 #include "oscam-reader.h"
@@ -21,7 +24,6 @@
 
 extern CS_MUTEX_LOCK system_lock;
 extern CS_MUTEX_LOCK ecmcache_lock;
-extern struct ecm_request_t *ecmcwcache;
 extern const struct s_cardsystem *cardsystems[];
 
 const char *RDR_CD_TXT[] =
@@ -705,19 +707,163 @@ void cs_clear_entitlement(struct s_reader *rdr)
 }
 
 
-void casc_check_dcw(struct s_reader *reader, int32_t idx, int32_t rc, uint8_t *cw)
+/*
+ * ecmtask[] of a proxy reader is indexed by two chained hash tables: message idx -> slot
+ * (to match answers) and (caid, ecmd5) -> slot (to find the same ecm pending on other slots).
+ * Protocol modules still write idx/rc of the slots directly, so every lookup verifies the
+ * slot content and the chains may contain stale entries until the slot is taken again.
+ */
+struct s_ecmtask_index
+{
+	int32_t mask;					// number of buckets - 1
+	int32_t cursor;					// search for a free slot starts here
+	time_t last_sweep;				// pending timeouts are dropped once per second
+	int32_t *idx_head;
+	int32_t *idx_next;
+	int32_t *idx_bucket;			// bucket of each slot, -1 if not linked
+	int32_t *ecm_head;
+	int32_t *ecm_next;
+	int32_t *ecm_bucket;
+};
+
+bool casc_alloc_ecmtask(struct s_client *cl)
+{
+	struct s_ecmtask_index *ix;
+	int32_t i, buckets = 16;
+	uint8_t *mem;
+
+	while(buckets < cfg.max_pending)
+		{ buckets <<= 1; }
+
+	// slots, index and chains in one block so add_garbage(cl->ecmtask) releases everything
+	size_t slots_size = cfg.max_pending * sizeof(ECM_REQUEST);
+	size_t chains_size = (4 * cfg.max_pending + 2 * buckets) * sizeof(int32_t);
+	if(!cs_malloc(&mem, slots_size + sizeof(struct s_ecmtask_index) + chains_size))
+		{ return false; }
+
+	ix = (struct s_ecmtask_index *)(mem + slots_size);
+	ix->mask = buckets - 1;
+	ix->idx_head = (int32_t *)(ix + 1);
+	ix->ecm_head = ix->idx_head + buckets;
+	ix->idx_next = ix->ecm_head + buckets;
+	ix->ecm_next = ix->idx_next + cfg.max_pending;
+	ix->idx_bucket = ix->ecm_next + cfg.max_pending;
+	ix->ecm_bucket = ix->idx_bucket + cfg.max_pending;
+
+	for(i = 0; i < buckets; i++)
+		{ ix->idx_head[i] = ix->ecm_head[i] = -1; }
+	for(i = 0; i < cfg.max_pending; i++)
+		{ ix->idx_bucket[i] = ix->ecm_bucket[i] = -1; }
+
+	cl->ecmtask = (ECM_REQUEST *)mem;
+	cl->ecmtask_index = ix;
+	return true;
+}
+
+static void ecmtask_unlink(int32_t *head, int32_t *next, int32_t *bucket, int32_t slot)
+{
+	int32_t *p;
+
+	if(bucket[slot] < 0)
+		{ return; }
+
+	for(p = &head[bucket[slot]]; *p >= 0; p = &next[*p])
+	{
+		if(*p == slot)
+		{
+			*p = next[slot];
+			break;
+		}
+	}
+	bucket[slot] = -1;
+}
+
+static void ecmtask_link(int32_t *head, int32_t *next, int32_t *bucket, int32_t slot, int32_t b)
+{
+	next[slot] = head[b];
+	head[b] = slot;
+	bucket[slot] = b;
+}
+
+static int32_t ecmtask_ecm_bucket(struct s_ecmtask_index *ix, uint16_t caid, const uint8_t *ecmd5)
+{
+	return tommy_hash_u32(caid, ecmd5, CS_ECMSTORESIZE) & ix->mask;
+}
+
+/* Returns the ecmtask slot waiting for message idx or -1. */
+int32_t casc_get_ecmtask(struct s_client *cl, int32_t idx)
+{
+	struct s_ecmtask_index *ix = cl->ecmtask_index;
+	int32_t i;
+
+	if(!cl->ecmtask || !ix)
+		{ return -1; }
+
+	for(i = ix->idx_head[idx & ix->mask]; i >= 0; i = ix->idx_next[i])
+	{
+		if(cl->ecmtask[i].idx == idx)
+			{ return i; }
+	}
+	return -1;
+}
+
+static int32_t casc_find_pending_ecm(struct s_client *cl, uint16_t caid, const uint8_t *ecmd5)
+{
+	struct s_ecmtask_index *ix = cl->ecmtask_index;
+	ECM_REQUEST *ecm;
+	int32_t i;
+
+	for(i = ix->ecm_head[ecmtask_ecm_bucket(ix, caid, ecmd5)]; i >= 0; i = ix->ecm_next[i])
+	{
+		ecm = &cl->ecmtask[i];
+		if((ecm->rc >= E_NOCARD) && ecm->caid == caid && (!memcmp(ecm->ecmd5, ecmd5, CS_ECMSTORESIZE)))
+			{ return i; }
+	}
+	return -1;
+}
+
+// drop timeouts and recount pending slots
+static void casc_sweep_ecmtask(struct s_client *cl, time_t t)
 {
 	int32_t i, pending = 0;
-	time_t t = time(NULL);
+	ECM_REQUEST *ecm;
+
+	for(i = 0; i < cfg.max_pending; i++)
+	{
+		ecm = &cl->ecmtask[i];
+		if((ecm->rc >= E_NOCARD) && (t - (uint32_t)ecm->tps.time > ((cfg.ctimeout + 500) / 1000) + 1)) // drop timeouts
+		{
+			ecm->rc = E_FOUND;
+		}
+
+		if(ecm->rc >= E_NOCARD)
+			{ pending++; }
+	}
+	cl->pending = pending;
+	cl->ecmtask_index->last_sweep = t;
+}
+
+void casc_check_dcw(struct s_reader *reader, int32_t idx, int32_t rc, uint8_t *cw)
+{
+	int32_t i, next;
+	uint16_t caid;
+	uint8_t ecmd5[CS_ECMSTORESIZE];
 	ECM_REQUEST *ecm;
 	struct s_client *cl = reader->client;
+	struct s_ecmtask_index *ix;
 
-	if(!check_client(cl)) { return; }
+	if(!check_client(cl) || !cl->ecmtask_index) { return; }
+	ix = cl->ecmtask_index;
 
-	for(i = 0; i < cfg.max_pending; i++)
+	// answer every slot waiting for the same ecm
+	caid = cl->ecmtask[idx].caid;
+	memcpy(ecmd5, cl->ecmtask[idx].ecmd5, CS_ECMSTORESIZE);
+
+	for(i = ix->ecm_head[ecmtask_ecm_bucket(ix, caid, ecmd5)]; i >= 0; i = next)
 	{
+		next = ix->ecm_next[i];
 		ecm = &cl->ecmtask[i];
-		if((ecm->rc >= E_NOCARD) && ecm->caid == cl->ecmtask[idx].caid && (!memcmp(ecm->ecmd5, cl->ecmtask[idx].ecmd5, CS_ECMSTORESIZE)))
+		if((ecm->rc >= E_NOCARD) && ecm->caid == caid && (!memcmp(ecm->ecmd5, ecmd5, CS_ECMSTORESIZE)))
 		{
 			if(rc == 2) // E_INVALID from camd35 CMD08
 			{
@@ -739,17 +885,10 @@ void casc_check_dcw(struct s_reader *reader, int32_t idx, int32_t rc, uint8_t *c
 			}
 			ecm->idx = 0;
 			ecm->rc = E_FOUND;
+			if(cl->pending > 0)
+				{ cl->pending--; }
 		}
-
-		if(ecm->rc >= E_NOCARD && (t - (uint32_t)ecm->tps.time > ((cfg.ctimeout + 500) / 1000) + 1)) // drop timeouts
-		{
-			ecm->rc = E_FOUND;
-		}
-
-		if(ecm->rc >= E_NOCARD)
-			{ pending++; }
 	}
-	cl->pending = pending;
 }
 
 int32_t hostResolve(struct s_reader *rdr)
@@ -1006,6 +1145,7 @@ void network_tcp_connection_close(struct s_reader *reader, char *reason)
 			cl->ecmtask[i].idx = 0;
 			cl->ecmtask[i].rc = E_FOUND;
 		}
+		cl->pending = 0;
 	}
 	// newcamd message ids are stored as a reference in ecmtask[].idx
 	// so we need to reset them aswell
@@ -1015,80 +1155,86 @@ void network_tcp_connection_close(struct s_reader *reader, char *reason)
 
 int32_t casc_process_ecm(struct s_reader *reader, ECM_REQUEST *er)
 {
-	int32_t rc, n, i, sflag, pending = 0;
+	int32_t rc, n, i, sflag;
 	time_t t;//, tls;
 	struct s_client *cl = reader->client;
+	struct s_ecmtask_index *ix;
 
-	if(!cl || !cl->ecmtask)
+	if(!cl || !cl->ecmtask || !cl->ecmtask_index)
 	{
 		rdr_log(reader, "WARNING: ecmtask not available");
 		return -1;
 	}
+	ix = cl->ecmtask_index;
 
 	t = time((time_t *)0);
-	ECM_REQUEST *ecm;
-	for(i = 0; i < cfg.max_pending; i++)
+	if(ix->last_sweep != t)
+		{ casc_sweep_ecmtask(cl, t); }
+
+	// ecm already pending
+	// ...this level at least
+	sflag = casc_find_pending_ecm(cl, er->caid, er->ecmd5) < 0;
+
+	for(n = -1, i = 0; i < cfg.max_pending; i++)
 	{
-		ecm = &cl->ecmtask[i];
-		if((ecm->rc >= E_NOCARD) && (t - (uint32_t)ecm->tps.time > ((cfg.ctimeout + 500) / 1000) + 1)) // drop timeouts
+		int32_t j = (ix->cursor + i) % cfg.max_pending;
+		if(cl->ecmtask[j].rc < E_NOCARD) // free slot found
 		{
-			ecm->rc = E_FOUND;
+			n = j;
+			break;
 		}
 	}
 
-	for(n = -1, i = 0, sflag = 1; i < cfg.max_pending; i++)
-	{
-		ecm = &cl->ecmtask[i];
-		if(n < 0 && (ecm->rc < E_NOCARD)) // free slot found
-			{ n = i; }
-
-		// ecm already pending
-		// ...this level at least
-		if((ecm->rc >= E_NOCARD) && er->caid == ecm->caid && (!memcmp(er->ecmd5, ecm->ecmd5, CS_ECMSTORESIZE)))
-			{ sflag = 0; }
-
-		if(ecm->rc >= E_NOCARD)
-			{ pending++; }
-	}
-	cl->pending = pending;
-
 	if(n < 0)
 	{
 		rdr_log(reader, "WARNING: reader ecm pending table overflow !!");
 		return (-2);
 	}
+	ix->cursor = (n + 1) % cfg.max_pending;
 
-	memcpy(&cl->ecmtask[n], er, sizeof(ECM_REQUEST));
-	cl->ecmtask[n].matching_rdr = NULL; // This avoids double free of matching_rdr!
+	// ecm[] is the first member: copy only its used part
+	ECM_REQUEST *ecm = &cl->ecmtask[n];
+	memcpy(&ecm->cw, &er->cw, sizeof(ECM_REQUEST) - offsetof(ECM_REQUEST, cw));
+	if(er->ecmlen > 0)
+		{ memcpy(ecm->ecm, er->ecm, MIN(er->ecmlen, MAX_ECM_SIZE)); }
+	ecm->matching_rdr = NULL; // This avoids double free of matching_rdr!
 #ifdef CS_CACHEEX
-	cl->ecmtask[n].csp_lastnodes = NULL; // This avoids double free of csp_lastnodes!
+	ecm->csp_lastnodes = NULL; // This avoids double free of csp_lastnodes!
 #endif
-	cl->ecmtask[n].parent = er;
+	ecm->inflight_waiters = NULL; // waiters are answered through the parent only
+	ecm->parent = er;
 
 	if(reader->typ == R_NEWCAMD)
-		{ cl->ecmtask[n].idx = (cl->ncd_msgid == 0) ? 2 : cl->ncd_msgid + 1; }
+		{ ecm->idx = (cl->ncd_msgid == 0) ? 2 : cl->ncd_msgid + 1; }
 	else
 	{
 		if(!cl->idx)
 			{ cl->idx = 1; }
-		cl->ecmtask[n].idx = cl->idx++;
+		ecm->idx = cl->idx++;
 	}
 
-	cl->ecmtask[n].rc = E_NOCARD;
-	cs_log_dbg(D_TRACE, "---- ecm_task %d, idx %d, sflag=%d", n, cl->ecmtask[n].idx, sflag);
+	ecm->rc = E_NOCARD;
+	cl->pending++;
+
+	ecmtask_unlink(ix->idx_head, ix->idx_next, ix->idx_bucket, n);
+	ecmtask_link(ix->idx_head, ix->idx_next, ix->idx_bucket, n, ecm->idx & ix->mask);
+	ecmtask_unlink(ix->ecm_head, ix->ecm_next, ix->ecm_bucket, n);
+	ecmtask_link(ix->ecm_head, ix->ecm_next, ix->ecm_bucket, n, ecmtask_ecm_bucket(ix, ecm->caid, ecm->ecmd5));
+
+	cs_log_dbg(D_TRACE, "---- ecm_task %d, idx %d, sflag=%d", n, ecm->idx, sflag);
 
 	cs_log_dump_dbg(D_ATR, er->ecm, er->ecmlen, "casc ecm (%s):", (reader) ? reader->label : "n/a");
 	rc = 0;
 
 	if(sflag)
 	{
-		rc = reader->ph.c_send_ecm(cl, &cl->ecmtask[n]);
+		rc = reader->ph.c_send_ecm(cl, ecm);
 		if(rc != 0)
 		{
-			casc_check_dcw(reader, n, 0, cl->ecmtask[n].cw); // simulate "not found"
+			casc_check_dcw(reader, n, 0, ecm->cw); // simulate "not found"
 		}
 		else
-			{ cl->last_idx = cl->ecmtask[n].idx; }
+			{ cl->last_idx = ecm->idx; }
 		reader->last_s = t; // used for inactive_timeout and reconnect_timeout in TCP reader
 	}
 
@@ -1114,28 +1260,29 @@ void reader_get_ecm(struct s_reader *reader, ECM_REQUEST *er)
 	struct s_ecm_answer *ea_er = get_ecm_answer(reader, er);
 	if(!ea_er) { return; }
 
+	ea_er->lat_picked = ecm_latency_now();
+	ecm_latency_add(reader, er->caid, LAT_QUEUE, ea_er->lat_sent);
+
 	struct s_ecm_answer *ea = NULL, *ea_prev = NULL;
 	struct ecm_request_t *ecm;
 	time_t timeout;
 
+	timeout = time(NULL) - ((cfg.ctimeout+500)/1000+1);
+
 	cs_readlock(__func__, &ecmcache_lock);
 
-		for(ecm = ecmcwcache; ecm; ecm = ecm->next)
+		// match same ecm
+		for(ecm = ecmcwcache_find(er->caid, er->ecmd5); ecm; ecm = ecmcwcache_find_next(ecm))
 		{
-			timeout = time(NULL) - ((cfg.ctimeout+500)/1000+1);
 			if(ecm->tps.time <= timeout)
-				{ break; }
+				{ continue; }
 
 			if(!ecm->matching_rdr || ecm == er || ecm->rc == E_99) { continue; }
 
-			// match same ecm
-			if(er->caid == ecm->caid && !memcmp(er->ecmd5, ecm->ecmd5, CS_ECMSTORESIZE))
-			{
-				//check if ask this reader
-				ea = get_ecm_answer(reader, ecm);
-				if(ea && !ea->is_pending && (ea->status & REQUEST_SENT) && ea->rc != E_TIMEOUT && ea->rcEx != E2_RATELIMIT) { break; }
-				ea = NULL;
-			}
+			//check if ask this reader
+			ea = get_ecm_answer(reader, ecm);
+			if(ea && !ea->is_pending && (ea->status & REQUEST_SENT) && ea->rc != E_TIMEOUT && ea->rcEx != E2_RATELIMIT) { break; }
+			ea = NULL;
 		}
 
 		cs_readunlock(__func__, &ecmcache_lock);
@@ -1243,9 +1390,10 @@ int32_t reader_init(struct s_reader *reader)
 		{
 			add_garbage(client->ecmtask);
 			client->ecmtask = NULL;
+			client->ecmtask_index = NULL;
 		}
 
-		if(!cs_malloc(&client->ecmtask, cfg.max_pending * sizeof(ECM_REQUEST)))
+		if(!casc_alloc_ecmtask(client))
 			{ return 0; }
 
 		rdr_log(reader, "proxy initialized, server %s:%d", reader->device, reader->r_port);
@@ -1368,6 +1516,8 @@ static void add_reader_to_active(struct s_reader *rdr)
 		first_active_reader = rdr;
 	}
 	rdr->active = 1;
+	matching_reader_invalidate();
+	cacheex_push_index_invalidate();
 	cs_writeunlock(__func__, &clientlist_lock);
 	cs_writeunlock(__func__, &readerlist_lock);
 }
@@ -1389,6 +1539,8 @@ void remove_reader_from_active(struct s_reader *rdr)
 	}
 	rdr->next = NULL;
 	rdr->active = 0;
+	matching_reader_invalidate();
+	cacheex_push_index_invalidate();
 	cs_writeunlock(__func__, &readerlist_lock);
 }
 
@@ -1516,6 +1668,8 @@ void kill_all_readers(void)
 #endif
 	}
 	first_active_reader = NULL;
+	matching_reader_invalidate();
+	cacheex_push_index_invalidate();
 }
 
 int32_t reader_slots_available(struct s_reader *reader, ECM_REQUEST *er)
@@ -19,6 +19,8 @@ void block_connect(struct s_reader *rdr);
 int32_t is_connect_blocked(struct s_reader *rdr);
 
 void reader_do_idle(struct s_reader *reader);
+bool casc_alloc_ecmtask(struct s_client *cl);
+int32_t casc_get_ecmtask(struct s_client *cl, int32_t idx);
 void casc_check_dcw(struct s_reader *reader, int32_t idx, int32_t rc, uint8_t *cw);
 void reader_do_card_info(struct s_reader *reader);
 int32_t reader_slots_available(struct s_reader *reader, ECM_REQUEST *er);
@@ -0,0 +1,145 @@
+#define MODULE_LOG_PREFIX "trace"
+
+#include "globals.h"
+#include "oscam-string.h"
+#include "oscam-trace.h"
+
+/*
+ * Binary ecm trace, all values big endian:
+ *   file header: "OSCT" + version byte
+ *   record:      sec(4) msec(2) userlen(1) user(userlen) caid(2) prid(4) srvid(2) chid(2) pid(2) ecmlen(2) ecm(ecmlen)
+ */
+
+#define TRACE_MAGIC "OSCT"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_FIXED 21 // record size without user and ecm
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ecm_trace_start(void)
+{
+#ifndef BUILD_REPLAY // the replay binary reads the trace
+	uint8_t hdr[5];
+	long size;
+
+	if(!cfg.ecmtrace || !cfg.ecmtrace[0])
+		{ return; }
+
+	SAFE_MUTEX_LOCK(&trace_lock);
+	if(!trace_file)
+	{
+		trace_file = fopen(cfg.ecmtrace, "ab");
+		if(!trace_file)
+		{
+			cs_log("ERROR: cannot open ecm trace file %s (errno=%d %s)", cfg.ecmtrace, errno, strerror(errno));
+		}
+		else
+		{
+			fseek(trace_file, 0, SEEK_END);
+			size = ftell(trace_file);
+			if(size == 0)
+			{
+				memcpy(hdr, TRACE_MAGIC, 4);
+				hdr[4] = TRACE_VERSION;
+				fwrite(hdr, 1, sizeof(hdr), trace_file);
+			}
+			cs_log("writing ecm trace to %s", cfg.ecmtrace);
+		}
+	}
+	SAFE_MUTEX_UNLOCK(&trace_lock);
+#endif
+}
+
+void ecm_trace_stop(void)
+{
+	SAFE_MUTEX_LOCK(&trace_lock);
+	if(trace_file)
+	{
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	SAFE_MUTEX_UNLOCK(&trace_lock);
+}
+
+void ecm_trace_write(struct s_client *client, ECM_REQUEST *er)
+{
+	uint8_t buf[TRACE_RECORD_FIXED + 255 + MAX_ECM_SIZE];
+	const char *usr;
+	int32_t len, ulen;
+
+	if(!trace_file || er->ecmlen < 0 || er->ecmlen > MAX_ECM_SIZE)
+		{ return; }
+
+	usr = (client && client->account) ? client->account->usr : "";
+	ulen = MIN(cs_strlen(usr), 255);
+
+	i2b_buf(4, er->tps.time, buf);
+	i2b_buf(2, er->tps.millitm, buf + 4);
+	buf[6] = ulen;
+	memcpy(buf + 7, usr, ulen);
+	len = 7 + ulen;
+	i2b_buf(2, er->caid, buf + len);
+	i2b_buf(4, er->prid, buf + len + 2);
+	i2b_buf(2, er->srvid, buf + len + 6);
+	i2b_buf(2, er->chid, buf + len + 8);
+	i2b_buf(2, er->pid, buf + len + 10);
+	i2b_buf(2, er->ecmlen, buf + len + 12);
+	len += 14;
+	memcpy(buf + len, er->ecm, er->ecmlen);
+	len += er->ecmlen;
+
+	SAFE_MUTEX_LOCK(&trace_lock);
+	if(trace_file)
+		{ fwrite(buf, 1, len, trace_file); }
+	SAFE_MUTEX_UNLOCK(&trace_lock);
+}
+
+/* Opens a trace for reading, NULL if the file is missing or no ecm trace. */
+FILE *ecm_trace_open(const char *file)
+{
+	uint8_t hdr[5];
+	FILE *f = fopen(file, "rb");
+
+	if(!f)
+		{ return NULL; }
+
+	if(fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, TRACE_MAGIC, 4) || hdr[4] != TRACE_VERSION)
+	{
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+/* Reads the next record. Returns 1 on success, 0 at end of file and -1 on a broken record. */
+int32_t ecm_trace_read(FILE *f, struct s_trace_ecm *rec)
+{
+	uint8_t buf[14];
+	char usr[256];
+	int32_t ulen;
+
+	if(fread(buf, 1, 7, f) != 7)
+		{ return 0; }
+
+	memset(rec, 0, sizeof(struct s_trace_ecm));
+	rec->tps.time = b2i(4, buf);
+	rec->tps.millitm = b2i(2, buf + 4);
+	ulen = buf[6];
+	if(fread(usr, 1, ulen, f) != (size_t)ulen)
+		{ return -1; }
+	usr[ulen] = '\0';
+	cs_strncpy(rec->usr, usr, sizeof(rec->usr));
+
+	if(fread(buf, 1, 14, f) != 14)
+		{ return -1; }
+	rec->caid = b2i(2, buf);
+	rec->prid = b2i(4, buf + 2);
+	rec->srvid = b2i(2, buf + 6);
+	rec->chid = b2i(2, buf + 8);
+	rec->pid = b2i(2, buf + 10);
+	rec->ecmlen = b2i(2, buf + 12);
+	if(rec->ecmlen < 0 || rec->ecmlen > MAX_ECM_SIZE || fread(rec->ecm, 1, rec->ecmlen, f) != (size_t)rec->ecmlen)
+		{ return -1; }
+	return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef OSCAM_TRACE_H_
+#define OSCAM_TRACE_H_
+
+/* one incoming ecm request as stored in the ecm trace file (ecmtrace in [global]) */
+struct s_trace_ecm
+{
+	struct timeb	tps;							// arrival time
+	char			usr[64];						// requesting account
+	uint16_t		caid;
+	uint32_t		prid;
+	uint16_t		srvid;
+	uint16_t		chid;
+	uint16_t		pid;
+	int16_t			ecmlen;
+	uint8_t			ecm[MAX_ECM_SIZE];
+};
+
+void ecm_trace_start(void);
+void ecm_trace_stop(void);
+void ecm_trace_write(struct s_client *client, ECM_REQUEST *er);
+
+FILE *ecm_trace_open(const char *file);
+int32_t ecm_trace_read(FILE *f, struct s_trace_ecm *rec);
+
+#endif
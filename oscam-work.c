@@ -5,6 +5,7 @@
 #include "oscam-client.h"
 #include "oscam-ecm.h"
 #include "oscam-emm.h"
+#include "oscam-garbage.h"
 #include "oscam-lock.h"
 #include "oscam-net.h"
 #include "oscam-reader.h"
@@ -18,9 +19,12 @@
 #include "module-cccam-data.h"
 #include "module-cccshare.h"
 #include "oscam-time.h"
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 extern CS_MUTEX_LOCK system_lock;
-extern int32_t thread_pipe[2];
+extern int32_t exit_oscam;
 
 struct job_data
 {
@@ -30,8 +34,64 @@ struct job_data
 	void *ptr;
 	struct timeb time;
 	uint16_t len;
+	uint32_t epoch; // garbage epoch of the queueing thread, ptr may point to pooled objects
+};
+
+/* Jobs of a client are queued in a ring of preallocated slots, so add_job()
+   needs neither a malloc nor a lock. Producers claim a position by a CAS on
+   tail and publish the job by setting the sequence number of its slot, the
+   work thread of the client is the only consumer (bounded MPSC queue with
+   sequence numbers, see D. Vyukov). A ring starts with JOB_RING_MIN slots,
+   so thousands of idle clients stay cheap. A full ring is replaced by one of
+   twice the size: the old ring is closed for producers and retired once the
+   work thread has drained it. Jobs which may be lost are dropped instead once
+   the queue is deep enough (see job_drop_depth()).
+
+   cl->thread_lock is only taken to start a work thread or to hand the client
+   back to process_clients(). An idle work thread sleeps in poll() on the
+   client socket (thread_active = 2), on linux it also polls an eventfd which
+   add_job() writes to, elsewhere it is woken with OSCAM_SIGNAL_WAKEUP. */
+#define JOB_RING_MIN 16
+#define JOB_QUEUE_DROP 256	// depth at which droppable jobs are dropped
+#define JOB_POS_MASK 0x7FFFFFFF
+#define JOB_RING_CLOSED 0x80000000	// tail flag, the ring was replaced by ring->next
+
+struct s_job_slot
+{
+	volatile uint32_t	seq;	// pos: free, pos + 1: job queued, pos + size: taken
+	struct job_data		data;
+};
+
+struct s_job_ring
+{
+	uint32_t			mask;	// slots - 1
+	volatile uint32_t	head;	// next position to take, written by the work thread only
+	volatile uint32_t	tail;	// next position to claim
+	struct s_job_ring	*volatile next;
+	struct s_job_slot	*slot;	// allocated behind the ring
 };
 
+struct s_job_queue
+{
+	struct s_job_ring	*volatile ring;	// the work thread takes from this one
+	struct job_data		current;		// job the work thread is running
+	int32_t				wakefd;			// eventfd of the idle work thread, -1 if none
+	volatile uint32_t	enqueued;
+	volatile uint32_t	dropped;
+	volatile uint32_t	max_depth;
+};
+
+// signed distance of two ring positions
+static inline int32_t job_pos_diff(uint32_t a, uint32_t b)
+{
+	return (int32_t)((a - b) << 1) / 2;
+}
+
+static inline uint32_t job_pos_add(uint32_t pos, uint32_t n)
+{
+	return (pos + n) & JOB_POS_MASK;
+}
+
 static void free_job_data(struct job_data *data)
 {
 	if(!data)
@@ -44,29 +104,323 @@ static void free_job_data(struct job_data *data)
 			NULLFREE(((struct s_write_from_cache *)data->ptr)->er_cache);
 		}
 
-		NULLFREE(data->ptr);
+		if(data->action == ACTION_CLIENT_UDP) // back to the listener pool
+			{ udp_buf_free(data->ptr); }
+		else
+			{ NULLFREE(data->ptr); }
+	}
+	data->ptr = NULL;
+}
+
+/* Queue depth at which a job of this action is dropped instead of queued,
+   0 for jobs which must not get lost. */
+static uint32_t job_drop_depth(enum actions action)
+{
+	switch(action)
+	{
+		case ACTION_CACHE_PUSH_OUT:
+			return JOB_QUEUE_DROP * 3 / 4; // keep room for ecm and answer jobs
+		case ACTION_CLIENT_UDP:
+		case ACTION_CLIENT_IDLE:
+		case ACTION_PEER_IDLE:
+		case ACTION_READER_CHECK_HEALTH:
+		case ACTION_READER_POLL_STATUS:
+			return JOB_QUEUE_DROP; // resent by the peer or repeated by the caller
+		default:
+			return 0;
+	}
+}
+
+static struct s_job_ring *job_ring_create(uint32_t size)
+{
+	struct s_job_ring *ring;
+	uint32_t i;
+
+	if(!cs_malloc(&ring, sizeof(struct s_job_ring) + size * sizeof(struct s_job_slot)))
+		{ return NULL; }
+	ring->mask = size - 1;
+	ring->slot = (struct s_job_slot *)(ring + 1);
+	for(i = 0; i < size; i++)
+		{ ring->slot[i].seq = i; }
+	return ring;
+}
+
+// the queue is created by the first add_job(), producers may race for it
+static struct s_job_queue *job_queue_get(struct s_client *cl)
+{
+	struct s_job_queue *queue = cl->jobqueue;
+
+	if(queue)
+		{ return queue; }
+	if(!cs_malloc(&queue, sizeof(struct s_job_queue)))
+		{ return NULL; }
+	if(!(queue->ring = job_ring_create(JOB_RING_MIN)))
+	{
+		NULLFREE(queue);
+		return NULL;
+	}
+	queue->wakefd = -1;
+	if(!__sync_bool_compare_and_swap(&cl->jobqueue, NULL, queue))
+	{
+		NULLFREE(queue->ring);
+		NULLFREE(queue);
+	}
+	return cl->jobqueue;
+}
+
+// claimed jobs including the ones not yet published, producers and readers may race
+static uint32_t job_queue_depth(struct s_job_queue *queue)
+{
+	struct s_job_ring *ring;
+	uint32_t head;
+	int32_t depth = 0, n;
+
+	if(!queue)
+		{ return 0; }
+	for(ring = queue->ring; ring; ring = ring->next)
+	{
+		head = ring->head; // before tail, head never passes it
+		n = job_pos_diff(ring->tail & JOB_POS_MASK, head);
+		if(n > 0)
+			{ depth += n; }
+	}
+	return depth;
+}
+
+/* Replaces a full ring by one of twice the size. Rare, so it is serialized by
+   cl->thread_lock. Returns 0 if there is no memory. */
+static int8_t job_ring_grow(struct s_client *cl, struct s_job_ring *ring)
+{
+	struct s_job_ring *bigger;
+	uint32_t tail;
+	int8_t ok = 1;
+
+	SAFE_MUTEX_LOCK(&cl->thread_lock);
+	if(!(ring->tail & JOB_RING_CLOSED))
+	{
+		if((bigger = job_ring_create((ring->mask + 1) * 2)))
+		{
+			ring->next = bigger;
+			__sync_synchronize();
+			do
+				{ tail = ring->tail; }
+			while(!__sync_bool_compare_and_swap(&ring->tail, tail, tail | JOB_RING_CLOSED));
+		}
+		else
+			{ ok = 0; }
+	}
+	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+	return ok;
+}
+
+// returns 0 if the job was dropped
+static int8_t job_ring_put(struct s_client *cl, enum actions action, void *ptr, int32_t len)
+{
+	struct s_job_queue *queue;
+	struct s_job_ring *ring;
+	struct s_job_slot *slot;
+	uint32_t tail, depth, drop_depth, max;
+	int32_t diff;
+
+	if(!(queue = job_queue_get(cl)))
+		{ return 0; }
+
+	depth = job_queue_depth(queue);
+	drop_depth = job_drop_depth(action);
+	if(drop_depth && depth >= drop_depth)
+	{
+		uint32_t dropped = __sync_add_and_fetch(&queue->dropped, 1);
+		if(dropped == 1 || !(dropped % 1000))
+		{
+			cs_log_dbg(D_TRACE, "WARNING: job queue %s %s is full (%u jobs), action %d dropped (%u total)",
+						cl->typ == 'c' ? "client" : "reader", username(cl), depth, action, dropped);
+		}
+		// a work thread which exited without clearing thread_active never drains the ring
+		SAFE_MUTEX_LOCK(&cl->thread_lock);
+		if(cl->thread && cl->thread_active && pthread_detach(cl->thread) == ESRCH)
+		{
+			cl->thread_active = 0;
+			cs_log_dbg(D_TRACE, "WARNING: %s %s thread died!", cl->typ == 'c' ? "client" : "reader", username(cl));
+		}
+		SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+		return 0;
+	}
+
+	ring = queue->ring;
+	while(1)
+	{
+		tail = ring->tail;
+		if(tail & JOB_RING_CLOSED)
+		{
+			__sync_synchronize(); // next was set before the ring was closed
+			ring = ring->next;
+			continue;
+		}
+		slot = &ring->slot[tail & ring->mask];
+		diff = job_pos_diff(slot->seq, tail);
+		if(!diff && __sync_bool_compare_and_swap(&ring->tail, tail, job_pos_add(tail, 1)))
+			{ break; }
+		if(diff < 0 && !job_ring_grow(cl, ring)) // slot still holds the job of the previous round
+			{ return 0; }
+	}
+
+	slot->data.action = action;
+	slot->data.rdr = NULL;
+	slot->data.ptr = ptr;
+	slot->data.cl = cl;
+	slot->data.len = len;
+	slot->data.epoch = garbage_epoch();
+	cs_ftime(&slot->data.time);
+	__sync_synchronize();
+	slot->seq = job_pos_add(tail, 1);
+
+	__sync_add_and_fetch(&queue->enqueued, 1);
+	depth++;
+	while((max = queue->max_depth) < depth && !__sync_bool_compare_and_swap(&queue->max_depth, max, depth)) { ; }
+	return 1;
+}
+
+// moves the next job to queue->current, called by the work thread of the client only
+static struct job_data *job_ring_take(struct s_client *cl)
+{
+	struct s_job_queue *queue = cl->jobqueue;
+	struct s_job_ring *ring;
+	struct s_job_slot *slot;
+	uint32_t head;
+
+	if(!queue)
+		{ return NULL; }
+
+	ring = queue->ring;
+	while(1)
+	{
+		head = ring->head;
+		slot = &ring->slot[head & ring->mask];
+		if(slot->seq == job_pos_add(head, 1))
+			{ break; }
+		// empty, or a producer has not yet published its job
+		if(!(ring->tail & JOB_RING_CLOSED) || (ring->tail & JOB_POS_MASK) != head)
+			{ return NULL; }
+		// a replaced ring is drained, producers may still look at it
+		queue->ring = ring->next;
+		add_garbage(ring);
+		ring = queue->ring;
+	}
+
+	__sync_synchronize();
+	queue->current = slot->data;
+	garbage_hold(queue->current.epoch); // before the slot is released, see garbage_safe_epoch()
+	__sync_synchronize();
+	slot->seq = job_pos_add(head, ring->mask + 1);
+	ring->head = job_pos_add(head, 1);
+	return &queue->current;
+}
+
+/* Oldest garbage epoch of the queued jobs, returns 0 if there are none. A job
+   which is claimed but not yet published counts as epoch 0. */
+int8_t job_queue_epoch(struct s_client *cl, uint32_t *epoch)
+{
+	struct s_job_queue *queue;
+	struct s_job_ring *ring;
+	struct s_job_slot *slot;
+	uint32_t pos, tail, job_epoch;
+	int32_t diff;
+	int8_t found = 0;
+
+	if(!cl || !(queue = cl->jobqueue))
+		{ return 0; }
+	for(ring = queue->ring; ring; ring = ring->next)
+	{
+		pos = ring->head;
+		tail = ring->tail & JOB_POS_MASK;
+		for(; job_pos_diff(tail, pos) > 0; pos = job_pos_add(pos, 1))
+		{
+			slot = &ring->slot[pos & ring->mask];
+			diff = job_pos_diff(slot->seq, job_pos_add(pos, 1));
+			if(diff > 0)
+				{ continue; } // taken meanwhile
+			__sync_synchronize();
+			job_epoch = diff ? 0 : slot->data.epoch;
+			if(!found || job_epoch < *epoch)
+			{
+				*epoch = job_epoch;
+				found = 1;
+			}
+		}
+	}
+	return found;
+}
+
+int32_t job_queue_length(struct s_client *cl)
+{
+	if(!cl)
+		{ return 0; }
+	return job_queue_depth(cl->jobqueue);
+}
+
+void job_queue_stats(struct s_client *cl, struct s_job_stats *stats)
+{
+	struct s_job_queue *queue;
+	struct s_job_ring *ring;
+
+	memset(stats, 0, sizeof(struct s_job_stats));
+	if(!cl || !(queue = cl->jobqueue))
+		{ return; }
+	stats->queued = job_queue_depth(queue);
+	stats->enqueued = queue->enqueued;
+	stats->dropped = queue->dropped;
+	stats->max_depth = queue->max_depth;
+	for(ring = queue->ring; ring; ring = ring->next)
+		{ stats->slots += ring->mask + 1; }
+}
+
+// wakes the work thread sleeping in poll()
+static void job_queue_wakeup(struct s_client *cl)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	if(cl->jobqueue && cl->jobqueue->wakefd >= 0)
+	{
+		if(write(cl->jobqueue->wakefd, &one, sizeof(one)) < 0)
+			{ cs_log_dbg(D_TRACE, "eventfd write failed (errno=%d %s)", errno, strerror(errno)); }
+		return;
 	}
-	NULLFREE(data);
+#endif
+	pthread_kill(cl->thread, OSCAM_SIGNAL_WAKEUP);
 }
 
 void free_joblist(struct s_client *cl)
 {
 	int32_t lock_status = pthread_mutex_trylock(&cl->thread_lock);
-	LL_ITER it = ll_iter_create(cl->joblist);
+	struct s_job_queue *queue = cl->jobqueue;
+	struct s_job_ring *ring, *next;
+	struct s_job_slot *slot;
 
-	struct job_data *data;
-	while((data = ll_iter_next(&it)))
+	if(queue)
 	{
-		free_job_data(data);
+		for(ring = queue->ring; ring; ring = next)
+		{
+			for(; ring->head != (ring->tail & JOB_POS_MASK); ring->head = job_pos_add(ring->head, 1))
+			{
+				slot = &ring->slot[ring->head & ring->mask];
+				if(slot->seq == job_pos_add(ring->head, 1))
+					{ free_job_data(&slot->data); }
+			}
+			next = ring->next;
+			NULLFREE(ring);
+		}
+		if(queue->wakefd >= 0)
+			{ close(queue->wakefd); }
 	}
-
-	ll_destroy(&cl->joblist);
 	cl->account = NULL;
 
 	if(cl->work_job_data) // Free job_data that was not freed by work_thread
 		{ free_job_data(cl->work_job_data); }
 
 	cl->work_job_data = NULL;
+	cl->jobqueue = NULL;
+	NULLFREE(queue);
 
 	if(lock_status == 0)
 		{ SAFE_MUTEX_UNLOCK(&cl->thread_lock); }
@@ -103,21 +457,293 @@ static void set_work_thread_name(struct job_data *data)
 		job_data = NULL; \
 	} while(0)
 
+#ifdef CS_ANTICASC
+/* Hides the shared cards from a client for the anticascading penalty. The
+   cards are unhidden by a later job queued from client_check_status(), so
+   the penalty does not block the work thread. */
+static void work_hidecards(struct s_client *cl, int8_t hide)
+{
+	int32_t hidetime, hide_count, cardsize, ii, uu = 0;
+	LLIST **sharelist, *sharelist2;
+	struct cc_card **cardarray;
+
+	if(!config_enabled(MODULE_CCCSHARE))
+		{ return; }
+
+	hidetime = (cl->account->acosc_penalty_duration == -1 ? cfg.acosc_penalty_duration : cl->account->acosc_penalty_duration);
+	if(hide && !hidetime)
+		{ return; }
+
+	sharelist = get_and_lock_sharelist();
+	sharelist2 = ll_create("hidecards-sharelist");
+	for(ii = 0; ii < CAID_KEY; ii++)
+	{
+		if(sharelist[ii])
+			{ ll_putall(sharelist2, sharelist[ii]); }
+	}
+	unlock_sharelist();
+
+	cardarray = get_sorted_card_copy(sharelist2, 0, &cardsize);
+	ll_destroy(&sharelist2);
+
+	for(ii = 0; ii < cardsize; ii++)
+	{
+		if(!hidecards_card_valid_for_client(cl, cardarray[ii]) || !cardarray[ii]->id)
+			{ continue; }
+
+		if(hide)
+		{
+			hide_count = hide_card_to_client(cardarray[ii], cl);
+			if(hide_count)
+			{
+				cs_log_dbg(D_TRACE, "Hiding card_%d caid=%04x remoteid=%08x from %s for %d %s",
+						uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl), hidetime, hidetime>1 ? "secconds" : "seccond");
+				uu += 1;
+			}
+		}
+		else
+		{
+			hide_count = unhide_card_to_client(cardarray[ii], cl);
+			if(hide_count)
+			{
+				cs_log_dbg(D_TRACE, "Unhiding card_%d caid=%04x remoteid=%08x for %s",
+						uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl));
+				uu += 1;
+			}
+		}
+	}
+	NULLFREE(cardarray);
+
+	cl->hidecards_until = hide ? time(NULL) + hidetime : 0;
+}
+#endif
+
+static void work_do_job(struct s_client *cl, struct job_data *data, uint8_t *mbuf, uint16_t bufsize, int8_t *restart_reader)
+{
+	struct s_reader *reader = cl->reader;
+	struct s_module *module = get_module(cl);
+	int32_t n, rc, i, idx, s;
+	uint8_t dcw[16];
+
+	switch(data->action)
+	{
+		case ACTION_READER_IDLE:
+			reader_do_idle(reader);
+			break;
+
+		case ACTION_READER_REMOTE:
+			s = check_fd_for_data(cl->pfd);
+			if(s == 0) // no data, another thread already read from fd?
+				{ break; }
+			if(s < 0)
+			{
+				if(cl->reader->ph.type == MOD_CONN_TCP)
+					{ network_tcp_connection_close(reader, "disconnect"); }
+				break;
+			}
+			rc = cl->reader->ph.recv(cl, mbuf, bufsize);
+			if(rc < 0)
+			{
+				if(cl->reader->ph.type == MOD_CONN_TCP)
+					{
+						network_tcp_connection_close(reader, "disconnect on receive");
+#ifdef CS_CACHEEX_AIO
+						cl->cacheex_aio_checked = 0;
+#endif
+					}
+				break;
+			}
+			cl->last = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER ****************
+			idx = cl->reader->ph.c_recv_chk(cl, dcw, &rc, mbuf, rc);
+			if(idx < 0) { break; }  // no dcw received
+			if(!idx) { idx = cl->last_idx; }
+			cl->reader->last_g = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER **************** // for reconnect timeout
+			if((i = casc_get_ecmtask(cl, idx)) >= 0)
+				{ casc_check_dcw(reader, i, rc, dcw); }
+			break;
+
+		case ACTION_READER_RESET:
+			cardreader_do_reset(reader);
+			break;
+
+		case ACTION_READER_ECM_REQUEST:
+			reader_get_ecm(reader, data->ptr);
+			break;
+
+		case ACTION_READER_EMM:
+			reader_do_emm(reader, data->ptr);
+			break;
+
+		case ACTION_READER_CARDINFO:
+			reader_do_card_info(reader);
+			break;
+
+		case ACTION_READER_POLL_STATUS:
+			cardreader_poll_status(reader);
+			break;
+
+#ifdef READER_NAGRA_MERLIN
+		case ACTION_READER_RENEW_SK:
+			CAK7_getCamKey(reader);
+			break;
+#endif
+
+		case ACTION_READER_INIT:
+			if(!cl->init_done)
+				{ reader_init(reader); }
+			break;
+
+		case ACTION_READER_RESTART:
+			cl->kill = 1;
+			*restart_reader = 1;
+			break;
+
+		case ACTION_READER_RESET_FAST:
+			cl->reader->card_status = CARD_NEED_INIT;
+			cardreader_do_reset(reader);
+			break;
+
+		case ACTION_READER_CHECK_HEALTH:
+			cardreader_do_checkhealth(reader);
+			break;
+
+		case ACTION_READER_CAPMT_NOTIFY:
+			if(cl->reader->ph.c_capmt) { cl->reader->ph.c_capmt(cl, data->ptr); }
+			break;
+
+		case ACTION_CLIENT_UDP:
+			n = module->recv(cl, data->ptr, data->len);
+			if(n < 0) { break; }
+			module->s_handler(cl, data->ptr, n);
+			break;
+
+		case ACTION_CLIENT_TCP:
+			s = check_fd_for_data(cl->pfd);
+			if(s == 0) // no data, another thread already read from fd?
+				{ break; }
+			if(s < 0) // system error or fd wants to be closed
+			{
+				cl->kill = 1; // kill client on next run
+				break;
+			}
+			n = module->recv(cl, mbuf, bufsize);
+			if(n < 0)
+			{
+				cl->kill = 1; // kill client on next run
+				break;
+			}
+			module->s_handler(cl, mbuf, n);
+			break;
+
+		case ACTION_CACHEEX1_DELAY:
+			cacheex_mode1_delay(data->ptr);
+			break;
+
+		case ACTION_CACHEEX_TIMEOUT:
+			cacheex_timeout(data->ptr);
+			break;
+
+		case ACTION_FALLBACK_TIMEOUT:
+			fallback_timeout(data->ptr);
+			break;
+
+		case ACTION_CLIENT_TIMEOUT:
+			ecm_timeout(data->ptr);
+			break;
+
+		case ACTION_ECM_ANSWER_READER:
+			chk_dcw(data->ptr);
+			break;
+
+		case ACTION_ECM_ANSWER_CACHE:
+			write_ecm_answer_fromcache(data->ptr);
+			break;
+
+		case ACTION_CLIENT_INIT:
+			if(module->s_init)
+				{ module->s_init(cl); }
+			cl->is_udp = module->type == MOD_CONN_UDP;
+			cl->init_done = 1;
+			break;
+
+		case ACTION_CLIENT_IDLE:
+			if(module->s_idle)
+				{ module->s_idle(cl); }
+			else
+			{
+				cs_log("user %s reached %d sec idle limit.", username(cl), cfg.cmaxidle);
+				cl->kill = 1;
+			}
+			break;
+
+		case ACTION_CACHE_PUSH_OUT:
+			cacheex_push_out(cl, data->ptr);
+			break;
+
+		case ACTION_CACHE_PUSH_FLUSH:
+			cacheex_push_batch_flush(cl);
+			break;
+
+		case ACTION_CLIENT_ECM:
+			get_cw(cl, data->ptr);
+			break;
+
+		case ACTION_CLIENT_KILL:
+			cl->kill = 1;
+			break;
+
+		case ACTION_CLIENT_SEND_MSG:
+		{
+			if (config_enabled(MODULE_CCCAM))
+			{
+				struct s_clientmsg *clientmsg = (struct s_clientmsg *)data->ptr;
+				cc_cmd_send(cl, clientmsg->msg, clientmsg->len, clientmsg->cmd);
+			}
+			break;
+		}
+
+		case ACTION_PEER_IDLE:
+			if(module->s_peer_idle)
+				{ module->s_peer_idle(cl); }
+			break;
+
+		case ACTION_CLIENT_HIDECARDS:
+#ifdef CS_ANTICASC
+			work_hidecards(cl, 1);
+#endif
+			break;
+
+		case ACTION_CLIENT_UNHIDECARDS:
+#ifdef CS_ANTICASC
+			work_hidecards(cl, 0);
+#endif
+			break;
+
+	} // switch
+}
+
 void *work_thread(void *ptr)
 {
-	struct job_data *data = (struct job_data *)ptr;
-	struct s_client *cl = data->cl;
+	struct s_client *cl = (struct s_client *)ptr;
+	struct job_data *data;
 	struct s_reader *reader = cl->reader;
 	struct timeb start, end; // start time poll, end time poll
 
 	struct job_data tmp_data;
-	struct pollfd pfd[1];
+	struct pollfd pfd[2];
+	int32_t npfd;
+	uint64_t wakeups;
 
 	SAFE_SETSPECIFIC(getclient, cl);
 	cl->thread = pthread_self();
+
+	SAFE_MUTEX_LOCK(&cl->thread_lock);
 	cl->thread_active = 1;
+	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+	data = job_ring_take(cl);
 
-	set_work_thread_name(data);
+	if(data)
+		{ set_work_thread_name(data); }
 
 	struct s_module *module = get_module(cl);
 	uint16_t bufsize = module->bufsize; // CCCam needs more than 1024bytes!
@@ -129,8 +755,7 @@ void *work_thread(void *ptr)
 		{ return NULL; }
 
 	cl->work_mbuf = mbuf; // Track locally allocated data, because some callback may call cs_exit/cs_disconect_client/pthread_exit and then mbuf would be leaked
-	int32_t n = 0, rc = 0, i, idx, s;
-	uint8_t dcw[16];
+	int32_t rc;
 	int8_t restart_reader = 0;
 
 	while(cl->thread_active)
@@ -163,16 +788,9 @@ void *work_thread(void *ptr)
 				if(!cl->kill && cl->typ != 'r')
 					{ client_check_status(cl); } // do not call for physical readers as this might cause an endless job loop
 
-				SAFE_MUTEX_LOCK(&cl->thread_lock);
-				if(cl->joblist && ll_count(cl->joblist) > 0)
-				{
-					LL_ITER itr = ll_iter_create(cl->joblist);
-					data = ll_iter_next_remove(&itr);
-					if(data)
-						{ set_work_thread_name(data); }
-					//cs_log_dbg(D_TRACE, "start next job from list action=%d", data->action);
-				}
-				SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+				data = job_ring_take(cl);
+				if(data)
+					{ set_work_thread_name(data); }
 			}
 
 			if(!data)
@@ -184,18 +802,38 @@ void *work_thread(void *ptr)
 
 				pfd[0].fd = cl->pfd;
 				pfd[0].events = POLLIN | POLLPRI;
+				pfd[0].revents = 0;
+				npfd = 1;
+#ifdef __linux__
+				if(cl->jobqueue && cl->jobqueue->wakefd < 0)
+					{ cl->jobqueue->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+				if(cl->jobqueue && cl->jobqueue->wakefd >= 0)
+				{
+					pfd[1].fd = cl->jobqueue->wakefd;
+					pfd[1].events = POLLIN;
+					npfd = 2;
+				}
+#endif
 
-				SAFE_MUTEX_LOCK(&cl->thread_lock);
+				// add_job() queues before it reads thread_active, so either side sees the other
 				cl->thread_active = 2;
-				SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+				__sync_synchronize();
+				if(job_queue_length(cl) > 0)
+				{
+					cl->thread_active = 1;
+					continue;
+				}
 
-				rc = poll(pfd, 1, 3000);
+				garbage_offline();
+				rc = poll(pfd, npfd, 3000);
+				garbage_online();
 
-				SAFE_MUTEX_LOCK(&cl->thread_lock);
 				cl->thread_active = 1;
-				SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 
-				if(rc > 0)
+				if(npfd == 2 && pfd[1].revents && read(pfd[1].fd, &wakeups, sizeof(wakeups)) < 0)
+					{ cs_log_dbg(D_TRACE, "eventfd read failed (errno=%d %s)", errno, strerror(errno)); }
+
+				if(rc > 0 && pfd[0].revents)
 				{
 					cs_ftime(&end); // register end time
 					cs_log_dbg(D_TRACE, "[OSCAM-WORK] new event %d occurred on fd %d after %"PRId64" ms inactivity", pfd[0].revents,
@@ -242,288 +880,32 @@ void *work_thread(void *ptr)
 			{
 				cs_log_dbg(D_TRACE, "dropping client data for %s time %"PRId64" ms", username(cl), gone);
 				__free_job_data(cl, data);
+				garbage_quiescent();
 				continue;
 			}
 
 			if(data != &tmp_data)
 				{ cl->work_job_data = data; } // Track the current job_data
 
-			switch(data->action)
-			{
-				case ACTION_READER_IDLE:
-					reader_do_idle(reader);
-					break;
-
-				case ACTION_READER_REMOTE:
-					s = check_fd_for_data(cl->pfd);
-					if(s == 0) // no data, another thread already read from fd?
-						{ break; }
-					if(s < 0)
-					{
-						if(cl->reader->ph.type == MOD_CONN_TCP)
-							{ network_tcp_connection_close(reader, "disconnect"); }
-						break;
-					}
-					rc = cl->reader->ph.recv(cl, mbuf, bufsize);
-					if(rc < 0)
-					{
-						if(cl->reader->ph.type == MOD_CONN_TCP)
-							{
-								network_tcp_connection_close(reader, "disconnect on receive");
-#ifdef CS_CACHEEX_AIO
-								cl->cacheex_aio_checked = 0;
-#endif
-							}
-						break;
-					}
-					cl->last = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER ****************
-					idx = cl->reader->ph.c_recv_chk(cl, dcw, &rc, mbuf, rc);
-					if(idx < 0) { break; }  // no dcw received
-					if(!idx) { idx = cl->last_idx; }
-					cl->reader->last_g = time(NULL); // *********************************** TO BE REPLACE BY CS_FTIME() LATER **************** // for reconnect timeout
-					for(i = 0, n = 0; i < cfg.max_pending && n == 0; i++)
-					{
-						if(cl->ecmtask[i].idx == idx)
-						{
-							cl->pending--;
-							casc_check_dcw(reader, i, rc, dcw);
-							n++;
-						}
-					}
-					break;
-
-				case ACTION_READER_RESET:
-					cardreader_do_reset(reader);
-					break;
-
-				case ACTION_READER_ECM_REQUEST:
-					reader_get_ecm(reader, data->ptr);
-					break;
-
-				case ACTION_READER_EMM:
-					reader_do_emm(reader, data->ptr);
-					break;
-
-				case ACTION_READER_CARDINFO:
-					reader_do_card_info(reader);
-					break;
-
-				case ACTION_READER_POLL_STATUS:
-					cardreader_poll_status(reader);
-					break;
-
-#ifdef READER_NAGRA_MERLIN
-				case ACTION_READER_RENEW_SK:
-					CAK7_getCamKey(reader);
-					break;
-#endif
-
-				case ACTION_READER_INIT:
-					if(!cl->init_done)
-						{ reader_init(reader); }
-					break;
-
-				case ACTION_READER_RESTART:
-					cl->kill = 1;
-					restart_reader = 1;
-					break;
-
-				case ACTION_READER_RESET_FAST:
-					cl->reader->card_status = CARD_NEED_INIT;
-					cardreader_do_reset(reader);
-					break;
-
-				case ACTION_READER_CHECK_HEALTH:
-					cardreader_do_checkhealth(reader);
-					break;
-
-				case ACTION_READER_CAPMT_NOTIFY:
-					if(cl->reader->ph.c_capmt) { cl->reader->ph.c_capmt(cl, data->ptr); }
-					break;
-
-				case ACTION_CLIENT_UDP:
-					n = module->recv(cl, data->ptr, data->len);
-					if(n < 0) { break; }
-					module->s_handler(cl, data->ptr, n);
-					break;
-
-				case ACTION_CLIENT_TCP:
-					s = check_fd_for_data(cl->pfd);
-					if(s == 0) // no data, another thread already read from fd?
-						{ break; }
-					if(s < 0) // system error or fd wants to be closed
-					{
-						cl->kill = 1; // kill client on next run
-						continue;
-					}
-					n = module->recv(cl, mbuf, bufsize);
-					if(n < 0)
-					{
-						cl->kill = 1; // kill client on next run
-						continue;
-					}
-					module->s_handler(cl, mbuf, n);
-					break;
-
-				case ACTION_CACHEEX1_DELAY:
-					cacheex_mode1_delay(data->ptr);
-					break;
-
-				case ACTION_CACHEEX_TIMEOUT:
-					cacheex_timeout(data->ptr);
-					break;
-
-				case ACTION_FALLBACK_TIMEOUT:
-					fallback_timeout(data->ptr);
-					break;
-
-				case ACTION_CLIENT_TIMEOUT:
-					ecm_timeout(data->ptr);
-					break;
-
-				case ACTION_ECM_ANSWER_READER:
-					chk_dcw(data->ptr);
-					break;
-
-				case ACTION_ECM_ANSWER_CACHE:
-					write_ecm_answer_fromcache(data->ptr);
-					break;
-
-				case ACTION_CLIENT_INIT:
-					if(module->s_init)
-						{ module->s_init(cl); }
-					cl->is_udp = module->type == MOD_CONN_UDP;
-					cl->init_done = 1;
-					break;
-
-				case ACTION_CLIENT_IDLE:
-					if(module->s_idle)
-						{ module->s_idle(cl); }
-					else
-					{
-						cs_log("user %s reached %d sec idle limit.", username(cl), cfg.cmaxidle);
-						cl->kill = 1;
-					}
-					break;
-
-				case ACTION_CACHE_PUSH_OUT:
-					cacheex_push_out(cl, data->ptr);
-					break;
-
-				case ACTION_CLIENT_KILL:
-					cl->kill = 1;
-					break;
-
-				case ACTION_CLIENT_SEND_MSG:
-				{
-					if (config_enabled(MODULE_CCCAM))
-					{
-						struct s_clientmsg *clientmsg = (struct s_clientmsg *)data->ptr;
-						cc_cmd_send(cl, clientmsg->msg, clientmsg->len, clientmsg->cmd);
-					}
-					break;
-				}
-
-				case ACTION_PEER_IDLE:
-					if(module->s_peer_idle)
-						{ module->s_peer_idle(cl); }
-					break;
-
-				case ACTION_CLIENT_HIDECARDS:
-				{
-#ifdef CS_ANTICASC
-					if(config_enabled(MODULE_CCCSHARE))
-					{
-						int32_t hidetime = (cl->account->acosc_penalty_duration == -1 ? cfg.acosc_penalty_duration : cl->account->acosc_penalty_duration);
-						if(hidetime)
-						{
-							int32_t hide_count;
-							int32_t cardsize;
-							int32_t ii, uu=0;
-							LLIST **sharelist = get_and_lock_sharelist();
-							LLIST *sharelist2 = ll_create("hidecards-sharelist");
-
-							for(ii = 0; ii < CAID_KEY; ii++)
-							{
-								if(sharelist[ii])
-								{
-									ll_putall(sharelist2, sharelist[ii]);
-								}
-							}
-
-							unlock_sharelist();
-
-							struct cc_card **cardarray = get_sorted_card_copy(sharelist2, 0, &cardsize);
-							ll_destroy(&sharelist2);
-
-							for(ii = 0; ii < cardsize; ii++)
-							{
-								if(hidecards_card_valid_for_client(cl, cardarray[ii]))
-								{
-									if (cardarray[ii]->id)
-									{
-										hide_count = hide_card_to_client(cardarray[ii], cl);
-										if(hide_count)
-										{
-											cs_log_dbg(D_TRACE, "Hiding card_%d caid=%04x remoteid=%08x from %s for %d %s",
-												 uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl), hidetime, hidetime>1 ? "secconds" : "seccond");
-											uu += 1;
-										}
-									}
-								}
-							}
-
-							cs_sleepms(hidetime * 1000);
-							uu = 0;
-
-							for(ii = 0; ii < cardsize; ii++)
-							{
-								if(hidecards_card_valid_for_client(cl, cardarray[ii]))
-								{
-									if (cardarray[ii]->id)
-									{
-										hide_count = unhide_card_to_client(cardarray[ii], cl);
-										if(hide_count)
-										{
-											cs_log_dbg(D_TRACE, "Unhiding card_%d caid=%04x remoteid=%08x for %s",
-											 uu, cardarray[ii]->caid, cardarray[ii]->remote_id, username(cl));
-											uu += 1;
-										}
-									}
-								}
-							}
-
-							NULLFREE(cardarray);
-						}
-					}
-#endif
-					break;
-				} // case ACTION_CLIENT_HIDECARDS
-
-			} // switch
+			work_do_job(cl, data, mbuf, bufsize, &restart_reader);
 
 			__free_job_data(cl, data);
-		}
-
-		if(thread_pipe[1] && (mbuf[0] != 0x00))
-		{
-			cs_log_dump_dbg(D_TRACE, mbuf, 1, "[OSCAM-WORK] Write to pipe:");
-			if(write(thread_pipe[1], mbuf, 1) == -1)    // wakeup client check
-			{
-				cs_log_dbg(D_TRACE, "[OSCAM-WORK] Writing to pipe failed (errno=%d %s)", errno, strerror(errno));
-			}
+			garbage_quiescent();
 		}
 
 		// Check for some race condition where while we ended, another thread added a job
 		SAFE_MUTEX_LOCK(&cl->thread_lock);
-		if(cl->joblist && ll_count(cl->joblist) > 0)
+		cl->thread_active = 0;
+		__sync_synchronize();
+		if(job_queue_length(cl) > 0)
 		{
+			cl->thread_active = 1;
 			SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 			continue;
 		}
 		else
 		{
-			cl->thread_active = 0;
+			watch_client_fd(cl); // the socket goes back to process_clients()
 			SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 			break;
 		}
@@ -535,6 +917,180 @@ void *work_thread(void *ptr)
 	return NULL;
 }
 
+/* Worker pool, enabled with [global] workerthreads. Instead of a thread per
+   client, a fixed number of workers runs the jobs of the clients on the run
+   queue. A client is queued when a job arrives while it has none running
+   (thread_active = 1) and is owned by one worker until its ring is empty, so
+   its jobs keep their order and never run in parallel. A worker runs at most
+   WORK_POOL_BATCH jobs of a client before putting it back at the end of the
+   queue. Sockets of idle clients are watched by process_clients() only.
+   Readers keep their own thread, card access and proxy connects may block for
+   seconds. */
+#define WORK_POOL_BATCH 16
+
+struct s_work_buf
+{
+	uint8_t		*data;
+	uint16_t	size;
+};
+
+static pthread_mutex_t work_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_pool_cond;
+static struct s_client *work_queue_first, *work_queue_last;
+static int32_t work_pool_size;
+
+// call with work_pool_lock held
+static void work_pool_queue(struct s_client *cl)
+{
+	cl->work_next = NULL;
+	if(work_queue_last)
+		{ work_queue_last->work_next = cl; }
+	else
+		{ work_queue_first = cl; }
+	work_queue_last = cl;
+	SAFE_COND_SIGNAL(&work_pool_cond);
+}
+
+static void work_pool_run(struct s_client *cl, struct s_work_buf *buf)
+{
+	struct s_reader *reader = cl->reader;
+	struct s_module *module = get_module(cl);
+	struct job_data *data;
+	struct timeb actualtime;
+	int64_t gone;
+	int32_t jobs = 0;
+	int8_t restart_reader = 0;
+	uint16_t bufsize = module->bufsize;
+
+	if(!bufsize)
+		{ bufsize = DEFAULT_MODULE_BUFSIZE; }
+	if(bufsize > buf->size)
+	{
+		if(!cs_realloc(&buf->data, bufsize))
+		{
+			buf->size = 0;
+			return;
+		}
+		buf->size = bufsize;
+	}
+
+	SAFE_SETSPECIFIC(getclient, cl);
+	cl->thread = pthread_self();
+
+	while(1)
+	{
+		if(cl->kill || !is_valid_client(cl))
+		{
+			SAFE_MUTEX_LOCK(&cl->thread_lock);
+			cl->thread_active = 0;
+			SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+			cs_log_dbg(D_TRACE, "ending client jobs (kill)");
+			free_client(cl);
+			if(restart_reader)
+				{ restart_cardreader(reader, 0); }
+			SAFE_SETSPECIFIC(getclient, NULL);
+			return;
+		}
+
+		if(jobs++ >= WORK_POOL_BATCH)
+			{ break; }
+
+		if(!(data = job_ring_take(cl)))
+			{ break; }
+
+		if(data->action != ACTION_READER_CHECK_HEALTH)
+			{ cs_log_dbg(D_TRACE, "data from add_job action=%d client %c %s", data->action, cl->typ, username(cl)); }
+
+		cs_ftime(&actualtime);
+		gone = comp_timeb(&actualtime, &data->time);
+		if(gone > (int) cfg.ctimeout + 1000)
+			{ cs_log_dbg(D_TRACE, "dropping client data for %s time %"PRId64" ms", username(cl), gone); }
+		else if(data->action && (reader || data->action >= ACTION_CLIENT_FIRST))
+		{
+			cl->work_job_data = data; // Track the current job_data
+			work_do_job(cl, data, buf->data, bufsize, &restart_reader);
+		}
+
+		cl->work_job_data = NULL;
+		free_job_data(data);
+		garbage_quiescent();
+	}
+
+	// more jobs go to the end of the queue, otherwise the socket goes back to process_clients()
+	SAFE_MUTEX_LOCK(&cl->thread_lock);
+	cl->thread_active = 0;
+	__sync_synchronize();
+	if(job_queue_length(cl) > 0)
+	{
+		cl->thread_active = 1;
+		SAFE_MUTEX_LOCK(&work_pool_lock);
+		work_pool_queue(cl);
+		SAFE_MUTEX_UNLOCK(&work_pool_lock);
+	}
+	else
+		{ watch_client_fd(cl); }
+	SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+	SAFE_SETSPECIFIC(getclient, NULL);
+}
+
+static void *work_pool_thread(void *UNUSED(ptr));
+
+// a job ended the worker with cs_exit(), keep the pool at its size
+static void work_pool_exit(void *ptr)
+{
+	struct s_work_buf *buf = ptr;
+
+	NULLFREE(buf->data);
+	if(!exit_oscam)
+		{ start_thread("work pool", work_pool_thread, NULL, NULL, 1, 1); }
+}
+
+static void *work_pool_thread(void *UNUSED(ptr))
+{
+	struct s_work_buf buf = { NULL, 0 };
+	struct s_client *cl;
+
+	set_thread_name(__func__);
+	pthread_cleanup_push(work_pool_exit, &buf);
+	while(!exit_oscam)
+	{
+		garbage_offline();
+		SAFE_MUTEX_LOCK(&work_pool_lock);
+		while(!work_queue_first)
+			{ SAFE_COND_WAIT(&work_pool_cond, &work_pool_lock); }
+		cl = work_queue_first;
+		work_queue_first = cl->work_next;
+		if(!work_queue_first)
+			{ work_queue_last = NULL; }
+		SAFE_MUTEX_UNLOCK(&work_pool_lock);
+		garbage_online();
+
+		work_pool_run(cl, &buf);
+	}
+	pthread_cleanup_pop(0);
+	NULLFREE(buf.data);
+	return NULL;
+}
+
+void work_pool_init(void)
+{
+	int32_t i;
+
+	if(!cfg.workerthreads || work_pool_size)
+		{ return; }
+
+	work_pool_size = cfg.workerthreads;
+	if(work_pool_size < 0)
+		{ work_pool_size = sysconf(_SC_NPROCESSORS_ONLN); }
+	if(work_pool_size < 1)
+		{ work_pool_size = 1; }
+
+	SAFE_COND_INIT(&work_pool_cond, NULL);
+	for(i = 0; i < work_pool_size; i++)
+		{ start_thread("work pool", work_pool_thread, NULL, NULL, 1, 1); }
+	cs_log("running client jobs on %d worker threads", work_pool_size);
+}
+
 /**
  * adds a job to the job queue
  * if ptr should be free() after use, set len to the size
@@ -542,48 +1098,57 @@ void *work_thread(void *ptr)
 **/
 int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len)
 {
+	int8_t active;
+
 	if(!cl || cl->kill)
 	{
 		if(!cl)
 			{ cs_log("WARNING: add_job failed. Client killed!"); } // Ignore jobs for killed clients
-		if(len && ptr)
+		if(len && ptr && action == ACTION_CLIENT_UDP)
+			{ udp_buf_free(ptr); }
+		else if(len && ptr)
 			{ NULLFREE(ptr); }
 		return 0;
 	}
 
-	if(action == ACTION_CACHE_PUSH_OUT && cacheex_check_queue_length(cl))
+	if(!job_ring_put(cl, action, ptr, len))
 	{
-		if(len && ptr)
+		if(len && ptr && action == ACTION_CLIENT_UDP)
+			{ udp_buf_free(ptr); }
+		else if(len && ptr)
 			{ NULLFREE(ptr); }
 		return 0;
 	}
 
-	struct job_data *data;
-	if(!cs_malloc(&data, sizeof(struct job_data)))
+	// the job is visible before thread_active is read, see work_thread()
+	__sync_synchronize();
+	active = cl->thread_active;
+	if(!active)
 	{
-		if(len && ptr)
-			{ NULLFREE(ptr); }
-		return 0;
+		// no work thread, the first producer starts one
+		SAFE_MUTEX_LOCK(&cl->thread_lock);
+		active = cl->thread_active;
+		if(active)
+			{ SAFE_MUTEX_UNLOCK(&cl->thread_lock); }
 	}
 
-	data->action = action;
-	data->ptr = ptr;
-	data->cl = cl;
-	data->len = len;
-	cs_ftime(&data->time);
-
-	SAFE_MUTEX_LOCK(&cl->thread_lock);
-	if(cl && !cl->kill && cl->thread_active)
+	if(active)
 	{
-		if(!cl->joblist)
-			{ cl->joblist = ll_create("joblist"); }
-		ll_append(cl->joblist, data);
-		if(cl->thread_active == 2)
-			{ pthread_kill(cl->thread, OSCAM_SIGNAL_WAKEUP); }
-		SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+		if(active == 2)
+			{ job_queue_wakeup(cl); }
 		cs_log_dbg(D_TRACE, "add %s job action %d queue length %d %s",
 					action > ACTION_CLIENT_FIRST ? "client" : "reader", action,
-					ll_count(cl->joblist), username(cl));
+					job_queue_length(cl), username(cl));
+		return 1;
+	}
+
+	if(work_pool_size && cl->typ == 'c')
+	{
+		cl->thread_active = 1;
+		SAFE_MUTEX_LOCK(&work_pool_lock);
+		work_pool_queue(cl);
+		SAFE_MUTEX_UNLOCK(&work_pool_lock);
+		SAFE_MUTEX_UNLOCK(&cl->thread_lock);
 		return 1;
 	}
 
@@ -599,12 +1164,14 @@ int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len
 					action > ACTION_CLIENT_FIRST ? "client" : "reader", action);
 	}
 
-	int32_t ret = start_thread("client work", work_thread, (void *)data, &cl->thread, 1, modify_stacksize);
+	int32_t ret = start_thread("client work", work_thread, (void *)cl, &cl->thread, 1, modify_stacksize);
 	if(ret)
 	{
+		// the job stays queued, the next add_job() tries again to start the thread
 		cs_log("ERROR: can't create thread for %s (errno=%d %s)",
 				action > ACTION_CLIENT_FIRST ? "client" : "reader", ret, strerror(ret));
-		free_job_data(data);
+		SAFE_MUTEX_UNLOCK(&cl->thread_lock);
+		return 1;
 	}
 
 	cl->thread_active = 1;
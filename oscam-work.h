@@ -34,12 +34,28 @@ enum actions
 	ACTION_ECM_ANSWER_CACHE    = 33,    // wc33
 	ACTION_CACHEEX1_DELAY      = 34,    // wc34
 	ACTION_PEER_IDLE           = 35,    // wc35
-	ACTION_CLIENT_HIDECARDS    = 36     // wc36
+	ACTION_CLIENT_HIDECARDS    = 36,    // wc36
+	ACTION_CACHE_PUSH_FLUSH    = 37,    // wc37
+	ACTION_CLIENT_ECM          = 38,    // wc38
+	ACTION_CLIENT_UNHIDECARDS  = 39     // wc39
 };
 
 #define ACTION_CLIENT_FIRST 20 // This just marks where client actions start
 
+struct s_job_stats
+{
+	uint32_t queued;
+	uint32_t enqueued;
+	uint32_t dropped;
+	uint32_t max_depth;
+	uint32_t slots;
+};
+
 int32_t add_job(struct s_client *cl, enum actions action, void *ptr, int32_t len);
+int32_t job_queue_length(struct s_client *cl);
+int8_t job_queue_epoch(struct s_client *cl, uint32_t *epoch);
+void job_queue_stats(struct s_client *cl, struct s_job_stats *stats);
 void free_joblist(struct s_client *cl);
+void work_pool_init(void);
 
 #endif
@@ -37,6 +37,7 @@
 #include "oscam-reader.h"
 #include "oscam-string.h"
 #include "oscam-time.h"
+#include "oscam-trace.h"
 #include "oscam-work.h"
 #include "reader-common.h"
 #include "module-gbox.h"
@@ -114,7 +115,6 @@ static int32_t max_pending = 32;
 
 // ecms list
 CS_MUTEX_LOCK ecmcache_lock;
-struct ecm_request_t *ecmcwcache = NULL;
 uint32_t ecmcwcache_size = 0;
 
 // pushout deleted list
@@ -207,6 +207,16 @@ static void show_usage(void)
 	{
 		printf(" -u, --utf8              | Enable WebIf support for UTF-8 charset.\n");
 	}
+	if(config_enabled(WITH_LB))
+	{
+		printf("\n Load balancer statistics:\n");
+		printf(" -e, --lbstat-export <stat>,<text>\n");
+		printf("                         | Convert the binary stat file <stat> to the text\n");
+		printf("                         . format of older versions in <text> and exit.\n");
+		printf(" -i, --lbstat-import <text>,<stat>\n");
+		printf("                         | Convert the text stat file <text> to the binary\n");
+		printf("                         . stat file <stat> and exit.\n");
+	}
 	printf("\n Debug parameters:\n");
 	printf(" -a, --crash-dump        | Write oscam.crash file on segfault. This option\n");
 	printf("                         . needs GDB to be installed and OSCam executable to\n");
@@ -222,9 +232,9 @@ static void show_usage(void)
 
 /* Keep the options sorted */
 #if defined(WITH_STAPI) || defined(WITH_STAPI5)
-static const char short_options[] = "aB:fc:d:g:hI:p:r:Sst:uVw:";
+static const char short_options[] = "aB:fc:d:e:g:hI:i:p:r:Sst:uVw:";
 #else
-static const char short_options[] = "aB:bc:d:g:hI:p:r:Sst:uVw:";
+static const char short_options[] = "aB:bc:d:e:g:hI:i:p:r:Sst:uVw:";
 #endif
 
 /* Keep the options sorted by short option */
@@ -239,9 +249,11 @@ static const struct option long_options[] =
 #endif
 	{ "config-dir",         required_argument, NULL, 'c' },
 	{ "debug",              required_argument, NULL, 'd' },
+	{ "lbstat-export",      required_argument, NULL, 'e' },
 	{ "gcollect",           required_argument, NULL, 'g' },
 	{ "help",               no_argument,       NULL, 'h' },
 	{ "syslog-ident",       required_argument, NULL, 'I' },
+	{ "lbstat-import",      required_argument, NULL, 'i' },
 	{ "pending-ecm",        required_argument, NULL, 'p' },
 	{ "restart",            required_argument, NULL, 'r' },
 	{ "show-sensitive",     no_argument,       NULL, 'S' },
@@ -261,6 +273,28 @@ static void set_default_dirs_first(void)
 
 static void write_versionfile(bool use_stdout);
 
+static void convert_lb_stat(int import, char *arg)
+{
+	const char *error;
+	char *dst = strchr(arg, ',');
+	int32_t count;
+
+	if(!dst)
+	{
+		fprintf(stderr, "ERROR: Expected <source>,<destination>: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	*dst++ = '\0';
+	count = import ? lb_stat_import(arg, dst, &error) : lb_stat_export(arg, dst, &error);
+	if(count < 0)
+	{
+		fprintf(stderr, "ERROR: Converting %s to %s failed: %s\n", arg, dst, error);
+		exit(EXIT_FAILURE);
+	}
+	printf("Converted %d load balancer statistics from %s to %s\n", count, arg, dst);
+	exit(EXIT_SUCCESS);
+}
+
 static void parse_cmdline_params(int argc, char **argv)
 {
 #if defined(WITH_STAPI) || defined(WITH_STAPI5)
@@ -292,6 +326,9 @@ static void parse_cmdline_params(int argc, char **argv)
 		case 'd': // --debug
 			cs_dblevel = atoi(optarg);
 			break;
+		case 'e': // --lbstat-export
+			convert_lb_stat(0, optarg);
+			break;
 		case 'g': // --gcollect
 			gbdb = atoi(optarg);
 			break;
@@ -302,6 +339,9 @@ static void parse_cmdline_params(int argc, char **argv)
 		case 'I': // --syslog-ident
 			syslog_ident = optarg;
 			break;
+		case 'i': // --lbstat-import
+			convert_lb_stat(1, optarg);
+			break;
 		case 'p': // --pending-ecm
 			max_pending = atoi(optarg) <= 0 ? 32 : MIN(atoi(optarg), 4096);
 			break;
@@ -992,6 +1032,7 @@ static void init_check(void)
 }
 
 #ifdef __linux__
+#include <sys/epoll.h>
 #include <sys/prctl.h>
 // PR_SET_NAME is introduced in 2.6.9 (which is ancient, released 18 Oct 2004)
 // but apparantly we can't count on having at least that version :(
@@ -1036,6 +1077,37 @@ static void fix_stacksize(void)
 	}
 }
 
+struct s_thread_start
+{
+	void *(*routine)(void *);
+	void *arg;
+};
+
+/* Every thread registers with the garbage collector before it runs, see
+   garbage_quiescent(). */
+static void *thread_start(void *ptr)
+{
+	struct s_thread_start start = *(struct s_thread_start *)ptr;
+
+	free(ptr);
+	garbage_thread_register();
+	return start.routine(start.arg);
+}
+
+static int32_t create_thread(pthread_t *pthread, pthread_attr_t *attr, void *startroutine, void *arg)
+{
+	struct s_thread_start *start;
+	int32_t ret;
+
+	if(!(start = malloc(sizeof(struct s_thread_start))))
+		{ return ENOMEM; }
+	start->routine = startroutine;
+	start->arg = arg;
+	if((ret = pthread_create(pthread, attr, thread_start, start)))
+		{ free(start); }
+	return ret;
+}
+
 /* Starts a thread named nameroutine with the start function startroutine. */
 int32_t start_thread(char *nameroutine, void *startroutine, void *arg, pthread_t *pthread, int8_t detach, int8_t modify_stacksize)
 {
@@ -1049,7 +1121,7 @@ int32_t start_thread(char *nameroutine, void *startroutine, void *arg, pthread_t
 	if(modify_stacksize)
 		{ SAFE_ATTR_SETSTACKSIZE(&attr, oscam_stacksize); }
 
-	int32_t ret = pthread_create(pthread == NULL ? &temp : pthread, &attr, startroutine, arg);
+	int32_t ret = create_thread(pthread == NULL ? &temp : pthread, &attr, startroutine, arg);
 	if(ret)
 		{ cs_log("ERROR: can't create %s thread (errno=%d %s)", nameroutine, ret, strerror(ret)); }
 	else
@@ -1075,7 +1147,7 @@ int32_t start_thread_nolog(char *nameroutine, void *startroutine, void *arg, pth
 	if(modify_stacksize)
  		{ SAFE_ATTR_SETSTACKSIZE(&attr, oscam_stacksize); }
 
-	int32_t ret = pthread_create(pthread == NULL ? &temp : pthread, &attr, startroutine, arg);
+	int32_t ret = create_thread(pthread == NULL ? &temp : pthread, &attr, startroutine, arg);
 	if(ret)
 		{ fprintf(stderr, "ERROR: can't create %s thread (errno=%d %s)", nameroutine, ret, strerror(ret)); }
 	else
@@ -1153,6 +1225,278 @@ static void cs_waitforcardinit(void)
 	}
 }
 
+/* The socket of a connected tcp client or proxy reader is watched by the main
+   loop while no work thread handles the client. */
+static int8_t client_fd_watched(struct s_client *cl)
+{
+	struct s_reader *rdr = cl->reader;
+
+	if(!cl->init_done || cl->kill || !cl->pfd || cl->thread_active)
+		{ return 0; }
+	if(cl->typ == 'c')
+		{ return !cl->is_udp; }
+	//reader:
+	//TCP:
+	//  - TCP socket must be connected
+	//  - no active init thread
+	//UDP:
+	//  - connection status ignored
+	//  - no active init thread
+	return rdr && cl->typ == 'p' && ((rdr->tcp_connected && rdr->ph.type == MOD_CONN_TCP) || (rdr->ph.type == MOD_CONN_UDP));
+}
+
+static void process_client_event(struct s_client *cl, int32_t fd, int32_t revents)
+{
+	struct s_reader *rdr;
+
+	//clients
+	// message on an open tcp connection
+	if(cl && cl->init_done && cl->pfd && (cl->typ == 'c' || cl->typ == 'm'))
+	{
+		if(fd == cl->pfd && (revents & (POLLHUP | POLLNVAL | POLLERR)))
+		{
+			//client disconnects
+			kill_thread(cl);
+			return;
+		}
+		if(fd == cl->pfd && (revents & (POLLIN | POLLPRI)))
+		{
+			// no work thread re-arms a oneshot fd when the job was not queued
+			if(!add_job(cl, ACTION_CLIENT_TCP, NULL, 0))
+				{ watch_client_fd(cl); }
+		}
+	}
+
+	//reader
+	// either an ecm answer, a keepalive or connection closed from a proxy
+	// physical reader ('r') should never send data without request
+	rdr = NULL;
+	struct s_client *cl2 = NULL;
+	if(cl && cl->typ == 'p')
+	{
+		rdr = cl->reader;
+		if(rdr)
+			{ cl2 = rdr->client; }
+	}
+
+	if(rdr && cl2 && cl2->init_done)
+	{
+		if(cl2->pfd && fd == cl2->pfd && (revents & (POLLHUP | POLLNVAL | POLLERR)))
+		{
+			//connection to remote proxy was closed
+			//oscam should check for rdr->tcp_connected and reconnect on next ecm request sent to the proxy
+			network_tcp_connection_close(rdr, "closed");
+			rdr_log_dbg(rdr, D_READER, "connection closed");
+		}
+		if(cl2->pfd && fd == cl2->pfd && (revents & (POLLIN | POLLPRI)))
+		{
+			if(!add_job(cl2, ACTION_READER_REMOTE, NULL, 0))
+				{ watch_client_fd(cl2); }
+		}
+	}
+}
+
+static int32_t listener_shards_running;
+
+/* Serves the sockets of one listener shard on all ports. The thread is pinned
+   to a core so that the shards of a port accept on different cores. */
+static void *listener_shard_thread(void *ptr)
+{
+	int8_t shard = (intptr_t)ptr;
+	int32_t i, k, j, rc, nfds = 0;
+	int8_t closed = 0;
+	struct pollfd pfd[CS_MAX_MOD * CS_MAXPORTS];
+	int8_t pfd_mod[CS_MAX_MOD * CS_MAXPORTS], pfd_port[CS_MAX_MOD * CS_MAXPORTS];
+
+	set_thread_name(__func__);
+	SAFE_SETSPECIFIC(getclient, first_client);
+
+#if defined(__linux__) && defined(CPU_SET)
+	cpu_set_t cpus;
+	int32_t ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpu > 1)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(shard % ncpu, &cpus);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+			{ cs_log_dbg(D_TRACE, "listener shard %d: cannot pin to cpu %d", shard, shard % ncpu); }
+	}
+#endif
+
+	for(k = 0; k < CS_MAX_MOD; k++)
+	{
+		struct s_module *module = &modules[k];
+		if(!(module->type & MOD_CONN_NET))
+			{ continue; }
+		for(j = 0; j < module->ptab.nports; j++)
+		{
+			int32_t fd = listener_fd(&module->ptab.ports[j], shard);
+			if(!fd)
+				{ continue; }
+			pfd[nfds].fd = fd;
+			pfd[nfds].events = POLLIN | POLLPRI;
+			pfd_mod[nfds] = k;
+			pfd_port[nfds] = j;
+			nfds++;
+		}
+	}
+
+	while(!exit_oscam && !closed)
+	{
+		garbage_offline();
+		rc = poll(pfd, nfds, 1000);
+		garbage_online();
+		if(rc < 1)
+			{ continue; }
+		for(i = 0; i < nfds && !exit_oscam; i++)
+		{
+			if(pfd[i].revents & POLLNVAL)
+			{
+				closed = 1;
+				break;
+			}
+			if(pfd[i].revents & (POLLIN | POLLPRI))
+				{ accept_connection(&modules[pfd_mod[i]], pfd_mod[i], pfd_port[i], shard); }
+		}
+	}
+	__sync_sub_and_fetch(&listener_shards_running, 1);
+	return NULL;
+}
+
+static void start_listener_shards(void)
+{
+	int32_t shard, shards = listen_shard_count();
+
+	for(shard = 1; shard < shards; shard++)
+	{
+		__sync_add_and_fetch(&listener_shards_running, 1);
+		if(start_thread("listener shard", listener_shard_thread, (void *)(intptr_t)shard, NULL, 1, 1))
+			{ __sync_sub_and_fetch(&listener_shards_running, 1); }
+	}
+}
+
+#ifdef __linux__
+/* Sockets are registered once in an epoll set, so a loop run costs only the
+   ready events. Client sockets are added EPOLLONESHOT: an event hands the
+   client to its work thread and watch_client_fd() arms the socket again once
+   the client has no work thread running. Listener sockets and the pipe are
+   tagged with small numbers, which no client pointer can have. */
+#define EPOLL_PIPE			0
+#define EPOLL_PORT(k, j)	(1 + (k) * CS_MAXPORTS + (j))
+#define EPOLL_EVENTS		64
+
+static int32_t epoll_fd = -1;
+
+void watch_client_fd(struct s_client *cl)
+{
+	struct epoll_event ev;
+
+	if(epoll_fd < 0 || !client_fd_watched(cl))
+		{ return; }
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLONESHOT;
+	ev.data.ptr = cl;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->pfd, &ev) == -1 && errno == ENOENT
+		&& epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cl->pfd, &ev) == -1)
+	{
+		cs_log_dbg(D_TRACE, "[OSCAM] watching fd %d failed (errno=%d %s)", cl->pfd, errno, strerror(errno));
+	}
+}
+
+static void process_clients(void)
+{
+	int32_t i, k, j, rc;
+	struct s_client *cl;
+	struct epoll_event ev, events[EPOLL_EVENTS];
+	struct timeb start, end; // start time poll, end time poll
+
+	uint8_t buf[10];
+
+	if(pipe(thread_pipe) == -1)
+	{
+		printf("cannot create pipe, errno=%d\n", errno);
+		exit(1);
+	}
+
+	if((epoll_fd = epoll_create(EPOLL_EVENTS)) == -1)
+	{
+		printf("cannot create epoll fd, errno=%d\n", errno);
+		exit(1);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLPRI;
+	ev.data.u64 = EPOLL_PIPE;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, thread_pipe[0], &ev);
+
+	//server (new tcp connections or udp messages)
+	for(k = 0; k < CS_MAX_MOD; k++)
+	{
+		struct s_module *module = &modules[k];
+		if((module->type & MOD_CONN_NET))
+		{
+			for(j = 0; j < module->ptab.nports; j++)
+			{
+				if(module->ptab.ports[j].fd)
+				{
+					ev.data.u64 = EPOLL_PORT(k, j);
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, module->ptab.ports[j].fd, &ev);
+				}
+			}
+		}
+	}
+
+	// sockets of clients and readers started before the main loop
+	for(cl = first_client->next; cl; cl = cl->next)
+		{ watch_client_fd(cl); }
+
+	cs_ftime(&start); // register start time
+	while(!exit_oscam)
+	{
+		garbage_offline();
+		rc = epoll_wait(epoll_fd, events, EPOLL_EVENTS, 5000);
+		garbage_online();
+		if(rc < 1) { continue; }
+		cs_ftime(&end); // register end time
+
+		for(i = 0; i < rc; i++)
+		{
+			if(events[i].data.u64 == EPOLL_PIPE)
+			{
+				int32_t len = read(thread_pipe[0], buf, sizeof(buf));
+				if(len == -1)
+				{
+					cs_log_dbg(D_TRACE, "[OSCAM] Reading from pipe failed (errno=%d %s)", errno, strerror(errno));
+				}
+				continue;
+			}
+
+			//server sockets
+			// new connection on a tcp listen socket or new message on udp listen socket
+			if(events[i].data.u64 < EPOLL_PORT(CS_MAX_MOD, 0))
+			{
+				k = (events[i].data.u64 - 1) / CS_MAXPORTS;
+				j = (events[i].data.u64 - 1) % CS_MAXPORTS;
+				accept_connection(&modules[k], k, j, 0);
+				continue;
+			}
+
+			cl = events[i].data.ptr;
+			if(!is_valid_client(cl))
+				{ continue; }
+			cs_log_dbg(D_TRACE, "[OSCAM] new event %d occurred on fd %d after %"PRId64" ms inactivity", events[i].events,
+						  cl->pfd, comp_timeb(&end, &start));
+			// EPOLLIN, EPOLLPRI, EPOLLERR and EPOLLHUP have the values of their POLL* counterparts
+			process_client_event(cl, cl->pfd, events[i].events);
+		}
+		cs_ftime(&start); // register start time for new poll next run
+		first_client->last = time((time_t *)0);
+	}
+	close(epoll_fd);
+	epoll_fd = -1;
+}
+#else
 static uint32_t resize_pfd_cllist(struct pollfd **pfd, struct s_client ***cl_list, uint32_t old_size, uint32_t new_size)
 {
 	if(old_size != new_size)
@@ -1192,11 +1536,39 @@ static uint32_t chk_resize_cllist(struct pollfd **pfd, struct s_client ***cl_lis
 	return cur_size;
 }
 
+static void process_listener_event(int32_t fd)
+{
+	int32_t k, j;
+
+	for(k = 0; k < CS_MAX_MOD; k++)
+	{
+		struct s_module *module = &modules[k];
+		if((module->type & MOD_CONN_NET))
+		{
+			for(j = 0; j < module->ptab.nports; j++)
+			{
+				if(module->ptab.ports[j].fd && module->ptab.ports[j].fd == fd)
+				{
+					accept_connection(module, k, j, 0);
+				}
+			}
+		}
+	}
+}
+
+void watch_client_fd(struct s_client *UNUSED(cl))
+{
+	// wake up the main loop, it rebuilds its poll list
+	if(thread_pipe[1] && write(thread_pipe[1], "\x01", 1) == -1)
+	{
+		cs_log_dbg(D_TRACE, "[OSCAM] Writing to pipe failed (errno=%d %s)", errno, strerror(errno));
+	}
+}
+
 static void process_clients(void)
 {
 	int32_t i, k, j, rc, pfdcount = 0;
 	struct s_client *cl;
-	struct s_reader *rdr;
 	struct pollfd *pfd;
 	struct s_client **cl_list;
 	struct timeb start, end; // start time poll, end time poll
@@ -1220,36 +1592,15 @@ static void process_clients(void)
 	{
 		pfdcount = 1;
 
-		// connected tcp clients
+		// connected tcp clients and proxy readers
 		for(cl = first_client->next; cl; cl = cl->next)
 		{
-			if(cl->init_done && !cl->kill && cl->pfd && cl->typ == 'c' && !cl->is_udp)
+			if(client_fd_watched(cl))
 			{
-				if(cl->pfd && !cl->thread_active)
-				{
-					cl_size = chk_resize_cllist(&pfd, &cl_list, cl_size, pfdcount);
-					cl_list[pfdcount] = cl;
-					pfd[pfdcount].fd = cl->pfd;
-					pfd[pfdcount++].events = POLLIN | POLLPRI;
-				}
-			}
-			//reader:
-			//TCP:
-			//  - TCP socket must be connected
-			//  - no active init thread
-			//UDP:
-			//  - connection status ignored
-			//  - no active init thread
-			rdr = cl->reader;
-			if(rdr && cl->typ == 'p' && cl->init_done)
-			{
-				if(cl->pfd && !cl->thread_active && ((rdr->tcp_connected && rdr->ph.type == MOD_CONN_TCP) || (rdr->ph.type == MOD_CONN_UDP)))
-				{
-					cl_size = chk_resize_cllist(&pfd, &cl_list, cl_size, pfdcount);
-					cl_list[pfdcount] = cl;
-					pfd[pfdcount].fd = cl->pfd;
-					pfd[pfdcount++].events = (POLLIN | POLLPRI);
-				}
+				cl_size = chk_resize_cllist(&pfd, &cl_list, cl_size, pfdcount);
+				cl_list[pfdcount] = cl;
+				pfd[pfdcount].fd = cl->pfd;
+				pfd[pfdcount++].events = (POLLIN | POLLPRI);
 			}
 		}
 
@@ -1275,7 +1626,9 @@ static void process_clients(void)
 		if(pfdcount >= 1024)
 			{ cs_log("WARNING: too many users!"); }
 		cs_ftime(&start); // register start time
+		garbage_offline();
 		rc = poll(pfd, pfdcount, 5000);
+		garbage_online();
 		if(rc < 1) { continue; }
 		cs_ftime(&end); // register end time
 
@@ -1302,68 +1655,10 @@ static void process_clients(void)
 				continue;
 			}
 
-			//clients
-			// message on an open tcp connection
-			if(cl && cl->init_done && cl->pfd && (cl->typ == 'c' || cl->typ == 'm'))
-			{
-				if(pfd[i].fd == cl->pfd && (pfd[i].revents & (POLLHUP | POLLNVAL | POLLERR)))
-				{
-					//client disconnects
-					kill_thread(cl);
-					continue;
-				}
-				if(pfd[i].fd == cl->pfd && (pfd[i].revents & (POLLIN | POLLPRI)))
-				{
-					add_job(cl, ACTION_CLIENT_TCP, NULL, 0);
-				}
-			}
-
-			//reader
-			// either an ecm answer, a keepalive or connection closed from a proxy
-			// physical reader ('r') should never send data without request
-			rdr = NULL;
-			struct s_client *cl2 = NULL;
-			if(cl && cl->typ == 'p')
-			{
-				rdr = cl->reader;
-				if(rdr)
-					{ cl2 = rdr->client; }
-			}
-
-			if(rdr && cl2 && cl2->init_done)
-			{
-				if(cl2->pfd && pfd[i].fd == cl2->pfd && (pfd[i].revents & (POLLHUP | POLLNVAL | POLLERR)))
-				{
-					//connection to remote proxy was closed
-					//oscam should check for rdr->tcp_connected and reconnect on next ecm request sent to the proxy
-					network_tcp_connection_close(rdr, "closed");
-					rdr_log_dbg(rdr, D_READER, "connection closed");
-				}
-				if(cl2->pfd && pfd[i].fd == cl2->pfd && (pfd[i].revents & (POLLIN | POLLPRI)))
-				{
-					add_job(cl2, ACTION_READER_REMOTE, NULL, 0);
-				}
-			}
-
-			//server sockets
-			// new connection on a tcp listen socket or new message on udp listen socket
-			if(!cl && (pfd[i].revents & (POLLIN | POLLPRI)))
-			{
-				for(k = 0; k < CS_MAX_MOD; k++)
-				{
-					struct s_module *module = &modules[k];
-					if((module->type & MOD_CONN_NET))
-					{
-						for(j = 0; j < module->ptab.nports; j++)
-						{
-							if(module->ptab.ports[j].fd && module->ptab.ports[j].fd == pfd[i].fd)
-							{
-								accept_connection(module, k, j);
-							}
-						}
-					}
-				}
-			}
+			if(cl)
+				{ process_client_event(cl, pfd[i].fd, pfd[i].revents); }
+			else if(pfd[i].revents & (POLLIN | POLLPRI))
+				{ process_listener_event(pfd[i].fd); }
 		}
 		cs_ftime(&start); // register start time for new poll next run
 		first_client->last = time((time_t *)0);
@@ -1373,6 +1668,8 @@ static void process_clients(void)
 	return;
 }
 
+#endif
+
 static pthread_cond_t reader_check_sleep_cond;
 static pthread_mutex_t reader_check_sleep_cond_mutex;
 
@@ -1402,7 +1699,9 @@ static void *reader_check(void)
 			}
 		}
 		cs_readunlock(__func__, &readerlist_lock);
+		garbage_offline();
 		sleepms_on_cond(__func__, &reader_check_sleep_cond_mutex, &reader_check_sleep_cond, 1000);
+		garbage_online();
 	}
 	return NULL;
 }
@@ -1432,9 +1731,11 @@ static void * card_poll(void) {
 		ts.tv_sec = tv.tv_sec;
 		ts.tv_nsec = tv.tv_usec * 1000;
 		ts.tv_sec += 1;
+		garbage_offline();
 		SAFE_MUTEX_LOCK(&card_poll_sleep_cond_mutex);
 		SAFE_COND_TIMEDWAIT(&card_poll_sleep_cond, &card_poll_sleep_cond_mutex, &ts); // sleep on card_poll_sleep_cond
 		SAFE_MUTEX_UNLOCK(&card_poll_sleep_cond_mutex);
+		garbage_online();
 	}
 	return NULL;
 }
@@ -1558,10 +1859,21 @@ __attribute__ ((noreturn)) static void run_tests(void)
 	run_all_tests();
 	exit(0);
 }
+#elif defined(BUILD_LOCKBENCH)
+extern void run_lock_benchmark(void);
+__attribute__ ((noreturn)) static void run_tests(void)
+{
+	run_lock_benchmark();
+	exit(0);
+}
 #else
 static void run_tests(void) { }
 #endif
 
+#ifdef BUILD_REPLAY
+extern void module_replay(struct s_module *ph);
+#endif
+
 const struct s_cardsystem *cardsystems[] =
 {
 #ifdef READER_NAGRA
@@ -1715,6 +2027,7 @@ int32_t main(int32_t argc, char *argv[])
 		fprintf(stderr, "Could not create getclient, exiting...");
 		exit(1);
 	}
+	garbage_thread_register(); // the main loop queues jobs
 
 	void (*mod_def[])(struct s_module *) =
 	{
@@ -1762,6 +2075,9 @@ int32_t main(int32_t argc, char *argv[])
 #endif
 #ifdef HAVE_DVBAPI
 		module_dvbapi,
+#endif
+#ifdef BUILD_REPLAY
+		module_replay,
 #endif
 		0
 	};
@@ -1801,9 +2117,10 @@ int32_t main(int32_t argc, char *argv[])
 	cs_lock_create(__func__, &ecm_pushed_deleted_lock, "ecm_pushed_deleted_lock", 5000);
 	cs_lock_create(__func__, &readdir_lock, "readdir_lock", 5000);
 	cs_lock_create(__func__, &cwcycle_lock, "cwcycle_lock", 5000);
-	init_cache();
+	init_ecmcwcache();
 	cacheex_init_hitcache();
 	init_config();
+	init_cache(); // needs the shard count from the config
 #ifdef CS_CACHEEX_AIO
 	init_cw_cache();
 	init_ecm_cache();
@@ -1822,6 +2139,7 @@ int32_t main(int32_t argc, char *argv[])
 	cs_init_statistics();
 	coolapi_open_all();
 	init_stat();
+	ecm_trace_start();
 	ssl_init();
 
 	// These initializations *MUST* be called after init_config()
@@ -1843,6 +2161,8 @@ int32_t main(int32_t argc, char *argv[])
 
 	start_garbage_collector(gbdb);
 
+	work_pool_init();
+
 	cacheex_init();
 
 	init_len4caid();
@@ -1876,6 +2196,8 @@ int32_t main(int32_t argc, char *argv[])
 		}
 	}
 
+	start_listener_shards();
+
 	// set time for server to now to avoid 0 in monitor/webif
 	first_client->last = time((time_t *)0);
 
@@ -1934,6 +2256,7 @@ int32_t main(int32_t argc, char *argv[])
 	remove_versionfile();
 
 	stat_finish();
+	ecm_trace_stop();
 	dvbapi_stop_all_descrambling(0);
 	dvbapi_save_channel_cache();
 	emm_save_cache();
@@ -1944,6 +2267,9 @@ int32_t main(int32_t argc, char *argv[])
 
 	kill_all_clients();
 	kill_all_readers();
+	// the listener shards leave their poll within a second, stop_listener() frees their buffers
+	for(i = 0; i < 30 && listener_shards_running; i++)
+		{ cs_sleepms(50); }
 	for(i = 0; i < CS_MAX_MOD; i++)
 	{
 		struct s_module *module = &modules[i];
@@ -1951,13 +2277,7 @@ int32_t main(int32_t argc, char *argv[])
 		{
 			for(j = 0; j < module->ptab.nports; j++)
 			{
-				struct s_port *port = &module->ptab.ports[j];
-				if(port->fd)
-				{
-					shutdown(port->fd, SHUT_RDWR);
-					close(port->fd);
-					port->fd = 0;
-				}
+				stop_listener(&module->ptab.ports[j]);
 			}
 		}
 	}
@@ -40,6 +40,7 @@ static void reader_nullcard(struct s_reader *reader)
 	reader->caid = 0;
 	reader->nprov = 0;
 	cs_clear_entitlement(reader);
+	matching_reader_invalidate(); // reader caid and card system are part of the reader matching
 }
 
 int32_t reader_cmd2icc(struct s_reader *reader, const uint8_t *buf, const int32_t l, uint8_t *cta_res, uint16_t *p_cta_lr)
@@ -182,6 +183,7 @@ static int32_t reader_get_cardsystem(struct s_reader *reader, ATR *atr)
 		rdr_log(reader, "card system not supported");
 		led_status_unsupported_card_system();
 	}
+	matching_reader_invalidate();
 
 	return (reader->csystem_active);
 }
@@ -0,0 +1,293 @@
+/*
+ * OSCam ecm trace replay
+ * Feeds the ecm trace written with 'ecmtrace' in [global] through get_cw() at the
+ * recorded arrival times and reports throughput, latency and cache hit rate. The readers answering the
+ * requests are the ones from the configuration, use constcw or a camd35 reader
+ * pointing to a second oscam as stand-ins.
+ * Build this file using `make replay`
+ */
+#define MODULE_LOG_PREFIX "replay"
+
+#include "globals.h"
+
+#ifdef BUILD_REPLAY
+
+#include "oscam-client.h"
+#include "oscam-ecm.h"
+#include "oscam-net.h"
+#include "oscam-string.h"
+#include "oscam-time.h"
+#include "oscam-trace.h"
+#include "oscam-work.h"
+
+extern int32_t exit_oscam;
+
+#define REPLAY_MAX_USERS 32
+
+struct s_replay_user
+{
+	char usr[64];
+	struct s_client *cl;
+};
+
+static pthread_mutex_t replay_lock;
+static pthread_cond_t replay_cond;
+static uint32_t replay_sent, replay_answered, replay_found, replay_cache, replay_notfound, replay_timeout;
+static uint32_t replay_dropped; // answers without latency sample, the sample buffer could not grow
+static uint32_t *replay_latency;
+static uint32_t replay_latency_size;
+
+static void replay_wait(uint32_t msec)
+{
+	struct timespec ts;
+	add_ms_to_timespec(&ts, msec);
+	SAFE_COND_TIMEDWAIT(&replay_cond, &replay_lock, &ts);
+}
+
+static int replay_cmp_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t replay_percentile(uint32_t pct)
+{
+	uint32_t samples = replay_answered - replay_dropped;
+
+	if(!samples)
+		{ return 0; }
+	return replay_latency[(samples - 1) * pct / 100];
+}
+
+static struct s_client *replay_get_client(struct s_replay_user *users, int32_t *count, const char *usr, int32_t module_idx)
+{
+	struct s_auth *account;
+	struct s_client *cl;
+	int32_t i;
+
+	for(i = 0; i < *count; i++)
+	{
+		if(!strcmp(users[i].usr, usr))
+			{ return users[i].cl; }
+	}
+
+	if(*count == REPLAY_MAX_USERS)
+		{ return users[0].cl; }
+
+	for(account = cfg.account; account; account = account->next)
+	{
+		if(!strcmp(account->usr, usr))
+			{ break; }
+	}
+	if(!account)
+	{
+		if(*count)
+			{ return users[0].cl; }
+		account = cfg.account;
+		cs_log("account %s not configured, replaying as %s", usr, account->usr);
+	}
+
+	cl = create_client(get_null_ip());
+	if(!cl)
+		{ return NULL; }
+	cl->typ = 'c';
+	cl->module_idx = module_idx;
+	if(cs_auth_client(cl, account, NULL))
+		{ return NULL; }
+
+	cs_strncpy(users[*count].usr, usr, sizeof(users[*count].usr));
+	users[*count].cl = cl;
+	(*count)++;
+	return cl;
+}
+
+static void *replay_main(void *arg)
+{
+	struct s_client *cl = arg;
+	struct s_replay_user users[REPLAY_MAX_USERS];
+	struct s_trace_ecm rec;
+	struct s_client *ucl;
+	struct timeb start, end, first, now;
+	ECM_REQUEST *er;
+	FILE *f;
+	int32_t nusers = 0, rc = 0;
+	uint32_t last_answered;
+	int64_t elapsed, delay;
+	time_t last_progress;
+
+	SAFE_SETSPECIFIC(getclient, cl);
+	cl->thread = pthread_self();
+	set_thread_name(__func__);
+
+	if(!(f = ecm_trace_open(cfg.ecmtrace)))
+	{
+		cs_log("ERROR: %s is no ecm trace", cfg.ecmtrace);
+		cs_exit_oscam();
+		return NULL;
+	}
+	if(!cfg.account)
+	{
+		cs_log("ERROR: no account configured");
+		fclose(f);
+		cs_exit_oscam();
+		return NULL;
+	}
+
+	cs_log("replaying %s", cfg.ecmtrace);
+	cs_ftime(&start);
+	while(!exit_oscam && (rc = ecm_trace_read(f, &rec)) > 0)
+	{
+		// keep the recorded distance to the first request
+		if(!replay_sent)
+			{ first = rec.tps; }
+		SAFE_MUTEX_LOCK(&replay_lock);
+		while(!exit_oscam)
+		{
+			cs_ftime(&now);
+			delay = comp_timeb(&rec.tps, &first) - comp_timeb(&now, &start);
+			if(delay <= 0)
+				{ break; }
+			replay_wait(MIN(delay, 1000));
+		}
+		SAFE_MUTEX_UNLOCK(&replay_lock);
+
+		if(!(ucl = replay_get_client(users, &nusers, rec.usr, cl->module_idx)))
+			{ break; }
+
+		SAFE_SETSPECIFIC(getclient, ucl);
+		er = get_ecmtask();
+		SAFE_SETSPECIFIC(getclient, cl);
+		if(!er)
+			{ break; }
+
+		er->caid = rec.caid;
+		er->prid = rec.prid;
+		er->srvid = rec.srvid;
+		er->chid = rec.chid;
+		er->pid = rec.pid;
+		er->ecmlen = rec.ecmlen;
+		memcpy(er->ecm, rec.ecm, rec.ecmlen);
+
+		SAFE_MUTEX_LOCK(&replay_lock);
+		replay_sent++;
+		SAFE_MUTEX_UNLOCK(&replay_lock);
+
+		// like a network module the client thread runs get_cw(), the replay clients live until exit
+		if(!add_job(ucl, ACTION_CLIENT_ECM, er, 0))
+		{
+			free_ecm(er);
+			SAFE_MUTEX_LOCK(&replay_lock);
+			replay_sent--;
+			SAFE_MUTEX_UNLOCK(&replay_lock);
+		}
+	}
+	if(rc < 0)
+		{ cs_log("ERROR: broken record in %s after %u requests", cfg.ecmtrace, replay_sent); }
+	fclose(f);
+
+	// wait for the outstanding answers, give up when nothing moves anymore
+	last_answered = 0;
+	last_progress = time(NULL);
+	SAFE_MUTEX_LOCK(&replay_lock);
+	while(replay_answered < replay_sent && !exit_oscam && time(NULL) - last_progress <= (time_t)(cfg.ctimeout / 1000 + 2))
+	{
+		replay_wait(500);
+		if(replay_answered != last_answered)
+		{
+			last_answered = replay_answered;
+			last_progress = time(NULL);
+		}
+	}
+	cs_ftime(&end);
+	elapsed = comp_timeb(&end, &start);
+	if(elapsed <= 0)
+		{ elapsed = 1; }
+
+	if(replay_answered > replay_dropped)
+		{ qsort(replay_latency, replay_answered - replay_dropped, sizeof(uint32_t), replay_cmp_latency); }
+
+	printf("requests:   %u sent, %u answered in %"PRId64" ms\n", replay_sent, replay_answered, elapsed);
+	printf("throughput: %.1f requests/s\n", replay_answered * 1000.0 / elapsed);
+	printf("latency:    p50 %u ms, p99 %u ms\n", replay_percentile(50), replay_percentile(99));
+	if(replay_dropped)
+		{ printf("            %u answers without latency sample (out of memory)\n", replay_dropped); }
+	printf("answers:    %u found, %u cache, %u not found, %u timeout\n", replay_found, replay_cache, replay_notfound, replay_timeout);
+	printf("cache hit:  %.1f%%\n", replay_answered ? replay_cache * 100.0 / replay_answered : 0.0);
+	fflush(stdout);
+	cs_log("replay done: %u/%u answered, %.1f requests/s, p50 %u ms, p99 %u ms, cache hit %.1f%%",
+			replay_answered, replay_sent, replay_answered * 1000.0 / elapsed, replay_percentile(50), replay_percentile(99),
+			replay_answered ? replay_cache * 100.0 / replay_answered : 0.0);
+	SAFE_MUTEX_UNLOCK(&replay_lock);
+
+	cs_exit_oscam();
+	return NULL;
+}
+
+static void *replay_handler(struct s_client *UNUSED(cl), uint8_t *UNUSED(mbuf), int32_t module_idx)
+{
+	struct s_client *cl;
+
+	if(!cfg.ecmtrace || !cfg.ecmtrace[0])
+	{
+		cs_log("ERROR: no ecmtrace set in [global], nothing to replay");
+		cs_exit_oscam();
+		return NULL;
+	}
+
+	cs_pthread_cond_init(__func__, &replay_lock, &replay_cond);
+	if(!(cl = create_client(get_null_ip())))
+		{ return NULL; }
+	cl->typ = 'c';
+	cl->module_idx = module_idx;
+	cl->account = first_client->account;
+	start_thread("replay", replay_main, (void *)cl, NULL, 1, 1);
+	return NULL;
+}
+
+static void replay_send_dcw(struct s_client *UNUSED(client), ECM_REQUEST *er)
+{
+	struct timeb now;
+
+	uint32_t *latency, samples;
+
+	cs_ftime(&now);
+	SAFE_MUTEX_LOCK(&replay_lock);
+	samples = replay_answered - replay_dropped;
+	if(samples == replay_latency_size)
+	{
+		// not cs_realloc(), the samples we have are kept when the buffer cannot grow
+		latency = realloc(replay_latency, (replay_latency_size + 4096) * sizeof(uint32_t));
+		if(latency)
+		{
+			replay_latency = latency;
+			replay_latency_size += 4096;
+		}
+	}
+	if(samples < replay_latency_size)
+		{ replay_latency[samples] = comp_timeb(&now, &er->tps); }
+	else
+		{ replay_dropped++; }
+	replay_answered++;
+
+	if(er->rc == E_FOUND)
+		{ replay_found++; }
+	else if(er->rc == E_CACHE1 || er->rc == E_CACHE2 || er->rc == E_CACHEEX)
+		{ replay_cache++; }
+	else if(er->rc == E_TIMEOUT)
+		{ replay_timeout++; }
+	else
+		{ replay_notfound++; }
+	SAFE_MUTEX_UNLOCK(&replay_lock);
+	SAFE_COND_SIGNAL(&replay_cond);
+}
+
+void module_replay(struct s_module *ph)
+{
+	ph->desc = "replay";
+	ph->type = MOD_CONN_SERIAL;
+	ph->listenertype = 0;
+	ph->s_handler = replay_handler;
+	ph->send_dcw = replay_send_dcw;
+}
+
+#endif
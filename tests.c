@@ -6,7 +6,11 @@
 #include "globals.h"
 
 #include "oscam-array.h"
+#include "oscam-ecm.h"
 #include "oscam-string.h"
+#include "oscam-time.h"
+#include "oscam-work.h"
+#include "module-stat.h"
 #include "oscam-conf-chk.h"
 #include "oscam-conf-mk.h"
 
@@ -72,6 +76,147 @@ static void run_parser_test(struct test_type *t)
 	t->clear_fn(t->data_c);
 }
 
+static void check(const char *desc, bool ok)
+{
+	printf(" Testing %s", desc);
+	if (ok)
+		printf(" [OK]\n");
+	else
+		printf("\n === ERROR ===\n\n");
+	fflush(stdout);
+}
+
+static void test_ecm_timer_heap(void)
+{
+	struct ecm_timer_heap heap;
+	struct ecm_timer t, prev;
+	uint32_t i, n = 1000;
+	bool sorted = true, complete = true;
+
+	printf("ECM timer heap (cw_process)\n");
+	memset(&heap, 0, sizeof(heap));
+	check("reserve", ecm_timer_reserve(&heap, n) && heap.size >= n);
+	srand(1);
+	for (i = 0; i < n; i++)
+	{
+		memset(&t, 0, sizeof(t));
+		t.expire.time = rand() % 50;       // many equal seconds
+		t.expire.millitm = rand() % 1000;
+		t.action = i;
+		ecm_timer_push(&heap, &t);
+	}
+	check("push count", heap.count == n);
+	for (i = 0; i < n; i++)
+	{
+		if (!heap.count)
+		{
+			complete = false;
+			break;
+		}
+		ecm_timer_pop(&heap, &t);
+		if (i && comp_timeb(&t.expire, &prev.expire) < 0)
+			sorted = false;
+		prev = t;
+	}
+	check("pop in expiry order", sorted);
+	check("pop count", complete && !heap.count);
+	check("reserve keeps size", ecm_timer_reserve(&heap, 10) && heap.size >= n);
+	NULLFREE(heap.timers);
+}
+
+static void test_job_ring(void)
+{
+	struct s_client *cl = NULL;
+	struct s_job_stats stats;
+	int32_t i, ring_size = 0;
+	bool queued = true;
+
+	printf("Client job ring (add_job)\n");
+	if (!cs_malloc(&cl, sizeof(struct s_client)))
+		return;
+	SAFE_MUTEX_INIT(&cl->thread_lock, NULL);
+	cl->typ = 'c';
+	cl->thread_active = 1; // busy work thread, add_job() only queues
+
+	add_job(cl, ACTION_CLIENT_IDLE, NULL, 0);
+	job_queue_stats(cl, &stats);
+	check("ring starts small", stats.queued == 1 && stats.slots > 0 && stats.slots <= 16);
+	ring_size = 1;
+
+	// idle jobs are dropped once the queue is full
+	while (ring_size < 100000 && add_job(cl, ACTION_CLIENT_IDLE, NULL, 0))
+		ring_size++;
+	job_queue_stats(cl, &stats);
+	check("ring fills up", ring_size > 16 && ring_size < 100000 && stats.queued == (uint32_t)ring_size);
+	check("full ring drops idle job", stats.dropped == 1);
+
+	// jobs which must not get lost grow the ring
+	for (i = 0; i < 10; i++)
+		queued = add_job(cl, ACTION_CLIENT_TIMEOUT, NULL, 0) && queued;
+	job_queue_stats(cl, &stats);
+	check("full ring grows", queued && stats.queued == (uint32_t)ring_size + 10 && stats.slots >= (uint32_t)ring_size + 10);
+	check("grown ring max depth", stats.max_depth == (uint32_t)ring_size + 10);
+
+	check("grown ring drops idle job", !add_job(cl, ACTION_CLIENT_IDLE, NULL, 0));
+	check("grown ring drops cache push", !add_job(cl, ACTION_CACHE_PUSH_OUT, NULL, 0));
+	job_queue_stats(cl, &stats);
+	check("drop count", stats.dropped == 3 && stats.enqueued == (uint32_t)ring_size + 10);
+
+	free_joblist(cl);
+	NULLFREE(cl);
+}
+
+#ifdef WITH_LB
+static void test_lb_hist(void)
+{
+	READER_STAT s;
+	int32_t i, b, t, success;
+	bool rising = true, edges = true, reached = true;
+
+	printf("Load balancer response time sketch (lb_mode 4)\n");
+	for (i = 0; i < LB_HIST_BUCKETS; i++)
+	{
+		if (lb_hist_edge(i + 1) <= lb_hist_edge(i))
+			rising = false;
+		if (lb_hist_bucket(lb_hist_edge(i)) != i || (i && lb_hist_bucket(lb_hist_edge(i) - 1) != i - 1))
+			edges = false;
+	}
+	check("edges rise", rising);
+	check("bucket of each edge", edges);
+	check("faster answers in bucket 0", lb_hist_bucket(0) == 0 && lb_hist_bucket(1) == 0);
+	check("slower answers in last bucket", lb_hist_bucket(1000000) == LB_HIST_BUCKETS - 1);
+	for (i = 0, t = 0; t <= lb_hist_edge(LB_HIST_BUCKETS - 1) && reached; t++)
+	{
+		b = lb_hist_bucket(t);
+		if (b < i || b > i + 1)
+			reached = false;
+		i = b;
+	}
+	check("every bucket filled", reached && i == LB_HIST_BUCKETS - 1);
+
+	memset(&s, 0, sizeof(s));
+	s.time_avg = 777;
+	check("empty sketch uses time_avg", lb_hist_percentile(&s, 90, &success) == 777 && success == 100);
+
+	b = lb_hist_bucket(100);
+	s.time_hist[b] = 100;
+	t = lb_hist_percentile(&s, 50, &success);
+	check("percentile within bucket", t >= lb_hist_edge(b) && t < lb_hist_edge(b + 1) && success == 100);
+	check("100th percentile at bucket end", lb_hist_percentile(&s, 100, NULL) == lb_hist_edge(b + 1));
+
+	memset(s.time_hist, 0, sizeof(s.time_hist));
+	s.time_hist[lb_hist_bucket(10)] = 90;
+	s.time_hist[lb_hist_bucket(1000)] = 10;
+	check("90th percentile of fast answers", lb_hist_percentile(&s, 90, NULL) == lb_hist_edge(lb_hist_bucket(10) + 1));
+	t = lb_hist_percentile(&s, 95, NULL);
+	check("95th percentile of slow answers", t >= lb_hist_edge(lb_hist_bucket(1000)) && t < lb_hist_edge(lb_hist_bucket(1000) + 1));
+
+	s.time_hist[LB_HIST_BUCKETS] = 100;
+	lb_hist_percentile(&s, 90, &success);
+	check("failures lower success", success == 50);
+}
+#endif
+
 void run_all_tests(void)
 {
 	ECM_WHITELIST ecm_whitelist, ecm_whitelist_c;
@@ -314,4 +459,10 @@ void run_all_tests(void)
 		},
 	};
 	run_parser_test(&caidtab_test);
+
+	test_ecm_timer_heap();
+	test_job_ring();
+#ifdef WITH_LB
+	test_lb_hist();
+#endif
 }
@@ -1066,6 +1066,11 @@ function updateCacheextotals(data) {
 	$("#total_cachexhit").text(data.oscam.totals.total_cachexhit);
 	$("#rel_cachexhit").text(data.oscam.totals.rel_cachexhit);
 	$("#total_cachesize").text(data.oscam.totals.total_cachesize);
+	$("#total_cacheshards").text(data.oscam.totals.total_cacheshards);
+	$("#total_cachelockwaits").text(data.oscam.totals.total_cachelockwaits);
+	$("#total_cachelockwait").text(data.oscam.totals.total_cachelockwait);
+	$("#total_cachememory").text(data.oscam.totals.total_cachememory);
+	$("#total_cacheevictions").text(data.oscam.totals.total_cacheevictions);
 }
 
 /*
@@ -1153,6 +1158,10 @@ function updateSysinfo(data) {
 	$("#mem_cur_shared").text(data.oscam.sysinfo.mem_cur_shared);
 	$("#oscam_vmsize").text(data.oscam.sysinfo.oscam_vmsize);
 	$("#oscam_rsssize").text(data.oscam.sysinfo.oscam_rsssize);
+	$("#pool_ecm").text(data.oscam.sysinfo.pool_ecm);
+	$("#pool_ecm_answer").text(data.oscam.sysinfo.pool_ecm_answer);
+	$("#gc_deferred").text(data.oscam.sysinfo.gc_deferred);
+	$("#gc_freed").text(data.oscam.sysinfo.gc_freed);
 	$("#server_procs").text(data.oscam.sysinfo.server_procs);
 	$("#cpu_load_0").text(data.oscam.sysinfo.cpu_load_0);
 	$("#cpu_load_1").text(data.oscam.sysinfo.cpu_load_1);